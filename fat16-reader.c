@@ -1,3 +1,5 @@
+//fnmatch FNM_CASEFOLD
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 //for file opening modes ( O_RDONLY)
@@ -7,6 +9,80 @@
 //for malloc and free
 #include <stdlib.h>  
 #include <string.h>
+//mmap, fstat and block device size
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+//worker threads
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <ctype.h>
+#include <time.h>
+#include <dirent.h>
+#include <signal.h>
+//serve and query: local socket
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+//mount needs libfuse 3: -DHAVE_FUSE $(pkg-config --cflags --libs fuse3)
+#ifdef HAVE_FUSE
+#define FUSE_USE_VERSION 31
+#include <fuse.h>
+#include <sys/statvfs.h>
+#endif
+//compressed containers need zlib: -DHAVE_ZLIB -lz
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+//io_uring is used through raw system calls, no liburing needed
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+/*/////////////////////////////////////////////////////////////
+                        DIAGNOSTICS
+/////////////////////////////////////////////////////////////*/
+
+//error messages of this thread go here instead of stderr when set
+//(a served command's messages go back to its client, see serveClient)
+static __thread FILE *threadDiagnostics;
+
+static FILE *diagnosticStream(void)
+{
+    return threadDiagnostics != NULL ? threadDiagnostics : stderr;
+}
+
+static void diagnosticError(const char *message)
+{
+    int error = errno;
+    if (message != NULL && *message != '\0')
+    {
+        fprintf(diagnosticStream(), "%s: %s\n", message, strerror(error));
+    }
+    else
+    {
+        fprintf(diagnosticStream(), "%s\n", strerror(error));
+    }
+    errno = error;
+}
+
+//every fprintf(stderr, ...) and perror below follows the thread's stream
+#undef stderr
+#define stderr diagnosticStream()
+#define perror(message) diagnosticError(message)
 
 // BootSector structure (TASK 2)
 typedef struct __attribute__((__packed__)) 
@@ -33,6 +109,27 @@ typedef struct __attribute__((__packed__))
     uint8_t BS_FilSysType[ 8 ]; // e.g. 'FAT16 ' (Not 0 term.)
 } BootSector;
 
+// on FAT32 these follow BPB_TotSec32 instead of BS_DrvNum...
+typedef struct __attribute__((__packed__)) 
+{
+    uint32_t BPB_FATSz32; // Sectors in FAT when BPB_FATSz16 == 0
+    uint16_t BPB_ExtFlags; // Bit 7 set: only FAT (bits 0-3) is active
+    uint16_t BPB_FSVer; // Version, 0:0
+    uint32_t BPB_RootClus; // First cluster of the root DIR
+    uint16_t BPB_FSInfo; // Sector of the FSInfo structure
+    uint16_t BPB_BkBootSec; // Sector of the boot sector copy
+    uint8_t BPB_Reserved[ 12 ]; // 
+    uint8_t BS_DrvNum; // 0 = floppy, 0x80 = hard disk
+    uint8_t BS_Reserved1; // 
+    uint8_t BS_BootSig; // Should = 0x29
+    uint32_t BS_VolID; // 'Unique' ID for volume
+    uint8_t BS_VolLab[ 11 ]; // Non zero terminated string
+    uint8_t BS_FilSysType[ 8 ]; // e.g. 'FAT32 ' (Not 0 term.)
+} BootSector32;
+
+// where BootSector32 starts in the boot sector
+#define BOOT_SECTOR32_OFFSET 36
+
 // DirectoryEntry structure (TASK 3)
 typedef struct __attribute__((__packed__)) {
     uint8_t DIR_Name[ 11 ]; // Non zero terminated string
@@ -49,12 +146,98 @@ typedef struct __attribute__((__packed__)) {
     uint32_t DIR_FileSize; // File size in bytes
 } DirectoryEntry;
 
+struct DirIndex;
+struct ClusterCache;
+struct VolumeWriter;
+struct CachedVolume;
+
+// one read of a batch, result filled in by the backend
+typedef struct {
+    void *buffer;
+    size_t length;
+    off_t offset;
+    ssize_t result;  // bytes read (short only at end of image), -1 on error
+} BackendRead;
+
+// where the bytes of an image come from
+// openVolume picks one for a path; openVolumeOn takes any other implementation
+typedef struct Backend {
+    ssize_t (*read)(struct Backend *backend, void *buffer, size_t length, off_t offset);  // read at offset, short only at end of image
+    void (*readBatch)(struct Backend *backend, BackendRead *reads, size_t count);  // many reads in flight at once, NULL if not supported
+    int (*pinBuffers)(struct Backend *backend, void *const *buffers, size_t count, size_t length);  // buffers reused for reads, NULL if it does not help
+    void (*unpinBuffers)(struct Backend *backend, void *const *buffers, size_t count);  // before the buffers are freed
+    ssize_t (*write)(struct Backend *backend, const void *buffer, size_t length, off_t offset);  // NULL when read only
+    void (*close)(struct Backend *backend);  // release everything, including the Backend itself
+    const uint8_t *memory;  // whole image addressable in memory, NULL if not
+    uint64_t size;  // bytes in the image
+    int fdesc;  // descriptor for file backed images, -1 otherwise
+    void *state;  // implementation data
+} Backend;
+
+// FAT variant, decided by the cluster count alone (see volumeGeometry)
+typedef enum {
+    FAT12 = 12,
+    FAT16 = 16,
+    FAT32 = 32,
+} FatType;
+
+// volume handle shared by every reader function
+// the image is opened once; metadata and cluster data are read through this
+typedef struct {
+    Backend *backend;  // image bytes
+    uint8_t *metadata;  // copy of boot sector, FATs and root directory when the backend is not in memory
+    struct ClusterCache *cache;  // cluster cache for backends not in memory, NULL if disabled
+    uint64_t imageSize;  // size of the image in bytes
+    const BootSector *bootSector;  // zero copy pointer to the boot sector
+    FatType fatType;
+    const uint16_t *fat;  // 16 bit entries: zero copy first FAT (FAT16) or its widened copy (FAT12), NULL on FAT32
+    const uint32_t *fat32;  // zero copy pointer to the first FAT on FAT32, NULL otherwise
+    uint16_t *widenedFat;  // FAT12 entries widened to 16 bits, owned
+    uint32_t endOfChain;  // lowest end of chain marker as read through fatEntry
+    uint32_t badCluster;  // bad cluster marker as read through fatEntry
+    uint32_t rootCluster;  // first cluster of the FAT32 root directory, 0 when the root is a fixed region
+    uint16_t clusterHigh;  // mask for DIR_FstClusHI, which only FAT32 uses
+    const DirectoryEntry *rootDir;  // zero copy pointer to the root directory region (FAT12, FAT16)
+    size_t fatSize;  // bytes in one FAT copy
+    size_t clusterSize;  // bytes per cluster
+    size_t clusterCount;  // data clusters, numbered from 2
+    off_t fatOffset;  // first FAT
+    off_t rootOffset;  // root directory region
+    off_t dataOffset;  // cluster 2
+    pthread_mutex_t indexLock;  // guards indexes while directories are loaded
+    struct DirIndex **indexes;  // directory index by first cluster, 0 = root
+    size_t indexBytes;  // memory held by the indexes
+    struct VolumeWriter *writer;  // changes not flushed yet, NULL when opened read only
+    struct CachedVolume *shared;  // entry of the shared volume cache (serve), NULL if not shared
+} Volume;
+
+// run of contiguous clusters in a cluster chain
+typedef struct {
+    uint32_t firstCluster;  // first cluster of the run
+    uint32_t length;  // number of clusters in the run
+    uint64_t fileOffset;  // byte offset of the run inside the file
+} Extent;
+
+// run-length form of a cluster chain, sorted by fileOffset
+typedef struct {
+    Extent *extents;  // array of runs
+    size_t count;  // runs in use
+    size_t capacity;  // runs allocated
+    size_t clusterCount;  // total clusters in the chain
+} ExtentMap;
+
 // file structure (TASK 5)
 typedef struct {
-    int fdesc;  // File descriptor
+    Volume *volume;  // Volume the file lives on
     size_t fileLength;  // Length of the file
     size_t currentPosition;  // Current position in the file
-    uint16_t startCluster;  // Starting cluster of the file
+    uint32_t startCluster;  // Starting cluster of the file
+    uint32_t entryDirectory;  // directory holding the entry (0 = root), for writing
+    size_t entrySlot;  // slot of the short entry in that directory, SIZE_MAX when read only
+    ExtentMap extents;  // cluster chain as contiguous runs
+    size_t currentExtent;  // run holding currentPosition (hint for sequential reads)
+    size_t lastEnd;  // position after the previous read, to spot sequential access
+    size_t readahead;  // clusters to read ahead, grows while reads stay sequential
 } File;
 
 //Long Name structure (TASK 6)
@@ -71,573 +254,13433 @@ typedef struct {
 } LongName;
 
 /*/////////////////////////////////////////////////////////////
-                        TASK 1 + 2
+                        PROFILE
 /////////////////////////////////////////////////////////////*/
 
-//read function
-//a pointer to a constant character (string) representing the filename
-void readDisk(const char *filename, BootSector *bootSector) 
-{
-    //open disk image
-    int fdisk = open(filename, O_RDONLY);
+//timed operations
+typedef enum {
+    PROFILE_COMMAND,  // one command, labelled with its name in the trace
+    PROFILE_OPEN_VOLUME,
+    PROFILE_LOAD_FAT,
+    PROFILE_FILE_CLUSTERS,
+    PROFILE_EXTENT_MAP,
+    PROFILE_DIRECTORY_SCAN,  // reading and indexing one directory
+    PROFILE_WALK_BATCH,  // one batch of entries for the walker
+    PROFILE_READ_FILE,
+    PROFILE_READ_FILE_AT,
+    PROFILE_SEEK_FILE,
+    PROFILE_OUTPUT,  // writing buffered command output
+    PROFILE_OPERATIONS
+} ProfileOperation;
 
-    if (fdisk == -1) 
-    {
-        perror("Unable to open disk file");
-        return;
-    }
+static const char *const profileOperationNames[PROFILE_OPERATIONS] = {
+    "command", "openVolume", "loadFAT", "fileClusters", "buildExtentMap", "directoryScan",
+    "walkBatch", "readFile", "readFileAt", "seekFile", "output"
+};
 
-    //read up to count bytes from file descriptor
-    //ssize_t read(int fdesc, void *buf, size_t count);
-    ssize_t reading = read(fdisk, bootSector, sizeof(BootSector));
+typedef enum {
+    COUNT_PREAD,  // pread system calls on the image
+    COUNT_PREAD_BYTES,
+    COUNT_PWRITE,
+    COUNT_PWRITE_BYTES,
+    COUNT_URING_ENTER,  // io_uring_enter system calls
+    COUNT_OUTPUT_WRITE,  // write system calls for command output
+    COUNT_OUTPUT_BYTES,
+    COUNT_IMAGE_BYTES,  // bytes handed out by volumeRead, from any backend
+    COUNT_CACHE_HITS,
+    COUNT_CACHE_MISSES,
+    COUNT_CLUSTERS_WALKED,  // FAT entries followed
+    COUNT_COUNTERS
+} ProfileCounter;
 
-    if (reading == -1) 
-    {
-        perror("Error reading from disk file");
-    } 
-    else 
-    {
-        printf("Bytes per Sector: %u\n", bootSector->BPB_BytsPerSec);
-        printf("Sectors per Cluster: %u\n", bootSector->BPB_SecPerClus);
-        printf("Reserved Sector Count: %u\n", bootSector->BPB_RsvdSecCnt);
-        printf("Number of copies of FAT: %u\n", bootSector->BPB_NumFATs);
-        printf("FAT12/FAT16: size of root DIR: %u\n", bootSector->BPB_RootEntCnt);
-        printf("Sectors, may be 0, see below: %u\n", bootSector->BPB_TotSec16);
-        printf("Sectors in FAT (FAT12 or FAT16): %u\n", bootSector->BPB_FATSz16);
-        printf("Sectors if BPB_TotSec16 == 0: %u\n", bootSector->BPB_TotSec32);
-        printf("Non zero terminated string: %s\n", bootSector->BS_VolLab);
+static const char *const profileCounterNames[COUNT_COUNTERS] = {
+    "pread_calls", "pread_bytes", "pwrite_calls", "pwrite_bytes", "io_uring_enter_calls",
+    "output_write_calls", "output_bytes", "image_bytes_read", "cache_hits", "cache_misses",
+    "clusters_walked"
+};
 
-    }
+//bucket b counts times of 2^b to 2^(b+1) - 1 ns, the last one everything longer
+#define PROFILE_BUCKETS 40
+//trace events kept; later ones are counted and dropped
+#define TRACE_EVENTS (1u << 20)
 
-    close(fdisk);
-}
+typedef struct {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t totalNs;
+    atomic_uint_fast64_t maxNs;
+    atomic_uint_fast64_t buckets[PROFILE_BUCKETS];
+} ProfileHistogram;
 
-/*/////////////////////////////////////////////////////////////
-                        TASK 3
-/////////////////////////////////////////////////////////////*/
+typedef struct {
+    uint64_t start;  // ns since profiling began
+    uint64_t duration;
+    uint64_t value;  // bytes or clusters, depending on the operation
+    const char *label;  // command name, NULL for everything else
+    uint32_t thread;
+    uint8_t operation;
+} TraceEvent;
 
-// Function to load a copy of the first FAT into memory
-void loadFAT(const char *filename, BootSector bootSector, uint16_t *fat, size_t fatSize) 
+//everything collected while profiling; all zero (and untouched) when it is off
+typedef struct {
+    int enabled;
+    const char *profilePath;  // JSON summary, NULL if not wanted
+    const char *tracePath;  // Chrome trace events, NULL if not wanted
+    uint64_t origin;  // monotonic time profiling began
+    atomic_uint_fast64_t counters[COUNT_COUNTERS];
+    ProfileHistogram histograms[PROFILE_OPERATIONS];
+    TraceEvent *events;
+    atomic_size_t eventCount;
+    atomic_uint threads;
+} Profile;
+
+static Profile profile;
+
+static uint64_t monotonicNanoseconds(void)
 {
-    int fdisk = open(filename, O_RDONLY);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
 
-    if (fdisk == -1) 
+//turn profiling on for the rest of the run; either path may be NULL
+int profileBegin(const char *profilePath, const char *tracePath)
+{
+    if (tracePath != NULL)
     {
-        perror("Unable to open disk file");
-        return;
+        profile.events = malloc(TRACE_EVENTS * sizeof(TraceEvent));
+        if (profile.events == NULL)
+        {
+            perror("Error allocating memory for trace events");
+            return -1;
+        }
     }
+    profile.profilePath = profilePath;
+    profile.tracePath = tracePath;
+    profile.origin = monotonicNanoseconds();
+    profile.enabled = 1;
+    return 0;
+}
 
-    //offset is at first FAT which is after reserved sectors
-    //Reserved Sector Count * Bytes per Sector
-    off_t offset = bootSector.BPB_RsvdSecCnt * bootSector.BPB_BytsPerSec;
-    if (lseek(fdisk, offset, SEEK_SET) == -1) 
+//add the time since start to an operation's histogram and the trace
+static void profileRecord(ProfileOperation operation, uint64_t start, uint64_t value, const char *label)
+{
+    uint64_t end = monotonicNanoseconds();
+    uint64_t duration = end - start;
+    ProfileHistogram *histogram = &profile.histograms[operation];
+    int bucket = 63 - __builtin_clzll(duration | 1);
+    if (bucket >= PROFILE_BUCKETS)
     {
-        perror("Error seeking to the start of the first FAT");
-        close(fdisk);
-        return;
+        bucket = PROFILE_BUCKETS - 1;
     }
-
-    //read the first FAT into memory
-    ssize_t reading = read(fdisk, fat, fatSize);
-    if (reading == -1) 
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->totalNs, duration, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    uint_fast64_t longest = atomic_load_explicit(&histogram->maxNs, memory_order_relaxed);
+    while (duration > longest && !atomic_compare_exchange_weak_explicit(&histogram->maxNs, &longest, duration, memory_order_relaxed, memory_order_relaxed))
     {
-        perror("Error reading the first FAT");
-    } 
+    }
 
-    close(fdisk);
+    if (profile.events != NULL)
+    {
+        //small thread numbers in order of first event
+        static __thread uint32_t thread;
+        if (thread == 0)
+        {
+            thread = atomic_fetch_add_explicit(&profile.threads, 1, memory_order_relaxed) + 1;
+        }
+        size_t slot = atomic_fetch_add_explicit(&profile.eventCount, 1, memory_order_relaxed);
+        if (slot < TRACE_EVENTS)
+        {
+            TraceEvent *event = &profile.events[slot];
+            event->start = start - profile.origin;
+            event->duration = duration;
+            event->value = value;
+            event->label = label;
+            event->thread = thread;
+            event->operation = (uint8_t)operation;
+        }
+    }
 }
 
-//function to get ordered lists of file cluster starting from the initial cluster
-void fileClusters(uint16_t *fat, size_t fatSize, uint16_t startCluster, size_t *clusters, size_t *clustersNumber) 
+//start of a timed operation, 0 when profiling is off
+static inline uint64_t profileStart(void)
 {
-    //number of clusters (counter)
-    *clustersNumber = 0;
+    return __builtin_expect(profile.enabled, 0) ? monotonicNanoseconds() : 0;
+}
 
-    //starting cluster is not end of file
-    while (startCluster < 0xFFF8) 
+//end of a timed operation; value (bytes, clusters) only goes to the trace
+static inline void profileEnd(ProfileOperation operation, uint64_t start, uint64_t value)
+{
+    if (__builtin_expect(start != 0, 0))
     {
-        //stores the new cluster in the clusters array
-        clusters[*clustersNumber] = startCluster;
-        (*clustersNumber)++;
-
-        //go to the next cluster
-        startCluster = fat[startCluster];
+        profileRecord(operation, start, value, NULL);
     }
 }
 
+static inline void profileCount(ProfileCounter counter, uint64_t value)
+{
+    if (__builtin_expect(profile.enabled, 0))
+    {
+        atomic_fetch_add_explicit(&profile.counters[counter], value, memory_order_relaxed);
+    }
+}
 
 /*/////////////////////////////////////////////////////////////
-                        TASK 4
+                        VOLUME
 /////////////////////////////////////////////////////////////*/
 
-void convertDateTime(uint16_t time, uint16_t date, uint16_t *hours, uint16_t *minutes, uint16_t *seconds, uint16_t *day, uint16_t *month, uint16_t *year) 
-{
-    //Bits 15-11: hours (0-23)
-    //Bits 10-5: minutes (0-59)
-    //Bits 4-0: seconds/2 (0-29, 2-second intervals)
-
-    //right shifts by 11 bits - left with 5 bits representing hours
-    //bits >= 5 are 0
-    *hours = (time >> 11) & 0x1F;
+//options every openVolume uses (set from the command line)
+typedef struct {
+    size_t cacheBytes;  // cluster cache budget for images not mapped in memory, 0 = no cache
+    int noMmap;  // always use pread (e.g. images on network mounts)
+    int cacheStats;  // report cache counters when a volume is closed
+    int ioUring;  // read images that are not mapped through io_uring
+} VolumeOptions;
 
-    //right shifts by 5 bits
-    *minutes = (time >> 5) & 0x3F;
+VolumeOptions volumeOptions = { 32u << 20, 0, 0, 0 };
 
-    //2-second interval
-    *seconds = (time & 0x1F) * 2; 
-    
-    //0x1F (total 31)
-    *day = date & 0x1F;
-    //right shifts by 5 bits
-    //0x0F (total 15)
-    *month = (date >> 5) & 0x0F;
-    //offset year = 1980 (7 bits/year)
-    *year = ((date >> 9) & 0x7F) + 1980; 
+//read exactly length bytes at offset (retries short reads)
+static ssize_t preadFull(int fdesc, void *buffer, size_t length, off_t offset)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t reading = pread(fdesc, (uint8_t *)buffer + done, length - done, offset + done);
+        profileCount(COUNT_PREAD, 1);
+        if (reading == -1)
+        {
+            return -1;
+        }
+        profileCount(COUNT_PREAD_BYTES, reading);
+        //end of image
+        if (reading == 0)
+        {
+            break;
+        }
+        done += reading;
+    }
+    return done;
 }
 
-void printRootDirectory(const char *filename, BootSector bootSector) 
+//write exactly length bytes at offset (retries short writes)
+static ssize_t pwriteFull(int fdesc, const void *buffer, size_t length, off_t offset)
 {
-    int fdisk = open(filename, O_RDONLY);
-
-    if (fdisk == -1) 
+    size_t done = 0;
+    while (done < length)
     {
-        perror("Unable to open disk file");
-        return;
+        ssize_t writing = pwrite(fdesc, (const uint8_t *)buffer + done, length - done, offset + done);
+        profileCount(COUNT_PWRITE, 1);
+        if (writing == -1)
+        {
+            return -1;
+        }
+        profileCount(COUNT_PWRITE_BYTES, writing);
+        done += writing;
     }
+    return done;
+}
 
-    //first sector of the root directory
-    //(Reserved Sector Count + Number of copies of FAT * Sectors in FAT) * Bytes per Sector
-    off_t offset = (bootSector.BPB_RsvdSecCnt + bootSector.BPB_NumFATs * bootSector.BPB_FATSz16) * bootSector.BPB_BytsPerSec;
-
-    if (lseek(fdisk, offset, SEEK_SET) == -1) 
+//copy a whole non seekable stream (pipe) into memory
+static uint8_t *readStream(int fdesc, uint64_t *length)
+{
+    size_t capacity = 1 << 20;
+    size_t used = 0;
+    uint8_t *data = malloc(capacity);
+    if (data == NULL)
     {
-        perror("Error seeking to the start of the root directory");
-        close(fdisk);
-        return;
+        return NULL;
     }
 
-    //numOfEntry = size of root DIR
-    size_t numOfEntry = bootSector.BPB_RootEntCnt;
-
-    printf("-------------------------------------------------------------------------------------------------\n");
-    printf("| Cluster \t | Date \t | Time \t | Attributes \t | Size \t | Name \t|\n");
-    printf("-------------------------------------------------------------------------------------------------\n");
-
-    for (size_t i = 0; i < numOfEntry; i++) 
+    for (;;)
     {
-        DirectoryEntry entry;
-        ssize_t reading = read(fdisk, &entry, sizeof(DirectoryEntry));
-
-        if (reading == -1) 
+        if (used == capacity)
         {
-            perror("Error to read directory entry");
-            break;
+            capacity *= 2;
+            uint8_t *grown = realloc(data, capacity);
+            if (grown == NULL)
+            {
+                free(data);
+                return NULL;
+            }
+            data = grown;
         }
-        //the first byte of the directory name is zero, there are no further valid entries
-        //0xe5 - specific entry is currently unused (deleted files)
-        //& 0x0F operation isolates the lower 4 bits of entry.DIR_Attr
-        //!= 0x0F, ensuring that the lower 4 bits don't have all bits set == a valid file or directory entry
-        if (entry.DIR_Name[0] != 0x00 && entry.DIR_Name[0] != 0xE5 && (entry.DIR_Attr & 0x0F) != 0x0F ) 
+        ssize_t reading = read(fdesc, data + used, capacity - used);
+        if (reading == -1)
         {
-            //declares variables of type uint16_t
-            uint16_t hours, minutes, seconds, day, month, year;
-            convertDateTime(entry.DIR_WrtTime, entry.DIR_WrtDate, &hours, &minutes, &seconds, &day, &month, &year);
-
-            printf("| %u \t\t | %u/%u/%u \t | %u:%u:%u \t | %c%c%c%c%c%c \t | %u\t\t | %.11s \t|\n",
-                   entry.DIR_FstClusLO,
-                   day, month, year,
-                   hours, minutes, seconds,
-                   (entry.DIR_Attr & 0x01) ? 'R' : '-',
-                   (entry.DIR_Attr & 0x02) ? 'H' : '-',
-                   (entry.DIR_Attr & 0x04) ? 'S' : '-',
-                   (entry.DIR_Attr & 0x08) ? 'V' : '-',
-                   (entry.DIR_Attr & 0x10) ? 'D' : '-',
-                   (entry.DIR_Attr & 0x20) ? 'A' : '-',
-                   entry.DIR_FileSize,
-                   entry.DIR_Name);
+            free(data);
+            return NULL;
+        }
+        if (reading == 0)
+        {
+            break;
         }
+        used += reading;
     }
-    printf("-------------------------------------------------------------------------------------------------\n");
-    close(fdisk);
+
+    *length = used;
+    return data;
 }
 
-/*/////////////////////////////////////////////////////////////
-                        TASK 5
-/////////////////////////////////////////////////////////////*/
+//backend over an image that is entirely in memory (mmap or a copied stream)
+typedef struct {
+    uint8_t *data;
+    int mapped;  // munmap rather than free
+} MemoryImage;
 
-size_t clusterOffsetCalculation(BootSector bootSector, uint16_t *fat, uint16_t cluster) 
+static ssize_t memoryRead(Backend *backend, void *buffer, size_t length, off_t offset)
 {
-    //sectors per cluster * bytes per sector
-    size_t clusterSize = bootSector.BPB_SecPerClus * bootSector.BPB_BytsPerSec;
-    //calculate offset to the beginning of the data area (after reserved sectors and root directory)
-    size_t offset = (bootSector.BPB_RsvdSecCnt + bootSector.BPB_NumFATs * bootSector.BPB_FATSz16) * bootSector.BPB_BytsPerSec + bootSector.BPB_RootEntCnt * sizeof(DirectoryEntry);
-
-    //calculate offset for current cluster by using the correct clusterSize
-    //"- 2" is a common adjustment for fat16.img 
-    //offset is calculated as if they are 0-based.
-    offset += (cluster - 2) * clusterSize;
-
-    // Move to the next cluster in the chain
-    cluster = fat[cluster];
-    return offset;
+    if (offset < 0 || (uint64_t)offset >= backend->size)
+    {
+        return 0;
+    }
+    if ((uint64_t)offset + length > backend->size)
+    {
+        length = backend->size - offset;
+    }
+    memcpy(buffer, backend->memory + offset, length);
+    return length;
 }
 
-
-//seek to a position in the file
-off_t seekFile(File *file, off_t offset, int whence) 
+static void memoryClose(Backend *backend)
 {
-
-    // '->' to access members of file structure through a pointer
-    //wence so that can use SEEK_SET, SEEK_CUR, SEEK_END (flexibility)
-    off_t newPos = lseek(file->fdesc, offset, whence);
-    //error handling
-    if (newPos == -1) 
+    MemoryImage *image = backend->state;
+    if (image->mapped)
     {
-        perror("Error seeking in file");
-        return -1;
+        munmap(image->data, backend->size);
     }
+    else
+    {
+        free(image->data);
+    }
+    if (backend->fdesc != -1)
+    {
+        close(backend->fdesc);
+    }
+    free(image);
+    free(backend);
+}
 
-    //updating current position to new position in the File structure
-    file->currentPosition = newPos;
-
-    return newPos;
+//backend reading a file or block device with pread
+static ssize_t fileRead(Backend *backend, void *buffer, size_t length, off_t offset)
+{
+    return preadFull(backend->fdesc, buffer, length, offset);
 }
 
-//Function to read 
-size_t readFile(File *file, void *buffer, size_t length) 
+static ssize_t fileWrite(Backend *backend, const void *buffer, size_t length, off_t offset)
 {
+    return pwriteFull(backend->fdesc, buffer, length, offset);
+}
 
-    //to read bytes from the file
-    ssize_t reading = read(file->fdesc, buffer, length);
-    //Error Handling
-    if (reading == -1) 
-    {
-        perror("Error reading from file");
-        return 0;
-    }
+static void fileClose(Backend *backend)
+{
+    close(backend->fdesc);
+    free(backend);
+}
 
-    //access the currentPosition (member of the structure) that file is pointing to
-    //to update current position in the File structure
-    file->currentPosition += reading;
+#ifdef HAVE_IO_URING
+//submission entries per ring
+#define URING_DEPTH 64
+//reads are split into pieces of this size so one large read fills the queue
+#define URING_PIECE (128u << 10)
+//rings per image, each thread takes a free one
+#define URING_RINGS 8
+//buffers that can be pinned (registered) at once
+#define URING_PINNED 256
 
-    //return results casted to size_t because of size_t function
-    return (size_t)reading;
-}
+//one io_uring instance and its shared memory
+typedef struct {
+    pthread_mutex_t lock;  // one batch at a time
+    int fd;
+    uint8_t *sqRing;
+    size_t sqSize;
+    uint8_t *cqRing;  // same mapping as sqRing when the kernel allows it
+    size_t cqSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    int fixedFile;  // the image is registered as file 0
+    int broken;  // reads left in flight could not be drained, the ring is not used again
+} Ring;
 
+//backend reading through a small pool of rings
+typedef struct {
+    Ring rings[URING_RINGS];
+    int ringCount;
+    atomic_uint nextRing;  // where a thread starts looking for a free ring
+    struct iovec pinned[URING_PINNED];  // registered with every ring; changed with every ring locked
+    size_t pinnedCount;
+} UringImage;
 
-//Function to close the file
-//pointer to a File structure named file
-void closeFile(File *file) 
+static int uringEnter(int fd, unsigned submit, unsigned wait)
 {
-    //  refers to a member (fdesc) of the File structure (file descriptor)
-    //if not close, can lead to resource leaks
-    close(file->fdesc);
-    
-    //deallocate memory previously allocated by malloc
-    //release memory occupied preventing memory leaks
-    free(file);
+    profileCount(COUNT_URING_ENTER, 1);
+    return (int)syscall(__NR_io_uring_enter, fd, submit, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
 }
 
-//return a member of the struct File
-//parameter: filename, bootSector, array representing FAT
-File *openFile(const char *filename, BootSector bootSector, uint16_t *fat) {
-    //directory entry corresponding to the file
-    DirectoryEntry dirEntry;
-    //int to check if file being found
-    int found = 0;
+static void closeRing(Ring *ring)
+{
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqesSize);
+    }
+    if (ring->cqRing != NULL && ring->cqRing != MAP_FAILED && ring->cqRing != ring->sqRing)
+    {
+        munmap(ring->cqRing, ring->cqSize);
+    }
+    if (ring->sqRing != NULL && ring->sqRing != MAP_FAILED)
+    {
+        munmap(ring->sqRing, ring->sqSize);
+    }
+    if (ring->fd >= 0)
+    {
+        close(ring->fd);
+    }
+    pthread_mutex_destroy(&ring->lock);
+}
 
-    //open disk image file in read-only mode
-    int fdisk = open("fat16.img", O_RDONLY);
-    //error handling
-    if (fdisk == -1) {
-        perror("Unable to open disk file");
-        return NULL;
+static int setupRing(Ring *ring, int fdesc)
+{
+    memset(ring, 0, sizeof(Ring));
+    pthread_mutex_init(&ring->lock, NULL);
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
     }
 
-    //offset to the root directory
-    off_t offset = (bootSector.BPB_RsvdSecCnt + bootSector.BPB_NumFATs * bootSector.BPB_FATSz16) * bootSector.BPB_BytsPerSec;
-    //seek to offset
-    if (lseek(fdisk, offset, SEEK_SET) == -1) {
-        perror("Error seeking to root directory");
-        close(fdisk);
-        return NULL;
+    ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+    {
+        ring->sqSize = ring->cqSize = ring->sqSize > ring->cqSize ? ring->sqSize : ring->cqSize;
+    }
+    ring->sqRing = mmap(NULL, ring->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = single ? ring->sqRing : mmap(NULL, ring->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        closeRing(ring);
+        return -1;
     }
 
-    //Retrieves number of entries in root directory from BootSector 
-    //max number of directory entries
-    size_t numOfEntry = bootSector.BPB_RootEntCnt;
-    //iterates through each directory entry in root directory
-    for (size_t i = 0; i < numOfEntry; i++) {
-        //read next directory entry from disk image (fdisk) into dirEntry structure
-        //size of each directory entry
-        ssize_t reading = read(fdisk, &dirEntry, sizeof(DirectoryEntry));
+    ring->sqTail = (unsigned *)(ring->sqRing + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)(ring->sqRing + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(ring->sqRing + params.sq_off.array);
+    ring->cqHead = (unsigned *)(ring->cqRing + params.cq_off.head);
+    ring->cqTail = (unsigned *)(ring->cqRing + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(ring->cqRing + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(ring->cqRing + params.cq_off.cqes);
 
-        //error handling
-        if (reading == -1) {
-            perror("Error to read directory entry");
-            close(fdisk);
-            return NULL;
-        }
+    //saves a file lookup per request; plain descriptors work too
+    ring->fixedFile = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &fdesc, 1) == 0;
+    return 0;
+}
 
-        //check if the entry is not empty, not deleted and not long file name entry
-        if (dirEntry.DIR_Name[0] != 0x00 && dirEntry.DIR_Name[0] != 0xE5 && (dirEntry.DIR_Attr & 0x0F) != 0x0F) {
-            //compare the directory entry name with filename
-            //up to 11 characters because file names are typically 8+3 format
-            if (strncmp((char *)dirEntry.DIR_Name, filename, 11) == 0) {
-                // if names match, breaks the loop indicating file has been found
-                found = 1;
-                break;
-            }
-        }
-    }
+//a piece of a read in flight
+typedef struct {
+    size_t read;  // index in the batch
+    size_t done;  // offset of the piece inside the read
+    size_t length;
+} RingPiece;
 
-    //check if entry is a directory
-    if (dirEntry.DIR_Attr & 0x10) {
-        printf("%s is a directory and not a regular file.\n", filename);
-        close(fdisk);
-        return NULL; // Return NULL for directories
-    }
-    //error handling
-    if (!found) {
-        fprintf(stderr, "File cant be found: %s\n", filename);
-        close(fdisk);
-        return NULL;
+//registered buffer holding a piece, -1 if none (lock of the ring held)
+static int pinnedIndex(const UringImage *image, const uint8_t *buffer, size_t length)
+{
+    for (size_t i = 0; i < image->pinnedCount; i++)
+    {
+        const uint8_t *base = image->pinned[i].iov_base;
+        if (buffer >= base && buffer + length <= base + image->pinned[i].iov_len)
+        {
+            return (int)i;
+        }
     }
+    return -1;
+}
 
+//after a failed batch: submit what is still queued and wait for every piece in flight,
+//the kernel may still write them into the caller's buffers and their completions must not
+//reach the next batch; -1 if the ring cannot be drained
+static int drainRing(Ring *ring, unsigned queued, size_t inFlight)
+{
+    while (inFlight > 0)
+    {
+        int entered = uringEnter(ring->fd, queued, 1);
+        if (entered < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            return -1;
+        }
+        if (entered > 0)
+        {
+            queued -= (unsigned)entered;
+        }
+        unsigned head = *ring->cqHead;
+        unsigned end = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        inFlight -= end - head;
+        __atomic_store_n(ring->cqHead, end, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
 
-    //duplicate the file descriptor
-    // creates a new file descriptor (fdesc) that refers to the same open file description
-    //original file descriptor (fdisk) is used for reading the directory entries and other operations
-    // Duplicating the file descriptor allows the code to maintain a separate (fdesc) that can be used independently
-    int fdesc = dup(fdisk);
-    if (fdesc == -1) {
-        perror("Unable to duplicate file descriptor");
-        close(fdisk);
-        return NULL;
+//run a batch on one ring: pieces are queued while there is room and completed out of order
+static void ringBatch(Backend *backend, Ring *ring, BackendRead *reads, size_t count)
+{
+    UringImage *image = backend->state;
+    RingPiece pieces[URING_DEPTH];
+    size_t freeSlots[URING_DEPTH];
+    size_t freeCount = URING_DEPTH;
+    size_t inFlight = 0;
+    unsigned queued = 0;  // entries in the submission ring not yet taken by the kernel
+    size_t next = 0;  // next read to split
+    size_t nextDone = 0;  // bytes of it already queued
+    int failed = ring->broken;
+    if (failed)
+    {
+        errno = EIO;
     }
 
-    //allocates memory for a new File structure
-    File *file = malloc(sizeof(File));
-    //error handling
-    if (file == NULL) {
-        perror("Error allocating memory for File");
-        close(fdisk);
-        close(fdesc);
-        return NULL;
+    for (size_t slot = 0; slot < URING_DEPTH; slot++)
+    {
+        freeSlots[slot] = URING_DEPTH - 1 - slot;
+    }
+    for (size_t r = 0; r < count; r++)
+    {
+        reads[r].result = reads[r].length;
     }
 
-    //Initialize File Structure Fields
-    file->fdesc = fdesc;//The duplicated file descriptor
-    file->fileLength = dirEntry.DIR_FileSize;//file size obtained from the directory entry
-    file->currentPosition = 0;//initialized to 0
-    file->startCluster = dirEntry.DIR_FstClusLO; //Set the starting cluster
+    while (!failed && (next < count || inFlight > 0))
+    {
+        //fill the queue
+        unsigned tail = *ring->sqTail;
+        while (next < count && freeCount > 0)
+        {
+            if (nextDone >= reads[next].length)
+            {
+                next++;
+                nextDone = 0;
+                continue;
+            }
+            size_t slot = freeSlots[--freeCount];
+            RingPiece *piece = &pieces[slot];
+            piece->read = next;
+            piece->done = nextDone;
+            piece->length = reads[next].length - nextDone < URING_PIECE ? reads[next].length - nextDone : URING_PIECE;
+            nextDone += piece->length;
 
-    //Close the directory entry file descriptor
-    close(fdisk);
-    return file;
-}
+            uint8_t *target = (uint8_t *)reads[piece->read].buffer + piece->done;
+            struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sqMask];
+            memset(sqe, 0, sizeof(*sqe));
+            int pinned = pinnedIndex(image, target, piece->length);
+            sqe->opcode = pinned >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->buf_index = pinned >= 0 ? (uint16_t)pinned : 0;
+            sqe->fd = ring->fixedFile ? 0 : backend->fdesc;
+            sqe->flags = ring->fixedFile ? IOSQE_FIXED_FILE : 0;
+            sqe->off = reads[piece->read].offset + piece->done;
+            sqe->addr = (uint64_t)(uintptr_t)target;
+            sqe->len = (uint32_t)piece->length;
+            sqe->user_data = slot;
+            ring->sqArray[tail & ring->sqMask] = tail & ring->sqMask;
+            tail++;
+            queued++;
+            inFlight++;
+        }
+        __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
 
-/*/////////////////////////////////////////////////////////////
-                        TASK 6
-/////////////////////////////////////////////////////////////*/
+        int entered = uringEnter(ring->fd, queued, inFlight > 0 ? 1 : 0);
+        if (entered < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+                continue;
+            }
+            perror("io_uring_enter");
+            failed = 1;
+            break;
+        }
+        queued -= (unsigned)entered;
 
+        //reap everything that completed, in any order
+        unsigned head = *ring->cqHead;
+        unsigned end = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != end; head++)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+            size_t slot = (size_t)cqe->user_data;
+            RingPiece *piece = &pieces[slot];
+            BackendRead *read = &reads[piece->read];
+            int result = cqe->res;
 
-void unicodeConverter(const uint8_t *unicodeString, char *asciiString) 
-{
-    
+            if (result == -EINTR || result == -EAGAIN || (result > 0 && (size_t)result < piece->length))
+            {
+                //the rest of the piece goes again
+                if (result > 0)
+                {
+                    piece->done += result;
+                    piece->length -= result;
+                }
+                unsigned again = *ring->sqTail;
+                struct io_uring_sqe *sqe = &ring->sqes[again & ring->sqMask];
+                uint8_t *target = (uint8_t *)read->buffer + piece->done;
+                int pinned = pinnedIndex(image, target, piece->length);
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = pinned >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+                sqe->buf_index = pinned >= 0 ? (uint16_t)pinned : 0;
+                sqe->fd = ring->fixedFile ? 0 : backend->fdesc;
+                sqe->flags = ring->fixedFile ? IOSQE_FIXED_FILE : 0;
+                sqe->off = read->offset + piece->done;
+                sqe->addr = (uint64_t)(uintptr_t)target;
+                sqe->len = (uint32_t)piece->length;
+                sqe->user_data = slot;
+                ring->sqArray[again & ring->sqMask] = again & ring->sqMask;
+                __atomic_store_n(ring->sqTail, again + 1, __ATOMIC_RELEASE);
+                queued++;
+                continue;
+            }
+
+            if (result < 0)
+            {
+                errno = -result;
+                read->result = -1;
+            }
+            else if (result == 0 && read->result != -1 && (ssize_t)piece->done < read->result)
+            {
+                //end of image inside this piece
+                read->result = piece->done;
+            }
+            freeSlots[freeCount++] = slot;
+            inFlight--;
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    if (failed)
+    {
+        if (drainRing(ring, queued, inFlight) == -1)
+        {
+            perror("io_uring_enter");
+            ring->broken = 1;
+        }
+        for (size_t r = 0; r < count; r++)
+        {
+            reads[r].result = -1;
+        }
+    }
 }
 
-//function to print long directory entry
-void printLongEntry(LongName *longEntry) 
+//take a free ring, or wait for the one this thread lands on
+static Ring *lockRing(UringImage *image)
 {
-    printf("Long Name: %s%s%s\n",
-           longEntry->LDIR_Name3,
-           longEntry->LDIR_Name2,
-           longEntry->LDIR_Name1);
+    unsigned start = atomic_fetch_add(&image->nextRing, 1);
+    for (int i = 0; i < image->ringCount; i++)
+    {
+        Ring *ring = &image->rings[(start + i) % image->ringCount];
+        if (pthread_mutex_trylock(&ring->lock) == 0)
+        {
+            return ring;
+        }
+    }
+    Ring *ring = &image->rings[start % image->ringCount];
+    pthread_mutex_lock(&ring->lock);
+    return ring;
 }
 
-//print a short directory entry
-void printShortEntry(DirectoryEntry *entry) 
+static void uringReadBatch(Backend *backend, BackendRead *reads, size_t count)
 {
-    //similar to task 4
-    uint16_t hours, minutes, seconds, day, month, year;
-    convertDateTime(entry->DIR_WrtTime, entry->DIR_WrtDate, &hours, &minutes, &seconds, &day, &month, &year);
+    Ring *ring = lockRing(backend->state);
+    ringBatch(backend, ring, reads, count);
+    pthread_mutex_unlock(&ring->lock);
+}
 
-    printf("| %u \t\t | %u/%u/%u \t | %u:%u:%u \t | %c%c%c%c%c%c \t | %u\t\t | %.11s \t|\n",
-           entry->DIR_FstClusLO,
-           day, month, year,
-           hours, minutes, seconds,
-           (entry->DIR_Attr & 0x01) ? 'R' : '-',
-           (entry->DIR_Attr & 0x02) ? 'H' : '-',
-           (entry->DIR_Attr & 0x04) ? 'S' : '-',
-           (entry->DIR_Attr & 0x08) ? 'V' : '-',
-           (entry->DIR_Attr & 0x10) ? 'D' : '-',
-           (entry->DIR_Attr & 0x20) ? 'A' : '-',
-           entry->DIR_FileSize,
-           entry->DIR_Name);
+static ssize_t uringRead(Backend *backend, void *buffer, size_t length, off_t offset)
+{
+    BackendRead read = { buffer, length, offset, 0 };
+    uringReadBatch(backend, &read, 1);
+    return read.result;
 }
 
-void printRootDirectoryLN(const char *filename, BootSector bootSector) 
+//register the pinned table with every ring (all rings locked)
+static int registerPinned(UringImage *image)
 {
-    int fdisk = open(filename, O_RDONLY);
-    //error handling
-    if (fdisk == -1) 
+    int result = 0;
+    for (int i = 0; i < image->ringCount; i++)
     {
-        perror("Unable to open disk file");
-        return;
+        syscall(__NR_io_uring_register, image->rings[i].fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        if (image->pinnedCount > 0 && syscall(__NR_io_uring_register, image->rings[i].fd, IORING_REGISTER_BUFFERS, image->pinned, (unsigned)image->pinnedCount) != 0)
+        {
+            result = -1;
+        }
     }
+    return result;
+}
 
-    //offset
-    off_t offset = (bootSector.BPB_RsvdSecCnt + bootSector.BPB_NumFATs * bootSector.BPB_FATSz16) * bootSector.BPB_BytsPerSec;
-
-    if (lseek(fdisk, offset, SEEK_SET) == -1) 
+static void lockAllRings(UringImage *image)
+{
+    for (int i = 0; i < image->ringCount; i++)
     {
-        perror("Error seeking to the start of the root directory");
-        close(fdisk);
-        return;
+        pthread_mutex_lock(&image->rings[i].lock);
     }
+}
 
-    size_t numOfEntry = bootSector.BPB_RootEntCnt;
-
-    //read entries 1 by 1
-    for (size_t i = 0; i < numOfEntry; i++) 
+static void unlockAllRings(UringImage *image)
+{
+    for (int i = 0; i < image->ringCount; i++)
     {
-        //read short entry 1st
-        DirectoryEntry entry;
-        ssize_t reading = read(fdisk, &entry, sizeof(DirectoryEntry));
+        pthread_mutex_unlock(&image->rings[i].lock);
+    }
+}
 
-        if (reading == -1) 
+//register a pool of buffers so reads into them skip the page pinning of every request
+static int uringPin(Backend *backend, void *const *buffers, size_t count, size_t length)
+{
+    UringImage *image = backend->state;
+    lockAllRings(image);
+    size_t before = image->pinnedCount;
+    int result = -1;
+    if (before + count <= URING_PINNED)
+    {
+        for (size_t b = 0; b < count; b++)
         {
-            perror("Error to read directory entry");
-            break;
+            image->pinned[before + b].iov_base = buffers[b];
+            image->pinned[before + b].iov_len = length;
         }
-
-        //check if the short entry is not empty or deleted or not long 
-        if (entry.DIR_Name[0] != 0x00 && entry.DIR_Name[0] != 0xE5 && (entry.DIR_Attr & 0x0F) != 0x0F) 
+        image->pinnedCount += count;
+        result = registerPinned(image);
+        if (result == -1)
         {
-            //read long entry after the short entry
-            LongName longEntry;
-            ssize_t longReading = read(fdisk, &longEntry, sizeof(LongName));
+            //memory lock limit: keep what was registered before
+            image->pinnedCount = before;
+            registerPinned(image);
+        }
+    }
+    unlockAllRings(image);
+    return result;
+}
 
-            if (longReading == -1) 
-            {
-                perror("Error to read long directory entry");
-                break;
-            }
+static void uringUnpin(Backend *backend, void *const *buffers, size_t count)
+{
+    UringImage *image = backend->state;
+    lockAllRings(image);
+    size_t kept = 0;
+    for (size_t i = 0; i < image->pinnedCount; i++)
+    {
+        int dropped = 0;
+        for (size_t b = 0; b < count && !dropped; b++)
+        {
+            dropped = image->pinned[i].iov_base == buffers[b];
+        }
+        if (!dropped)
+        {
+            image->pinned[kept++] = image->pinned[i];
+        }
+    }
+    if (kept != image->pinnedCount)
+    {
+        image->pinnedCount = kept;
+        registerPinned(image);
+    }
+    unlockAllRings(image);
+}
 
-            //check if last entry in the sequence
-            if (longEntry.LDIR_Ord & 0x40) 
-            {
-                //convert to ascci from unicode for long name
-                char ASCIIname[256];  //declare an array
-                ASCIIname[0] = '\0';   //null-terminate
+static void uringClose(Backend *backend)
+{
+    UringImage *image = backend->state;
+    for (int i = 0; i < image->ringCount; i++)
+    {
+        closeRing(&image->rings[i]);
+    }
+    free(image);
+    fileClose(backend);
+}
 
-                //concatenate three parts of the long name in reverse order
-                strncat(ASCIIname, (char *)longEntry.LDIR_Name3, 4);
-                strncat(ASCIIname, (char *)longEntry.LDIR_Name2, 12);
-                strncat(ASCIIname, (char *)longEntry.LDIR_Name1, 10);
+//switch a pread backend to io_uring, -1 (backend unchanged) if the kernel does not allow it
+static int useIoUring(Backend *backend)
+{
+    UringImage *image = calloc(1, sizeof(UringImage));
+    if (image == NULL)
+    {
+        return -1;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cpus < 1 ? 1 : cpus > URING_RINGS ? URING_RINGS : (int)cpus;
+    for (; image->ringCount < wanted; image->ringCount++)
+    {
+        if (setupRing(&image->rings[image->ringCount], backend->fdesc) == -1)
+        {
+            break;
+        }
+    }
+    if (image->ringCount == 0)
+    {
+        free(image);
+        return -1;
+    }
 
-                printf("\nLong Name: %s", ASCIIname);
-            }
+    backend->state = image;
+    backend->read = uringRead;
+    backend->readBatch = uringReadBatch;
+    backend->pinBuffers = uringPin;
+    backend->unpinBuffers = uringUnpin;
+    backend->close = uringClose;
 
-            // Print the short entry
-            printf("\nShort Name: %.11s", entry.DIR_Name);
+    //kernels without IORING_OP_READ fail the first request
+    uint8_t probe[512];
+    if (backend->size > 0 && uringRead(backend, probe, backend->size < sizeof(probe) ? backend->size : sizeof(probe), 0) < 0)
+    {
+        for (int i = 0; i < image->ringCount; i++)
+        {
+            closeRing(&image->rings[i]);
         }
+        free(image);
+        backend->state = NULL;
+        backend->read = fileRead;
+        backend->readBatch = NULL;
+        backend->pinBuffers = NULL;
+        backend->unpinBuffers = NULL;
+        backend->close = fileClose;
+        return -1;
     }
-
-    close(fdisk);
+    return 0;
 }
+#endif
 
+//container of an image cut into chunks (pack): header, chunk data, then one index entry
+//per chunk; chunks that are all zeros (free space) take no room at all
+#define CONTAINER_MAGIC "FAT16CNT"
+#define CONTAINER_VERSION 1
+//header flag: free clusters were stored as zeros, so they can be read without their chunk
+#define CONTAINER_FREE_ZEROED 1
+//decompressed chunks kept per open container
+#define CONTAINER_CACHE_CHUNKS 32
 
+typedef struct __attribute__((__packed__)) {
+    uint8_t magic[8];  // CONTAINER_MAGIC
+    uint32_t version;
+    uint32_t chunkSize;  // image bytes per chunk, the last one may be shorter
+    uint64_t imageSize;
+    uint64_t indexOffset;  // chunkCount ContainerChunk entries
+    uint32_t chunkCount;
+    uint32_t flags;
+} ContainerHeader;
 
+enum {
+    CHUNK_ZERO,  // nothing stored
+    CHUNK_RAW,  // stored as it is
+    CHUNK_DEFLATE,  // zlib stream
+};
 
-int main() 
-{
-    //      TASK2       //
-    
-    BootSector bootSector;
-    readDisk("fat16.img", &bootSector);
+typedef struct __attribute__((__packed__)) {
+    uint64_t offset;  // where the stored bytes start in the container
+    uint32_t length;  // stored bytes
+    uint32_t method;  // CHUNK_ZERO, CHUNK_RAW or CHUNK_DEFLATE
+} ContainerChunk;
 
-    //      TASK3       //
+//backend reading an image out of a container
+typedef struct {
+    ContainerHeader header;
+    ContainerChunk *chunks;
+    uint8_t *freeClusters;  // one bit per cluster from the image's own FAT, NULL if unknown
+    off_t dataOffset;  // cluster 2 in the image
+    size_t clusterSize;
+    size_t clusterCount;
+    pthread_mutex_t lock;  // guards the cache
+    uint8_t *slots;  // CONTAINER_CACHE_CHUNKS decompressed chunks
+    int64_t slotChunk[CONTAINER_CACHE_CHUNKS];  // -1 when empty
+    uint8_t referenced[CONTAINER_CACHE_CHUNKS];
+    size_t hand;  // CLOCK hand
+    uint64_t hits;
+    uint64_t inflated;
+    uint64_t freeReads;  // reads answered from the FAT alone
+} Container;
 
-    //Sectors in FAT * Bytes per Sector = total size
-    size_t fatSize = bootSector.BPB_FATSz16 * bootSector.BPB_BytsPerSec;
+//does an open file start with a container header
+static int isContainer(int fdesc)
+{
+    uint8_t magic[8];
+    return preadFull(fdesc, magic, sizeof(magic), 0) == sizeof(magic) && memcmp(magic, CONTAINER_MAGIC, sizeof(magic)) == 0;
+}
 
-    //allocate memory to store FAT table
-    uint16_t *fat = malloc(fatSize);
-    if (fat == NULL) 
+//decompress chunk index into out (chunkSize bytes), -1 on a damaged chunk
+static int inflateChunk(Backend *backend, const Container *container, size_t index, uint8_t *out, size_t length)
+{
+    const ContainerChunk *chunk = &container->chunks[index];
+#ifdef HAVE_ZLIB
+    uint8_t *stored = malloc(chunk->length);
+    if (stored == NULL)
     {
-        perror("Error allocating memory");
-        return 1;
+        return -1;
     }
+    uLongf outLength = length;
+    int status = preadFull(backend->fdesc, stored, chunk->length, chunk->offset) == (ssize_t)chunk->length &&
+                 uncompress(out, &outLength, stored, chunk->length) == Z_OK && outLength == length ? 0 : -1;
+    free(stored);
+    return status;
+#else
+    (void)backend;
+    (void)chunk;
+    (void)out;
+    (void)length;
+    return -1;
+#endif
+}
 
-    loadFAT("fat16.img", bootSector, fat, fatSize);
-
-    //read starting cluster from user
-    int startingCluster;
-    printf("What is the starting cluster?\n");
-    scanf("%u",&startingCluster);
-    uint16_t startCluster = startingCluster;
-    
-    // array to store the ordered list of clusters
-    size_t clusters[100]; 
-    //number of clusters
-    size_t clustersNumber;
-
-    fileClusters(fat, fatSize, startCluster, clusters, &clustersNumber);
+//copy part of one chunk out, through the cache when it is compressed
+static int readChunk(Backend *backend, Container *container, size_t index, uint8_t *buffer, size_t inChunk, size_t length)
+{
+    const ContainerChunk *chunk = &container->chunks[index];
+    if (chunk->method == CHUNK_ZERO)
+    {
+        memset(buffer, 0, length);
+        return 0;
+    }
+    if (chunk->method == CHUNK_RAW)
+    {
+        return preadFull(backend->fdesc, buffer, length, chunk->offset + inChunk) == (ssize_t)length ? 0 : -1;
+    }
 
-    // Print the ordered list of clusters
-    for (size_t i = 0; i < clustersNumber; i++) {
-        printf("starting cluster: %u\n", (unsigned int)clusters[i]);
-        //dont print next cluster if (i+1) more than the number of clusters
-        if ((i+1) < clustersNumber)
+    size_t chunkSize = container->header.chunkSize;
+    pthread_mutex_lock(&container->lock);
+    for (size_t s = 0; s < CONTAINER_CACHE_CHUNKS; s++)
+    {
+        if (container->slotChunk[s] == (int64_t)index)
         {
-            printf("next cluster: %u\n", (unsigned int)clusters[i+1]);
+            container->referenced[s] = 1;
+            container->hits++;
+            memcpy(buffer, container->slots + s * chunkSize + inChunk, length);
+            pthread_mutex_unlock(&container->lock);
+            return 0;
         }
     }
+    pthread_mutex_unlock(&container->lock);
 
-    //      TASK4       //
+    //inflate without the lock, other threads keep reading cached chunks
+    uint64_t chunkStart = (uint64_t)index * chunkSize;
+    size_t chunkLength = container->header.imageSize - chunkStart < chunkSize ? (size_t)(container->header.imageSize - chunkStart) : chunkSize;
+    uint8_t *data = malloc(chunkSize);
+    if (data == NULL || inflateChunk(backend, container, index, data, chunkLength) == -1)
+    {
+        free(data);
+        return -1;
+    }
+    memcpy(buffer, data + inChunk, length);
 
-    // Read and decode entries in the root directory
-    printRootDirectory("fat16.img", bootSector);
+    pthread_mutex_lock(&container->lock);
+    container->inflated++;
+    while (container->referenced[container->hand])
+    {
+        container->referenced[container->hand] = 0;
+        container->hand = (container->hand + 1) % CONTAINER_CACHE_CHUNKS;
+    }
+    size_t slot = container->hand;
+    container->hand = (container->hand + 1) % CONTAINER_CACHE_CHUNKS;
+    container->slotChunk[slot] = (int64_t)index;
+    memcpy(container->slots + slot * chunkSize, data, chunkLength);
+    pthread_mutex_unlock(&container->lock);
+    free(data);
+    return 0;
+}
 
-    //      TASK5       //
+static int clusterIsFree(const Container *container, size_t cluster)
+{
+    return container->freeClusters[cluster / 8] & (1 << (cluster % 8));
+}
 
-    char Filename[12];  //filename is 8 characters long with 3 char extension. 1 for null terminator
-    printf("Enter the filename: ");
-    scanf("%s", Filename);
+static ssize_t containerRead(Backend *backend, void *buffer, size_t length, off_t offset)
+{
+    Container *container = backend->state;
+    if (offset < 0 || (uint64_t)offset >= backend->size)
+    {
+        return 0;
+    }
+    if ((uint64_t)offset + length > backend->size)
+    {
+        length = backend->size - offset;
+    }
 
-    //Calls openFile function to open the specified file
-    File* file = openFile(Filename, bootSector, fat);
+    size_t chunkSize = container->header.chunkSize;
+    off_t dataEnd = container->dataOffset + (off_t)(container->clusterCount * container->clusterSize);
+    size_t done = 0;
+    while (done < length)
+    {
+        uint64_t at = (uint64_t)offset + done;
+        size_t index = at / chunkSize;
+        size_t inChunk = at % chunkSize;
+        size_t piece = chunkSize - inChunk < length - done ? chunkSize - inChunk : length - done;
 
-    if (file != NULL) {
-        //calculate offset based on starting cluster of file
-        //unsigned integer type that is commonly used to represent sizes of objects in memory
-        size_t fileOffset = clusterOffsetCalculation(bootSector, fat, file->startCluster);
-
-        //off_t - represents offset
-        off_t newPos = seekFile(file, fileOffset, SEEK_SET);
-        if (newPos != -1) {
-            //store the data read from the file (declares an array)
-            char buffer[2024];
-            size_t reading = readFile(file, buffer, sizeof(buffer));
-            //if  data is successfully read (>0 bytes)
-            if (reading > 0) {
-                //reading(type size_t) is cast to (int) to match expected argument type for the precision
-                printf("%.*s", (int)reading, buffer);
+        //free clusters come from the FAT, one cluster at a time
+        if (container->freeClusters != NULL && (off_t)at >= container->dataOffset && (off_t)at < dataEnd)
+        {
+            size_t cluster = 2 + (at - container->dataOffset) / container->clusterSize;
+            size_t inCluster = (at - container->dataOffset) % container->clusterSize;
+            if (piece > container->clusterSize - inCluster)
+            {
+                piece = container->clusterSize - inCluster;
+            }
+            if (clusterIsFree(container, cluster))
+            {
+                memset((uint8_t *)buffer + done, 0, piece);
+                __atomic_fetch_add(&container->freeReads, 1, __ATOMIC_RELAXED);
+                done += piece;
+                continue;
             }
         }
-        // Close the file
-        closeFile(file);
+
+        if (readChunk(backend, container, index, (uint8_t *)buffer + done, inChunk, piece) == -1)
+        {
+            fprintf(stderr, "Damaged container chunk %zu\n", index);
+            errno = EIO;
+            return -1;
+        }
+        done += piece;
     }
+    return done;
+}
 
-    //      TASK6       //
+static void containerClose(Backend *backend)
+{
+    Container *container = backend->state;
+    if (volumeOptions.cacheStats)
+    {
+        fprintf(stderr, "container: %u chunks, %llu inflated, %llu cache hits, %llu free cluster reads\n",
+                container->header.chunkCount, (unsigned long long)container->inflated,
+                (unsigned long long)container->hits, (unsigned long long)container->freeReads);
+    }
+    pthread_mutex_destroy(&container->lock);
+    free(container->chunks);
+    free(container->freeClusters);
+    free(container->slots);
+    free(container);
+    fileClose(backend);
+}
 
-    
-    printRootDirectoryLN("fat16.img", bootSector);
+//free cluster bitmap from the image's own boot sector and first FAT (read through the container)
+//left NULL when the boot sector does not describe a FAT16 layout (FAT12 and FAT32 images read
+//their zeroed free space from the chunks)
+static void loadFreeClusters(Backend *backend, Container *container)
+{
+    BootSector bs;
+    if (containerRead(backend, &bs, sizeof(bs), 0) != sizeof(bs) || bs.BPB_BytsPerSec == 0 || bs.BPB_SecPerClus == 0 || bs.BPB_FATSz16 == 0)
+    {
+        return;
+    }
+    size_t fatSize = (size_t)bs.BPB_FATSz16 * bs.BPB_BytsPerSec;
+    off_t fatOffset = (off_t)bs.BPB_RsvdSecCnt * bs.BPB_BytsPerSec;
+    container->clusterSize = (size_t)bs.BPB_SecPerClus * bs.BPB_BytsPerSec;
+    container->dataOffset = fatOffset + (off_t)bs.BPB_NumFATs * fatSize + (off_t)bs.BPB_RootEntCnt * sizeof(DirectoryEntry);
+    uint64_t totalBytes = (uint64_t)(bs.BPB_TotSec16 != 0 ? bs.BPB_TotSec16 : bs.BPB_TotSec32) * bs.BPB_BytsPerSec;
+    uint64_t bpbClusters = totalBytes > (uint64_t)container->dataOffset ? (totalBytes - container->dataOffset) / container->clusterSize : 0;
+    //the BPB cluster count decides the variant, as in volumeGeometry
+    if (bpbClusters < 4085 || bpbClusters >= 65525)
+    {
+        return;
+    }
+    if (totalBytes > backend->size)
+    {
+        totalBytes = backend->size;
+    }
+    if (totalBytes <= (uint64_t)container->dataOffset)
+    {
+        return;
+    }
+    size_t clusterCount = (totalBytes - container->dataOffset) / container->clusterSize;
+    if (clusterCount + 2 > fatSize / 2)
+    {
+        clusterCount = fatSize / 2 - 2;
+    }
 
-    //free the memory allocated
+    uint16_t *fat = malloc(fatSize);
+    uint8_t *bitmap = calloc((clusterCount + 2 + 7) / 8, 1);
+    if (fat != NULL && bitmap != NULL && containerRead(backend, fat, fatSize, fatOffset) == (ssize_t)fatSize)
+    {
+        for (size_t c = 2; c < clusterCount + 2; c++)
+        {
+            if (fat[c] == 0)
+            {
+                bitmap[c / 8] |= 1 << (c % 8);
+            }
+        }
+        container->clusterCount = clusterCount;
+        container->freeClusters = bitmap;
+        bitmap = NULL;
+    }
     free(fat);
+    free(bitmap);
+}
 
-    return 0;
+//turn a pread backend on a container file into one reading the image inside, -1 if damaged
+static int openContainer(Backend *backend)
+{
+    Container *container = calloc(1, sizeof(Container));
+    if (container == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    ContainerHeader *header = &container->header;
+    size_t indexBytes = 0;
+    int valid = preadFull(backend->fdesc, header, sizeof(ContainerHeader), 0) == sizeof(ContainerHeader) &&
+                header->version == CONTAINER_VERSION && header->chunkSize > 0 &&
+                header->chunkCount == (header->imageSize + header->chunkSize - 1) / header->chunkSize;
+    if (valid)
+    {
+        indexBytes = (size_t)header->chunkCount * sizeof(ContainerChunk);
+        container->chunks = malloc(indexBytes + 1);
+        container->slots = malloc((size_t)CONTAINER_CACHE_CHUNKS * header->chunkSize);
+        valid = container->chunks != NULL && container->slots != NULL &&
+                preadFull(backend->fdesc, container->chunks, indexBytes, header->indexOffset) == (ssize_t)indexBytes;
+    }
+    for (uint32_t c = 0; valid && c < header->chunkCount; c++)
+    {
+        const ContainerChunk *chunk = &container->chunks[c];
+        valid = chunk->method <= CHUNK_DEFLATE && chunk->offset <= backend->size && chunk->length <= backend->size - chunk->offset;
+        //a raw chunk is read in place, so it must hold exactly its part of the image
+        uint64_t start = (uint64_t)c * header->chunkSize;
+        uint64_t imageLength = header->imageSize - start < header->chunkSize ? header->imageSize - start : header->chunkSize;
+        valid = valid && (chunk->method != CHUNK_RAW || chunk->length == imageLength);
+#ifndef HAVE_ZLIB
+        if (chunk->method == CHUNK_DEFLATE)
+        {
+            fprintf(stderr, "Built without zlib, compressed containers cannot be read\n");
+            valid = 0;
+        }
+#endif
+    }
+    if (!valid)
+    {
+        fprintf(stderr, "Damaged container\n");
+        free(container->chunks);
+        free(container->slots);
+        free(container);
+        return -1;
+    }
+
+    pthread_mutex_init(&container->lock, NULL);
+    for (size_t s = 0; s < CONTAINER_CACHE_CHUNKS; s++)
+    {
+        container->slotChunk[s] = -1;
+    }
+    backend->state = container;
+    backend->size = header->imageSize;
+    backend->read = containerRead;
+    backend->close = containerClose;
+    if (header->flags & CONTAINER_FREE_ZEROED)
+    {
+        loadFreeClusters(backend, container);
+    }
+    return 0;
+}
+
+//pick a backend for a path: mmap regular files, pread block devices, buffer pipes, unpack containers
+//writable images always use pread/pwrite
+Backend *openImageBackend(const char *filename, int writable)
+{
+    Backend *backend = calloc(1, sizeof(Backend));
+    if (backend == NULL)
+    {
+        perror("Error allocating memory for Volume");
+        return NULL;
+    }
+
+    backend->fdesc = open(filename, writable ? O_RDWR : O_RDONLY);
+    if (backend->fdesc == -1)
+    {
+        perror("Unable to open disk file");
+        free(backend);
+        return NULL;
+    }
+
+    struct stat info;
+    if (fstat(backend->fdesc, &info) == -1)
+    {
+        perror("Unable to stat disk file");
+        close(backend->fdesc);
+        free(backend);
+        return NULL;
+    }
+
+    backend->read = fileRead;
+    backend->write = writable ? fileWrite : NULL;
+    backend->close = fileClose;
+
+    if (S_ISREG(info.st_mode))
+    {
+        backend->size = info.st_size;
+        if (isContainer(backend->fdesc))
+        {
+            if (writable)
+            {
+                fprintf(stderr, "Containers are read only: %s\n", filename);
+            }
+            if (writable || openContainer(backend) == -1)
+            {
+                close(backend->fdesc);
+                free(backend);
+                return NULL;
+            }
+            return backend;
+        }
+        if (!writable && !volumeOptions.noMmap && backend->size > 0)
+        {
+            void *map = mmap(NULL, backend->size, PROT_READ, MAP_PRIVATE, backend->fdesc, 0);
+            MemoryImage *image = map != MAP_FAILED ? malloc(sizeof(MemoryImage)) : NULL;
+            if (image != NULL)
+            {
+                image->data = map;
+                image->mapped = 1;
+                backend->state = image;
+                backend->memory = map;
+                backend->read = memoryRead;
+                backend->close = memoryClose;
+            }
+            else if (map != MAP_FAILED)
+            {
+                munmap(map, backend->size);
+            }
+        }
+    }
+#ifdef BLKGETSIZE64
+    else if (S_ISBLK(info.st_mode))
+    {
+        uint64_t bytes;
+        if (ioctl(backend->fdesc, BLKGETSIZE64, &bytes) == 0)
+        {
+            backend->size = bytes;
+        }
+    }
+#endif
+    else if (lseek(backend->fdesc, 0, SEEK_CUR) == -1)
+    {
+        if (writable)
+        {
+            fprintf(stderr, "Cannot write to a stream: %s\n", filename);
+            close(backend->fdesc);
+            free(backend);
+            return NULL;
+        }
+        //pipes cannot be read with pread, keep the whole stream in memory
+        MemoryImage *image = malloc(sizeof(MemoryImage));
+        if (image != NULL)
+        {
+            image->data = readStream(backend->fdesc, &backend->size);
+            image->mapped = 0;
+        }
+        if (image == NULL || image->data == NULL)
+        {
+            perror("Error reading disk image stream");
+            free(image);
+            close(backend->fdesc);
+            free(backend);
+            return NULL;
+        }
+        backend->state = image;
+        backend->memory = image->data;
+        backend->read = memoryRead;
+        backend->close = memoryClose;
+    }
+    else
+    {
+        off_t end = lseek(backend->fdesc, 0, SEEK_END);
+        backend->size = end == -1 ? 0 : end;
+    }
+
+    //deep queue reads for everything still read with pread
+    if (volumeOptions.ioUring && backend->read == fileRead)
+    {
+#ifdef HAVE_IO_URING
+        if (useIoUring(backend) == -1)
+        {
+            fprintf(stderr, "io_uring is not available, reading %s with pread\n", filename);
+        }
+#else
+        fprintf(stderr, "Built without io_uring, reading %s with pread\n", filename);
+#endif
+    }
+
+    return backend;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        CLUSTER CACHE
+/////////////////////////////////////////////////////////////*/
+
+//fixed budget of cluster sized slots, CLOCK eviction
+//one lock; backend reads happen outside it
+typedef struct ClusterCache {
+    pthread_mutex_t lock;
+    size_t slotCount;  // clusters the budget holds
+    size_t clusterSize;  // bytes per slot
+    uint8_t *data;  // slotCount * clusterSize
+    uint32_t *slotCluster;  // cluster held by each slot, 0 = empty
+    uint8_t *referenced;  // CLOCK reference bit per slot
+    int32_t *slotOf;  // slot holding each cluster, -1 = not cached
+    size_t hand;  // CLOCK hand
+    uint64_t hits;  // clusters served from the cache
+    uint64_t misses;  // clusters read from the backend on demand
+    uint64_t prefetched;  // clusters read ahead of use
+    uint64_t bypassed;  // clusters of reads too large to cache
+} ClusterCache;
+
+void freeClusterCache(ClusterCache *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->data);
+    free(cache->slotCluster);
+    free(cache->referenced);
+    free(cache->slotOf);
+    free(cache);
+}
+
+//cache of budget bytes for clusters 2..clusterCount+1, NULL if the budget is too small
+ClusterCache *createClusterCache(size_t budget, size_t clusterSize, size_t clusterCount)
+{
+    size_t slotCount = budget / clusterSize;
+    if (slotCount < 8)
+    {
+        return NULL;
+    }
+
+    ClusterCache *cache = calloc(1, sizeof(ClusterCache));
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->slotCount = slotCount;
+    cache->clusterSize = clusterSize;
+    cache->data = malloc(slotCount * clusterSize);
+    cache->slotCluster = calloc(slotCount, sizeof(uint32_t));
+    cache->referenced = calloc(slotCount, 1);
+    cache->slotOf = malloc((clusterCount + 2) * sizeof(int32_t));
+    if (cache->data == NULL || cache->slotCluster == NULL || cache->referenced == NULL || cache->slotOf == NULL)
+    {
+        freeClusterCache(cache);
+        return NULL;
+    }
+    for (size_t c = 0; c < clusterCount + 2; c++)
+    {
+        cache->slotOf[c] = -1;
+    }
+    return cache;
+}
+
+//copy a cached cluster out (lock held), 0 if it is not cached
+static int cacheLookup(ClusterCache *cache, uint32_t cluster, size_t inCluster, void *buffer, size_t length)
+{
+    int32_t slot = cache->slotOf[cluster];
+    if (slot < 0)
+    {
+        return 0;
+    }
+    cache->referenced[slot] = 1;
+    memcpy(buffer, cache->data + (size_t)slot * cache->clusterSize + inCluster, length);
+    return 1;
+}
+
+//store one cluster (lock held), evicting with the CLOCK hand
+static void cacheInsert(ClusterCache *cache, uint32_t cluster, const uint8_t *data)
+{
+    if (cache->slotOf[cluster] >= 0)
+    {
+        return;
+    }
+    //second chance for referenced slots
+    while (cache->referenced[cache->hand])
+    {
+        cache->referenced[cache->hand] = 0;
+        cache->hand = (cache->hand + 1) % cache->slotCount;
+    }
+    size_t slot = cache->hand;
+    cache->hand = (cache->hand + 1) % cache->slotCount;
+
+    if (cache->slotCluster[slot] != 0)
+    {
+        cache->slotOf[cache->slotCluster[slot]] = -1;
+    }
+    cache->slotCluster[slot] = cluster;
+    cache->slotOf[cluster] = (int32_t)slot;
+    memcpy(cache->data + slot * cache->clusterSize, data, cache->clusterSize);
+}
+
+/*/////////////////////////////////////////////////////////////
+                        VOLUME ACCESS
+/////////////////////////////////////////////////////////////*/
+
+//pending changes of a writable volume
+//FAT and root directory changes live in the metadata copy, subdirectory clusters in buffers
+typedef struct VolumeWriter {
+    uint8_t *dirtySectors;  // one flag per sector of the metadata copy
+    size_t sectorSize;  // bytes per sector
+    uint8_t **directories;  // buffered subdirectory clusters by cluster number
+    uint8_t *changed;  // buffered cluster differs from the image
+    uint16_t *buffered;  // clusters that have a buffer, in load order
+    size_t bufferedCount;
+    size_t bufferedCapacity;
+    uint16_t nextFree;  // next fit: allocation resumes here
+} VolumeWriter;
+
+//byte offsets of each region, computed once from the boot sector
+static int volumeGeometry(Volume *volume)
+{
+    const BootSector *bs = volume->bootSector;
+    const BootSector32 *bs32 = (const BootSector32 *)((const uint8_t *)bs + BOOT_SECTOR32_OFFSET);
+    //BPB_FATSz16 == 0 means the size is in BPB_FATSz32
+    uint64_t fatSectors = bs->BPB_FATSz16 != 0 ? bs->BPB_FATSz16 : bs32->BPB_FATSz32;
+
+    if (bs->BPB_BytsPerSec == 0 || bs->BPB_SecPerClus == 0 || bs->BPB_NumFATs == 0 || fatSectors == 0)
+    {
+        fprintf(stderr, "Not a FAT boot sector\n");
+        return -1;
+    }
+
+    volume->fatSize = (size_t)fatSectors * bs->BPB_BytsPerSec;
+    volume->clusterSize = (size_t)bs->BPB_SecPerClus * bs->BPB_BytsPerSec;
+    volume->fatOffset = (off_t)bs->BPB_RsvdSecCnt * bs->BPB_BytsPerSec;
+    volume->rootOffset = volume->fatOffset + (off_t)bs->BPB_NumFATs * volume->fatSize;
+    volume->dataOffset = volume->rootOffset + (off_t)bs->BPB_RootEntCnt * sizeof(DirectoryEntry);
+
+    if ((uint64_t)volume->dataOffset > volume->imageSize)
+    {
+        fprintf(stderr, "Disk image is smaller than its FAT and root directory\n");
+        return -1;
+    }
+
+    //BPB_TotSec16 == 0 means the count is in BPB_TotSec32
+    uint64_t totalSectors = bs->BPB_TotSec16 != 0 ? bs->BPB_TotSec16 : bs->BPB_TotSec32;
+    uint64_t totalBytes = totalSectors * bs->BPB_BytsPerSec;
+    uint64_t bpbClusters = totalBytes > (uint64_t)volume->dataOffset ? (totalBytes - volume->dataOffset) / volume->clusterSize : 0;
+
+    //the BPB cluster count alone tells the variants apart, whatever BS_FilSysType says
+    //(a truncated image is still the variant it was made as)
+    volume->fatType = bpbClusters < 4085 ? FAT12 : bpbClusters < 65525 ? FAT16 : FAT32;
+
+    //clusters past the end of the image cannot be read
+    if (totalBytes > volume->imageSize)
+    {
+        totalBytes = volume->imageSize;
+    }
+    volume->clusterCount = totalBytes > (uint64_t)volume->dataOffset ? (totalBytes - volume->dataOffset) / volume->clusterSize : 0;
+    volume->rootCluster = 0;
+    if (volume->fatType == FAT32)
+    {
+        volume->rootCluster = bs32->BPB_RootClus;
+        if (volume->rootCluster < 2 || volume->rootCluster > volume->clusterCount + 1)
+        {
+            fprintf(stderr, "Root directory cluster %u is outside the volume\n", volume->rootCluster);
+            return -1;
+        }
+    }
+
+    //a cluster number must also have a FAT entry (12 bit entries: 2 per 3 bytes)
+    size_t entries = volume->fatType == FAT12 ? volume->fatSize * 2 / 3 : volume->fatSize / (volume->fatType / 8);
+    if (volume->clusterCount + 2 > entries)
+    {
+        volume->clusterCount = entries - 2;
+    }
+    return 0;
+}
+
+//point the volume at its first FAT; FAT12 entries are widened to 16 bits once, so
+//FAT12 and FAT16 share one table layout (see fatEntryOf) and only FAT32 needs its own
+static int setupFat(Volume *volume, const uint8_t *base)
+{
+    const uint8_t *fat = base + volume->fatOffset;
+    switch (volume->fatType)
+    {
+        case FAT12:
+        {
+            size_t end = volume->clusterCount + 2;
+            uint16_t *widened = malloc(end * sizeof(uint16_t));
+            if (widened == NULL)
+            {
+                perror("Error allocating memory");
+                return -1;
+            }
+            for (size_t c = 0; c < end; c++)
+            {
+                //two entries share three bytes, odd ones take the upper 12 bits
+                uint16_t pair = fat[c * 3 / 2] | fat[c * 3 / 2 + 1] << 8;
+                uint16_t value = c & 1 ? pair >> 4 : pair & 0x0FFF;
+                //reserved, bad and end of chain markers keep their meaning: 0xFF7 -> 0xFFF7
+                widened[c] = value >= 0x0FF0 ? value | 0xF000 : value;
+            }
+            volume->widenedFat = widened;
+            volume->fat = widened;
+            break;
+        }
+        case FAT16:
+            volume->fat = (const uint16_t *)fat;
+            break;
+        case FAT32:
+            volume->fat32 = (const uint32_t *)fat;
+            break;
+    }
+    volume->endOfChain = volume->fatType == FAT32 ? 0x0FFFFFF8 : 0xFFF8;
+    volume->badCluster = volume->fatType == FAT32 ? 0x0FFFFFF7 : 0xFFF7;
+    //the top 4 bits of a FAT32 cluster number are reserved
+    volume->clusterHigh = volume->fatType == FAT32 ? 0x0FFF : 0;
+    return 0;
+}
+
+//drop the indexes and cache, then close the backend
+void freeDirectoryIndexes(Volume *volume);
+int flushVolume(Volume *volume);
+void freeVolumeWriter(Volume *volume);
+
+void releaseSharedVolume(Volume *volume);
+
+void closeVolume(Volume *volume)
+{
+    //shared volumes stay open for the next request
+    if (volume->shared != NULL)
+    {
+        releaseSharedVolume(volume);
+        return;
+    }
+    if (volume->writer != NULL)
+    {
+        flushVolume(volume);
+        freeVolumeWriter(volume);
+    }
+    freeDirectoryIndexes(volume);
+    pthread_mutex_destroy(&volume->indexLock);
+    if (volume->cache != NULL)
+    {
+        ClusterCache *cache = volume->cache;
+        if (volumeOptions.cacheStats)
+        {
+            fprintf(stderr, "cache: %zu slots, %llu hits, %llu misses, %llu read ahead, %llu bypassed\n",
+                    cache->slotCount, (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+                    (unsigned long long)cache->prefetched, (unsigned long long)cache->bypassed);
+        }
+        freeClusterCache(cache);
+    }
+    free(volume->widenedFat);
+    free(volume->metadata);
+    if (volume->backend != NULL)
+    {
+        volume->backend->close(volume->backend);
+    }
+    free(volume);
+}
+
+//open a volume over any backend (takes ownership of it, also on failure)
+Volume *openVolumeOn(Backend *backend)
+{
+    Volume *volume = calloc(1, sizeof(Volume));
+    if (volume == NULL)
+    {
+        perror("Error allocating memory for Volume");
+        backend->close(backend);
+        return NULL;
+    }
+    pthread_mutex_init(&volume->indexLock, NULL);
+    volume->backend = backend;
+    volume->imageSize = backend->size;
+
+    if (volume->imageSize < BOOT_SECTOR32_OFFSET + sizeof(BootSector32))
+    {
+        fprintf(stderr, "Disk image is too small\n");
+        closeVolume(volume);
+        return NULL;
+    }
+
+    const uint8_t *base = backend->memory;
+    if (base == NULL)
+    {
+        //keep one copy of everything before cluster 2
+        uint8_t bootSector[BOOT_SECTOR32_OFFSET + sizeof(BootSector32)];
+        if (backend->read(backend, bootSector, sizeof(bootSector), 0) != sizeof(bootSector))
+        {
+            perror("Error reading from disk file");
+            closeVolume(volume);
+            return NULL;
+        }
+        volume->bootSector = (const BootSector *)bootSector;
+        if (volumeGeometry(volume) == -1)
+        {
+            closeVolume(volume);
+            return NULL;
+        }
+        volume->metadata = malloc(volume->dataOffset);
+        if (volume->metadata == NULL)
+        {
+            perror("Error allocating memory");
+            closeVolume(volume);
+            return NULL;
+        }
+        if (backend->read(backend, volume->metadata, volume->dataOffset, 0) != volume->dataOffset)
+        {
+            perror("Error reading the FAT and root directory");
+            closeVolume(volume);
+            return NULL;
+        }
+        base = volume->metadata;
+    }
+
+    volume->bootSector = (const BootSector *)base;
+    if (volumeGeometry(volume) == -1)
+    {
+        closeVolume(volume);
+        return NULL;
+    }
+    if (setupFat(volume, base) == -1)
+    {
+        closeVolume(volume);
+        return NULL;
+    }
+    volume->rootDir = (const DirectoryEntry *)(base + volume->rootOffset);
+
+    //the page cache already covers mapped images, writable images are not cached
+    if (backend->memory == NULL && backend->write == NULL && volumeOptions.cacheBytes > 0)
+    {
+        volume->cache = createClusterCache(volumeOptions.cacheBytes, volume->clusterSize, volume->clusterCount);
+    }
+
+    return volume;
+}
+
+//open the image once through the backend that suits the path
+static Volume *loadVolume(const char *filename)
+{
+    uint64_t start = profileStart();
+    Backend *backend = openImageBackend(filename, 0);
+    if (backend == NULL)
+    {
+        return NULL;
+    }
+    Volume *volume = openVolumeOn(backend);
+    if (volume == NULL)
+    {
+        fprintf(stderr, "Unable to open volume: %s\n", filename);
+    }
+    profileEnd(PROFILE_OPEN_VOLUME, start, 0);
+    return volume;
+}
+
+Volume *acquireSharedVolume(const char *filename);
+//set while serve runs: volumes are kept open between requests
+static struct VolumeCache *sharedVolumes;
+
+Volume *openVolume(const char *filename)
+{
+    if (sharedVolumes != NULL)
+    {
+        return acquireSharedVolume(filename);
+    }
+    return loadVolume(filename);
+}
+
+//zero copy pointer to length bytes at offset, NULL if not in memory
+const uint8_t *volumePointer(const Volume *volume, off_t offset, size_t length)
+{
+    if (offset < 0 || (uint64_t)offset + length > volume->imageSize)
+    {
+        return NULL;
+    }
+    if (volume->backend->memory != NULL)
+    {
+        return volume->backend->memory + offset;
+    }
+    //otherwise only everything before the data region is in memory
+    if (offset + length <= (uint64_t)volume->dataOffset)
+    {
+        return volume->metadata + offset;
+    }
+    return NULL;
+}
+
+//image offset of the first byte of a cluster
+off_t clusterOffset(const Volume *volume, uint32_t cluster)
+{
+    //"- 2" because the first data cluster is cluster 2
+    return volume->dataOffset + (off_t)(cluster - 2) * volume->clusterSize;
+}
+
+//read clusters first..first+count-1 from the backend in one request and cache them
+//returns the clusters read, 0 on error
+static size_t cacheFill(const Volume *volume, uint32_t first, size_t count, uint8_t *scratch)
+{
+    ClusterCache *cache = volume->cache;
+    size_t bytes = count * volume->clusterSize;
+    if (volume->backend->read(volume->backend, scratch, bytes, clusterOffset(volume, first)) != (ssize_t)bytes)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&cache->lock);
+    for (size_t c = 0; c < count; c++)
+    {
+        cacheInsert(cache, (uint32_t)(first + c), scratch + c * volume->clusterSize);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return count;
+}
+
+//read ahead: cache up to count clusters from first that are not cached yet
+void cachePrefetch(const Volume *volume, uint32_t first, size_t count)
+{
+    ClusterCache *cache = volume->cache;
+    if (cache == NULL || first < 2)
+    {
+        return;
+    }
+    //never more than half the cache, never past the last cluster
+    if (count > cache->slotCount / 2)
+    {
+        count = cache->slotCount / 2;
+    }
+    if (first + count > volume->clusterCount + 2)
+    {
+        count = volume->clusterCount + 2 - first;
+    }
+
+    //skip the clusters already cached
+    pthread_mutex_lock(&cache->lock);
+    while (count > 0 && cache->slotOf[first] >= 0)
+    {
+        first++;
+        count--;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    if (count == 0)
+    {
+        return;
+    }
+
+    uint8_t *scratch = malloc(count * volume->clusterSize);
+    if (scratch == NULL)
+    {
+        return;
+    }
+    size_t filled = cacheFill(volume, first, count, scratch);
+    free(scratch);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->prefetched += filled;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+//read part of the data region through the cache
+//a miss is read with the rest of the request in one backend read, every cluster of it a miss
+//returns the bytes copied before a failed read, -1 if there are none
+static ssize_t cachedRead(const Volume *volume, uint8_t *buffer, size_t length, off_t offset)
+{
+    ClusterCache *cache = volume->cache;
+    size_t clusterSize = volume->clusterSize;
+    uint32_t first = (uint32_t)(2 + (offset - volume->dataOffset) / clusterSize);
+    size_t span = ((offset - volume->dataOffset) % clusterSize + length + clusterSize - 1) / clusterSize;
+
+    //large reads would flush everything else out of the cache
+    if (span > cache->slotCount / 4)
+    {
+        pthread_mutex_lock(&cache->lock);
+        cache->bypassed += span;
+        pthread_mutex_unlock(&cache->lock);
+        return volume->backend->read(volume->backend, buffer, length, offset);
+    }
+
+    size_t done = 0;
+    while (done < length)
+    {
+        uint32_t cluster = (uint32_t)(2 + (offset + done - volume->dataOffset) / clusterSize);
+        size_t inCluster = (offset + done - volume->dataOffset) % clusterSize;
+        size_t chunk = clusterSize - inCluster < length - done ? clusterSize - inCluster : length - done;
+
+        pthread_mutex_lock(&cache->lock);
+        int hit = cacheLookup(cache, cluster, inCluster, buffer + done, chunk);
+        if (hit)
+        {
+            cache->hits++;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        if (hit)
+        {
+            profileCount(COUNT_CACHE_HITS, 1);
+            done += chunk;
+            continue;
+        }
+
+        //this cluster and everything after it in the request
+        size_t count = first + span - cluster;
+        pthread_mutex_lock(&cache->lock);
+        cache->misses += count;
+        pthread_mutex_unlock(&cache->lock);
+        profileCount(COUNT_CACHE_MISSES, count);
+        uint8_t *scratch = malloc(count * clusterSize);
+        if (scratch == NULL)
+        {
+            ssize_t reading = volume->backend->read(volume->backend, buffer + done, length - done, offset + done);
+            if (reading == -1)
+            {
+                return done > 0 ? (ssize_t)done : -1;
+            }
+            return (ssize_t)done + reading;
+        }
+        if (cacheFill(volume, cluster, count, scratch) == 0)
+        {
+            free(scratch);
+            return done > 0 ? (ssize_t)done : -1;
+        }
+        memcpy(buffer + done, scratch + inCluster, length - done);
+        free(scratch);
+        done = length;
+    }
+    return done;
+}
+
+//copy length bytes at offset into buffer (memcpy from memory, the cluster cache, or the backend)
+ssize_t volumeRead(const Volume *volume, void *buffer, size_t length, off_t offset)
+{
+    if (offset < 0 || (uint64_t)offset >= volume->imageSize)
+    {
+        return 0;
+    }
+    //clamp to end of image
+    if ((uint64_t)offset + length > volume->imageSize)
+    {
+        length = volume->imageSize - offset;
+    }
+
+    const uint8_t *source = volumePointer(volume, offset, length);
+    if (source != NULL)
+    {
+        memcpy(buffer, source, length);
+        profileCount(COUNT_IMAGE_BYTES, length);
+        return length;
+    }
+
+    off_t dataEnd = volume->dataOffset + (off_t)(volume->clusterCount * volume->clusterSize);
+    if (volume->cache != NULL && offset >= volume->dataOffset && offset + (off_t)length <= dataEnd)
+    {
+        ssize_t reading = cachedRead(volume, buffer, length, offset);
+        profileCount(COUNT_IMAGE_BYTES, reading > 0 ? reading : 0);
+        return reading;
+    }
+    ssize_t reading = volume->backend->read(volume->backend, buffer, length, offset);
+    profileCount(COUNT_IMAGE_BYTES, reading > 0 ? reading : 0);
+
+    //buffered directory clusters are newer than the image
+    VolumeWriter *writer = volume->writer;
+    for (size_t b = 0; writer != NULL && reading > 0 && b < writer->bufferedCount; b++)
+    {
+        off_t start = clusterOffset(volume, writer->buffered[b]);
+        off_t end = start + (off_t)volume->clusterSize;
+        off_t from = start > offset ? start : offset;
+        off_t to = end < offset + reading ? end : offset + reading;
+        if (from < to)
+        {
+            memcpy((uint8_t *)buffer + (from - offset), writer->directories[writer->buffered[b]] + (from - start), to - from);
+        }
+    }
+    return reading;
+}
+
+//many reads of the data region at once; -1 if any came back short or failed
+//only the backend without cache or pending writes can keep them all in flight
+int volumeReadBatch(const Volume *volume, BackendRead *reads, size_t count)
+{
+    Backend *backend = volume->backend;
+    int direct = backend->readBatch != NULL && backend->memory == NULL && volume->cache == NULL && volume->writer == NULL;
+    for (size_t r = 0; direct && r < count; r++)
+    {
+        direct = reads[r].offset >= volume->dataOffset && (uint64_t)reads[r].offset + reads[r].length <= volume->imageSize;
+    }
+
+    if (direct)
+    {
+        backend->readBatch(backend, reads, count);
+        for (size_t r = 0; r < count; r++)
+        {
+            profileCount(COUNT_IMAGE_BYTES, reads[r].result > 0 ? reads[r].result : 0);
+        }
+    }
+    else
+    {
+        for (size_t r = 0; r < count; r++)
+        {
+            reads[r].result = volumeRead(volume, reads[r].buffer, reads[r].length, reads[r].offset);
+        }
+    }
+
+    for (size_t r = 0; r < count; r++)
+    {
+        if (reads[r].result != (ssize_t)reads[r].length)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//register buffers a command reuses for every read (no-op for backends that do not need it)
+void volumePinBuffers(const Volume *volume, void *const *buffers, size_t count, size_t length)
+{
+    if (volume->backend->pinBuffers != NULL && count > 0)
+    {
+        volume->backend->pinBuffers(volume->backend, buffers, count, length);
+    }
+}
+
+void volumeUnpinBuffers(const Volume *volume, void *const *buffers, size_t count)
+{
+    if (volume->backend->unpinBuffers != NULL && count > 0)
+    {
+        volume->backend->unpinBuffers(volume->backend, buffers, count);
+    }
+}
+
+//zero copy pointer to a whole cluster, NULL if not mapped or out of range
+const uint8_t *volumeCluster(const Volume *volume, uint32_t cluster)
+{
+    if (cluster < 2)
+    {
+        return NULL;
+    }
+    return volumePointer(volume, clusterOffset(volume, cluster), volume->clusterSize);
+}
+
+/*/////////////////////////////////////////////////////////////
+                        SHARED VOLUMES
+/////////////////////////////////////////////////////////////*/
+
+//one open image kept by the shared volume cache
+typedef struct CachedVolume {
+    dev_t device;  // identity of the image file
+    ino_t inode;
+    off_t size;  // size and modification time when loaded; any change means a new image
+    struct timespec modified;
+    Volume *volume;
+    size_t users;  // requests holding it now
+    size_t bytes;  // memory charged for it
+    int stale;  // no longer findable; closed when the last user is done
+    struct CachedVolume *newer;  // recently used list
+    struct CachedVolume *older;
+    struct CachedVolume *next;  // hash chain, or the list of volumes to close
+} CachedVolume;
+
+//open volumes by file identity, least recently used dropped first
+typedef struct VolumeCache {
+    pthread_mutex_t lock;  // held only to find, count and link entries, never while loading
+    CachedVolume **buckets;
+    size_t bucketMask;
+    CachedVolume *newest;
+    CachedVolume *oldest;
+    size_t count;
+    size_t maxCount;  // each open image holds a descriptor and a mapping
+    size_t bytes;
+    size_t budget;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} VolumeCache;
+
+//heap memory a volume holds: metadata, indexes and cluster cache
+static size_t volumeBytes(const Volume *volume)
+{
+    size_t bytes = sizeof(Volume) + (size_t)volume->dataOffset + __atomic_load_n(&volume->indexBytes, __ATOMIC_RELAXED);
+    if (volume->cache != NULL)
+    {
+        bytes += volume->cache->slotCount * volume->clusterSize;
+    }
+    if (volume->widenedFat != NULL)
+    {
+        bytes += (volume->clusterCount + 2) * sizeof(uint16_t);
+    }
+    return bytes;
+}
+
+VolumeCache *createVolumeCache(size_t budget, size_t maxCount)
+{
+    VolumeCache *cache = calloc(1, sizeof(VolumeCache));
+    size_t buckets = 16;
+    while (buckets < maxCount * 2)
+    {
+        buckets *= 2;
+    }
+    if (cache == NULL || (cache->buckets = calloc(buckets, sizeof(CachedVolume *))) == NULL)
+    {
+        perror("Error allocating memory for the volume cache");
+        free(cache);
+        return NULL;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->bucketMask = buckets - 1;
+    cache->maxCount = maxCount > 0 ? maxCount : 1;
+    cache->budget = budget;
+    return cache;
+}
+
+static CachedVolume **cachedBucket(VolumeCache *cache, dev_t device, ino_t inode)
+{
+    uint64_t key = ((uint64_t)device * 0x9E3779B97F4A7C15ULL) ^ (uint64_t)inode;
+    return &cache->buckets[(key ^ key >> 29) & cache->bucketMask];
+}
+
+//take an entry out of the hash and the recently used list (lock held)
+static void unlinkCached(VolumeCache *cache, CachedVolume *entry)
+{
+    CachedVolume **link = cachedBucket(cache, entry->device, entry->inode);
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    entry->next = NULL;
+    if (entry->newer != NULL)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        cache->newest = entry->older;
+    }
+    if (entry->older != NULL)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        cache->oldest = entry->newer;
+    }
+    entry->newer = entry->older = NULL;
+    cache->count--;
+    cache->bytes -= entry->bytes;
+}
+
+static void linkNewest(VolumeCache *cache, CachedVolume *entry)
+{
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest != NULL)
+    {
+        cache->newest->newer = entry;
+    }
+    cache->newest = entry;
+    if (cache->oldest == NULL)
+    {
+        cache->oldest = entry;
+    }
+}
+
+//unused entries past the budget or count, oldest first (lock held); returned as a list to close
+static CachedVolume *evictCached(VolumeCache *cache)
+{
+    CachedVolume *closing = NULL;
+    CachedVolume *entry = cache->oldest;
+    while (entry != NULL && (cache->bytes > cache->budget || cache->count > cache->maxCount))
+    {
+        CachedVolume *newer = entry->newer;
+        if (entry->users == 0)
+        {
+            unlinkCached(cache, entry);
+            entry->next = closing;
+            closing = entry;
+            cache->evictions++;
+        }
+        entry = newer;
+    }
+    return closing;
+}
+
+static void closeCachedList(CachedVolume *entry)
+{
+    while (entry != NULL)
+    {
+        CachedVolume *next = entry->next;
+        entry->volume->shared = NULL;
+        closeVolume(entry->volume);
+        free(entry);
+        entry = next;
+    }
+}
+
+//the open volume for an image, loading it if it is not cached or changed on disk
+//every acquire is paired with a closeVolume, which hands the volume back
+Volume *acquireSharedVolume(const char *filename)
+{
+    VolumeCache *cache = sharedVolumes;
+    struct stat info;
+    if (stat(filename, &info) == -1)
+    {
+        perror(filename);
+        return NULL;
+    }
+
+    CachedVolume *closing = NULL;
+    pthread_mutex_lock(&cache->lock);
+    CachedVolume *entry = *cachedBucket(cache, info.st_dev, info.st_ino);
+    while (entry != NULL && !(entry->device == info.st_dev && entry->inode == info.st_ino))
+    {
+        entry = entry->next;
+    }
+    if (entry != NULL && entry->size == info.st_size && entry->modified.tv_sec == info.st_mtim.tv_sec && entry->modified.tv_nsec == info.st_mtim.tv_nsec)
+    {
+        entry->users++;
+        cache->hits++;
+        if (cache->newest != entry)
+        {
+            //move to the front
+            entry->newer->older = entry->older;
+            if (entry->older != NULL)
+            {
+                entry->older->newer = entry->newer;
+            }
+            else
+            {
+                cache->oldest = entry->newer;
+            }
+            linkNewest(cache, entry);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return entry->volume;
+    }
+    if (entry != NULL)
+    {
+        //the image was rewritten: requests still using the old one keep it until they finish
+        unlinkCached(cache, entry);
+        entry->stale = 1;
+        if (entry->users == 0)
+        {
+            closing = entry;
+        }
+    }
+    cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+    closeCachedList(closing);
+
+    //loading takes no lock; two requests for a cold image may both load it
+    Volume *volume = loadVolume(filename);
+    entry = volume != NULL ? calloc(1, sizeof(CachedVolume)) : NULL;
+    if (entry == NULL)
+    {
+        if (volume != NULL)
+        {
+            perror("Error allocating memory");
+            closeVolume(volume);
+        }
+        return NULL;
+    }
+    entry->device = info.st_dev;
+    entry->inode = info.st_ino;
+    entry->size = info.st_size;
+    entry->modified = info.st_mtim;
+    entry->volume = volume;
+    entry->users = 1;
+    entry->bytes = volumeBytes(volume);
+    volume->shared = entry;
+
+    pthread_mutex_lock(&cache->lock);
+    CachedVolume **bucket = cachedBucket(cache, entry->device, entry->inode);
+    CachedVolume *other = *bucket;
+    while (other != NULL && !(other->device == entry->device && other->inode == entry->inode))
+    {
+        other = other->next;
+    }
+    if (other != NULL)
+    {
+        //lost the race: ours serves this request only
+        entry->stale = 1;
+    }
+    else
+    {
+        entry->next = *bucket;
+        *bucket = entry;
+        linkNewest(cache, entry);
+        cache->count++;
+        cache->bytes += entry->bytes;
+        closing = evictCached(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    closeCachedList(closing);
+    return volume;
+}
+
+//a request is done with a shared volume; memory it grew (indexes) is charged now
+void releaseSharedVolume(Volume *volume)
+{
+    VolumeCache *cache = sharedVolumes;
+    CachedVolume *entry = volume->shared;
+    CachedVolume *closing = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    entry->users--;
+    if (entry->stale)
+    {
+        if (entry->users == 0)
+        {
+            closing = entry;
+        }
+    }
+    else
+    {
+        size_t bytes = volumeBytes(volume);
+        cache->bytes += bytes - entry->bytes;
+        entry->bytes = bytes;
+        closing = evictCached(cache);
+    }
+    pthread_mutex_unlock(&cache->lock);
+    closeCachedList(closing);
+}
+
+//close every cached volume; no request may be running
+void freeVolumeCache(VolumeCache *cache)
+{
+    CachedVolume *closing = NULL;
+    while (cache->oldest != NULL)
+    {
+        CachedVolume *entry = cache->oldest;
+        unlinkCached(cache, entry);
+        entry->next = closing;
+        closing = entry;
+    }
+    closeCachedList(closing);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+/*/////////////////////////////////////////////////////////////
+                        TASK 1 + 2
+/////////////////////////////////////////////////////////////*/
+
+//read function
+//copies the boot sector out of the volume opened by openVolume
+void readDisk(Volume *volume, BootSector *bootSector) 
+{
+    //boot sector is already in memory (mapping or metadata copy)
+    memcpy(bootSector, volume->bootSector, sizeof(BootSector));
+
+    {
+        printf("Bytes per Sector: %u\n", bootSector->BPB_BytsPerSec);
+        printf("Sectors per Cluster: %u\n", bootSector->BPB_SecPerClus);
+        printf("Reserved Sector Count: %u\n", bootSector->BPB_RsvdSecCnt);
+        printf("Number of copies of FAT: %u\n", bootSector->BPB_NumFATs);
+        printf("FAT12/FAT16: size of root DIR: %u\n", bootSector->BPB_RootEntCnt);
+        printf("Sectors, may be 0, see below: %u\n", bootSector->BPB_TotSec16);
+        printf("Sectors in FAT (FAT12 or FAT16): %u\n", bootSector->BPB_FATSz16);
+        printf("Sectors if BPB_TotSec16 == 0: %u\n", bootSector->BPB_TotSec32);
+        printf("Non zero terminated string: %.11s\n", bootSector->BS_VolLab);
+
+    }
+}
+
+/*/////////////////////////////////////////////////////////////
+                        FAT VARIANTS
+/////////////////////////////////////////////////////////////*/
+
+//loops over FAT entries are written once, taking the entry width as "bits": 16 for
+//FAT12 (widened by setupFat) and FAT16, 32 for FAT32
+//they are always inlined and FAT_DISPATCH calls them with a constant width after
+//testing the volume once, so each loop is compiled per width and the FAT16 one is
+//plain 16 bit loads and compares, with no test of the variant per entry
+#define FAT_INLINE static inline __attribute__((always_inline))
+
+//call function(arguments..., width) with the width of the volume's FAT
+#define FAT_DISPATCH(volume, function, ...) \
+    ((volume)->fat32 != NULL ? function(__VA_ARGS__, 32) : function(__VA_ARGS__, 16))
+
+//next cluster of a chain, or a marker
+FAT_INLINE uint32_t fatEntryOf(const Volume *volume, size_t cluster, int bits)
+{
+    //the top 4 bits of FAT32 entries are reserved
+    return bits == 16 ? volume->fat[cluster] : volume->fat32[cluster] & 0x0FFFFFFF;
+}
+
+//lowest end of chain marker
+FAT_INLINE uint32_t fatEndOfChainOf(int bits)
+{
+    return bits == 16 ? 0xFFF8 : 0x0FFFFFF8;
+}
+
+FAT_INLINE uint32_t fatBadClusterOf(int bits)
+{
+    return bits == 16 ? 0xFFF7 : 0x0FFFFFF7;
+}
+
+//one FAT entry, for code that does not loop over the FAT
+uint32_t fatEntry(const Volume *volume, size_t cluster)
+{
+    return FAT_DISPATCH(volume, fatEntryOf, volume, cluster);
+}
+
+//first cluster of an entry, DIR_FstClusHI only counts on FAT32
+static inline uint32_t entryCluster(const Volume *volume, const DirectoryEntry *entry)
+{
+    return (uint32_t)(entry->DIR_FstClusHI & volume->clusterHigh) << 16 | entry->DIR_FstClusLO;
+}
+
+//chain holding a directory's entries (0 = root): the FAT32 root is a chain like
+//any other, the FAT12 and FAT16 root is the fixed region and has none (0)
+static inline uint32_t directoryChain(const Volume *volume, uint32_t cluster)
+{
+    return cluster == 0 ? volume->rootCluster : cluster;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        TASK 3
+/////////////////////////////////////////////////////////////*/
+
+// Function to get the first FAT of the volume
+//no copy is made: the pointer is into the mapping (or the metadata copy, or the
+//widened FAT12 table); entries are uint16_t, or uint32_t on FAT32 (see fatEntry)
+const void *loadFAT(Volume *volume, size_t *fatSize) 
+{
+    //offset is at first FAT which is after reserved sectors
+    //Reserved Sector Count * Bytes per Sector
+    uint64_t start = profileStart();
+    *fatSize = volume->fatSize;
+    profileEnd(PROFILE_LOAD_FAT, start, *fatSize);
+    return volume->fat32 != NULL ? (const void *)volume->fat32 : (const void *)volume->fat;
+}
+
+//fileClusters for one entry width
+FAT_INLINE size_t chainClusters(const Volume *volume, uint32_t cluster, size_t *clusters, size_t maxClusters, int bits)
+{
+    //number of clusters (counter), kept local so the loop does not go through memory
+    size_t count = 0;
+    size_t end = volume->clusterCount + 2;
+
+    //starting cluster is not end of file (and has a FAT entry)
+    while (cluster >= 2 && cluster < fatEndOfChainOf(bits) && cluster < end && count < maxClusters) 
+    {
+        //stores the new cluster in the clusters array
+        clusters[count++] = cluster;
+
+        //go to the next cluster
+        cluster = fatEntryOf(volume, cluster, bits);
+    }
+    return count;
+}
+
+//function to get ordered lists of file cluster starting from the initial cluster
+//stops after maxClusters entries so a long (or looping) chain cannot overflow clusters
+void fileClusters(const Volume *volume, uint32_t startCluster, size_t *clusters, size_t maxClusters, size_t *clustersNumber) 
+{
+    uint64_t start = profileStart();
+    size_t count = FAT_DISPATCH(volume, chainClusters, volume, startCluster, clusters, maxClusters);
+    *clustersNumber = count;
+    profileCount(COUNT_CLUSTERS_WALKED, count);
+    profileEnd(PROFILE_FILE_CLUSTERS, start, count);
+}
+
+//free the runs of an extent map
+void freeExtentMap(ExtentMap *map)
+{
+    free(map->extents);
+    map->extents = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->clusterCount = 0;
+}
+
+//add the next cluster of a file to its runs, -1 on allocation failure
+static int appendExtent(const Volume *volume, ExtentMap *map, uint32_t cluster)
+{
+    Extent *last = map->count > 0 ? &map->extents[map->count - 1] : NULL;
+    if (last != NULL && cluster == last->firstCluster + last->length)
+    {
+        //next cluster continues the current run
+        last->length++;
+    }
+    else
+    {
+        if (map->count == map->capacity)
+        {
+            size_t capacity = map->capacity ? map->capacity * 2 : 4;
+            Extent *grown = realloc(map->extents, capacity * sizeof(Extent));
+            if (grown == NULL)
+            {
+                perror("Error allocating memory for extents");
+                return -1;
+            }
+            map->extents = grown;
+            map->capacity = capacity;
+        }
+        Extent *run = &map->extents[map->count++];
+        run->firstCluster = cluster;
+        run->length = 1;
+        run->fileOffset = (uint64_t)map->clusterCount * volume->clusterSize;
+    }
+
+    map->clusterCount++;
+    return 0;
+}
+
+//buildExtentMap for one entry width, frees the map on error
+FAT_INLINE int chainExtents(const Volume *volume, uint32_t startCluster, ExtentMap *map, int bits)
+{
+    size_t lastCluster = volume->clusterCount + 1;
+    uint32_t cluster = startCluster;
+    //0 means an empty file
+    while (cluster >= 2 && cluster < fatEndOfChainOf(bits))
+    {
+        if (cluster > lastCluster)
+        {
+            fprintf(stderr, "Cluster %u is outside the volume\n", cluster);
+            freeExtentMap(map);
+            return -1;
+        }
+        //a chain longer than the volume must loop
+        if (map->clusterCount == volume->clusterCount)
+        {
+            fprintf(stderr, "Cluster chain from %u loops\n", startCluster);
+            freeExtentMap(map);
+            return -1;
+        }
+
+        if (appendExtent(volume, map, cluster) == -1)
+        {
+            freeExtentMap(map);
+            return -1;
+        }
+        cluster = fatEntryOf(volume, cluster, bits);
+    }
+    return 0;
+}
+
+//walk the chain once and store it as runs of contiguous clusters
+//returns -1 on allocation failure or a corrupt chain (loop, out of range cluster)
+int buildExtentMap(const Volume *volume, uint32_t startCluster, ExtentMap *map)
+{
+    uint64_t start = profileStart();
+
+    map->extents = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->clusterCount = 0;
+
+    if (FAT_DISPATCH(volume, chainExtents, volume, startCluster, map) == -1)
+    {
+        return -1;
+    }
+    profileCount(COUNT_CLUSTERS_WALKED, map->clusterCount);
+    profileEnd(PROFILE_EXTENT_MAP, start, map->clusterCount);
+    return 0;
+}
+
+//binary search for the run holding a byte offset of the file, NULL past the chain
+const Extent *findExtent(const Volume *volume, const ExtentMap *map, uint64_t offset)
+{
+    size_t low = 0;
+    size_t high = map->count;
+
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        const Extent *run = &map->extents[middle];
+        if (offset < run->fileOffset)
+        {
+            high = middle;
+        }
+        else if (offset >= run->fileOffset + (uint64_t)run->length * volume->clusterSize)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            return run;
+        }
+    }
+    return NULL;
+}
+
+//image offset of a byte offset of the file, -1 past the chain
+off_t extentDiskOffset(const Volume *volume, const ExtentMap *map, uint64_t offset)
+{
+    const Extent *run = findExtent(volume, map, offset);
+    if (run == NULL)
+    {
+        return -1;
+    }
+    return clusterOffset(volume, run->firstCluster) + (off_t)(offset - run->fileOffset);
+}
+
+
+/*/////////////////////////////////////////////////////////////
+                        TASK 4
+/////////////////////////////////////////////////////////////*/
+
+void convertDateTime(uint16_t time, uint16_t date, uint16_t *hours, uint16_t *minutes, uint16_t *seconds, uint16_t *day, uint16_t *month, uint16_t *year) 
+{
+    //Bits 15-11: hours (0-23)
+    //Bits 10-5: minutes (0-59)
+    //Bits 4-0: seconds/2 (0-29, 2-second intervals)
+
+    //right shifts by 11 bits - left with 5 bits representing hours
+    //bits >= 5 are 0
+    *hours = (time >> 11) & 0x1F;
+
+    //right shifts by 5 bits
+    *minutes = (time >> 5) & 0x3F;
+
+    //2-second interval
+    *seconds = (time & 0x1F) * 2; 
+    
+    //0x1F (total 31)
+    *day = date & 0x1F;
+    //right shifts by 5 bits
+    //0x0F (total 15)
+    *month = (date >> 5) & 0x0F;
+    //offset year = 1980 (7 bits/year)
+    *year = ((date >> 9) & 0x7F) + 1980; 
+}
+
+void printRootDirectory(Volume *volume) 
+{
+    //first sector of the root directory is volume->rootDir
+    //(Reserved Sector Count + Number of copies of FAT * Sectors in FAT) * Bytes per Sector
+
+    //numOfEntry = size of root DIR
+    size_t numOfEntry = volume->bootSector->BPB_RootEntCnt;
+
+    printf("-------------------------------------------------------------------------------------------------\n");
+    printf("| Cluster \t | Date \t | Time \t | Attributes \t | Size \t | Name \t|\n");
+    printf("-------------------------------------------------------------------------------------------------\n");
+
+    for (size_t i = 0; i < numOfEntry; i++) 
+    {
+        DirectoryEntry entry = volume->rootDir[i];
+
+        //the first byte of the directory name is zero, there are no further valid entries
+        //0xe5 - specific entry is currently unused (deleted files)
+        //& 0x0F operation isolates the lower 4 bits of entry.DIR_Attr
+        //!= 0x0F, ensuring that the lower 4 bits don't have all bits set == a valid file or directory entry
+        if (entry.DIR_Name[0] != 0x00 && entry.DIR_Name[0] != 0xE5 && (entry.DIR_Attr & 0x0F) != 0x0F ) 
+        {
+            //declares variables of type uint16_t
+            uint16_t hours, minutes, seconds, day, month, year;
+            convertDateTime(entry.DIR_WrtTime, entry.DIR_WrtDate, &hours, &minutes, &seconds, &day, &month, &year);
+
+            printf("| %u \t\t | %u/%u/%u \t | %u:%u:%u \t | %c%c%c%c%c%c \t | %u\t\t | %.11s \t|\n",
+                   entry.DIR_FstClusLO,
+                   day, month, year,
+                   hours, minutes, seconds,
+                   (entry.DIR_Attr & 0x01) ? 'R' : '-',
+                   (entry.DIR_Attr & 0x02) ? 'H' : '-',
+                   (entry.DIR_Attr & 0x04) ? 'S' : '-',
+                   (entry.DIR_Attr & 0x08) ? 'V' : '-',
+                   (entry.DIR_Attr & 0x10) ? 'D' : '-',
+                   (entry.DIR_Attr & 0x20) ? 'A' : '-',
+                   entry.DIR_FileSize,
+                   entry.DIR_Name);
+        }
+    }
+    printf("-------------------------------------------------------------------------------------------------\n");
+}
+
+/*/////////////////////////////////////////////////////////////
+                        DIRECTORY INDEX
+/////////////////////////////////////////////////////////////*/
+
+//"NAME    EXT" to "NAME.EXT" (name needs 13 bytes)
+void shortNameToString(const uint8_t *shortName, char *name)
+{
+    size_t length = 0;
+    for (size_t i = 0; i < 8 && shortName[i] != ' '; i++)
+    {
+        name[length++] = shortName[i];
+    }
+    //0x05 stands for a real 0xE5 first byte
+    if (length > 0 && (uint8_t)name[0] == 0x05)
+    {
+        name[0] = (char)0xE5;
+    }
+    if (shortName[8] != ' ')
+    {
+        name[length++] = '.';
+        for (size_t i = 8; i < 11 && shortName[i] != ' '; i++)
+        {
+            name[length++] = shortName[i];
+        }
+    }
+    name[length] = '\0';
+}
+
+//"name.ext" to the 11 byte "NAME    EXT" form, -1 if it is not a valid 8.3 name
+//an 11 character name without a dot is taken as already in directory form
+int toShortName(const char *name, uint8_t *shortName)
+{
+    size_t length = strlen(name);
+    const char *dot = strrchr(name, '.');
+
+    if (length == 11 && dot == NULL)
+    {
+        for (size_t i = 0; i < 11; i++)
+        {
+            shortName[i] = toupper((unsigned char)name[i]);
+        }
+        return 0;
+    }
+
+    //"." and ".." are the only names starting with a dot
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        memset(shortName, ' ', 11);
+        memcpy(shortName, name, length);
+        return 0;
+    }
+
+    size_t baseLength = dot != NULL ? (size_t)(dot - name) : length;
+    size_t extLength = dot != NULL ? length - baseLength - 1 : 0;
+    if (baseLength == 0 || baseLength > 8 || extLength > 3 || memchr(name, '.', baseLength) != NULL)
+    {
+        return -1;
+    }
+
+    memset(shortName, ' ', 11);
+    for (size_t i = 0; i < baseLength; i++)
+    {
+        shortName[i] = toupper((unsigned char)name[i]);
+    }
+    for (size_t i = 0; i < extLength; i++)
+    {
+        shortName[8 + i] = toupper((unsigned char)dot[1 + i]);
+    }
+    //a real 0xE5 first byte is stored as 0x05
+    if (shortName[0] == 0xE5)
+    {
+        shortName[0] = 0x05;
+    }
+    return 0;
+}
+
+//FNV-1a over a short name or a case folded long name
+static uint32_t hashName(const uint8_t *name, size_t length, int fold)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        uint8_t c = fold ? tolower(name[i]) : name[i];
+        hash = (hash ^ c) * 16777619u;
+    }
+    return hash;
+}
+
+//ASCII case insensitive compare (UTF-8 bytes above 0x7F compare exactly)
+static int foldedEqual(const char *a, const char *b, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i]))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//one live entry of an indexed directory
+typedef struct {
+    DirectoryEntry entry;  // short entry
+    uint32_t longName;  // offset of the long name in names, UINT32_MAX if none
+    uint32_t longLength;  // bytes in the long name
+} IndexedEntry;
+
+//every live entry of one directory with a hash table over its names
+//built once per directory, never changed afterwards
+typedef struct DirIndex {
+    uint32_t cluster;  // first cluster, 0 for the root directory
+    IndexedEntry *entries;  // entries in directory order
+    size_t count;  // number of entries
+    char *names;  // long names, each NUL terminated
+    uint32_t *slots;  // open addressing: (entry << 1 | isLongKey) + 1, 0 = empty
+    uint32_t *hashes;  // hash of the key in each slot
+    size_t mask;  // slots - 1
+} DirIndex;
+
+//long name stored for an indexed entry, NULL if it has none
+const char *indexedLongName(const DirIndex *index, const IndexedEntry *entry)
+{
+    return entry->longName == UINT32_MAX ? NULL : index->names + entry->longName;
+}
+
+static void insertSlot(DirIndex *index, uint32_t hash, uint32_t value)
+{
+    size_t slot = hash & index->mask;
+    while (index->slots[slot] != 0)
+    {
+        slot = (slot + 1) & index->mask;
+    }
+    index->slots[slot] = value;
+    index->hashes[slot] = hash;
+}
+
+//long name entries seen before a short entry, in the order they are stored
+typedef struct {
+    LongName parts[20];  // at most 20 entries (255 characters)
+    int count;  // entries collected
+} LongNameRun;
+
+void resetLongName(LongNameRun *run)
+{
+    run->count = 0;
+}
+
+//collect one long name entry; the entry flagged 0x40 starts a new name
+void addLongName(LongNameRun *run, const DirectoryEntry *entry)
+{
+    //LDIR_Ord is the first byte of the entry
+    if (entry->DIR_Name[0] & 0x40)
+    {
+        run->count = 0;
+    }
+    if (run->count == 20)
+    {
+        run->count = 0;
+        return;
+    }
+    memcpy(&run->parts[run->count++], entry, sizeof(LongName));
+}
+
+//bytes needed for any decoded long name: 255 UTF-16 units, at most 3 UTF-8 bytes each, and NUL
+#define LONG_NAME_BYTES (255 * 3 + 1)
+
+//checksum of an 11 byte short name, stored in LDIR_Chksum of each long entry
+uint8_t shortNameChecksum(const uint8_t *shortName)
+{
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++)
+    {
+        //rotate right by one, then add the next character
+        sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + shortName[i]);
+    }
+    return sum;
+}
+
+//the 13 UTF-16 units of one long entry, in order
+static void longNameUnits(const LongName *part, uint16_t *units)
+{
+    memcpy(units, part->LDIR_Name1, 10);
+    memcpy(units + 5, part->LDIR_Name2, 12);
+    memcpy(units + 11, part->LDIR_Name3, 4);
+}
+
+//UTF-16LE to UTF-8 in one pass, stops at count units or a 0x0000 unit
+//unpaired surrogates become U+FFFD; output is cut at a whole character to fit size (NUL included)
+//returns the bytes written, not counting the NUL
+size_t utf16ToUtf8(const uint16_t *units, size_t count, char *out, size_t size)
+{
+    size_t used = 0;
+    size_t i = 0;
+
+    if (size == 0)
+    {
+        return 0;
+    }
+
+#ifdef __SSE2__
+    //pure ASCII runs: 8 units become 8 bytes with one pack
+    const __m128i high = _mm_set1_epi16((short)0xFF80);
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 8 <= count && used + 8 < size)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i *)(units + i));
+        //no unit above 0x7F and no terminator in the block
+        int ascii = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(block, high), zero)) == 0xFFFF;
+        int terminated = _mm_movemask_epi8(_mm_cmpeq_epi16(block, zero)) != 0;
+        if (!ascii || terminated)
+        {
+            break;
+        }
+        _mm_storel_epi64((__m128i *)(out + used), _mm_packus_epi16(block, block));
+        used += 8;
+        i += 8;
+    }
+#endif
+
+    for (; i < count; i++)
+    {
+        uint32_t c = units[i];
+        if (c == 0)
+        {
+            break;
+        }
+        if (c >= 0xD800 && c <= 0xDBFF && i + 1 < count && units[i + 1] >= 0xDC00 && units[i + 1] <= 0xDFFF)
+        {
+            //surrogate pair
+            c = 0x10000 + ((c - 0xD800) << 10) + (units[i + 1] - 0xDC00);
+            i++;
+        }
+        else if (c >= 0xD800 && c <= 0xDFFF)
+        {
+            c = 0xFFFD;
+        }
+
+        char encoded[4];
+        size_t length;
+        if (c < 0x80)
+        {
+            encoded[0] = (char)c;
+            length = 1;
+        }
+        else if (c < 0x800)
+        {
+            encoded[0] = (char)(0xC0 | c >> 6);
+            encoded[1] = (char)(0x80 | (c & 0x3F));
+            length = 2;
+        }
+        else if (c < 0x10000)
+        {
+            encoded[0] = (char)(0xE0 | c >> 12);
+            encoded[1] = (char)(0x80 | (c >> 6 & 0x3F));
+            encoded[2] = (char)(0x80 | (c & 0x3F));
+            length = 3;
+        }
+        else
+        {
+            encoded[0] = (char)(0xF0 | c >> 18);
+            encoded[1] = (char)(0x80 | (c >> 12 & 0x3F));
+            encoded[2] = (char)(0x80 | (c >> 6 & 0x3F));
+            encoded[3] = (char)(0x80 | (c & 0x3F));
+            length = 4;
+        }
+
+        if (used + length >= size)
+        {
+            break;
+        }
+        memcpy(out + used, encoded, length);
+        used += length;
+    }
+
+    out[used] = '\0';
+    return used;
+}
+
+//long name of the collected run as UTF-8 in name (size bytes, LONG_NAME_BYTES is always enough)
+//returns 0 if there is no run or it does not belong to shortName (order or checksum mismatch)
+size_t decodeLongName(const LongNameRun *run, const uint8_t *shortName, char *name, size_t size)
+{
+    name[0] = '\0';
+    if (run->count == 0)
+    {
+        return 0;
+    }
+
+    //first stored entry is the last part, flagged 0x40, and numbers the whole run
+    int parts = run->parts[0].LDIR_Ord & 0x1F;
+    if (!(run->parts[0].LDIR_Ord & 0x40) || parts != run->count)
+    {
+        return 0;
+    }
+
+    uint8_t checksum = shortNameChecksum(shortName);
+    uint16_t units[20 * 13];
+    for (int i = 0; i < run->count; i++)
+    {
+        const LongName *part = &run->parts[i];
+        //entries count down to 1 and all carry the short name's checksum
+        if ((part->LDIR_Ord & 0x1F) != parts - i || part->LDIR_Chksum != checksum)
+        {
+            return 0;
+        }
+        //part n holds characters (n - 1) * 13 onwards
+        longNameUnits(part, units + (parts - 1 - i) * 13);
+    }
+
+    return utf16ToUtf8(units, (size_t)parts * 13, name, size);
+}
+
+void freeDirIndex(DirIndex *index)
+{
+    if (index == NULL)
+    {
+        return;
+    }
+    free(index->entries);
+    free(index->names);
+    free(index->slots);
+    free(index->hashes);
+    free(index);
+}
+
+//heap memory of an index, roughly
+static size_t dirIndexBytes(const DirIndex *index)
+{
+    size_t bytes = sizeof(DirIndex) + (index->count + 1) * sizeof(IndexedEntry) + (index->mask + 1) * 2 * sizeof(uint32_t);
+    for (size_t e = 0; e < index->count; e++)
+    {
+        bytes += index->entries[e].longLength;
+    }
+    return bytes;
+}
+
+//index the raw entries of one directory
+static DirIndex *buildDirIndex(uint32_t cluster, const DirectoryEntry *entries, size_t numOfEntry)
+{
+    DirIndex *index = calloc(1, sizeof(DirIndex));
+    if (index == NULL)
+    {
+        return NULL;
+    }
+    index->cluster = cluster;
+    index->entries = malloc((numOfEntry + 1) * sizeof(IndexedEntry));
+    size_t namesCapacity = 256;
+    size_t namesUsed = 0;
+    index->names = malloc(namesCapacity);
+    if (index->entries == NULL || index->names == NULL)
+    {
+        freeDirIndex(index);
+        return NULL;
+    }
+
+    LongNameRun run;
+    resetLongName(&run);
+    for (size_t i = 0; i < numOfEntry; i++)
+    {
+        const DirectoryEntry *entry = &entries[i];
+        //the first byte of the directory name is zero, there are no further valid entries
+        if (entry->DIR_Name[0] == 0x00)
+        {
+            break;
+        }
+        //deleted entries end any long name being collected
+        if (entry->DIR_Name[0] == 0xE5)
+        {
+            resetLongName(&run);
+            continue;
+        }
+        //part of a long name
+        if ((entry->DIR_Attr & 0x0F) == 0x0F)
+        {
+            addLongName(&run, entry);
+            continue;
+        }
+
+        IndexedEntry *indexed = &index->entries[index->count++];
+        indexed->entry = *entry;
+        indexed->longName = UINT32_MAX;
+        indexed->longLength = 0;
+
+        char longName[LONG_NAME_BYTES];
+        size_t length = decodeLongName(&run, entry->DIR_Name, longName, sizeof(longName));
+        resetLongName(&run);
+        if (length > 0)
+        {
+            if (namesUsed + length + 1 > namesCapacity)
+            {
+                while (namesUsed + length + 1 > namesCapacity)
+                {
+                    namesCapacity *= 2;
+                }
+                char *grown = realloc(index->names, namesCapacity);
+                if (grown == NULL)
+                {
+                    freeDirIndex(index);
+                    return NULL;
+                }
+                index->names = grown;
+            }
+            memcpy(index->names + namesUsed, longName, length + 1);
+            indexed->longName = namesUsed;
+            indexed->longLength = length;
+            namesUsed += length + 1;
+        }
+    }
+
+    //two keys per entry, table at most half full
+    size_t slots = 16;
+    while (slots < index->count * 4)
+    {
+        slots *= 2;
+    }
+    index->mask = slots - 1;
+    index->slots = calloc(slots, sizeof(uint32_t));
+    index->hashes = malloc(slots * sizeof(uint32_t));
+    if (index->slots == NULL || index->hashes == NULL)
+    {
+        freeDirIndex(index);
+        return NULL;
+    }
+
+    for (size_t e = 0; e < index->count; e++)
+    {
+        IndexedEntry *indexed = &index->entries[e];
+        insertSlot(index, hashName(indexed->entry.DIR_Name, 11, 0), (uint32_t)(e << 1) + 1);
+        if (indexed->longName != UINT32_MAX)
+        {
+            insertSlot(index, hashName((const uint8_t *)index->names + indexed->longName, indexed->longLength, 1), (uint32_t)(e << 1 | 1) + 1);
+        }
+    }
+    return index;
+}
+
+//read a directory's cluster chain into memory
+static DirectoryEntry *readDirectoryClusters(Volume *volume, uint32_t cluster, size_t *numOfEntry)
+{
+    ExtentMap chain;
+    if (buildExtentMap(volume, cluster, &chain) == -1)
+    {
+        return NULL;
+    }
+
+    size_t bytes = chain.clusterCount * volume->clusterSize;
+    DirectoryEntry *entries = malloc(bytes + 1);
+    if (entries == NULL)
+    {
+        freeExtentMap(&chain);
+        return NULL;
+    }
+
+    //one read per run of contiguous clusters, all in one batch
+    BackendRead *reads = malloc(chain.count * sizeof(BackendRead) + 1);
+    if (reads == NULL)
+    {
+        free(entries);
+        freeExtentMap(&chain);
+        return NULL;
+    }
+    size_t done = 0;
+    for (size_t e = 0; e < chain.count; e++)
+    {
+        reads[e].buffer = (uint8_t *)entries + done;
+        reads[e].length = (size_t)chain.extents[e].length * volume->clusterSize;
+        reads[e].offset = clusterOffset(volume, chain.extents[e].firstCluster);
+        done += reads[e].length;
+    }
+    if (volumeReadBatch(volume, reads, chain.count) == -1)
+    {
+        perror("Error reading directory");
+        free(reads);
+        free(entries);
+        freeExtentMap(&chain);
+        return NULL;
+    }
+    free(reads);
+
+    freeExtentMap(&chain);
+    *numOfEntry = bytes / sizeof(DirectoryEntry);
+    return entries;
+}
+
+//index of a directory by its first cluster (0 for the root), loaded on first use
+//an index never changes once published (only writers drop them, and they are single
+//threaded), so finding a loaded one takes no lock
+const DirIndex *directoryIndex(Volume *volume, uint32_t cluster)
+{
+    if (cluster != 0 && (cluster < 2 || cluster > volume->clusterCount + 1))
+    {
+        return NULL;
+    }
+
+    DirIndex **indexes = __atomic_load_n(&volume->indexes, __ATOMIC_ACQUIRE);
+    DirIndex *index = indexes != NULL ? __atomic_load_n(&indexes[cluster], __ATOMIC_ACQUIRE) : NULL;
+    if (index != NULL)
+    {
+        return index;
+    }
+
+    pthread_mutex_lock(&volume->indexLock);
+    if (volume->indexes == NULL)
+    {
+        indexes = calloc(volume->clusterCount + 2, sizeof(DirIndex *));
+        if (indexes == NULL)
+        {
+            pthread_mutex_unlock(&volume->indexLock);
+            return NULL;
+        }
+        __atomic_store_n(&volume->indexes, indexes, __ATOMIC_RELEASE);
+    }
+
+    index = volume->indexes[cluster];
+    if (index == NULL)
+    {
+        uint64_t start = profileStart();
+        if (directoryChain(volume, cluster) == 0)
+        {
+            index = buildDirIndex(0, volume->rootDir, volume->bootSector->BPB_RootEntCnt);
+        }
+        else
+        {
+            size_t numOfEntry;
+            DirectoryEntry *entries = readDirectoryClusters(volume, directoryChain(volume, cluster), &numOfEntry);
+            if (entries != NULL)
+            {
+                index = buildDirIndex(cluster, entries, numOfEntry);
+                free(entries);
+            }
+        }
+        __atomic_store_n(&volume->indexes[cluster], index, __ATOMIC_RELEASE);
+        if (index != NULL)
+        {
+            __atomic_fetch_add(&volume->indexBytes, dirIndexBytes(index), __ATOMIC_RELAXED);
+        }
+        profileEnd(PROFILE_DIRECTORY_SCAN, start, index != NULL ? index->count : 0);
+    }
+    pthread_mutex_unlock(&volume->indexLock);
+    return index;
+}
+
+void freeDirectoryIndexes(Volume *volume)
+{
+    volume->indexBytes = 0;
+    if (volume->indexes == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < volume->clusterCount + 2; i++)
+    {
+        freeDirIndex(volume->indexes[i]);
+    }
+    free(volume->indexes);
+    volume->indexes = NULL;
+}
+
+//drop the index of a directory that changed, it is rebuilt on next use
+void forgetDirectoryIndex(Volume *volume, uint32_t cluster)
+{
+    pthread_mutex_lock(&volume->indexLock);
+    if (volume->indexes != NULL && cluster < volume->clusterCount + 2)
+    {
+        if (volume->indexes[cluster] != NULL)
+        {
+            volume->indexBytes -= dirIndexBytes(volume->indexes[cluster]);
+        }
+        freeDirIndex(volume->indexes[cluster]);
+        volume->indexes[cluster] = NULL;
+    }
+    pthread_mutex_unlock(&volume->indexLock);
+}
+
+//find one name in an indexed directory: 8.3 name, or case insensitive long name
+const IndexedEntry *lookupName(const DirIndex *index, const char *name)
+{
+    uint8_t shortName[11];
+    if (toShortName(name, shortName) == 0)
+    {
+        uint32_t hash = hashName(shortName, 11, 0);
+        for (size_t slot = hash & index->mask; index->slots[slot] != 0; slot = (slot + 1) & index->mask)
+        {
+            uint32_t value = index->slots[slot] - 1;
+            if (index->hashes[slot] == hash && !(value & 1) && memcmp(index->entries[value >> 1].entry.DIR_Name, shortName, 11) == 0)
+            {
+                return &index->entries[value >> 1];
+            }
+        }
+    }
+
+    size_t length = strlen(name);
+    uint32_t hash = hashName((const uint8_t *)name, length, 1);
+    for (size_t slot = hash & index->mask; index->slots[slot] != 0; slot = (slot + 1) & index->mask)
+    {
+        uint32_t value = index->slots[slot] - 1;
+        if (index->hashes[slot] != hash || !(value & 1))
+        {
+            continue;
+        }
+        const IndexedEntry *entry = &index->entries[value >> 1];
+        if (entry->longLength == length && foldedEqual(index->names + entry->longName, name, length))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+//find a '/' separated path from the root directory
+//returns 0 and fills entry, -1 if a component is missing
+int statPath(Volume *volume, const char *path, DirectoryEntry *entry)
+{
+    uint32_t cluster = 0;
+    const char *part = path;
+    int found = 0;
+
+    for (;;)
+    {
+        while (*part == '/')
+        {
+            part++;
+        }
+        if (*part == '\0')
+        {
+            break;
+        }
+        //a component below something that is not a directory
+        if (found && !(entry->DIR_Attr & 0x10))
+        {
+            return -1;
+        }
+
+        const char *end = strchr(part, '/');
+        size_t length = end != NULL ? (size_t)(end - part) : strlen(part);
+        char name[1024];
+        if (length >= sizeof(name))
+        {
+            return -1;
+        }
+        memcpy(name, part, length);
+        name[length] = '\0';
+
+        const DirIndex *index = directoryIndex(volume, cluster);
+        const IndexedEntry *match = index != NULL ? lookupName(index, name) : NULL;
+        if (match == NULL)
+        {
+            return -1;
+        }
+        *entry = match->entry;
+        //".." of a top level directory points at cluster 0, which is the root
+        cluster = entryCluster(volume, entry);
+        found = 1;
+        part += length;
+    }
+
+    return found ? 0 : -1;
+}
+
+//"/" and "" name the root directory, which has no entry of its own
+static int isRootPath(const char *path)
+{
+    return path[strspn(path, "/")] == '\0';
+}
+
+//entry standing in for the root directory, its first cluster is 0 below FAT32
+static void rootEntry(const Volume *volume, DirectoryEntry *entry)
+{
+    memset(entry, 0, sizeof(DirectoryEntry));
+    memcpy(entry->DIR_Name, "/          ", 11);
+    entry->DIR_Attr = 0x10;
+    entry->DIR_FstClusLO = volume->rootCluster & 0xFFFF;
+    entry->DIR_FstClusHI = volume->rootCluster >> 16;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        WALKER
+/////////////////////////////////////////////////////////////*/
+
+//bytes of directory entries read at a time
+#define WALK_BATCH (64u << 10)
+
+//what the walker reports for each entry
+typedef struct {
+    const char *path;  // full path from the root, '/' separated
+    const DirectoryEntry *entry;  // short entry
+    const char *longName;  // decoded long name, NULL if none
+    uint32_t parentCluster;  // first cluster of the directory, 0 for root
+    int depth;  // 0 for entries of the root directory
+} WalkEntry;
+
+//return non zero to stop the walk
+typedef int (*WalkCallback)(void *context, const WalkEntry *item);
+
+//position inside one directory being walked
+typedef struct {
+    uint32_t cluster;  // first cluster, 0 for root
+    ExtentMap chain;  // runs of the directory (empty for a FAT12 or FAT16 root)
+    size_t run;  // current run
+    uint64_t runDone;  // bytes of the current run already batched
+    const DirectoryEntry *batch;  // current batch of entries
+    size_t batchCount;  // entries in batch
+    size_t batchNext;  // next entry to report
+    uint8_t *buffer;  // batch copy when the image is not mapped
+    size_t pathLength;  // path length of this directory
+    LongNameRun longName;  // long name entries since the last short entry
+} WalkFrame;
+
+//fetch the next batch of entries of a directory, 0 at the end
+static int fetchWalkBatch(Volume *volume, WalkFrame *frame)
+{
+    off_t offset;
+    uint64_t length;
+
+    if (directoryChain(volume, frame->cluster) == 0)
+    {
+        //root directory: one fixed region
+        uint64_t rootBytes = (uint64_t)volume->bootSector->BPB_RootEntCnt * sizeof(DirectoryEntry);
+        if (frame->runDone >= rootBytes)
+        {
+            return 0;
+        }
+        offset = volume->rootOffset + frame->runDone;
+        length = rootBytes - frame->runDone;
+    }
+    else
+    {
+        //skip finished runs
+        while (frame->run < frame->chain.count && frame->runDone >= (uint64_t)frame->chain.extents[frame->run].length * volume->clusterSize)
+        {
+            frame->run++;
+            frame->runDone = 0;
+        }
+        if (frame->run == frame->chain.count)
+        {
+            return 0;
+        }
+        const Extent *run = &frame->chain.extents[frame->run];
+        offset = clusterOffset(volume, run->firstCluster) + frame->runDone;
+        length = (uint64_t)run->length * volume->clusterSize - frame->runDone;
+    }
+
+    if (length > WALK_BATCH)
+    {
+        length = WALK_BATCH;
+    }
+
+    //zero copy when mapped, otherwise one large read
+    const uint8_t *data = volumePointer(volume, offset, length);
+    if (data == NULL)
+    {
+        if (frame->buffer == NULL)
+        {
+            frame->buffer = malloc(WALK_BATCH);
+            if (frame->buffer == NULL)
+            {
+                perror("Error allocating memory");
+                return 0;
+            }
+        }
+        if (volumeRead(volume, frame->buffer, length, offset) != (ssize_t)length)
+        {
+            perror("Error reading directory");
+            return 0;
+        }
+        data = frame->buffer;
+    }
+
+    frame->batch = (const DirectoryEntry *)data;
+    frame->batchCount = length / sizeof(DirectoryEntry);
+    frame->batchNext = 0;
+    frame->runDone += length;
+    return frame->batchCount > 0;
+}
+
+static int nextWalkBatch(Volume *volume, WalkFrame *frame)
+{
+    uint64_t start = profileStart();
+    int more = fetchWalkBatch(volume, frame);
+    profileEnd(PROFILE_WALK_BATCH, start, more ? frame->batchCount : 0);
+    return more;
+}
+
+static void freeWalkFrame(WalkFrame *frame)
+{
+    freeExtentMap(&frame->chain);
+    free(frame->buffer);
+}
+
+//set up a frame for a directory, -1 if its chain is unusable
+static int pushWalkFrame(Volume *volume, WalkFrame *frame, uint32_t cluster, size_t pathLength)
+{
+    memset(frame, 0, sizeof(WalkFrame));
+    frame->cluster = cluster;
+    frame->pathLength = pathLength;
+    if (directoryChain(volume, cluster) != 0 && buildExtentMap(volume, directoryChain(volume, cluster), &frame->chain) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+//visit every entry of every directory depth first, parents before children
+//keeps one frame per open directory (no recursion, no tree in memory)
+//directories already visited (corrupt images) are reported and not entered again
+//returns 0 when finished, the callback's value if it stopped the walk, -1 on error
+int walkVolume(Volume *volume, WalkCallback callback, void *context)
+{
+    size_t capacity = 16;
+    size_t depth = 0;
+    WalkFrame *stack = malloc(capacity * sizeof(WalkFrame));
+    //one bit per cluster: directories entered so far
+    uint8_t *visited = calloc((volume->clusterCount + 2 + 7) / 8, 1);
+    char *path = malloc(4096);
+    int result = 0;
+
+    if (stack == NULL || visited == NULL || path == NULL)
+    {
+        perror("Error allocating memory");
+        free(stack);
+        free(visited);
+        free(path);
+        return -1;
+    }
+
+    path[0] = '\0';
+    //a FAT32 root is entered like a directory, once
+    visited[volume->rootCluster / 8] |= 1 << (volume->rootCluster % 8);
+    pushWalkFrame(volume, &stack[depth++], 0, 0);
+
+    while (depth > 0 && result == 0)
+    {
+        WalkFrame *frame = &stack[depth - 1];
+
+        if (frame->batchNext == frame->batchCount && !nextWalkBatch(volume, frame))
+        {
+            //directory finished
+            freeWalkFrame(frame);
+            depth--;
+            continue;
+        }
+
+        const DirectoryEntry *entry = &frame->batch[frame->batchNext++];
+        //the first byte of the directory name is zero, there are no further valid entries
+        if (entry->DIR_Name[0] == 0x00)
+        {
+            frame->batchNext = frame->batchCount;
+            frame->runDone = UINT64_MAX;
+            frame->run = frame->chain.count;
+            continue;
+        }
+        if (entry->DIR_Name[0] == 0xE5)
+        {
+            resetLongName(&frame->longName);
+            continue;
+        }
+        if ((entry->DIR_Attr & 0x0F) == 0x0F)
+        {
+            addLongName(&frame->longName, entry);
+            continue;
+        }
+
+        char longName[LONG_NAME_BYTES];
+        size_t longLength = decodeLongName(&frame->longName, entry->DIR_Name, longName, sizeof(longName));
+        resetLongName(&frame->longName);
+
+        //volume label, "." and ".." are not part of the tree
+        if ((entry->DIR_Attr & 0x08) || entry->DIR_Name[0] == '.')
+        {
+            continue;
+        }
+
+        char shortName[13];
+        const char *name = longName;
+        if (longLength == 0)
+        {
+            shortNameToString(entry->DIR_Name, shortName);
+            name = shortName;
+        }
+        size_t nameLength = strlen(name);
+        if (frame->pathLength + nameLength + 2 > 4096)
+        {
+            fprintf(stderr, "Path too long below %s\n", path);
+            continue;
+        }
+        size_t entryPathLength = frame->pathLength;
+        if (entryPathLength > 0)
+        {
+            path[entryPathLength++] = '/';
+        }
+        memcpy(path + entryPathLength, name, nameLength + 1);
+        //a '/' in a corrupt name would read as a directory of its own
+        for (char *c = path + entryPathLength; *c != '\0'; c++)
+        {
+            if (*c == '/')
+            {
+                *c = '_';
+            }
+        }
+        entryPathLength += nameLength;
+
+        WalkEntry item = { path, entry, longLength > 0 ? longName : NULL, frame->cluster, (int)depth - 1 };
+        result = callback(context, &item);
+
+        uint32_t child = entryCluster(volume, entry);
+        if (result == 0 && (entry->DIR_Attr & 0x10) && child >= 2 && child <= volume->clusterCount + 1)
+        {
+            if (visited[child / 8] & (1 << (child % 8)))
+            {
+                fprintf(stderr, "Directory loop at %s (cluster %u)\n", path, child);
+            }
+            else
+            {
+                visited[child / 8] |= 1 << (child % 8);
+                if (depth == capacity)
+                {
+                    WalkFrame *grown = realloc(stack, capacity * 2 * sizeof(WalkFrame));
+                    if (grown == NULL)
+                    {
+                        perror("Error allocating memory");
+                        result = -1;
+                        break;
+                    }
+                    stack = grown;
+                    capacity *= 2;
+                }
+                if (pushWalkFrame(volume, &stack[depth], child, entryPathLength) == 0)
+                {
+                    depth++;
+                }
+            }
+        }
+
+        //back to this directory's own path
+        path[stack[depth - 1].pathLength] = '\0';
+    }
+
+    while (depth > 0)
+    {
+        freeWalkFrame(&stack[--depth]);
+    }
+    free(stack);
+    free(visited);
+    free(path);
+    return result;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        TASK 5
+/////////////////////////////////////////////////////////////*/
+
+size_t clusterOffsetCalculation(Volume *volume, uint32_t cluster) 
+{
+    //data area starts after reserved sectors, FATs and root directory
+    //"- 2" is a common adjustment for fat16.img 
+    //offset is calculated as if they are 0-based.
+    return clusterOffset(volume, cluster);
+}
+
+
+//seek to a position in the file
+off_t seekFile(File *file, off_t offset, int whence) 
+{
+
+    // '->' to access members of file structure through a pointer
+    //wence so that can use SEEK_SET, SEEK_CUR, SEEK_END (flexibility)
+    //positions are inside the file, SEEK_END is relative to DIR_FileSize
+    uint64_t start = profileStart();
+    off_t newPos;
+    switch (whence)
+    {
+        case SEEK_SET: newPos = offset; break;
+        case SEEK_CUR: newPos = (off_t)file->currentPosition + offset; break;
+        case SEEK_END: newPos = (off_t)file->fileLength + offset; break;
+        default: newPos = -1; break;
+    }
+    //error handling
+    if (newPos < 0) 
+    {
+        fprintf(stderr, "Error seeking in file\n");
+        profileEnd(PROFILE_SEEK_FILE, start, 0);
+        return -1;
+    }
+
+    //updating current position to new position in the File structure
+    file->currentPosition = newPos;
+    profileEnd(PROFILE_SEEK_FILE, start, 0);
+
+    return newPos;
+}
+
+#define READAHEAD_MIN 4  // clusters read ahead once reads look sequential
+#define READAHEAD_MAX 256  // window stops doubling here
+#define READ_BATCH 32  // runs of one readFile call read together
+
+//pull the next clusters of the file into the cluster cache
+static void readAhead(File *file, size_t clusters)
+{
+    Volume *volume = file->volume;
+    uint64_t position = file->currentPosition;
+    while (clusters > 0 && position < file->fileLength)
+    {
+        const Extent *run = findExtent(volume, &file->extents, position);
+        if (run == NULL)
+        {
+            return;
+        }
+        size_t index = (position - run->fileOffset) / volume->clusterSize;
+        size_t count = run->length - index < clusters ? run->length - index : clusters;
+        cachePrefetch(volume, (uint32_t)(run->firstCluster + index), count);
+        clusters -= count;
+        position = run->fileOffset + (uint64_t)(index + count) * volume->clusterSize;
+    }
+}
+
+//Function to read 
+//follows the cluster chain, one memcpy or pread per run of contiguous clusters
+size_t readFile(File *file, void *buffer, size_t length) 
+{
+    Volume *volume = file->volume;
+    uint64_t start = profileStart();
+
+    //sequential reads double the read ahead window, a seek resets it
+    if (volume->cache != NULL)
+    {
+        if (file->currentPosition == file->lastEnd)
+        {
+            file->readahead = file->readahead == 0 ? READAHEAD_MIN : file->readahead * 2;
+            if (file->readahead > READAHEAD_MAX)
+            {
+                file->readahead = READAHEAD_MAX;
+            }
+        }
+        else
+        {
+            file->readahead = 0;
+        }
+    }
+
+    //never read past the end of the file
+    if (file->currentPosition >= file->fileLength) 
+    {
+        profileEnd(PROFILE_READ_FILE, start, 0);
+        return 0;
+    }
+    if (length > file->fileLength - file->currentPosition) 
+    {
+        length = file->fileLength - file->currentPosition;
+    }
+
+    size_t total = 0;
+    while (total < length) 
+    {
+        //the pieces of every run this read touches, read as one batch
+        BackendRead reads[READ_BATCH];
+        size_t count = 0;
+        uint64_t position = file->currentPosition;
+        size_t planned = total;
+        while (planned < length && count < READ_BATCH) 
+        {
+            //sequential reads usually stay in the same run or move to the next one
+            const Extent *run = NULL;
+            if (file->currentExtent < file->extents.count) 
+            {
+                const Extent *hint = &file->extents.extents[file->currentExtent];
+                uint64_t runEnd = hint->fileOffset + (uint64_t)hint->length * volume->clusterSize;
+                if (position >= hint->fileOffset && position < runEnd) 
+                {
+                    run = hint;
+                }
+                else if (position == runEnd && file->currentExtent + 1 < file->extents.count) 
+                {
+                    run = hint + 1;
+                }
+            }
+            if (run == NULL) 
+            {
+                run = findExtent(volume, &file->extents, position);
+            }
+            //chain is shorter than DIR_FileSize
+            if (run == NULL) 
+            {
+                break;
+            }
+            file->currentExtent = run - file->extents.extents;
+
+            //bytes left in this run
+            uint64_t inRun = position - run->fileOffset;
+            uint64_t available = (uint64_t)run->length * volume->clusterSize - inRun;
+            size_t chunk = length - planned;
+            if (chunk > available) 
+            {
+                chunk = available;
+            }
+            reads[count].buffer = (uint8_t *)buffer + planned;
+            reads[count].length = chunk;
+            reads[count].offset = clusterOffset(volume, run->firstCluster) + inRun;
+            count++;
+            planned += chunk;
+            position += chunk;
+        }
+        if (count == 0) 
+        {
+            break;
+        }
+
+        //to read bytes from the file
+        volumeReadBatch(volume, reads, count);
+        int stop = 0;
+        for (size_t r = 0; r < count && !stop; r++) 
+        {
+            //Error Handling
+            if (reads[r].result == -1) 
+            {
+                perror("Error reading from file");
+                stop = 1;
+                break;
+            }
+
+            //access the currentPosition (member of the structure) that file is pointing to
+            //to update current position in the File structure
+            file->currentPosition += reads[r].result;
+            total += reads[r].result;
+
+            //image ends before the cluster does
+            stop = (size_t)reads[r].result < reads[r].length;
+        }
+        if (stop) 
+        {
+            break;
+        }
+    }
+
+    file->lastEnd = file->currentPosition;
+    if (file->readahead > 0)
+    {
+        readAhead(file, file->readahead);
+    }
+    profileEnd(PROFILE_READ_FILE, start, total);
+
+    //return results casted to size_t because of size_t function
+    return total;
+}
+
+//read at a byte offset without touching the file position, so several threads can share a File
+//each run is found by binary search in the extent map; returns bytes read (short at the end of
+//the file or chain), -1 on a read error
+static ssize_t readRunsAt(const File *file, void *buffer, size_t length, uint64_t offset)
+{
+    const Volume *volume = file->volume;
+    if (offset >= file->fileLength)
+    {
+        return 0;
+    }
+    if (length > file->fileLength - offset)
+    {
+        length = file->fileLength - offset;
+    }
+
+    size_t total = 0;
+    while (total < length)
+    {
+        BackendRead reads[READ_BATCH];
+        size_t count = 0;
+        size_t planned = total;
+        const Extent *run = findExtent(volume, &file->extents, offset + planned);
+        const Extent *end = file->extents.extents + file->extents.count;
+        //runs after the first follow in order
+        for (; run != NULL && run < end && planned < length && count < READ_BATCH; run++)
+        {
+            uint64_t inRun = offset + planned - run->fileOffset;
+            uint64_t available = (uint64_t)run->length * volume->clusterSize - inRun;
+            size_t chunk = length - planned < available ? length - planned : available;
+            reads[count].buffer = (uint8_t *)buffer + planned;
+            reads[count].length = chunk;
+            reads[count].offset = clusterOffset(volume, run->firstCluster) + inRun;
+            count++;
+            planned += chunk;
+        }
+        if (count == 0)
+        {
+            break;
+        }
+
+        volumeReadBatch(volume, reads, count);
+        for (size_t r = 0; r < count; r++)
+        {
+            if (reads[r].result == -1)
+            {
+                return total > 0 ? (ssize_t)total : -1;
+            }
+            total += reads[r].result;
+            if ((size_t)reads[r].result < reads[r].length)
+            {
+                return total;
+            }
+        }
+    }
+    return total;
+}
+
+ssize_t readFileAt(const File *file, void *buffer, size_t length, uint64_t offset)
+{
+    uint64_t start = profileStart();
+    ssize_t reading = readRunsAt(file, buffer, length, offset);
+    profileEnd(PROFILE_READ_FILE_AT, start, reading > 0 ? reading : 0);
+    return reading;
+}
+
+//Function to close the file
+//pointer to a File structure named file
+void closeFile(File *file) 
+{
+    //the volume stays open, it is shared with other files
+    freeExtentMap(&file->extents);
+
+    //deallocate memory previously allocated by malloc
+    //release memory occupied preventing memory leaks
+    free(file);
+}
+
+File *openEntry(Volume *volume, const DirectoryEntry *dirEntry);
+
+//return a member of the struct File
+//parameter: volume, filename (8.3 or long name, '/' separated path)
+File *openFile(Volume *volume, const char *filename) {
+    //directory entry corresponding to the file
+    DirectoryEntry dirEntry;
+
+    //hashed lookup in the directory index (built once per directory)
+    //error handling
+    if (statPath(volume, filename, &dirEntry) == -1) {
+        fprintf(stderr, "File cant be found: %s\n", filename);
+        return NULL;
+    }
+    //check if entry is a directory
+    if (dirEntry.DIR_Attr & 0x10) {
+        printf("%s is a directory and not a regular file.\n", filename);
+        return NULL; // Return NULL for directories
+    }
+
+    return openEntry(volume, &dirEntry);
+}
+
+//open a file from a directory entry that has already been found
+File *openEntry(Volume *volume, const DirectoryEntry *dirEntry) {
+    //allocates memory for a new File structure
+    File *file = malloc(sizeof(File));
+    //error handling
+    if (file == NULL) {
+        perror("Error allocating memory for File");
+        return NULL;
+    }
+
+    //Initialize File Structure Fields
+    file->volume = volume;//all files share the volume handle
+    file->fileLength = dirEntry->DIR_FileSize;//file size obtained from the directory entry
+    file->currentPosition = 0;//initialized to 0
+    file->currentExtent = 0;//first run
+    file->entryDirectory = 0;
+    file->entrySlot = SIZE_MAX;//read only until the write functions say otherwise
+    file->lastEnd = 0;//a read from the start counts as sequential
+    file->readahead = 0;
+    file->startCluster = entryCluster(volume, dirEntry); //Set the starting cluster
+
+    //walk the chain once, seeks then use the runs
+    if (buildExtentMap(volume, file->startCluster, &file->extents) == -1) {
+        free(file);
+        return NULL;
+    }
+
+    return file;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        TASK 6
+/////////////////////////////////////////////////////////////*/
+
+
+//convert a UTF-16LE string ending in 0x0000 (at most 255 characters) to UTF-8
+//asciiString needs LONG_NAME_BYTES bytes
+void unicodeConverter(const uint8_t *unicodeString, char *asciiString) 
+{
+    uint16_t units[255];
+    size_t count = 0;
+
+    //copy so the units are aligned whatever the source is
+    while (count < 255) 
+    {
+        units[count] = unicodeString[count * 2] | unicodeString[count * 2 + 1] << 8;
+        if (units[count] == 0) 
+        {
+            break;
+        }
+        count++;
+    }
+    utf16ToUtf8(units, count, asciiString, LONG_NAME_BYTES);
+}
+
+//function to print long directory entry (its own 13 characters)
+void printLongEntry(LongName *longEntry) 
+{
+    uint16_t units[13];
+    char part[13 * 3 + 1];
+    longNameUnits(longEntry, units);
+    utf16ToUtf8(units, 13, part, sizeof(part));
+    printf("Long Name: %s\n", part);
+}
+
+//print a short directory entry
+void printShortEntry(DirectoryEntry *entry) 
+{
+    //similar to task 4
+    uint16_t hours, minutes, seconds, day, month, year;
+    convertDateTime(entry->DIR_WrtTime, entry->DIR_WrtDate, &hours, &minutes, &seconds, &day, &month, &year);
+
+    printf("| %u \t\t | %u/%u/%u \t | %u:%u:%u \t | %c%c%c%c%c%c \t | %u\t\t | %.11s \t|\n",
+           entry->DIR_FstClusLO,
+           day, month, year,
+           hours, minutes, seconds,
+           (entry->DIR_Attr & 0x01) ? 'R' : '-',
+           (entry->DIR_Attr & 0x02) ? 'H' : '-',
+           (entry->DIR_Attr & 0x04) ? 'S' : '-',
+           (entry->DIR_Attr & 0x08) ? 'V' : '-',
+           (entry->DIR_Attr & 0x10) ? 'D' : '-',
+           (entry->DIR_Attr & 0x20) ? 'A' : '-',
+           entry->DIR_FileSize,
+           entry->DIR_Name);
+}
+
+void printRootDirectoryLN(Volume *volume) 
+{
+    size_t numOfEntry = volume->bootSector->BPB_RootEntCnt;
+    //long entries come before the short entry they belong to
+    LongNameRun run;
+    resetLongName(&run);
+
+    //read entries 1 by 1
+    for (size_t i = 0; i < numOfEntry; i++) 
+    {
+        const DirectoryEntry *entry = &volume->rootDir[i];
+
+        //the first byte of the directory name is zero, there are no further valid entries
+        if (entry->DIR_Name[0] == 0x00) 
+        {
+            break;
+        }
+        //deleted entry, any long name collected so far is not ours
+        if (entry->DIR_Name[0] == 0xE5) 
+        {
+            resetLongName(&run);
+            continue;
+        }
+        //long entry: collect it until its short entry comes
+        if ((entry->DIR_Attr & 0x0F) == 0x0F) 
+        {
+            addLongName(&run, entry);
+            continue;
+        }
+
+        //convert to UTF-8 from UTF-16 for long name (checksum must match the short name)
+        char longName[LONG_NAME_BYTES];
+        if (decodeLongName(&run, entry->DIR_Name, longName, sizeof(longName)) > 0) 
+        {
+            printf("\nLong Name: %s", longName);
+        }
+        resetLongName(&run);
+
+        // Print the short entry
+        printf("\nShort Name: %.11s", entry->DIR_Name);
+    }
+    printf("\n");
+}
+
+
+/*/////////////////////////////////////////////////////////////
+                        WRITE
+/////////////////////////////////////////////////////////////*/
+
+//FAT entry that ends a chain
+#define END_OF_CHAIN 0xFFFF
+//most entries a subdirectory may hold (2 MiB), "." and ".." included
+#define DIRECTORY_MAX_SLOTS 65536
+
+void freeVolumeWriter(Volume *volume)
+{
+    VolumeWriter *writer = volume->writer;
+    if (writer == NULL)
+    {
+        return;
+    }
+    for (size_t b = 0; b < writer->bufferedCount; b++)
+    {
+        free(writer->directories[writer->buffered[b]]);
+    }
+    free(writer->directories);
+    free(writer->changed);
+    free(writer->buffered);
+    free(writer->dirtySectors);
+    free(writer);
+    volume->writer = NULL;
+}
+
+//open an image for reading and writing; changes are kept until flushVolume or closeVolume
+//the write functions are not thread safe
+Volume *openVolumeForWriting(const char *filename)
+{
+    Backend *backend = openImageBackend(filename, 1);
+    if (backend == NULL)
+    {
+        return NULL;
+    }
+    Volume *volume = openVolumeOn(backend);
+    if (volume == NULL)
+    {
+        fprintf(stderr, "Unable to open volume: %s\n", filename);
+        return NULL;
+    }
+    //the writer changes 16 bit FAT entries in place, other variants are read only
+    if (volume->fatType != FAT16)
+    {
+        fprintf(stderr, "%s: writing is only supported on FAT16, this is FAT%d\n", filename, (int)volume->fatType);
+        closeVolume(volume);
+        return NULL;
+    }
+
+    VolumeWriter *writer = calloc(1, sizeof(VolumeWriter));
+    if (writer != NULL)
+    {
+        writer->sectorSize = volume->bootSector->BPB_BytsPerSec;
+        writer->dirtySectors = calloc(volume->dataOffset / writer->sectorSize + 1, 1);
+        writer->directories = calloc(volume->clusterCount + 2, sizeof(uint8_t *));
+        writer->changed = calloc(volume->clusterCount + 2, 1);
+        writer->nextFree = 2;
+    }
+    volume->writer = writer;
+    if (writer == NULL || writer->dirtySectors == NULL || writer->directories == NULL || writer->changed == NULL)
+    {
+        perror("Error allocating memory");
+        freeVolumeWriter(volume);
+        closeVolume(volume);
+        return NULL;
+    }
+    return volume;
+}
+
+//mark bytes of the metadata copy (FATs, root directory) for the next flush
+static void markMetadata(Volume *volume, off_t offset, size_t length)
+{
+    VolumeWriter *writer = volume->writer;
+    for (size_t sector = offset / writer->sectorSize; sector <= (offset + length - 1) / writer->sectorSize; sector++)
+    {
+        writer->dirtySectors[sector] = 1;
+    }
+}
+
+//write every pending change: directory clusters, then each dirty metadata run once
+//FAT sectors are copied to every FAT before they go out
+int flushVolume(Volume *volume)
+{
+    VolumeWriter *writer = volume->writer;
+    if (writer == NULL)
+    {
+        return 0;
+    }
+    Backend *backend = volume->backend;
+    int status = 0;
+
+    for (size_t b = 0; b < writer->bufferedCount; b++)
+    {
+        uint16_t cluster = writer->buffered[b];
+        if (writer->changed[cluster])
+        {
+            if (backend->write(backend, writer->directories[cluster], volume->clusterSize, clusterOffset(volume, cluster)) != (ssize_t)volume->clusterSize)
+            {
+                perror("Error writing directory");
+                status = -1;
+                continue;
+            }
+            writer->changed[cluster] = 0;
+        }
+    }
+
+    size_t sectorSize = writer->sectorSize;
+    size_t firstFat = volume->fatOffset / sectorSize;
+    size_t fatSectors = volume->fatSize / sectorSize;
+    for (size_t sector = firstFat; sector < firstFat + fatSectors; sector++)
+    {
+        if (!writer->dirtySectors[sector])
+        {
+            continue;
+        }
+        for (size_t copy = 1; copy < volume->bootSector->BPB_NumFATs; copy++)
+        {
+            size_t mirror = sector + copy * fatSectors;
+            memcpy(volume->metadata + mirror * sectorSize, volume->metadata + sector * sectorSize, sectorSize);
+            writer->dirtySectors[mirror] = 1;
+        }
+    }
+
+    size_t sectors = volume->dataOffset / sectorSize;
+    for (size_t sector = 0; sector < sectors; )
+    {
+        if (!writer->dirtySectors[sector])
+        {
+            sector++;
+            continue;
+        }
+        size_t end = sector;
+        while (end < sectors && writer->dirtySectors[end])
+        {
+            writer->dirtySectors[end++] = 0;
+        }
+        size_t length = (end - sector) * sectorSize;
+        if (backend->write(backend, volume->metadata + sector * sectorSize, length, sector * sectorSize) != (ssize_t)length)
+        {
+            perror("Error writing the FAT and root directory");
+            status = -1;
+        }
+        sector = end;
+    }
+    return status;
+}
+
+//forget every buffered directory cluster; only after a flush, changes would be lost
+//once data moves between clusters a buffer can describe a cluster that holds something else
+static void dropDirectoryBuffers(Volume *volume)
+{
+    VolumeWriter *writer = volume->writer;
+    for (size_t b = 0; b < writer->bufferedCount; b++)
+    {
+        uint16_t cluster = writer->buffered[b];
+        free(writer->directories[cluster]);
+        writer->directories[cluster] = NULL;
+        writer->changed[cluster] = 0;
+    }
+    writer->bufferedCount = 0;
+}
+
+static void setFatEntry(Volume *volume, uint16_t cluster, uint16_t value)
+{
+    uint16_t *fat = (uint16_t *)(volume->metadata + volume->fatOffset);
+    fat[cluster] = value;
+    markMetadata(volume, volume->fatOffset + (off_t)cluster * 2, 2);
+}
+
+//release a whole chain
+static void freeChain(Volume *volume, uint16_t cluster)
+{
+    size_t steps = 0;
+    while (cluster >= 2 && cluster < volume->clusterCount + 2 && steps++ < volume->clusterCount)
+    {
+        uint16_t next = volume->fat[cluster];
+        setFatEntry(volume, cluster, 0);
+        cluster = next;
+    }
+}
+
+//next fit allocation of count clusters, linked after the cluster "after" (0 starts a new chain)
+//extends the chain in place when it can, otherwise takes the first free run long enough for
+//everything, and only splits over several runs when no run is
+//returns the first new cluster, 0 if the volume does not have count free clusters
+static uint16_t allocateClusters(Volume *volume, uint16_t after, size_t count)
+{
+    VolumeWriter *writer = volume->writer;
+    const uint16_t *fat = volume->fat;
+    size_t end = volume->clusterCount + 2;
+
+    size_t freeClusters = 0;
+    for (size_t c = 2; c < end && freeClusters < count; c++)
+    {
+        freeClusters += fat[c] == 0;
+    }
+    if (count == 0 || freeClusters < count)
+    {
+        return 0;
+    }
+
+    uint16_t first = 0;
+    uint16_t previous = after;
+    while (count > 0)
+    {
+        size_t start = 0;
+        size_t length = 0;
+        if (previous >= 2 && previous + 1u < end && fat[previous + 1] == 0)
+        {
+            //grow the chain in place
+            start = previous + 1;
+            while (start + length < end && fat[start + length] == 0 && length < count)
+            {
+                length++;
+            }
+        }
+        else
+        {
+            //one lap from the hint: first run that fits, else the longest one
+            size_t bestStart = 0;
+            size_t bestLength = 0;
+            size_t c = writer->nextFree >= 2 && writer->nextFree < end ? writer->nextFree : 2;
+            for (size_t seen = 0; seen < end - 2; )
+            {
+                if (fat[c] != 0)
+                {
+                    c = c + 1 < end ? c + 1 : 2;
+                    seen++;
+                    continue;
+                }
+                size_t runStart = c;
+                size_t runLength = 0;
+                //runs do not wrap past the last cluster
+                while (c < end && fat[c] == 0 && seen < end - 2)
+                {
+                    runLength++;
+                    c++;
+                    seen++;
+                }
+                if (c == end)
+                {
+                    c = 2;
+                }
+                if (runLength > bestLength)
+                {
+                    bestStart = runStart;
+                    bestLength = runLength;
+                }
+                if (runLength >= count)
+                {
+                    break;
+                }
+            }
+            start = bestStart;
+            length = bestLength < count ? bestLength : count;
+        }
+
+        for (size_t c = start; c < start + length; c++)
+        {
+            if (previous >= 2)
+            {
+                setFatEntry(volume, previous, (uint16_t)c);
+            }
+            else
+            {
+                first = (uint16_t)c;
+            }
+            setFatEntry(volume, (uint16_t)c, END_OF_CHAIN);
+            previous = (uint16_t)c;
+        }
+        if (first == 0)
+        {
+            first = (uint16_t)start;
+        }
+        count -= length;
+        writer->nextFree = (uint16_t)(start + length < end ? start + length : 2);
+    }
+    return first;
+}
+
+//buffer of a subdirectory cluster, read on first use (fresh: start zeroed instead)
+static uint8_t *directoryCluster(Volume *volume, uint16_t cluster, int fresh)
+{
+    VolumeWriter *writer = volume->writer;
+    if (writer->directories[cluster] != NULL)
+    {
+        if (fresh)
+        {
+            memset(writer->directories[cluster], 0, volume->clusterSize);
+        }
+        return writer->directories[cluster];
+    }
+
+    if (writer->bufferedCount == writer->bufferedCapacity)
+    {
+        size_t capacity = writer->bufferedCapacity ? writer->bufferedCapacity * 2 : 16;
+        uint16_t *grown = realloc(writer->buffered, capacity * sizeof(uint16_t));
+        if (grown == NULL)
+        {
+            return NULL;
+        }
+        writer->buffered = grown;
+        writer->bufferedCapacity = capacity;
+    }
+    uint8_t *data = calloc(1, volume->clusterSize);
+    if (data == NULL)
+    {
+        return NULL;
+    }
+    if (!fresh && volume->backend->read(volume->backend, data, volume->clusterSize, clusterOffset(volume, cluster)) != (ssize_t)volume->clusterSize)
+    {
+        perror("Error reading directory");
+        free(data);
+        return NULL;
+    }
+    writer->directories[cluster] = data;
+    writer->buffered[writer->bufferedCount++] = cluster;
+    return data;
+}
+
+//writable pointer to slot "slot" of a directory (0 = root), NULL past its end
+static DirectoryEntry *directorySlot(Volume *volume, uint16_t directory, size_t slot)
+{
+    if (directory == 0)
+    {
+        if (slot >= volume->bootSector->BPB_RootEntCnt)
+        {
+            return NULL;
+        }
+        return (DirectoryEntry *)(volume->metadata + volume->rootOffset) + slot;
+    }
+
+    size_t perCluster = volume->clusterSize / sizeof(DirectoryEntry);
+    uint16_t cluster = directory;
+    for (size_t hop = slot / perCluster; hop > 0; hop--)
+    {
+        cluster = volume->fat[cluster];
+        if (cluster < 2 || cluster >= volume->clusterCount + 2)
+        {
+            return NULL;
+        }
+    }
+    uint8_t *data = directoryCluster(volume, cluster, 0);
+    return data != NULL ? (DirectoryEntry *)data + slot % perCluster : NULL;
+}
+
+//a slot changed: write it on flush and forget the directory's index
+static void touchSlot(Volume *volume, uint16_t directory, size_t slot)
+{
+    if (directory == 0)
+    {
+        markMetadata(volume, volume->rootOffset + (off_t)slot * sizeof(DirectoryEntry), sizeof(DirectoryEntry));
+    }
+    else
+    {
+        size_t perCluster = volume->clusterSize / sizeof(DirectoryEntry);
+        uint16_t cluster = directory;
+        for (size_t hop = slot / perCluster; hop > 0; hop--)
+        {
+            cluster = volume->fat[cluster];
+        }
+        volume->writer->changed[cluster] = 1;
+    }
+    forgetDirectoryIndex(volume, directory);
+}
+
+//slot of the short entry with this 11 byte name, -1 if there is none
+static long findSlot(Volume *volume, uint16_t directory, const uint8_t *shortName)
+{
+    for (size_t slot = 0; ; slot++)
+    {
+        const DirectoryEntry *entry = directorySlot(volume, directory, slot);
+        if (entry == NULL || entry->DIR_Name[0] == 0x00)
+        {
+            return -1;
+        }
+        if (entry->DIR_Name[0] != 0xE5 && (entry->DIR_Attr & 0x0F) != 0x0F && memcmp(entry->DIR_Name, shortName, 11) == 0)
+        {
+            return (long)slot;
+        }
+    }
+}
+
+//FAT date (high 16 bits) and time (low 16 bits) of a host time
+static uint32_t fatTimestamp(time_t when)
+{
+    struct tm local;
+    localtime_r(&when, &local);
+    int year = local.tm_year + 1900 < 1980 ? 0 : local.tm_year + 1900 - 1980;
+    uint32_t date = (year << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday;
+    uint32_t time = (local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2);
+    return date << 16 | time;
+}
+
+//UTF-8 to UTF-16, invalid bytes become U+FFFD; returns units, -1 if more than max
+static long utf8ToUtf16(const char *text, uint16_t *units, size_t max)
+{
+    const uint8_t *in = (const uint8_t *)text;
+    size_t count = 0;
+    while (*in != 0)
+    {
+        uint32_t code = 0xFFFD;
+        int extra = *in >= 0xF0 && *in < 0xF5 ? 3 : *in >= 0xE0 ? 2 : *in >= 0xC2 && *in < 0xE0 ? 1 : 0;
+        if (*in < 0x80)
+        {
+            code = *in++;
+        }
+        else if (extra == 0 || (*in >= 0xF5))
+        {
+            in++;
+        }
+        else
+        {
+            uint32_t value = *in++ & (0x3F >> extra);
+            int valid = 1;
+            for (int i = 0; i < extra; i++)
+            {
+                if ((in[i] & 0xC0) != 0x80)
+                {
+                    valid = 0;
+                    break;
+                }
+                value = (value << 6) | (in[i] & 0x3F);
+            }
+            //overlong forms and surrogates are not characters
+            uint32_t minimum = extra == 1 ? 0x80 : extra == 2 ? 0x800 : 0x10000;
+            if (valid && value >= minimum && value <= 0x10FFFF && (value < 0xD800 || value > 0xDFFF))
+            {
+                code = value;
+                in += extra;
+            }
+        }
+
+        if (count + (code >= 0x10000 ? 2 : 1) > max)
+        {
+            return -1;
+        }
+        if (code >= 0x10000)
+        {
+            code -= 0x10000;
+            units[count++] = (uint16_t)(0xD800 | (code >> 10));
+            units[count++] = (uint16_t)(0xDC00 | (code & 0x3FF));
+        }
+        else
+        {
+            units[count++] = (uint16_t)code;
+        }
+    }
+    return (long)count;
+}
+
+//numeric tails tried for generated short names
+#define MAX_NAME_TAIL 100000
+
+//characters a short name can keep as they are
+static int shortNameChar(unsigned char c)
+{
+    return isupper(c) || isdigit(c) || c >= 0x80 || strchr("!#$%&'()-@^_`{}~", c) != NULL;
+}
+
+//pick the 11 byte short name of a new entry among the short names already in its directory
+//returns 1 if it needs long name entries too, -1 if no numeric tail is left
+//"README.TXT" stays as it is, anything else gets a basis name with a "~N" tail
+static int pickShortName(const char *name, uint8_t *shortName, const uint8_t (*existing)[11], size_t existingCount)
+{
+    const char *dot = strrchr(name, '.');
+    if (dot == name)
+    {
+        dot = NULL;
+    }
+    size_t length = strlen(name);
+    size_t baseEnd = dot != NULL ? (size_t)(dot - name) : length;
+    int lossy = 0;
+
+    uint8_t base[8];
+    size_t baseLength = 0;
+    for (size_t i = 0; i < baseEnd; i++)
+    {
+        unsigned char c = toupper((unsigned char)name[i]);
+        if (c == ' ' || c == '.')
+        {
+            lossy = 1;
+            continue;
+        }
+        if (baseLength == 8)
+        {
+            lossy = 1;
+            break;
+        }
+        base[baseLength++] = shortNameChar(c) ? c : '_';
+        lossy |= !shortNameChar(c) || c != (unsigned char)name[i];
+    }
+
+    uint8_t extension[3];
+    size_t extensionLength = 0;
+    for (const char *c = dot != NULL ? dot + 1 : ""; *c != '\0'; c++)
+    {
+        unsigned char upper = toupper((unsigned char)*c);
+        if (upper == ' ')
+        {
+            lossy = 1;
+            continue;
+        }
+        if (extensionLength == 3)
+        {
+            lossy = 1;
+            break;
+        }
+        extension[extensionLength++] = shortNameChar(upper) ? upper : '_';
+        lossy |= !shortNameChar(upper) || upper != (unsigned char)*c;
+    }
+    if (baseLength == 0)
+    {
+        base[baseLength++] = '_';
+        lossy = 1;
+    }
+
+    memset(shortName, ' ', 11);
+    memcpy(shortName, base, baseLength);
+    memcpy(shortName + 8, extension, extensionLength);
+    if (shortName[0] == 0xE5)
+    {
+        shortName[0] = 0x05;
+    }
+
+    //only case differs: keep the basis if it is free, the long name keeps the case
+    int caseOnly = lossy && baseLength == strnlen(name, baseEnd) && (dot == NULL || extensionLength == strlen(dot + 1));
+    for (size_t i = 0; caseOnly && i < length; i++)
+    {
+        caseOnly = name[i] == '.' || shortNameChar(toupper((unsigned char)name[i]));
+    }
+    int taken = 0;
+    for (size_t e = 0; e < existingCount && !taken; e++)
+    {
+        taken = memcmp(existing[e], shortName, 11) == 0;
+    }
+    if ((!lossy || caseOnly) && !taken)
+    {
+        return lossy;
+    }
+
+    //numeric tail: NAME~1, NAM~10, ...; one pass over the names finds the tails in use
+    static uint8_t usedTails[MAX_NAME_TAIL / 8];
+    memset(usedTails, 0, sizeof(usedTails));
+    for (size_t e = 0; e < existingCount; e++)
+    {
+        const uint8_t *other = existing[e];
+        const uint8_t *tilde = memchr(other, '~', 8);
+        if (tilde == NULL || memcmp(other + 8, shortName + 8, 3) != 0)
+        {
+            continue;
+        }
+        size_t keep = tilde - other;
+        unsigned tail = 0;
+        size_t digits = 0;
+        for (size_t i = keep + 1; i < 8 && isdigit(other[i]) && tail < MAX_NAME_TAIL; i++, digits++)
+        {
+            tail = tail * 10 + (other[i] - '0');
+        }
+        //the name this tail would produce for our basis
+        size_t expectedKeep = baseLength < 7 - digits ? baseLength : 7 - digits;
+        if (digits > 0 && tail < MAX_NAME_TAIL && keep == expectedKeep && memcmp(other, shortName, keep) == 0)
+        {
+            usedTails[tail / 8] |= 1 << (tail % 8);
+        }
+    }
+
+    for (unsigned tail = 1; tail < MAX_NAME_TAIL; tail++)
+    {
+        if (usedTails[tail / 8] & (1 << (tail % 8)))
+        {
+            continue;
+        }
+        char digits[8];
+        int digitCount = snprintf(digits, sizeof(digits), "~%u", tail);
+        size_t keep = baseLength < 8 - (size_t)digitCount ? baseLength : 8 - (size_t)digitCount;
+        memcpy(shortName + keep, digits, digitCount);
+        memset(shortName + keep + digitCount, ' ', 8 - keep - digitCount);
+        return 1;
+    }
+    return -1;
+}
+
+//short names of every live entry of a directory (caller frees)
+static uint8_t (*directoryShortNames(Volume *volume, uint16_t directory, size_t *count))[11]
+{
+    uint8_t (*names)[11] = NULL;
+    size_t capacity = 0;
+    *count = 0;
+    for (size_t slot = 0; ; slot++)
+    {
+        const DirectoryEntry *entry = directorySlot(volume, directory, slot);
+        if (entry == NULL || entry->DIR_Name[0] == 0x00)
+        {
+            break;
+        }
+        if (entry->DIR_Name[0] == 0xE5 || (entry->DIR_Attr & 0x0F) == 0x0F)
+        {
+            continue;
+        }
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            uint8_t (*grown)[11] = realloc(names, capacity * 11);
+            if (grown == NULL)
+            {
+                free(names);
+                *count = 0;
+                return NULL;
+            }
+            names = grown;
+        }
+        memcpy(names[(*count)++], entry->DIR_Name, 11);
+    }
+    return names;
+}
+
+//long name entries for a name, in directory order (last part first); returns how many, -1 if too long
+static long longNameEntries(const char *name, const uint8_t *shortName, DirectoryEntry *entries)
+{
+    uint16_t units[255];
+    long unitCount = utf8ToUtf16(name, units, 255);
+    if (unitCount == -1)
+    {
+        return -1;
+    }
+    size_t longCount = (unitCount + 12) / 13;
+
+    //the part holding the end of the name is flagged 0x40
+    uint8_t checksum = shortNameChecksum(shortName);
+    for (size_t part = 0; part < longCount; part++)
+    {
+        LongName longEntry;
+        memset(&longEntry, 0, sizeof(longEntry));
+        uint16_t chunk[13];
+        for (size_t i = 0; i < 13; i++)
+        {
+            size_t unit = part * 13 + i;
+            chunk[i] = unit < (size_t)unitCount ? units[unit] : unit == (size_t)unitCount ? 0x0000 : 0xFFFF;
+        }
+        memcpy(longEntry.LDIR_Name1, chunk, 10);
+        memcpy(longEntry.LDIR_Name2, chunk + 5, 12);
+        memcpy(longEntry.LDIR_Name3, chunk + 11, 4);
+        longEntry.LDIR_Ord = (uint8_t)((part + 1) | (part + 1 == longCount ? 0x40 : 0));
+        longEntry.LDIR_Attr = 0x0F;
+        longEntry.LDIR_Chksum = checksum;
+        memcpy(&entries[longCount - 1 - part], &longEntry, sizeof(DirectoryEntry));
+    }
+    return (long)longCount;
+}
+
+//a name a new entry can have: no path separators or reserved characters
+static int validEntryName(const char *name)
+{
+    if (*name == '\0' || strpbrk(name, "\\/:*?\"<>|") != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        return 0;
+    }
+    for (const char *c = name; *c != '\0'; c++)
+    {
+        if ((unsigned char)*c < 0x20)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//index of the first of count free slots in a row, growing a subdirectory if needed (up to DIRECTORY_MAX_SLOTS)
+//everything after a 0x00 entry is free; *atEnd tells if the run reaches past it
+static long findFreeSlots(Volume *volume, uint16_t directory, size_t count, int *atEnd)
+{
+    size_t run = 0;
+    *atEnd = 0;
+    for (size_t slot = 0; ; slot++)
+    {
+        const DirectoryEntry *entry = directorySlot(volume, directory, slot);
+        if (entry == NULL)
+        {
+            if (directory == 0)
+            {
+                fprintf(stderr, "Root directory is full\n");
+                return -1;
+            }
+            if (slot >= DIRECTORY_MAX_SLOTS)
+            {
+                fprintf(stderr, "Directory is full (%d entries)\n", DIRECTORY_MAX_SLOTS);
+                return -1;
+            }
+            //append a zeroed cluster to the directory
+            uint16_t last = directory;
+            while (volume->fat[last] >= 2 && volume->fat[last] < volume->clusterCount + 2)
+            {
+                last = volume->fat[last];
+            }
+            uint16_t added = allocateClusters(volume, last, 1);
+            if (added == 0 || directoryCluster(volume, added, 1) == NULL)
+            {
+                fprintf(stderr, "Volume is full\n");
+                return -1;
+            }
+            volume->writer->changed[added] = 1;
+            entry = directorySlot(volume, directory, slot);
+        }
+
+        *atEnd |= entry->DIR_Name[0] == 0x00;
+        run = *atEnd || entry->DIR_Name[0] == 0xE5 ? run + 1 : 0;
+        if (run == count)
+        {
+            return (long)(slot + 1 - count);
+        }
+    }
+}
+
+//add an entry (and its long name entries) to a directory; returns the short entry's slot, -1 on error
+static long addDirectoryEntry(Volume *volume, uint16_t directory, const char *name, uint8_t attributes, uint16_t cluster)
+{
+    if (!validEntryName(name))
+    {
+        fprintf(stderr, "Invalid file name: %s\n", name);
+        return -1;
+    }
+
+    size_t existingCount;
+    uint8_t (*existing)[11] = directoryShortNames(volume, directory, &existingCount);
+    uint8_t shortName[11];
+    int needsLong = pickShortName(name, shortName, (const uint8_t (*)[11])existing, existingCount);
+    free(existing);
+    DirectoryEntry longEntries[20];
+    long longCount = needsLong == 1 ? longNameEntries(name, shortName, longEntries) : 0;
+    if (needsLong == -1 || longCount == -1)
+    {
+        fprintf(stderr, "Name is too long: %s\n", name);
+        return -1;
+    }
+
+    int atEnd;
+    long first = findFreeSlots(volume, directory, longCount + 1, &atEnd);
+    if (first == -1)
+    {
+        return -1;
+    }
+    for (long part = 0; part < longCount; part++)
+    {
+        memcpy(directorySlot(volume, directory, first + part), &longEntries[part], sizeof(DirectoryEntry));
+        touchSlot(volume, directory, first + part);
+    }
+
+    size_t slot = first + longCount;
+    DirectoryEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.DIR_Name, shortName, 11);
+    entry.DIR_Attr = attributes;
+    uint32_t now = fatTimestamp(time(NULL));
+    entry.DIR_CrtDate = entry.DIR_WrtDate = entry.DIR_LstAccDate = now >> 16;
+    entry.DIR_CrtTime = entry.DIR_WrtTime = now & 0xFFFF;
+    entry.DIR_FstClusLO = cluster;
+    memcpy(directorySlot(volume, directory, slot), &entry, sizeof(DirectoryEntry));
+    touchSlot(volume, directory, slot);
+
+    //the new entries took the end marker, the slot after them becomes the end
+    if (atEnd)
+    {
+        DirectoryEntry *next = directorySlot(volume, directory, slot + 1);
+        if (next != NULL && next->DIR_Name[0] != 0x00)
+        {
+            memset(next, 0, sizeof(DirectoryEntry));
+            touchSlot(volume, directory, slot + 1);
+        }
+    }
+    return (long)slot;
+}
+
+//first cluster of the directory holding a path (0 = root) and the last component of the path
+static int parentDirectory(Volume *volume, const char *path, uint16_t *directory, const char **name)
+{
+    while (*path == '/')
+    {
+        path++;
+    }
+    const char *slash = strrchr(path, '/');
+    *name = slash != NULL ? slash + 1 : path;
+    *directory = 0;
+    if (**name == '\0')
+    {
+        fprintf(stderr, "Invalid path: %s\n", path);
+        return -1;
+    }
+    if (slash == NULL)
+    {
+        return 0;
+    }
+
+    char parent[4096];
+    size_t length = slash - path;
+    if (length >= sizeof(parent))
+    {
+        return -1;
+    }
+    memcpy(parent, path, length);
+    parent[length] = '\0';
+    DirectoryEntry entry;
+    if (statPath(volume, parent, &entry) == -1 || !(entry.DIR_Attr & 0x10))
+    {
+        fprintf(stderr, "Directory cant be found: %s\n", parent);
+        return -1;
+    }
+    *directory = entry.DIR_FstClusLO;
+    return 0;
+}
+
+//parent directory and slot of an existing path, fills entry
+static long locateEntry(Volume *volume, const char *path, uint16_t *directory, DirectoryEntry *entry)
+{
+    const char *name;
+    if (parentDirectory(volume, path, directory, &name) == -1 || statPath(volume, path, entry) == -1)
+    {
+        return -1;
+    }
+    return findSlot(volume, *directory, entry->DIR_Name);
+}
+
+//write the file's size, first cluster and write time back to its entry
+static void updateEntry(File *file)
+{
+    DirectoryEntry *entry = directorySlot(file->volume, file->entryDirectory, file->entrySlot);
+    if (entry == NULL)
+    {
+        return;
+    }
+    entry->DIR_FileSize = (uint32_t)file->fileLength;
+    entry->DIR_FstClusLO = file->startCluster;
+    uint32_t now = fatTimestamp(time(NULL));
+    entry->DIR_WrtDate = entry->DIR_LstAccDate = now >> 16;
+    entry->DIR_WrtTime = now & 0xFFFF;
+    touchSlot(file->volume, file->entryDirectory, file->entrySlot);
+}
+
+//open an existing file for writing, positioned at the start
+File *openFileForWriting(Volume *volume, const char *filename)
+{
+    if (volume->writer == NULL)
+    {
+        fprintf(stderr, "Volume is open read only\n");
+        return NULL;
+    }
+    uint16_t directory;
+    DirectoryEntry entry;
+    long slot = locateEntry(volume, filename, &directory, &entry);
+    if (slot == -1)
+    {
+        fprintf(stderr, "File cant be found: %s\n", filename);
+        return NULL;
+    }
+    if (entry.DIR_Attr & 0x10)
+    {
+        fprintf(stderr, "%s is a directory and not a regular file.\n", filename);
+        return NULL;
+    }
+
+    File *file = openEntry(volume, &entry);
+    if (file != NULL)
+    {
+        file->entryDirectory = directory;
+        file->entrySlot = slot;
+    }
+    return file;
+}
+
+int truncateFile(File *file, size_t length);
+
+//create an empty file (an existing one is truncated) and open it for writing
+File *createFile(Volume *volume, const char *filename)
+{
+    if (volume->writer == NULL)
+    {
+        fprintf(stderr, "Volume is open read only\n");
+        return NULL;
+    }
+    DirectoryEntry entry;
+    if (statPath(volume, filename, &entry) == 0)
+    {
+        File *file = openFileForWriting(volume, filename);
+        if (file != NULL && truncateFile(file, 0) == -1)
+        {
+            closeFile(file);
+            return NULL;
+        }
+        return file;
+    }
+
+    uint16_t directory;
+    const char *name;
+    if (parentDirectory(volume, filename, &directory, &name) == -1)
+    {
+        return NULL;
+    }
+    long slot = addDirectoryEntry(volume, directory, name, 0x20, 0);
+    if (slot == -1)
+    {
+        return NULL;
+    }
+
+    File *file = openEntry(volume, directorySlot(volume, directory, slot));
+    if (file != NULL)
+    {
+        file->entryDirectory = directory;
+        file->entrySlot = slot;
+    }
+    return file;
+}
+
+//make the chain long enough for length bytes, new clusters go after the current last one
+static int reserveClusters(File *file, uint64_t length)
+{
+    Volume *volume = file->volume;
+    size_t needed = (length + volume->clusterSize - 1) / volume->clusterSize;
+    size_t have = file->extents.clusterCount;
+    if (needed <= have)
+    {
+        return 0;
+    }
+
+    const Extent *last = have > 0 ? &file->extents.extents[file->extents.count - 1] : NULL;
+    uint16_t tail = last != NULL ? (uint16_t)(last->firstCluster + last->length - 1) : 0;
+    uint16_t first = allocateClusters(volume, tail, needed - have);
+    if (first == 0)
+    {
+        fprintf(stderr, "Volume is full\n");
+        return -1;
+    }
+    if (file->startCluster == 0)
+    {
+        file->startCluster = first;
+    }
+    freeExtentMap(&file->extents);
+    file->currentExtent = 0;
+    return buildExtentMap(volume, file->startCluster, &file->extents);
+}
+
+//write bytes at a file position inside the reserved chain, one write per run
+static int writeRange(File *file, const void *buffer, uint64_t position, size_t length)
+{
+    Volume *volume = file->volume;
+    static const uint8_t zeros[4096];
+    size_t done = 0;
+    while (done < length)
+    {
+        const Extent *run = findExtent(volume, &file->extents, position + done);
+        if (run == NULL)
+        {
+            return -1;
+        }
+        uint64_t inRun = position + done - run->fileOffset;
+        uint64_t available = (uint64_t)run->length * volume->clusterSize - inRun;
+        size_t chunk = length - done < available ? length - done : available;
+        //NULL buffer writes zeros
+        if (buffer == NULL && chunk > sizeof(zeros))
+        {
+            chunk = sizeof(zeros);
+        }
+        const void *source = buffer != NULL ? (const uint8_t *)buffer + done : zeros;
+        if (volume->backend->write(volume->backend, source, chunk, clusterOffset(volume, run->firstCluster) + inRun) != (ssize_t)chunk)
+        {
+            perror("Error writing to file");
+            return -1;
+        }
+        done += chunk;
+    }
+    return 0;
+}
+
+//write at the current position, growing the file (a gap after a seek past the end reads as zeros)
+size_t writeFile(File *file, const void *buffer, size_t length)
+{
+    if (file->entrySlot == SIZE_MAX || file->volume->writer == NULL)
+    {
+        fprintf(stderr, "File is not open for writing\n");
+        return 0;
+    }
+    //DIR_FileSize is 32 bits
+    if (file->currentPosition + length > UINT32_MAX)
+    {
+        fprintf(stderr, "File would be larger than 4 GiB\n");
+        return 0;
+    }
+
+    size_t end = file->currentPosition + length;
+    if (reserveClusters(file, end) == -1)
+    {
+        return 0;
+    }
+    if (file->currentPosition > file->fileLength && writeRange(file, NULL, file->fileLength, file->currentPosition - file->fileLength) == -1)
+    {
+        return 0;
+    }
+    if (writeRange(file, buffer, file->currentPosition, length) == -1)
+    {
+        return 0;
+    }
+
+    file->currentPosition = end;
+    if (end > file->fileLength)
+    {
+        file->fileLength = end;
+    }
+    updateEntry(file);
+    return length;
+}
+
+//cut or extend (with zeros) a file open for writing
+int truncateFile(File *file, size_t length)
+{
+    Volume *volume = file->volume;
+    if (file->entrySlot == SIZE_MAX || volume->writer == NULL)
+    {
+        fprintf(stderr, "File is not open for writing\n");
+        return -1;
+    }
+    if (length > UINT32_MAX)
+    {
+        fprintf(stderr, "File would be larger than 4 GiB\n");
+        return -1;
+    }
+
+    if (length > file->fileLength)
+    {
+        if (reserveClusters(file, length) == -1 || writeRange(file, NULL, file->fileLength, length - file->fileLength) == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        size_t keep = (length + volume->clusterSize - 1) / volume->clusterSize;
+        if (keep == 0)
+        {
+            freeChain(volume, file->startCluster);
+            file->startCluster = 0;
+        }
+        else if (keep < file->extents.clusterCount)
+        {
+            const Extent *run = findExtent(volume, &file->extents, (uint64_t)(keep - 1) * volume->clusterSize);
+            uint16_t last = (uint16_t)(run->firstCluster + ((uint64_t)(keep - 1) * volume->clusterSize - run->fileOffset) / volume->clusterSize);
+            uint16_t rest = volume->fat[last];
+            setFatEntry(volume, last, END_OF_CHAIN);
+            freeChain(volume, rest);
+        }
+        freeExtentMap(&file->extents);
+        file->currentExtent = 0;
+        if (buildExtentMap(volume, file->startCluster, &file->extents) == -1)
+        {
+            return -1;
+        }
+    }
+
+    file->fileLength = length;
+    updateEntry(file);
+    return 0;
+}
+
+//mark an entry and the long name entries before it deleted
+static void deleteEntry(Volume *volume, uint16_t directory, size_t slot)
+{
+    DirectoryEntry *entry = directorySlot(volume, directory, slot);
+    entry->DIR_Name[0] = 0xE5;
+    touchSlot(volume, directory, slot);
+    while (slot-- > 0)
+    {
+        DirectoryEntry *previous = directorySlot(volume, directory, slot);
+        if (previous == NULL || (previous->DIR_Attr & 0x0F) != 0x0F || previous->DIR_Name[0] == 0xE5)
+        {
+            break;
+        }
+        int last = previous->DIR_Name[0] & 0x40;
+        previous->DIR_Name[0] = 0xE5;
+        touchSlot(volume, directory, slot);
+        //the 0x40 part is the first entry of the run
+        if (last)
+        {
+            break;
+        }
+    }
+}
+
+//delete a file and free its clusters
+int unlinkFile(Volume *volume, const char *filename)
+{
+    if (volume->writer == NULL)
+    {
+        fprintf(stderr, "Volume is open read only\n");
+        return -1;
+    }
+    uint16_t directory;
+    DirectoryEntry entry;
+    long slot = locateEntry(volume, filename, &directory, &entry);
+    if (slot == -1)
+    {
+        fprintf(stderr, "File cant be found: %s\n", filename);
+        return -1;
+    }
+    if (entry.DIR_Attr & 0x10)
+    {
+        fprintf(stderr, "%s is a directory and not a regular file.\n", filename);
+        return -1;
+    }
+    freeChain(volume, entry.DIR_FstClusLO);
+    deleteEntry(volume, directory, slot);
+    return 0;
+}
+
+//create an empty directory with its "." and ".." entries
+int makeDirectory(Volume *volume, const char *path)
+{
+    if (volume->writer == NULL)
+    {
+        fprintf(stderr, "Volume is open read only\n");
+        return -1;
+    }
+    DirectoryEntry existing;
+    if (statPath(volume, path, &existing) == 0)
+    {
+        fprintf(stderr, "Already exists: %s\n", path);
+        return -1;
+    }
+    uint16_t directory;
+    const char *name;
+    if (parentDirectory(volume, path, &directory, &name) == -1)
+    {
+        return -1;
+    }
+
+    uint16_t cluster = allocateClusters(volume, 0, 1);
+    if (cluster == 0)
+    {
+        fprintf(stderr, "Volume is full\n");
+        return -1;
+    }
+    long slot = addDirectoryEntry(volume, directory, name, 0x10, cluster);
+    if (slot == -1)
+    {
+        freeChain(volume, cluster);
+        return -1;
+    }
+    uint8_t *data = directoryCluster(volume, cluster, 1);
+    if (data == NULL)
+    {
+        perror("Error allocating memory");
+        deleteEntry(volume, directory, slot);
+        freeChain(volume, cluster);
+        return -1;
+    }
+
+    //"." is the directory itself, ".." the parent (0 for the root)
+    DirectoryEntry *dots = (DirectoryEntry *)data;
+    dots[0] = *directorySlot(volume, directory, slot);
+    memcpy(dots[0].DIR_Name, ".          ", 11);
+    dots[1] = dots[0];
+    memcpy(dots[1].DIR_Name, "..         ", 11);
+    dots[1].DIR_FstClusLO = directory;
+    volume->writer->changed[cluster] = 1;
+    return 0;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        MKIMAGE
+/////////////////////////////////////////////////////////////*/
+
+//bytes per sector of built images
+#define IMAGE_SECTOR 512
+//size of each sequential write
+#define IMAGE_WRITE_BUFFER (4u << 20)
+//FAT16 needs this many clusters at least, and at most the second value
+#define FAT16_MIN_CLUSTERS 4085
+#define FAT16_MAX_CLUSTERS 65524
+
+//one host file or directory in the planned image; children of a directory are consecutive
+typedef struct {
+    char *hostPath;
+    const char *name;  // last component of hostPath
+    int directory;
+    uint64_t size;  // file bytes, directory entry bytes
+    time_t modified;
+    size_t parent;  // index of the directory holding it
+    size_t firstChild;
+    size_t childCount;
+    uint8_t shortName[11];
+    uint8_t longEntries;  // long name entries before the short entry
+    uint16_t cluster;  // first cluster, 0 for empty files and the root
+    uint32_t clusters;  // contiguous clusters from cluster
+} ImageNode;
+
+typedef struct {
+    ImageNode *nodes;  // nodes[0] is the root
+    size_t count;
+    size_t capacity;
+    //geometry
+    uint8_t sectorsPerCluster;
+    uint16_t rootEntries;
+    uint16_t fatSectors;
+    uint32_t clusterCount;
+    uint32_t totalSectors;
+} ImagePlan;
+
+static int compareNodeNames(const void *a, const void *b)
+{
+    return strcmp(((const ImageNode *)a)->name, ((const ImageNode *)b)->name);
+}
+
+//read the whole host tree, breadth first so each directory's children sit together
+static int scanHostTree(ImagePlan *plan, const char *root)
+{
+    plan->nodes = calloc(1, sizeof(ImageNode));
+    if (plan->nodes == NULL || (plan->nodes[0].hostPath = strdup(root)) == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    plan->count = plan->capacity = 1;
+    plan->nodes[0].directory = 1;
+    plan->nodes[0].name = plan->nodes[0].hostPath;
+
+    for (size_t n = 0; n < plan->count; n++)
+    {
+        if (!plan->nodes[n].directory)
+        {
+            continue;
+        }
+        DIR *dir = opendir(plan->nodes[n].hostPath);
+        if (dir == NULL)
+        {
+            perror(plan->nodes[n].hostPath);
+            return -1;
+        }
+        plan->nodes[n].firstChild = plan->count;
+
+        struct dirent *item;
+        while ((item = readdir(dir)) != NULL)
+        {
+            if (strcmp(item->d_name, ".") == 0 || strcmp(item->d_name, "..") == 0)
+            {
+                continue;
+            }
+            if (plan->count == plan->capacity)
+            {
+                size_t capacity = plan->capacity * 2;
+                ImageNode *grown = realloc(plan->nodes, capacity * sizeof(ImageNode));
+                if (grown == NULL)
+                {
+                    perror("Error allocating memory");
+                    closedir(dir);
+                    return -1;
+                }
+                plan->nodes = grown;
+                plan->capacity = capacity;
+            }
+
+            ImageNode *node = &plan->nodes[plan->count];
+            memset(node, 0, sizeof(ImageNode));
+            size_t length = strlen(plan->nodes[n].hostPath) + strlen(item->d_name) + 2;
+            node->hostPath = malloc(length);
+            if (node->hostPath == NULL)
+            {
+                perror("Error allocating memory");
+                closedir(dir);
+                return -1;
+            }
+            snprintf(node->hostPath, length, "%s/%s", plan->nodes[n].hostPath, item->d_name);
+            node->name = node->hostPath + length - 1 - strlen(item->d_name);
+
+            struct stat info;
+            if (stat(node->hostPath, &info) == -1 || !(S_ISREG(info.st_mode) || S_ISDIR(info.st_mode)))
+            {
+                fprintf(stderr, "Skipping %s: not a regular file or directory\n", node->hostPath);
+                free(node->hostPath);
+                continue;
+            }
+            if (!validEntryName(node->name))
+            {
+                fprintf(stderr, "Skipping %s: name not allowed on FAT\n", node->hostPath);
+                free(node->hostPath);
+                continue;
+            }
+            if (S_ISREG(info.st_mode) && (uint64_t)info.st_size > UINT32_MAX)
+            {
+                fprintf(stderr, "Skipping %s: larger than 4 GiB\n", node->hostPath);
+                free(node->hostPath);
+                continue;
+            }
+            node->parent = n;
+            node->directory = S_ISDIR(info.st_mode);
+            node->size = node->directory ? 0 : (uint64_t)info.st_size;
+            node->modified = info.st_mtime;
+            plan->count++;
+        }
+        closedir(dir);
+
+        //same input, same image
+        plan->nodes[n].childCount = plan->count - plan->nodes[n].firstChild;
+        qsort(plan->nodes + plan->nodes[n].firstChild, plan->nodes[n].childCount, sizeof(ImageNode), compareNodeNames);
+    }
+    return 0;
+}
+
+//short names, long name entry counts and directory sizes
+static int nameEntries(ImagePlan *plan)
+{
+    for (size_t n = 0; n < plan->count; n++)
+    {
+        ImageNode *parent = &plan->nodes[n];
+        if (!parent->directory)
+        {
+            continue;
+        }
+        uint8_t (*names)[11] = malloc((parent->childCount + 1) * 11);
+        if (names == NULL)
+        {
+            perror("Error allocating memory");
+            return -1;
+        }
+
+        //"." and ".." below the root
+        uint64_t slots = n == 0 ? 0 : 2;
+        for (size_t c = 0; c < parent->childCount; c++)
+        {
+            ImageNode *child = &plan->nodes[parent->firstChild + c];
+            int needsLong = pickShortName(child->name, child->shortName, (const uint8_t (*)[11])names, c);
+            DirectoryEntry longEntries[20];
+            long longCount = needsLong == 1 ? longNameEntries(child->name, child->shortName, longEntries) : 0;
+            if (needsLong == -1 || longCount == -1)
+            {
+                fprintf(stderr, "Name is too long: %s\n", child->hostPath);
+                free(names);
+                return -1;
+            }
+            memcpy(names[c], child->shortName, 11);
+            child->longEntries = (uint8_t)longCount;
+            slots += longCount + 1;
+        }
+        free(names);
+        //the root has its own limit, checked with its size in planGeometry
+        if (n > 0 && slots > DIRECTORY_MAX_SLOTS)
+        {
+            fprintf(stderr, "Too many entries in directory %s\n", parent->hostPath);
+            return -1;
+        }
+        parent->size = slots * sizeof(DirectoryEntry);
+    }
+    return 0;
+}
+
+//clusters every node needs with a given cluster size
+static uint64_t dataClusters(const ImagePlan *plan, size_t clusterSize)
+{
+    uint64_t total = 0;
+    for (size_t n = 1; n < plan->count; n++)
+    {
+        const ImageNode *node = &plan->nodes[n];
+        uint64_t clusters = (node->size + clusterSize - 1) / clusterSize;
+        //a directory always has a cluster, even with no entries
+        total += node->directory && clusters == 0 ? 1 : clusters;
+    }
+    return total;
+}
+
+//cluster size, root size and FAT size for the tree, in imageBytes if given (0 = as small as possible)
+//clusterBytes forces a cluster size (0 = smallest that keeps FAT16 cluster counts)
+static int planGeometry(ImagePlan *plan, uint64_t imageBytes, size_t clusterBytes)
+{
+    //root entries fill whole sectors, at least the usual 512
+    uint64_t rootSlots = plan->nodes[0].size / sizeof(DirectoryEntry) + 1;
+    rootSlots = rootSlots < 512 ? 512 : (rootSlots + 15) / 16 * 16;
+    if (rootSlots > 0xFFF0)
+    {
+        fprintf(stderr, "Too many entries in the root directory\n");
+        return -1;
+    }
+    plan->rootEntries = (uint16_t)rootSlots;
+    uint32_t rootSectors = rootSlots * sizeof(DirectoryEntry) / IMAGE_SECTOR;
+
+    for (unsigned perCluster = 1; perCluster <= 64; perCluster *= 2)
+    {
+        size_t clusterSize = (size_t)perCluster * IMAGE_SECTOR;
+        if (clusterBytes != 0 && clusterSize != clusterBytes)
+        {
+            continue;
+        }
+        uint64_t needed = dataClusters(plan, clusterSize);
+        uint64_t clusters;
+        uint32_t fatSectors;
+        if (imageBytes == 0)
+        {
+            clusters = needed < FAT16_MIN_CLUSTERS ? FAT16_MIN_CLUSTERS : needed;
+            fatSectors = ((clusters + 2) * 2 + IMAGE_SECTOR - 1) / IMAGE_SECTOR;
+        }
+        else
+        {
+            //the FAT grows with the cluster count, settle both
+            uint64_t sectors = imageBytes / IMAGE_SECTOR;
+            fatSectors = 1;
+            for (int round = 0; round < 4; round++)
+            {
+                uint64_t fixed = 1 + 2 * (uint64_t)fatSectors + rootSectors;
+                clusters = sectors > fixed ? (sectors - fixed) / perCluster : 0;
+                fatSectors = ((clusters + 2) * 2 + IMAGE_SECTOR - 1) / IMAGE_SECTOR;
+            }
+            uint64_t fixed = 1 + 2 * (uint64_t)fatSectors + rootSectors;
+            clusters = sectors > fixed ? (sectors - fixed) / perCluster : 0;
+        }
+        if (clusters < FAT16_MIN_CLUSTERS || clusters > FAT16_MAX_CLUSTERS || clusters < needed)
+        {
+            continue;
+        }
+
+        plan->sectorsPerCluster = (uint8_t)perCluster;
+        plan->clusterCount = (uint32_t)clusters;
+        plan->fatSectors = (uint16_t)fatSectors;
+        plan->totalSectors = 1 + 2 * fatSectors + rootSectors + (uint32_t)clusters * perCluster;
+        return 0;
+    }
+
+    fprintf(stderr, "The tree does not fit a FAT16 volume of that size and cluster size\n");
+    return -1;
+}
+
+//directories first, then files, each in one contiguous run
+static void placeNodes(ImagePlan *plan)
+{
+    size_t clusterSize = (size_t)plan->sectorsPerCluster * IMAGE_SECTOR;
+    uint32_t next = 2;
+    for (int pass = 1; pass >= 0; pass--)
+    {
+        for (size_t n = 1; n < plan->count; n++)
+        {
+            ImageNode *node = &plan->nodes[n];
+            if (node->directory != pass)
+            {
+                continue;
+            }
+            node->clusters = (node->size + clusterSize - 1) / clusterSize;
+            if (node->directory && node->clusters == 0)
+            {
+                node->clusters = 1;
+            }
+            node->cluster = node->clusters > 0 ? (uint16_t)next : 0;
+            next += node->clusters;
+        }
+    }
+}
+
+//entries of one directory: "." and "..", then long name and short entries of each child
+static void fillDirectory(const ImagePlan *plan, size_t n, DirectoryEntry *entries)
+{
+    const ImageNode *directory = &plan->nodes[n];
+    size_t slot = 0;
+    if (n != 0)
+    {
+        uint32_t stamp = fatTimestamp(directory->modified);
+        DirectoryEntry dot;
+        memset(&dot, 0, sizeof(dot));
+        memcpy(dot.DIR_Name, ".          ", 11);
+        dot.DIR_Attr = 0x10;
+        dot.DIR_CrtDate = dot.DIR_WrtDate = dot.DIR_LstAccDate = stamp >> 16;
+        dot.DIR_CrtTime = dot.DIR_WrtTime = stamp & 0xFFFF;
+        dot.DIR_FstClusLO = directory->cluster;
+        entries[slot++] = dot;
+        memcpy(dot.DIR_Name, "..         ", 11);
+        dot.DIR_FstClusLO = plan->nodes[directory->parent].cluster;
+        entries[slot++] = dot;
+    }
+
+    for (size_t c = 0; c < directory->childCount; c++)
+    {
+        const ImageNode *child = &plan->nodes[directory->firstChild + c];
+        if (child->longEntries > 0)
+        {
+            longNameEntries(child->name, child->shortName, entries + slot);
+            slot += child->longEntries;
+        }
+        DirectoryEntry *entry = &entries[slot++];
+        memset(entry, 0, sizeof(DirectoryEntry));
+        memcpy(entry->DIR_Name, child->shortName, 11);
+        entry->DIR_Attr = child->directory ? 0x10 : 0x20;
+        uint32_t stamp = fatTimestamp(child->modified);
+        entry->DIR_CrtDate = entry->DIR_WrtDate = entry->DIR_LstAccDate = stamp >> 16;
+        entry->DIR_CrtTime = entry->DIR_WrtTime = stamp & 0xFFFF;
+        entry->DIR_FstClusLO = child->cluster;
+        entry->DIR_FileSize = child->directory ? 0 : (uint32_t)child->size;
+    }
+}
+
+//sequential writer with one large aligned buffer
+typedef struct {
+    int fdesc;
+    uint8_t *buffer;
+    size_t used;
+    uint64_t written;
+    int failed;
+} ImageWriter;
+
+static void imageFlush(ImageWriter *writer)
+{
+    if (writer->used > 0 && !writer->failed && pwriteFull(writer->fdesc, writer->buffer, writer->used, writer->written) != (ssize_t)writer->used)
+    {
+        perror("Error writing image");
+        writer->failed = 1;
+    }
+    writer->written += writer->used;
+    writer->used = 0;
+}
+
+//room for length more bytes, zeroed, NULL when it would not fit in the buffer
+static uint8_t *imageReserve(ImageWriter *writer, size_t length)
+{
+    if (length > IMAGE_WRITE_BUFFER)
+    {
+        fprintf(stderr, "Image part of %zu bytes does not fit the write buffer\n", length);
+        writer->failed = 1;
+        return NULL;
+    }
+    if (writer->used + length > IMAGE_WRITE_BUFFER)
+    {
+        imageFlush(writer);
+    }
+    uint8_t *place = writer->buffer + writer->used;
+    memset(place, 0, length);
+    writer->used += length;
+    return place;
+}
+
+//zeros up to the next multiple of size
+static void imagePad(ImageWriter *writer, size_t size)
+{
+    uint64_t position = writer->written + writer->used;
+    size_t padding = (size - position % size) % size;
+    while (padding > 0)
+    {
+        size_t chunk = padding < IMAGE_WRITE_BUFFER ? padding : IMAGE_WRITE_BUFFER;
+        imageReserve(writer, chunk);
+        padding -= chunk;
+    }
+}
+
+//copy a host file into the image stream, exactly size bytes
+static void imageCopyFile(ImageWriter *writer, const ImageNode *node)
+{
+    int in = open(node->hostPath, O_RDONLY);
+    if (in == -1)
+    {
+        perror(node->hostPath);
+    }
+    uint64_t done = 0;
+    while (in != -1 && done < node->size)
+    {
+        if (writer->used == IMAGE_WRITE_BUFFER)
+        {
+            imageFlush(writer);
+        }
+        size_t want = IMAGE_WRITE_BUFFER - writer->used;
+        if (want > node->size - done)
+        {
+            want = node->size - done;
+        }
+        ssize_t reading = read(in, writer->buffer + writer->used, want);
+        if (reading == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (reading <= 0)
+        {
+            break;
+        }
+        writer->used += reading;
+        done += reading;
+    }
+    if (done < node->size)
+    {
+        //shrank since the scan: the rest reads as zeros
+        fprintf(stderr, "%s: read %llu of %llu bytes\n", node->hostPath, (unsigned long long)done, (unsigned long long)node->size);
+        while (done < node->size)
+        {
+            size_t chunk = node->size - done < IMAGE_WRITE_BUFFER ? node->size - done : IMAGE_WRITE_BUFFER;
+            imageReserve(writer, chunk);
+            done += chunk;
+        }
+    }
+    if (in != -1)
+    {
+        close(in);
+    }
+}
+
+//write the planned image front to back: boot sector, FATs, root directory, directories, files
+static int writeImage(const ImagePlan *plan, const char *output, const char *label)
+{
+    ImageWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    writer.fdesc = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (writer.fdesc == -1)
+    {
+        perror(output);
+        return -1;
+    }
+    if (posix_memalign((void **)&writer.buffer, 4096, IMAGE_WRITE_BUFFER) != 0)
+    {
+        perror("Error allocating memory");
+        close(writer.fdesc);
+        return -1;
+    }
+    size_t clusterSize = (size_t)plan->sectorsPerCluster * IMAGE_SECTOR;
+
+    BootSector *bs = (BootSector *)imageReserve(&writer, IMAGE_SECTOR);
+    memcpy(bs->BS_jmpBoot, "\xEB\x3C\x90", 3);
+    memcpy(bs->BS_OEMName, "MSWIN4.1", 8);
+    bs->BPB_BytsPerSec = IMAGE_SECTOR;
+    bs->BPB_SecPerClus = plan->sectorsPerCluster;
+    bs->BPB_RsvdSecCnt = 1;
+    bs->BPB_NumFATs = 2;
+    bs->BPB_RootEntCnt = plan->rootEntries;
+    bs->BPB_TotSec16 = plan->totalSectors < 0x10000 ? (uint16_t)plan->totalSectors : 0;
+    bs->BPB_TotSec32 = plan->totalSectors < 0x10000 ? 0 : plan->totalSectors;
+    bs->BPB_Media = 0xF8;
+    bs->BPB_FATSz16 = plan->fatSectors;
+    bs->BPB_SecPerTrk = 32;
+    bs->BPB_NumHeads = 64;
+    bs->BS_DrvNum = 0x80;
+    bs->BS_BootSig = 0x29;
+    bs->BS_VolID = (uint32_t)time(NULL);
+    memset(bs->BS_VolLab, ' ', 11);
+    memcpy(bs->BS_VolLab, label != NULL ? label : "NO NAME", strnlen(label != NULL ? label : "NO NAME", 11));
+    memcpy(bs->BS_FilSysType, "FAT16   ", 8);
+    ((uint8_t *)bs)[510] = 0x55;
+    ((uint8_t *)bs)[511] = 0xAA;
+
+    //both FAT copies (at most 128 KiB each): every node is one contiguous chain
+    size_t fatBytes = (size_t)plan->fatSectors * IMAGE_SECTOR;
+    for (int copy = 0; copy < 2; copy++)
+    {
+        uint16_t *fat = (uint16_t *)imageReserve(&writer, fatBytes);
+        if (fat == NULL)
+        {
+            break;
+        }
+        fat[0] = 0xFFF8;  // media byte 0xF8
+        fat[1] = 0xFFFF;
+        for (size_t n = 1; n < plan->count; n++)
+        {
+            const ImageNode *node = &plan->nodes[n];
+            for (uint32_t c = 0; c < node->clusters; c++)
+            {
+                size_t cluster = node->cluster + c;
+                fat[cluster] = c + 1 == node->clusters ? END_OF_CHAIN : (uint16_t)(cluster + 1);
+            }
+        }
+    }
+
+    //root directory, with the volume label first
+    DirectoryEntry *root = (DirectoryEntry *)imageReserve(&writer, (size_t)plan->rootEntries * sizeof(DirectoryEntry));
+    size_t labelSlots = 0;
+    if (root != NULL && label != NULL)
+    {
+        memset(root[0].DIR_Name, ' ', 11);
+        memcpy(root[0].DIR_Name, label, strnlen(label, 11));
+        root[0].DIR_Attr = 0x08;
+        labelSlots = 1;
+    }
+    if (root != NULL)
+    {
+        fillDirectory(plan, 0, root + labelSlots);
+    }
+
+    //directories, in cluster order
+    for (size_t n = 1; n < plan->count; n++)
+    {
+        const ImageNode *node = &plan->nodes[n];
+        if (!node->directory)
+        {
+            continue;
+        }
+        size_t bytes = (size_t)node->clusters * clusterSize;
+        DirectoryEntry *entries = (DirectoryEntry *)imageReserve(&writer, bytes);
+        if (entries != NULL)
+        {
+            fillDirectory(plan, n, entries);
+        }
+    }
+
+    //files, each padded to its last cluster
+    for (size_t n = 1; n < plan->count && !writer.failed; n++)
+    {
+        const ImageNode *node = &plan->nodes[n];
+        if (!node->directory && node->clusters > 0)
+        {
+            imageCopyFile(&writer, node);
+            imagePad(&writer, clusterSize);
+        }
+    }
+    imageFlush(&writer);
+
+    //free space at the end stays a hole
+    if (!writer.failed && ftruncate(writer.fdesc, (off_t)plan->totalSectors * IMAGE_SECTOR) == -1)
+    {
+        perror(output);
+        writer.failed = 1;
+    }
+    free(writer.buffer);
+    if (close(writer.fdesc) == -1)
+    {
+        perror(output);
+        writer.failed = 1;
+    }
+    return writer.failed ? -1 : 0;
+}
+
+static void freeImagePlan(ImagePlan *plan)
+{
+    for (size_t n = 0; n < plan->count; n++)
+    {
+        free(plan->nodes[n].hostPath);
+    }
+    free(plan->nodes);
+}
+
+//pack a host directory into a new FAT16 image
+//imageBytes and clusterBytes may be 0 to pick the smallest that fits
+int buildImage(const char *source, const char *output, uint64_t imageBytes, size_t clusterBytes, const char *label)
+{
+    ImagePlan plan;
+    memset(&plan, 0, sizeof(plan));
+    int status = scanHostTree(&plan, source);
+    if (status == 0)
+    {
+        status = nameEntries(&plan);
+    }
+    if (status == 0)
+    {
+        status = planGeometry(&plan, imageBytes, clusterBytes);
+    }
+    if (status == 0)
+    {
+        placeNodes(&plan);
+        status = writeImage(&plan, output, label);
+    }
+    freeImagePlan(&plan);
+    return status;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        SYNTHETIC IMAGES
+/////////////////////////////////////////////////////////////*/
+
+//directories hold this many subdirectories at most
+#define SYNTH_FANOUT 16
+//bytes of pattern data copied into files
+#define SYNTH_PATTERN (256u << 10)
+
+//what a generated benchmark image holds
+typedef struct {
+    size_t files;
+    uint64_t meanSize;  // file sizes are uniform in 0..2 * meanSize
+    size_t filesPerDirectory;
+    unsigned fragmentPercent;  // files written interleaved with another one, so their chains split
+    unsigned longNamePercent;  // files with names that need long name entries
+    uint64_t seed;  // same options and seed, same layout
+} SynthOptions;
+
+//xorshift64*
+static uint64_t synthRandom(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+//smallest cluster size whose cluster count fits FAT16 with some room to spare, 0 if none does
+static size_t synthClusterSize(const uint32_t *sizes, size_t files, size_t directories, uint64_t *imageBytes)
+{
+    for (size_t clusterSize = IMAGE_SECTOR; clusterSize <= 64 * IMAGE_SECTOR; clusterSize *= 2)
+    {
+        uint64_t needed = directories;
+        for (size_t f = 0; f < files; f++)
+        {
+            needed += (sizes[f] + clusterSize - 1) / clusterSize;
+        }
+        uint64_t clusters = needed + needed / 8 + 64;
+        if (clusters < FAT16_MIN_CLUSTERS + 16)
+        {
+            clusters = FAT16_MIN_CLUSTERS + 16;
+        }
+        //planGeometry adds at most one cluster per sector of FAT and root directory
+        if (clusters > 64900)
+        {
+            continue;
+        }
+        *imageBytes = clusters * clusterSize + (1 + 2 * 256 + 32) * IMAGE_SECTOR;
+        return clusterSize;
+    }
+    return 0;
+}
+
+//append length bytes of the pattern to a file
+static int synthWrite(File *file, const uint8_t *pattern, uint64_t length)
+{
+    while (length > 0)
+    {
+        size_t chunk = length < SYNTH_PATTERN ? length : SYNTH_PATTERN;
+        size_t start = file->currentPosition % (SYNTH_PATTERN - chunk + 1);
+        if (writeFile(file, pattern + start, chunk) != chunk)
+        {
+            return -1;
+        }
+        length -= chunk;
+    }
+    return 0;
+}
+
+//write two files a few clusters at a time, turn about, so neither chain stays contiguous
+static int synthInterleave(File *first, uint64_t firstSize, File *second, uint64_t secondSize, const uint8_t *pattern, uint64_t *random)
+{
+    size_t clusterSize = first->volume->clusterSize;
+    while (first->currentPosition < firstSize || second->currentPosition < secondSize)
+    {
+        File *file = first->currentPosition < firstSize ? first : second;
+        uint64_t size = file == first ? firstSize : secondSize;
+        if (file == first && second->currentPosition < secondSize && synthRandom(random) % 2)
+        {
+            file = second;
+            size = secondSize;
+        }
+        uint64_t chunk = clusterSize * (1 + synthRandom(random) % 4);
+        if (chunk > size - file->currentPosition)
+        {
+            chunk = size - file->currentPosition;
+        }
+        if (synthWrite(file, pattern, chunk) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//new image at output filled with generated directories and files
+int buildSyntheticImage(const char *output, const SynthOptions *options)
+{
+    size_t perDirectory = options->filesPerDirectory > 0 ? options->filesPerDirectory : 1;
+    size_t directories = (options->files + perDirectory - 1) / perDirectory;
+    uint64_t random = options->seed ^ 0x9E3779B97F4A7C15ULL;
+    uint32_t *sizes = malloc((options->files + 1) * sizeof(uint32_t));
+    char (*paths)[64] = malloc((directories + 1) * 64);
+    uint8_t *pattern = malloc(SYNTH_PATTERN);
+    if (sizes == NULL || paths == NULL || pattern == NULL)
+    {
+        perror("Error allocating memory");
+        free(sizes);
+        free(paths);
+        free(pattern);
+        return -1;
+    }
+    for (size_t i = 0; i < SYNTH_PATTERN; i += 8)
+    {
+        uint64_t word = synthRandom(&random);
+        memcpy(pattern + i, &word, 8);
+    }
+    for (size_t f = 0; f < options->files; f++)
+    {
+        uint64_t size = options->meanSize > 0 ? synthRandom(&random) % (2 * options->meanSize + 1) : 0;
+        sizes[f] = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    }
+
+    uint64_t imageBytes = 0;
+    size_t clusterSize = synthClusterSize(sizes, options->files, directories, &imageBytes);
+    if (clusterSize == 0)
+    {
+        fprintf(stderr, "That much data does not fit a FAT16 volume\n");
+        free(sizes);
+        free(paths);
+        free(pattern);
+        return -1;
+    }
+
+    //an empty tree gives a formatted volume of the size asked for
+    char empty[] = "/tmp/fat16-synth-XXXXXX";
+    int status = mkdtemp(empty) != NULL ? 0 : -1;
+    if (status == -1)
+    {
+        perror("Error creating a temporary directory");
+    }
+    else
+    {
+        status = buildImage(empty, output, imageBytes, clusterSize, "SYNTHETIC");
+        rmdir(empty);
+    }
+    Volume *volume = status == 0 ? openVolumeForWriting(output) : NULL;
+    if (volume == NULL)
+    {
+        free(sizes);
+        free(paths);
+        free(pattern);
+        return -1;
+    }
+
+    //the first SYNTH_FANOUT directories sit in the root, the rest below them
+    for (size_t d = 0; d < directories && status == 0; d++)
+    {
+        const char *parent = d < SYNTH_FANOUT ? "" : paths[d / SYNTH_FANOUT - 1];
+        snprintf(paths[d], sizeof(paths[d]), "%s/D%05zu", parent, d);
+        status = makeDirectory(volume, paths[d]);
+    }
+
+    //a fragmented file waits for the next one to be written alongside
+    File *waiting = NULL;
+    size_t waitingIndex = 0;
+    for (size_t f = 0; f < options->files && status == 0; f++)
+    {
+        char path[128];
+        if (synthRandom(&random) % 100 < options->longNamePercent)
+        {
+            snprintf(path, sizeof(path), "%s/synthetic file %06zu.data", paths[f / perDirectory], f);
+        }
+        else
+        {
+            snprintf(path, sizeof(path), "%s/F%07zu.DAT", paths[f / perDirectory], f);
+        }
+        File *file = createFile(volume, path);
+        if (file == NULL)
+        {
+            status = -1;
+            break;
+        }
+
+        if (synthRandom(&random) % 100 >= options->fragmentPercent)
+        {
+            status = synthWrite(file, pattern, sizes[f]);
+            closeFile(file);
+        }
+        else if (waiting == NULL)
+        {
+            waiting = file;
+            waitingIndex = f;
+        }
+        else
+        {
+            status = synthInterleave(waiting, sizes[waitingIndex], file, sizes[f], pattern, &random);
+            closeFile(waiting);
+            closeFile(file);
+            waiting = NULL;
+        }
+    }
+    if (waiting != NULL)
+    {
+        if (status == 0)
+        {
+            status = synthWrite(waiting, pattern, sizes[waitingIndex]);
+        }
+        closeFile(waiting);
+    }
+
+    if (flushVolume(volume) == -1)
+    {
+        status = -1;
+    }
+    closeVolume(volume);
+    free(sizes);
+    free(paths);
+    free(pattern);
+    return status;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        DEFRAG
+/////////////////////////////////////////////////////////////*/
+
+//owner of clusters in use by no file or directory (lost chains, bad clusters): they stay put
+#define DEFRAG_FIXED UINT32_MAX
+//default staging buffer, also about the most data one batch copies
+#define DEFRAG_STAGING (16u << 20)
+
+//what a defrag run found and did
+typedef struct {
+    size_t objects;  // files and directories with clusters
+    size_t fragmented;  // of those, not one run before
+    size_t placed;  // already where the layout puts them
+    uint64_t outOfPlace;  // clusters not where the layout puts them
+    size_t moves;  // chains rewritten (a chain moved out of the way counts again)
+    uint64_t clustersCopied;
+    size_t batches;  // rounds of copy, new FAT entries, switch, free
+} DefragReport;
+
+//a file or directory with clusters, in layout order (depth first, like walkVolume)
+typedef struct {
+    size_t chain;  // first slot of its chain in Defrag.chains
+    size_t length;  // clusters in the chain
+    size_t parent;  // object holding its entry, SIZE_MAX for the root directory
+    size_t slot;  // slot of the short entry in the parent
+    size_t firstChild;  // first subdirectory, SIZE_MAX if none
+    size_t nextSibling;  // next subdirectory of the same parent
+    uint16_t target;  // first cluster of its planned run
+    int directory;
+    int queued;  // rewritten by the current batch
+} DefragObject;
+
+//chain of an object before the current batch, freed once the new one is in place
+typedef struct {
+    size_t object;
+    uint16_t *previous;
+} DefragMove;
+
+//one cluster a batch copies
+typedef struct {
+    uint16_t from;
+    uint16_t to;
+    int dot;  // first cluster of a directory: its "." entry must name the copy
+} DefragCopy;
+
+typedef struct {
+    Volume *volume;
+    size_t end;  // one past the last cluster
+    DefragObject *objects;
+    size_t objectCount;
+    size_t objectCapacity;
+    uint16_t *chains;  // every chain in file order, as it will be after the batch
+    size_t chainsUsed;
+    size_t *scratch;  // fileClusters output
+    uint32_t *owner;  // per cluster: 0 free, object + 1 or DEFRAG_FIXED, as after the batch
+    uint8_t *pending;  // per cluster: freed by the batch, not reusable until the batch is written
+    DefragMove *moves;  // the batch, at most one move per object
+    size_t moveCount;
+    size_t batchClusters;  // clusters the batch copies
+    uint8_t *staging;
+    size_t stagingClusters;
+    size_t spare;  // search for room to move chains out of the way goes on here, downwards
+    DefragReport *report;
+} Defrag;
+
+static uint16_t *defragChain(Defrag *defrag, size_t object)
+{
+    return defrag->chains + defrag->objects[object].chain;
+}
+
+//first cluster of a directory object, 0 for the root
+static uint16_t defragDirectory(Defrag *defrag, size_t object)
+{
+    return object == SIZE_MAX ? 0 : defragChain(defrag, object)[0];
+}
+
+//record a file or directory and claim its chain; -1 on damage a move could make worse
+static int defragAdd(Defrag *defrag, size_t parent, size_t slot, const DirectoryEntry *entry)
+{
+    Volume *volume = defrag->volume;
+    uint16_t start = entry->DIR_FstClusLO;
+    if (start < 2 || start >= defrag->end)
+    {
+        fprintf(stderr, "Entry with a bad first cluster (%u), run check first\n", start);
+        return -1;
+    }
+    if (defrag->objectCount == defrag->objectCapacity)
+    {
+        size_t capacity = defrag->objectCapacity ? defrag->objectCapacity * 2 : 256;
+        DefragObject *grown = realloc(defrag->objects, capacity * sizeof(DefragObject));
+        if (grown == NULL)
+        {
+            perror("Error allocating memory");
+            return -1;
+        }
+        defrag->objects = grown;
+        defrag->objectCapacity = capacity;
+    }
+
+    //one more than the clusters not claimed yet: a loop or cross link always meets an owned cluster
+    size_t count;
+    fileClusters(volume, start, defrag->scratch, volume->clusterCount - defrag->chainsUsed + 1, &count);
+    if (count == 0)
+    {
+        fprintf(stderr, "Entry with a bad first cluster (%u), run check first\n", start);
+        return -1;
+    }
+    size_t index = defrag->objectCount;
+    for (size_t p = 0; p < count; p++)
+    {
+        uint16_t cluster = (uint16_t)defrag->scratch[p];
+        if (defrag->owner[cluster] != 0)
+        {
+            fprintf(stderr, "Cluster %u is in two chains or a loop, run check first\n", cluster);
+            return -1;
+        }
+        defrag->owner[cluster] = (uint32_t)index + 1;
+        defrag->chains[defrag->chainsUsed + p] = cluster;
+    }
+    uint16_t last = (uint16_t)defrag->scratch[count - 1];
+    if (volume->fat[last] < 0xFFF8)
+    {
+        fprintf(stderr, "Chain from cluster %u does not end properly, run check first\n", start);
+        return -1;
+    }
+
+    DefragObject *object = &defrag->objects[defrag->objectCount++];
+    memset(object, 0, sizeof(DefragObject));
+    object->chain = defrag->chainsUsed;
+    object->length = count;
+    object->parent = parent;
+    object->slot = slot;
+    object->firstChild = SIZE_MAX;
+    object->nextSibling = SIZE_MAX;
+    object->directory = (entry->DIR_Attr & 0x10) != 0;
+    if (object->directory && parent != SIZE_MAX)
+    {
+        object->nextSibling = defrag->objects[parent].firstChild;
+        defrag->objects[parent].firstChild = index;
+    }
+    defrag->chainsUsed += count;
+    return 0;
+}
+
+//every file and directory with clusters, depth first in directory order
+//this is the order walkVolume (and so extract and hash) reads them in
+static int defragScan(Defrag *defrag)
+{
+    Volume *volume = defrag->volume;
+    size_t capacity = 16;
+    size_t depth = 0;
+    //directory object and next slot of every open directory
+    size_t (*stack)[2] = malloc(capacity * sizeof(*stack));
+    if (stack == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    stack[depth][0] = SIZE_MAX;
+    stack[depth++][1] = 0;
+
+    int status = 0;
+    while (depth > 0 && status == 0)
+    {
+        size_t directory = stack[depth - 1][0];
+        size_t slot = stack[depth - 1][1]++;
+        const DirectoryEntry *entry = directorySlot(volume, defragDirectory(defrag, directory), slot);
+        if (entry == NULL || entry->DIR_Name[0] == 0x00)
+        {
+            depth--;
+            continue;
+        }
+        //deleted, long name parts, volume label, "." and ".."
+        if (entry->DIR_Name[0] == 0xE5 || (entry->DIR_Attr & 0x0F) == 0x0F || (entry->DIR_Attr & 0x08) || entry->DIR_Name[0] == '.')
+        {
+            continue;
+        }
+        //empty files have no chain
+        if (entry->DIR_FstClusLO == 0 && !(entry->DIR_Attr & 0x10))
+        {
+            continue;
+        }
+        status = defragAdd(defrag, directory, slot, entry);
+        if (status == 0 && defrag->objects[defrag->objectCount - 1].directory)
+        {
+            if (depth == capacity)
+            {
+                size_t (*grown)[2] = realloc(stack, capacity * 2 * sizeof(*stack));
+                if (grown == NULL)
+                {
+                    perror("Error allocating memory");
+                    status = -1;
+                    break;
+                }
+                stack = grown;
+                capacity *= 2;
+            }
+            stack[depth][0] = defrag->objectCount - 1;
+            stack[depth++][1] = 0;
+        }
+    }
+    free(stack);
+    //nothing changed, the buffers are only taking memory
+    dropDirectoryBuffers(volume);
+    return status;
+}
+
+//give every object one run, in order from cluster 2, around clusters that stay put
+static int defragPlan(Defrag *defrag)
+{
+    size_t cursor = 2;
+    for (size_t o = 0; o < defrag->objectCount; o++)
+    {
+        DefragObject *object = &defrag->objects[o];
+        size_t start = cursor;
+        for (size_t c = start; c < start + object->length && c < defrag->end; c++)
+        {
+            if (defrag->owner[c] == DEFRAG_FIXED)
+            {
+                start = c + 1;
+            }
+        }
+        if (start + object->length > defrag->end)
+        {
+            fprintf(stderr, "No contiguous room left around clusters of no file, run check first\n");
+            return -1;
+        }
+        object->target = (uint16_t)start;
+        cursor = start + object->length;
+
+        const uint16_t *chain = defragChain(defrag, o);
+        int contiguous = 1;
+        size_t misplaced = 0;
+        for (size_t p = 0; p < object->length; p++)
+        {
+            contiguous &= p == 0 || chain[p] == chain[p - 1] + 1;
+            misplaced += chain[p] != start + p;
+        }
+        defrag->report->fragmented += !contiguous;
+        defrag->report->outOfPlace += misplaced;
+        defrag->report->placed += misplaced == 0;
+    }
+    return 0;
+}
+
+//make the writes so far durable before the next step depends on them
+static int defragSync(Defrag *defrag)
+{
+    int fdesc = defrag->volume->backend->fdesc;
+    if (fdesc != -1 && fsync(fdesc) == -1)
+    {
+        perror("Error syncing the image");
+        return -1;
+    }
+    return 0;
+}
+
+static int compareCopies(const void *a, const void *b)
+{
+    const DefragCopy *left = a;
+    const DefragCopy *right = b;
+    return (left->to > right->to) - (left->to < right->to);
+}
+
+//copy the clusters of every move to their new places, in order of destination
+//runs of destinations are filled with one read per run of sources, then written at once
+static int defragCopy(Defrag *defrag, DefragCopy *copies, size_t count)
+{
+    Volume *volume = defrag->volume;
+    Backend *backend = volume->backend;
+    size_t clusterSize = volume->clusterSize;
+    qsort(copies, count, sizeof(DefragCopy), compareCopies);
+
+    for (size_t i = 0; i < count; )
+    {
+        size_t end = i + 1;
+        while (end < count && end - i < defrag->stagingClusters && copies[end].to == copies[end - 1].to + 1)
+        {
+            end++;
+        }
+        for (size_t r = i; r < end; )
+        {
+            size_t s = r + 1;
+            while (s < end && copies[s].from == copies[s - 1].from + 1)
+            {
+                s++;
+            }
+            size_t length = (s - r) * clusterSize;
+            if (backend->read(backend, defrag->staging + (r - i) * clusterSize, length, clusterOffset(volume, copies[r].from)) != (ssize_t)length)
+            {
+                perror("Error reading clusters to move");
+                return -1;
+            }
+            r = s;
+        }
+        for (size_t r = i; r < end; r++)
+        {
+            DirectoryEntry *dot = (DirectoryEntry *)(defrag->staging + (r - i) * clusterSize);
+            if (copies[r].dot && memcmp(dot->DIR_Name, ".          ", 11) == 0)
+            {
+                dot->DIR_FstClusLO = copies[r].to;
+            }
+        }
+        size_t length = (end - i) * clusterSize;
+        if (backend->write(backend, defrag->staging, length, clusterOffset(volume, copies[i].to)) != (ssize_t)length)
+        {
+            perror("Error writing moved clusters");
+            return -1;
+        }
+        i = end;
+    }
+    return 0;
+}
+
+//write the batch; each step is synced before the next one, so a crash at any point
+//leaves every chain readable, with at worst lost clusters for check to report:
+//1. copy the data to free clusters
+//2. FAT entries of the new clusters (nothing points at them yet)
+//3. switch: kept clusters, directory entries and ".." point at the new clusters; any mix of
+//   old and new links is still a whole chain, every copy holds the same data
+//4. free the old clusters
+static int defragFlush(Defrag *defrag)
+{
+    Volume *volume = defrag->volume;
+    if (defrag->moveCount == 0)
+    {
+        return 0;
+    }
+
+    DefragCopy *copies = malloc((defrag->batchClusters + 1) * sizeof(DefragCopy));
+    if (copies == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    size_t count = 0;
+    for (size_t m = 0; m < defrag->moveCount; m++)
+    {
+        const DefragObject *object = &defrag->objects[defrag->moves[m].object];
+        const uint16_t *previous = defrag->moves[m].previous;
+        const uint16_t *chain = defragChain(defrag, defrag->moves[m].object);
+        for (size_t p = 0; p < object->length; p++)
+        {
+            if (chain[p] != previous[p])
+            {
+                copies[count++] = (DefragCopy){ previous[p], chain[p], object->directory && p == 0 };
+            }
+        }
+    }
+    int status = defragCopy(defrag, copies, count);
+    free(copies);
+    if (status == -1 || defragSync(defrag) == -1)
+    {
+        return -1;
+    }
+
+    for (size_t m = 0; m < defrag->moveCount; m++)
+    {
+        const DefragObject *object = &defrag->objects[defrag->moves[m].object];
+        const uint16_t *previous = defrag->moves[m].previous;
+        const uint16_t *chain = defragChain(defrag, defrag->moves[m].object);
+        for (size_t p = 0; p < object->length; p++)
+        {
+            if (chain[p] != previous[p])
+            {
+                setFatEntry(volume, chain[p], p + 1 < object->length ? chain[p + 1] : END_OF_CHAIN);
+            }
+        }
+    }
+    if (flushVolume(volume) == -1 || defragSync(defrag) == -1)
+    {
+        return -1;
+    }
+
+    for (size_t m = 0; m < defrag->moveCount; m++)
+    {
+        size_t index = defrag->moves[m].object;
+        const DefragObject *object = &defrag->objects[index];
+        const uint16_t *previous = defrag->moves[m].previous;
+        const uint16_t *chain = defragChain(defrag, index);
+        for (size_t p = 0; p + 1 < object->length; p++)
+        {
+            if (chain[p] == previous[p] && chain[p + 1] != previous[p + 1])
+            {
+                setFatEntry(volume, chain[p], chain[p + 1]);
+            }
+        }
+        if (chain[0] == previous[0])
+        {
+            continue;
+        }
+        //the parent is not in this batch, its chain is the one in the FAT
+        uint16_t parent = defragDirectory(defrag, object->parent);
+        DirectoryEntry *entry = directorySlot(volume, parent, object->slot);
+        if (entry == NULL)
+        {
+            fprintf(stderr, "Error reading directory\n");
+            return -1;
+        }
+        entry->DIR_FstClusLO = chain[0];
+        touchSlot(volume, parent, object->slot);
+        for (size_t child = object->firstChild; child != SIZE_MAX; child = defrag->objects[child].nextSibling)
+        {
+            uint16_t directory = defragDirectory(defrag, child);
+            DirectoryEntry *dotDot = directorySlot(volume, directory, 1);
+            if (dotDot != NULL && memcmp(dotDot->DIR_Name, "..         ", 11) == 0)
+            {
+                dotDot->DIR_FstClusLO = chain[0];
+                touchSlot(volume, directory, 1);
+            }
+        }
+    }
+    if (flushVolume(volume) == -1 || defragSync(defrag) == -1)
+    {
+        return -1;
+    }
+
+    for (size_t m = 0; m < defrag->moveCount; m++)
+    {
+        size_t index = defrag->moves[m].object;
+        const uint16_t *previous = defrag->moves[m].previous;
+        const uint16_t *chain = defragChain(defrag, index);
+        for (size_t p = 0; p < defrag->objects[index].length; p++)
+        {
+            if (chain[p] != previous[p])
+            {
+                setFatEntry(volume, previous[p], 0);
+                defrag->pending[previous[p]] = 0;
+            }
+        }
+        defrag->objects[index].queued = 0;
+        free(defrag->moves[m].previous);
+    }
+    if (flushVolume(volume) == -1)
+    {
+        return -1;
+    }
+    dropDirectoryBuffers(volume);
+
+    defrag->report->moves += defrag->moveCount;
+    defrag->report->clustersCopied += count;
+    defrag->report->batches++;
+    defrag->moveCount = 0;
+    defrag->batchClusters = 0;
+    defrag->spare = defrag->end - 1;
+    return 0;
+}
+
+//moving an object next to its parent or a subdirectory in one batch would have the
+//switch step write into a directory that is being copied
+static int defragConflict(Defrag *defrag, size_t index)
+{
+    const DefragObject *object = &defrag->objects[index];
+    if (object->queued || (object->parent != SIZE_MAX && defrag->objects[object->parent].queued))
+    {
+        return 1;
+    }
+    for (size_t child = object->firstChild; child != SIZE_MAX; child = defrag->objects[child].nextSibling)
+    {
+        if (defrag->objects[child].queued)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//add a new chain for an object to the batch; where it differs, the clusters must be free
+static int defragQueue(Defrag *defrag, size_t index, const uint16_t *chain)
+{
+    DefragObject *object = &defrag->objects[index];
+    uint16_t *current = defragChain(defrag, index);
+    DefragMove *move = &defrag->moves[defrag->moveCount];
+    move->object = index;
+    move->previous = malloc(object->length * sizeof(uint16_t));
+    if (move->previous == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    memcpy(move->previous, current, object->length * sizeof(uint16_t));
+    defrag->moveCount++;
+    object->queued = 1;
+
+    for (size_t p = 0; p < object->length; p++)
+    {
+        if (chain[p] != current[p])
+        {
+            defrag->owner[current[p]] = 0;
+            defrag->pending[current[p]] = 1;
+            defrag->owner[chain[p]] = (uint32_t)index + 1;
+            defrag->batchClusters++;
+        }
+    }
+    memcpy(current, chain, object->length * sizeof(uint16_t));
+    return 0;
+}
+
+//move the clusters of an object that lie in first..limit-1 (and are not already where the
+//layout wants them) to free clusters above limit
+static int defragEvict(Defrag *defrag, size_t index, size_t first, size_t limit, uint16_t *chain)
+{
+    DefragObject *object = &defrag->objects[index];
+    if (defragConflict(defrag, index) && defragFlush(defrag) == -1)
+    {
+        return -1;
+    }
+
+    for (int attempt = 0; ; attempt++)
+    {
+        memcpy(chain, defragChain(defrag, index), object->length * sizeof(uint16_t));
+        size_t needed = 0;
+        for (size_t p = 0; p < object->length; p++)
+        {
+            needed += chain[p] >= first && chain[p] < limit && chain[p] != object->target + p;
+        }
+        //free clusters from the top down, handed out in ascending order so the copies stay runs
+        size_t found = 0;
+        size_t c = defrag->spare;
+        for (; c >= limit && found < needed; c--)
+        {
+            found += defrag->owner[c] == 0 && !defrag->pending[c];
+        }
+        if (found == needed)
+        {
+            defrag->spare = c;
+            size_t next = c + 1;
+            for (size_t p = 0; p < object->length; p++)
+            {
+                if (chain[p] >= first && chain[p] < limit && chain[p] != object->target + p)
+                {
+                    while (defrag->owner[next] != 0 || defrag->pending[next])
+                    {
+                        next++;
+                    }
+                    chain[p] = (uint16_t)next++;
+                }
+            }
+            return defragQueue(defrag, index, chain);
+        }
+        //clusters freed by the batch become usable once it is written
+        if (attempt > 0 || defrag->moveCount == 0)
+        {
+            fprintf(stderr, "Not enough free clusters to move chains out of the way\n");
+            return -1;
+        }
+        if (defragFlush(defrag) == -1)
+        {
+            return -1;
+        }
+    }
+}
+
+//put one object in its planned run
+static int defragPlace(Defrag *defrag, size_t index, uint16_t *chain)
+{
+    DefragObject *object = &defrag->objects[index];
+    size_t first = object->target;
+    size_t limit = first + object->length;
+
+    //empty the run: other chains, and clusters of this one at the wrong position
+    for (size_t c = first; c < limit; c++)
+    {
+        uint32_t owner = defrag->owner[c];
+        if (owner == 0 || (owner == index + 1 && defragChain(defrag, index)[c - first] == c))
+        {
+            continue;
+        }
+        if (defragEvict(defrag, owner - 1, first, limit, chain) == -1)
+        {
+            return -1;
+        }
+    }
+
+    int waiting = defragConflict(defrag, index);
+    for (size_t c = first; c < limit && !waiting; c++)
+    {
+        waiting = defrag->pending[c];
+    }
+    if (waiting && defragFlush(defrag) == -1)
+    {
+        return -1;
+    }
+    for (size_t p = 0; p < object->length; p++)
+    {
+        chain[p] = (uint16_t)(first + p);
+    }
+    if (defragQueue(defrag, index, chain) == -1)
+    {
+        return -1;
+    }
+    return defrag->batchClusters >= defrag->stagingClusters ? defragFlush(defrag) : 0;
+}
+
+static void freeDefrag(Defrag *defrag)
+{
+    for (size_t m = 0; m < defrag->moveCount; m++)
+    {
+        free(defrag->moves[m].previous);
+    }
+    free(defrag->moves);
+    free(defrag->objects);
+    free(defrag->chains);
+    free(defrag->scratch);
+    free(defrag->owner);
+    free(defrag->pending);
+    free(defrag->staging);
+}
+
+//rewrite a volume open for writing so every file and directory is one run, packed from
+//cluster 2 in walk order; clusters in use by no file stay where they are
+//a volume without fragmented chains is left alone
+//data moves through a staging buffer of stagingBytes; planOnly fills in the report only
+//returns 0 on success, -1 if the image is damaged, full, or a step failed (what was
+//written until then is consistent)
+int defragVolume(Volume *volume, size_t stagingBytes, int planOnly, DefragReport *report)
+{
+    if (volume->writer == NULL)
+    {
+        fprintf(stderr, "Volume is open read only\n");
+        return -1;
+    }
+    memset(report, 0, sizeof(DefragReport));
+    Defrag defrag = { 0 };
+    defrag.volume = volume;
+    defrag.end = volume->clusterCount + 2;
+    defrag.report = report;
+    defrag.spare = defrag.end - 1;
+    defrag.stagingClusters = stagingBytes / volume->clusterSize;
+    if (defrag.stagingClusters == 0)
+    {
+        defrag.stagingClusters = 1;
+    }
+    defrag.chains = malloc((volume->clusterCount + 1) * sizeof(uint16_t));
+    defrag.scratch = malloc((volume->clusterCount + 1) * sizeof(size_t));
+    defrag.owner = calloc(defrag.end, sizeof(uint32_t));
+    defrag.pending = calloc(defrag.end, 1);
+    if (defrag.chains == NULL || defrag.scratch == NULL || defrag.owner == NULL || defrag.pending == NULL)
+    {
+        perror("Error allocating memory");
+        freeDefrag(&defrag);
+        return -1;
+    }
+
+    int status = defragScan(&defrag);
+    for (size_t c = 2; c < defrag.end && status == 0; c++)
+    {
+        if (volume->fat[c] != 0 && defrag.owner[c] == 0)
+        {
+            defrag.owner[c] = DEFRAG_FIXED;
+        }
+    }
+    if (status == 0)
+    {
+        status = defragPlan(&defrag);
+    }
+    report->objects = defrag.objectCount;
+    //packing chains that are already runs would only reorder them
+    if (status == -1 || planOnly || report->fragmented == 0)
+    {
+        freeDefrag(&defrag);
+        return status;
+    }
+
+    uint16_t *chain = malloc((volume->clusterCount + 1) * sizeof(uint16_t));
+    defrag.moves = malloc((defrag.objectCount + 1) * sizeof(DefragMove));
+    defrag.staging = malloc(defrag.stagingClusters * volume->clusterSize);
+    if (chain == NULL || defrag.moves == NULL || defrag.staging == NULL)
+    {
+        perror("Error allocating memory");
+        status = -1;
+    }
+    for (size_t o = 0; o < defrag.objectCount && status == 0; o++)
+    {
+        const uint16_t *current = defragChain(&defrag, o);
+        size_t p = 0;
+        while (p < defrag.objects[o].length && current[p] == defrag.objects[o].target + p)
+        {
+            p++;
+        }
+        if (p < defrag.objects[o].length)
+        {
+            status = defragPlace(&defrag, o, chain);
+        }
+    }
+    if (status == 0)
+    {
+        status = defragFlush(&defrag);
+    }
+    if (status == 0)
+    {
+        //new chains are allocated after the packed data
+        volume->writer->nextFree = 2;
+        status = defragSync(&defrag);
+    }
+    free(chain);
+    freeDefrag(&defrag);
+    return status;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        PACK
+/////////////////////////////////////////////////////////////*/
+
+//default image bytes per container chunk
+#define PACK_CHUNK (64u << 10)
+
+//what pack wrote
+typedef struct {
+    uint32_t chunks;
+    uint32_t zero;  // nothing stored
+    uint32_t raw;
+    uint32_t deflated;
+    uint64_t imageBytes;
+    uint64_t storedBytes;  // size of the container
+} PackReport;
+
+//clear the bytes of free clusters inside one chunk of the image
+static void zeroFreeClusters(const Volume *volume, uint8_t *data, uint64_t start, size_t length)
+{
+    uint64_t dataEnd = volume->dataOffset + (uint64_t)volume->clusterCount * volume->clusterSize;
+    uint64_t from = start > (uint64_t)volume->dataOffset ? start : (uint64_t)volume->dataOffset;
+    uint64_t to = start + length < dataEnd ? start + length : dataEnd;
+    while (from < to)
+    {
+        size_t cluster = 2 + (from - volume->dataOffset) / volume->clusterSize;
+        uint64_t clusterEnd = clusterOffset(volume, (uint32_t)cluster) + volume->clusterSize;
+        uint64_t end = clusterEnd < to ? clusterEnd : to;
+        if (fatEntry(volume, cluster) == 0)
+        {
+            memset(data + (from - start), 0, end - from);
+        }
+        from = end;
+    }
+}
+
+//write the image of a volume as a container of chunkSize chunks (see openContainer)
+//free clusters are stored as zeros unless keepFree (undelete needs what they hold), so
+//chunks of free space take no room and readers skip them using the FAT
+//chunks are deflated at level when built with zlib and it saves space, stored raw otherwise
+int packImage(Volume *volume, const char *output, size_t chunkSize, int level, int keepFree, PackReport *report)
+{
+    memset(report, 0, sizeof(PackReport));
+    if (chunkSize == 0 || chunkSize > UINT32_MAX)
+    {
+        fprintf(stderr, "Bad chunk size\n");
+        return -1;
+    }
+    uint64_t imageSize = volume->imageSize;
+    size_t chunkCount = (imageSize + chunkSize - 1) / chunkSize;
+    if (chunkCount > UINT32_MAX)
+    {
+        fprintf(stderr, "Too many chunks, use larger ones\n");
+        return -1;
+    }
+
+    int fdesc = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fdesc == -1)
+    {
+        perror("Unable to create container");
+        return -1;
+    }
+    ContainerChunk *chunks = calloc(chunkCount + 1, sizeof(ContainerChunk));
+    uint8_t *data = malloc(chunkSize);
+#ifdef HAVE_ZLIB
+    uLong bound = compressBound(chunkSize);
+    uint8_t *packed = malloc(bound);
+#else
+    (void)level;
+    uint8_t *packed = data;
+#endif
+    int status = chunks != NULL && data != NULL && packed != NULL ? 0 : -1;
+    if (status == -1)
+    {
+        perror("Error allocating memory");
+    }
+
+    uint64_t position = sizeof(ContainerHeader);
+    for (size_t c = 0; c < chunkCount && status == 0; c++)
+    {
+        uint64_t start = (uint64_t)c * chunkSize;
+        size_t length = imageSize - start < chunkSize ? (size_t)(imageSize - start) : chunkSize;
+        if (volume->backend->read(volume->backend, data, length, start) != (ssize_t)length)
+        {
+            perror("Error reading disk image");
+            status = -1;
+            break;
+        }
+        if (!keepFree)
+        {
+            zeroFreeClusters(volume, data, start, length);
+        }
+
+        ContainerChunk *chunk = &chunks[c];
+        if (data[0] == 0 && memcmp(data, data + 1, length - 1) == 0)
+        {
+            chunk->method = CHUNK_ZERO;
+            report->zero++;
+            continue;
+        }
+        const uint8_t *stored = data;
+        size_t storedLength = length;
+        chunk->method = CHUNK_RAW;
+#ifdef HAVE_ZLIB
+        uLongf packedLength = bound;
+        if (compress2(packed, &packedLength, data, length, level) == Z_OK && packedLength < length)
+        {
+            stored = packed;
+            storedLength = packedLength;
+            chunk->method = CHUNK_DEFLATE;
+        }
+#endif
+        report->raw += chunk->method == CHUNK_RAW;
+        report->deflated += chunk->method == CHUNK_DEFLATE;
+        chunk->offset = position;
+        chunk->length = (uint32_t)storedLength;
+        if (pwriteFull(fdesc, stored, storedLength, position) != (ssize_t)storedLength)
+        {
+            perror("Error writing container");
+            status = -1;
+        }
+        position += storedLength;
+    }
+
+    //index last, then the header that points at it
+    ContainerHeader header = { { 0 }, CONTAINER_VERSION, (uint32_t)chunkSize, imageSize, position, (uint32_t)chunkCount, keepFree ? 0 : CONTAINER_FREE_ZEROED };
+    memcpy(header.magic, CONTAINER_MAGIC, sizeof(header.magic));
+    size_t indexBytes = chunkCount * sizeof(ContainerChunk);
+    if (status == 0 && (pwriteFull(fdesc, chunks, indexBytes, position) != (ssize_t)indexBytes ||
+                        pwriteFull(fdesc, &header, sizeof(header), 0) != sizeof(header)))
+    {
+        perror("Error writing container");
+        status = -1;
+    }
+    if (close(fdesc) == -1 && status == 0)
+    {
+        perror("Error writing container");
+        status = -1;
+    }
+    if (status == -1)
+    {
+        unlink(output);
+    }
+
+    report->chunks = (uint32_t)chunkCount;
+    report->imageBytes = imageSize;
+    report->storedBytes = position + indexBytes;
+#ifdef HAVE_ZLIB
+    free(packed);
+#endif
+    free(data);
+    free(chunks);
+    return status;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        WORK POOL
+/////////////////////////////////////////////////////////////*/
+
+//task callback: task index and the worker running it
+typedef void (*TaskFunction)(void *context, size_t task, int worker);
+
+//tasks still owned by one worker, [next, end)
+//the owner takes from the front, thieves take half from the back
+typedef struct {
+    pthread_mutex_t lock;
+    size_t next;
+    size_t end;
+} WorkRange;
+
+typedef struct {
+    WorkRange *ranges;
+    int workers;
+    TaskFunction run;
+    void *context;
+    FILE *diagnostics;  // the caller's, for the workers' messages
+} WorkPool;
+
+typedef struct {
+    WorkPool *pool;
+    int worker;
+} WorkerArgs;
+
+//take the next task of a worker's own range
+static int takeTask(WorkRange *range, size_t *task)
+{
+    int taken = 0;
+    pthread_mutex_lock(&range->lock);
+    if (range->next < range->end)
+    {
+        *task = range->next++;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&range->lock);
+    return taken;
+}
+
+//move half of the tasks left in another worker's range into our own
+static int stealTasks(WorkPool *pool, int worker)
+{
+    for (int i = 1; i < pool->workers; i++)
+    {
+        WorkRange *victim = &pool->ranges[(worker + i) % pool->workers];
+        size_t first = 0;
+        size_t last = 0;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->next < victim->end)
+        {
+            size_t left = victim->end - victim->next;
+            last = victim->end;
+            first = victim->end - (left + 1) / 2;
+            victim->end = first;
+        }
+        pthread_mutex_unlock(&victim->lock);
+
+        if (first < last)
+        {
+            WorkRange *own = &pool->ranges[worker];
+            pthread_mutex_lock(&own->lock);
+            own->next = first;
+            own->end = last;
+            pthread_mutex_unlock(&own->lock);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *workerMain(void *argument)
+{
+    WorkerArgs *args = argument;
+    WorkPool *pool = args->pool;
+    size_t task;
+    threadDiagnostics = pool->diagnostics;
+
+    //tasks never create tasks, so nothing to steal means we are done
+    do
+    {
+        while (takeTask(&pool->ranges[args->worker], &task))
+        {
+            pool->run(pool->context, task, args->worker);
+        }
+    } while (stealTasks(pool, args->worker));
+
+    return NULL;
+}
+
+//number of workers to use when none is requested
+int defaultWorkers(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+//run tasks 0..count-1 on workers threads with work stealing
+//each worker starts with an equal contiguous share of the indices
+void runWorkPool(size_t count, int workers, TaskFunction run, void *context)
+{
+    if (workers < 1)
+    {
+        workers = 1;
+    }
+    if ((size_t)workers > count)
+    {
+        workers = count > 0 ? (int)count : 1;
+    }
+
+    WorkPool pool = { NULL, workers, run, context, threadDiagnostics };
+    pool.ranges = calloc(workers, sizeof(WorkRange));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    WorkerArgs *args = calloc(workers, sizeof(WorkerArgs));
+    if (pool.ranges == NULL || threads == NULL || args == NULL)
+    {
+        //no memory for a pool, run everything here
+        for (size_t task = 0; task < count; task++)
+        {
+            run(context, task, 0);
+        }
+        free(pool.ranges);
+        free(threads);
+        free(args);
+        return;
+    }
+
+    for (int w = 0; w < workers; w++)
+    {
+        pthread_mutex_init(&pool.ranges[w].lock, NULL);
+        pool.ranges[w].next = count * w / workers;
+        pool.ranges[w].end = count * (w + 1) / workers;
+        args[w].pool = &pool;
+        args[w].worker = w;
+    }
+
+    //worker 0 is the calling thread
+    int started = 1;
+    for (int w = 1; w < workers; w++)
+    {
+        if (pthread_create(&threads[w], NULL, workerMain, &args[w]) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+    //workers that failed to start are drained by stealing
+    workerMain(&args[0]);
+    for (int w = 1; w < started; w++)
+    {
+        pthread_join(threads[w], NULL);
+    }
+    //ranges of workers that never started
+    for (int w = started; w < workers; w++)
+    {
+        size_t task;
+        while (takeTask(&pool.ranges[w], &task))
+        {
+            run(context, task, 0);
+        }
+    }
+
+    for (int w = 0; w < workers; w++)
+    {
+        pthread_mutex_destroy(&pool.ranges[w].lock);
+    }
+    free(pool.ranges);
+    free(threads);
+    free(args);
+}
+
+/*/////////////////////////////////////////////////////////////
+                        EXTRACT
+/////////////////////////////////////////////////////////////*/
+
+//files larger than this are split so one huge file is shared by several workers
+#define EXTRACT_CHUNK (16u << 20)
+//per worker copy buffer
+#define EXTRACT_BUFFER (1u << 20)
+
+//one file selected for extraction
+typedef struct {
+    DirectoryEntry entry;
+    char *path;  // host path
+} ExtractFile;
+
+//a byte range of one file, the unit of work
+typedef struct {
+    size_t file;
+    uint64_t offset;
+    uint64_t length;
+} ExtractTask;
+
+typedef struct {
+    Volume *volume;
+    ExtractFile *files;
+    ExtractTask *tasks;
+    uint8_t **buffers;  // one per worker
+    atomic_int failures;
+} Extraction;
+
+//copy one byte range of a file to the host file
+static void extractTask(void *context, size_t index, int worker)
+{
+    Extraction *job = context;
+    ExtractTask *task = &job->tasks[index];
+    ExtractFile *target = &job->files[task->file];
+    uint8_t *buffer = job->buffers[worker];
+
+    int out = open(target->path, O_WRONLY);
+    if (out == -1)
+    {
+        perror(target->path);
+        atomic_fetch_add(&job->failures, 1);
+        return;
+    }
+
+    File *file = openEntry(job->volume, &target->entry);
+    if (file == NULL || seekFile(file, task->offset, SEEK_SET) == -1)
+    {
+        if (file != NULL)
+        {
+            closeFile(file);
+        }
+        close(out);
+        atomic_fetch_add(&job->failures, 1);
+        return;
+    }
+
+    uint64_t done = 0;
+    while (done < task->length)
+    {
+        size_t want = task->length - done < EXTRACT_BUFFER ? task->length - done : EXTRACT_BUFFER;
+        size_t reading = readFile(file, buffer, want);
+        if (reading == 0)
+        {
+            fprintf(stderr, "Cluster chain of %s is shorter than its size\n", target->path);
+            atomic_fetch_add(&job->failures, 1);
+            break;
+        }
+
+        size_t written = 0;
+        while (written < reading)
+        {
+            ssize_t writing = pwrite(out, buffer + written, reading - written, task->offset + done + written);
+            if (writing == -1)
+            {
+                perror(target->path);
+                atomic_fetch_add(&job->failures, 1);
+                closeFile(file);
+                close(out);
+                return;
+            }
+            written += writing;
+        }
+        done += reading;
+    }
+
+    closeFile(file);
+    close(out);
+}
+
+//larger tasks first
+static int compareTasks(const void *a, const void *b)
+{
+    const ExtractTask *left = a;
+    const ExtractTask *right = b;
+    if (left->length != right->length)
+    {
+        return left->length < right->length ? 1 : -1;
+    }
+    return 0;
+}
+
+//files picked by the walk
+typedef struct {
+    const char *outDir;
+    char **patterns;
+    int patternCount;
+    ExtractFile *files;
+    size_t count;
+    size_t capacity;
+    size_t taskCount;
+    int failures;
+    char root[4096];  // outDir resolved, every host directory must stay below it
+    char lastDir[4096];  // last host directory known to exist
+} ExtractSelection;
+
+//host path of an image path below outDir, NULL when out of memory
+//names come from the image and are not trusted: an empty, "." or ".." name would leave
+//outDir or collapse into its parent, and '\\' separates names on some hosts, so those are renamed
+static char *hostPath(const char *outDir, const char *path)
+{
+    size_t outLength = strlen(outDir);
+    //an empty name takes one byte more than it had
+    size_t size = outLength + 2 * strlen(path) + 3;
+    char *host = malloc(size);
+    if (host == NULL)
+    {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    memcpy(host, outDir, outLength);
+    char *out = host + outLength;
+    const char *name = path;
+    for (;;)
+    {
+        const char *slash = strchr(name, '/');
+        size_t length = slash != NULL ? (size_t)(slash - name) : strlen(name);
+        *out++ = '/';
+        if (length == 0 || (name[0] == '.' && (length == 1 || (length == 2 && name[1] == '.'))))
+        {
+            //"" and "." become "_", ".." becomes "__"
+            size_t renamed = length > 0 ? length : 1;
+            memset(out, '_', renamed);
+            out += renamed;
+        }
+        else
+        {
+            for (size_t c = 0; c < length; c++)
+            {
+                *out++ = name[c] == '\\' ? '_' : name[c];
+            }
+        }
+        if (slash == NULL)
+        {
+            break;
+        }
+        name = slash + 1;
+    }
+    *out = '\0';
+    return host;
+}
+
+//remember where outDir really is, -1 if it cannot be resolved
+static int setExtractRoot(ExtractSelection *selection, const char *outDir)
+{
+    if (realpath(outDir, selection->root) == NULL)
+    {
+        perror(outDir);
+        return -1;
+    }
+    return 0;
+}
+
+//create every missing directory above a host path
+static int makeParents(ExtractSelection *selection, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    size_t length = slash != NULL ? (size_t)(slash - path) : 0;
+    if (length == 0)
+    {
+        return 0;
+    }
+    if (length >= sizeof(selection->lastDir))
+    {
+        fprintf(stderr, "Path too long: %s\n", path);
+        return -1;
+    }
+    //files of one directory come one after another
+    if (strncmp(selection->lastDir, path, length) == 0 && selection->lastDir[length] == '\0')
+    {
+        return 0;
+    }
+
+    char directory[4096];
+    memcpy(directory, path, length);
+    directory[length] = '\0';
+    for (char *next = directory + 1; ; next++)
+    {
+        if (*next == '/' || *next == '\0')
+        {
+            char saved = *next;
+            *next = '\0';
+            if (mkdir(directory, 0777) == -1 && errno != EEXIST)
+            {
+                perror(directory);
+                return -1;
+            }
+            *next = saved;
+            if (saved == '\0')
+            {
+                break;
+            }
+        }
+    }
+
+    //a directory reached through a link must not take files out of the output directory
+    char resolved[4096];
+    size_t rootLength = strlen(selection->root);
+    if (realpath(directory, resolved) == NULL)
+    {
+        perror(directory);
+        return -1;
+    }
+    if (strncmp(resolved, selection->root, rootLength) != 0 ||
+        (rootLength > 1 && resolved[rootLength] != '/' && resolved[rootLength] != '\0'))
+    {
+        fprintf(stderr, "%s: outside the output directory\n", directory);
+        return -1;
+    }
+    memcpy(selection->lastDir, directory, length + 1);
+    return 0;
+}
+
+//walk callback: select a file and create it at its final size
+static int selectForExtract(void *context, const WalkEntry *item)
+{
+    ExtractSelection *selection = context;
+    const DirectoryEntry *entry = item->entry;
+
+    //directories are created as files below them are extracted
+    if (entry->DIR_Attr & 0x10)
+    {
+        return 0;
+    }
+
+    //patterns match the whole path or the file name
+    const char *slash = strrchr(item->path, '/');
+    const char *name = slash != NULL ? slash + 1 : item->path;
+    int selected = selection->patternCount == 0;
+    for (int p = 0; p < selection->patternCount && !selected; p++)
+    {
+        selected = fnmatch(selection->patterns[p], item->path, FNM_CASEFOLD) == 0 || fnmatch(selection->patterns[p], name, FNM_CASEFOLD) == 0;
+    }
+    if (!selected)
+    {
+        return 0;
+    }
+
+    if (selection->count == selection->capacity)
+    {
+        size_t capacity = selection->capacity ? selection->capacity * 2 : 64;
+        ExtractFile *grown = realloc(selection->files, capacity * sizeof(ExtractFile));
+        if (grown == NULL)
+        {
+            perror("Error allocating memory");
+            return -1;
+        }
+        selection->files = grown;
+        selection->capacity = capacity;
+    }
+
+    char *path = hostPath(selection->outDir, item->path);
+    if (path == NULL)
+    {
+        return -1;
+    }
+
+    //makeParents reports its own errors
+    if (makeParents(selection, path) == -1)
+    {
+        free(path);
+        selection->failures++;
+        return 0;
+    }
+    int out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0666);
+    if (out == -1 || ftruncate(out, entry->DIR_FileSize) == -1)
+    {
+        perror(path);
+        if (out != -1)
+        {
+            close(out);
+        }
+        free(path);
+        selection->failures++;
+        return 0;
+    }
+    close(out);
+
+    ExtractFile *target = &selection->files[selection->count++];
+    target->entry = *entry;
+    target->path = path;
+    selection->taskCount += (entry->DIR_FileSize + EXTRACT_CHUNK - 1) / EXTRACT_CHUNK;
+    return 0;
+}
+
+//extract every file matching one of patterns (all if none) into outDir, keeping the directory tree
+//returns the number of files that failed
+int extractFiles(Volume *volume, const char *outDir, char **patterns, int patternCount, int workers)
+{
+    if (mkdir(outDir, 0777) == -1 && errno != EEXIST)
+    {
+        perror(outDir);
+        return -1;
+    }
+
+    //select files and create them at their final size
+    ExtractSelection selection;
+    memset(&selection, 0, sizeof(selection));
+    selection.outDir = outDir;
+    selection.patterns = patterns;
+    selection.patternCount = patternCount;
+    if (setExtractRoot(&selection, outDir) == -1)
+    {
+        return -1;
+    }
+    if (walkVolume(volume, selectForExtract, &selection) != 0)
+    {
+        for (size_t f = 0; f < selection.count; f++)
+        {
+            free(selection.files[f].path);
+        }
+        free(selection.files);
+        return -1;
+    }
+
+    ExtractFile *files = selection.files;
+    size_t fileCount = selection.count;
+    size_t taskCount = selection.taskCount;
+    int failures = selection.failures;
+
+    int pool = workers < 1 ? 1 : workers;
+    if ((size_t)pool > taskCount)
+    {
+        pool = taskCount > 0 ? (int)taskCount : 1;
+    }
+    ExtractTask *tasks = malloc(taskCount * sizeof(ExtractTask) + 1);
+    ExtractTask *order = malloc(taskCount * sizeof(ExtractTask) + 1);
+    uint8_t **buffers = calloc(pool, sizeof(uint8_t *));
+    if (tasks == NULL || order == NULL || buffers == NULL)
+    {
+        perror("Error allocating memory");
+        for (size_t f = 0; f < fileCount; f++)
+        {
+            free(files[f].path);
+        }
+        free(files);
+        free(tasks);
+        free(order);
+        free(buffers);
+        return -1;
+    }
+
+    size_t t = 0;
+    for (size_t f = 0; f < fileCount; f++)
+    {
+        uint64_t size = files[f].entry.DIR_FileSize;
+        for (uint64_t offset = 0; offset < size; offset += EXTRACT_CHUNK)
+        {
+            tasks[t].file = f;
+            tasks[t].offset = offset;
+            tasks[t].length = size - offset < EXTRACT_CHUNK ? size - offset : EXTRACT_CHUNK;
+            t++;
+        }
+    }
+
+    //deal the tasks largest first, round robin, so each worker starts with a fair share
+    qsort(tasks, taskCount, sizeof(ExtractTask), compareTasks);
+    size_t slot = 0;
+    for (int w = 0; w < pool; w++)
+    {
+        for (size_t i = w; i < taskCount; i += pool)
+        {
+            order[slot++] = tasks[i];
+        }
+    }
+
+    Extraction job;
+    job.volume = volume;
+    job.files = files;
+    job.tasks = order;
+    job.buffers = buffers;
+    atomic_init(&job.failures, 0);
+
+    for (int w = 0; w < pool; w++)
+    {
+        buffers[w] = malloc(EXTRACT_BUFFER);
+        if (buffers[w] == NULL)
+        {
+            perror("Error allocating memory");
+            failures = -1;
+        }
+    }
+    if (failures != -1)
+    {
+        volumePinBuffers(volume, (void *const *)buffers, pool, EXTRACT_BUFFER);
+        runWorkPool(taskCount, pool, extractTask, &job);
+        volumeUnpinBuffers(volume, (void *const *)buffers, pool);
+        failures += atomic_load(&job.failures);
+    }
+
+    for (int w = 0; w < pool; w++)
+    {
+        free(buffers[w]);
+    }
+    free(buffers);
+    free(tasks);
+    free(order);
+    for (size_t f = 0; f < fileCount; f++)
+    {
+        free(files[f].path);
+    }
+    free(files);
+    return failures;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        CHECK
+/////////////////////////////////////////////////////////////*/
+
+typedef enum {
+    PROBLEM_FAT_COPY,  // a FAT copy differs from the first one
+    PROBLEM_CROSS_LINK,  // two chains share a cluster
+    PROBLEM_CYCLE,  // a chain leads back into itself
+    PROBLEM_BROKEN,  // a chain reaches a free, bad or out of range entry
+    PROBLEM_SIZE,  // chain length does not match DIR_FileSize
+    PROBLEM_ORPHANS  // allocated clusters no entry owns
+} ProblemKind;
+
+typedef struct {
+    ProblemKind kind;
+    size_t file;  // index into the checked files (FAT copy number for PROBLEM_FAT_COPY)
+    size_t other;  // second file of a cross link
+    uint32_t cluster;  // where the problem is
+    uint64_t count;  // clusters found (differing entries, orphans, FAT value of a broken link)
+    uint64_t expected;  // clusters DIR_FileSize needs, lost chains for PROBLEM_ORPHANS
+} Problem;
+
+//a file or directory whose chain is checked
+typedef struct {
+    DirectoryEntry entry;
+    char *path;
+} CheckedFile;
+
+typedef struct {
+    CheckedFile *files;
+    size_t fileCount;
+    Problem *problems;
+    size_t problemCount;
+    size_t usedClusters;  // clusters owned by some entry
+} CheckReport;
+
+typedef struct {
+    Volume *volume;
+    CheckedFile *files;
+    size_t count;
+    size_t capacity;
+    atomic_uint *owner;  // per cluster: index of the owning file + 1, 0 = unowned
+    pthread_mutex_t lock;  // protects problems
+    Problem *problems;
+    size_t problemCount;
+    size_t problemCapacity;
+} Check;
+
+static int addProblem(Check *check, const Problem *problem)
+{
+    if (check->problemCount == check->problemCapacity)
+    {
+        size_t capacity = check->problemCapacity ? check->problemCapacity * 2 : 16;
+        Problem *grown = realloc(check->problems, capacity * sizeof(Problem));
+        if (grown == NULL)
+        {
+            return -1;
+        }
+        check->problems = grown;
+        check->problemCapacity = capacity;
+    }
+    check->problems[check->problemCount++] = *problem;
+    return 0;
+}
+
+static void reportProblem(Check *check, const Problem *problem)
+{
+    pthread_mutex_lock(&check->lock);
+    if (addProblem(check, problem) == -1)
+    {
+        perror("Error allocating memory");
+    }
+    pthread_mutex_unlock(&check->lock);
+}
+
+//compare every FAT copy with the first one
+static void checkFatCopies(Check *check)
+{
+    Volume *volume = check->volume;
+    const uint8_t *first = volumePointer(volume, volume->fatOffset, volume->fatSize);
+    const BootSector32 *bs32 = (const BootSector32 *)((const uint8_t *)volume->bootSector + BOOT_SECTOR32_OFFSET);
+
+    //FAT32 may turn mirroring off and keep a single active FAT
+    if (volume->fatType == FAT32 && (bs32->BPB_ExtFlags & 0x80))
+    {
+        return;
+    }
+    for (size_t copy = 1; copy < volume->bootSector->BPB_NumFATs; copy++)
+    {
+        const uint8_t *other = volumePointer(volume, volume->fatOffset + (off_t)(copy * volume->fatSize), volume->fatSize);
+        if (first == NULL || other == NULL || memcmp(first, other, volume->fatSize) == 0)
+        {
+            continue;
+        }
+
+        //locate the differences a block at a time, most blocks still match
+        Problem problem = { PROBLEM_FAT_COPY, copy, 0, 0, 0, 0 };
+        size_t counted = SIZE_MAX;
+        for (size_t block = 0; block < volume->fatSize; block += 4096)
+        {
+            size_t length = volume->fatSize - block < 4096 ? volume->fatSize - block : 4096;
+            if (memcmp(first + block, other + block, length) == 0)
+            {
+                continue;
+            }
+            for (size_t byte = block; byte < block + length; byte++)
+            {
+                //entries are fatType / 4 half bytes long
+                size_t entry = byte * 2 / (volume->fatType / 4);
+                if (first[byte] != other[byte] && entry != counted)
+                {
+                    if (problem.count == 0)
+                    {
+                        problem.cluster = entry;
+                    }
+                    problem.count++;
+                    counted = entry;
+                }
+            }
+        }
+        reportProblem(check, &problem);
+    }
+}
+
+//walk callback: every file and directory below the root owns a chain
+static int collectChecked(void *context, const WalkEntry *item)
+{
+    Check *check = context;
+
+    if (check->count == check->capacity)
+    {
+        size_t capacity = check->capacity ? check->capacity * 2 : 256;
+        CheckedFile *grown = realloc(check->files, capacity * sizeof(CheckedFile));
+        if (grown == NULL)
+        {
+            perror("Error allocating memory");
+            return -1;
+        }
+        check->files = grown;
+        check->capacity = capacity;
+    }
+
+    CheckedFile *file = &check->files[check->count];
+    file->path = strdup(item->path);
+    if (file->path == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    file->entry = *item->entry;
+    check->count++;
+    return 0;
+}
+
+//checkChain for one entry width
+FAT_INLINE void checkChainOf(Check *check, size_t index, int bits)
+{
+    Volume *volume = check->volume;
+    const DirectoryEntry *entry = &check->files[index].entry;
+    int directory = (entry->DIR_Attr & 0x10) != 0;
+    uint64_t expected = (entry->DIR_FileSize + volume->clusterSize - 1) / volume->clusterSize;
+    uint32_t cluster = entryCluster(volume, entry);
+    unsigned self = (unsigned)index + 1;
+    int claiming = 1;
+    uint64_t length = 0;
+
+    if (cluster == 0)
+    {
+        if (!directory && expected > 0)
+        {
+            Problem problem = { PROBLEM_SIZE, index, 0, 0, 0, expected };
+            reportProblem(check, &problem);
+        }
+        return;
+    }
+
+    while (1)
+    {
+        if (cluster < 2 || cluster >= volume->clusterCount + 2)
+        {
+            Problem problem = { PROBLEM_BROKEN, index, 0, cluster, cluster, 0 };
+            reportProblem(check, &problem);
+            return;
+        }
+
+        //after a cross link the rest of the chain belongs to the other file
+        if (claiming)
+        {
+            unsigned owner = 0;
+            if (!atomic_compare_exchange_strong(&check->owner[cluster], &owner, self))
+            {
+                if (owner == self)
+                {
+                    Problem problem = { PROBLEM_CYCLE, index, 0, cluster, length, 0 };
+                    reportProblem(check, &problem);
+                    return;
+                }
+                Problem problem = { PROBLEM_CROSS_LINK, index, owner - 1, cluster, 0, 0 };
+                reportProblem(check, &problem);
+                claiming = 0;
+            }
+        }
+        length++;
+        //loop inside a chain claimed by another file, reported there
+        if (length > volume->clusterCount)
+        {
+            return;
+        }
+
+        uint32_t next = fatEntryOf(volume, cluster, bits);
+        if (next >= fatEndOfChainOf(bits))
+        {
+            break;
+        }
+        if (next < 2 || next == fatBadClusterOf(bits) || next >= volume->clusterCount + 2)
+        {
+            Problem problem = { PROBLEM_BROKEN, index, 0, cluster, next, 0 };
+            reportProblem(check, &problem);
+            return;
+        }
+        cluster = next;
+    }
+
+    if (!directory && length != expected)
+    {
+        Problem problem = { PROBLEM_SIZE, index, 0, entryCluster(volume, entry), length, expected };
+        reportProblem(check, &problem);
+    }
+}
+
+//follow one chain, claiming each cluster in the ownership map
+static void checkChain(void *context, size_t index, int worker)
+{
+    (void)worker;
+    Check *check = context;
+    FAT_DISPATCH(check->volume, checkChainOf, check, index);
+}
+
+//checkOrphans for one entry width
+FAT_INLINE void checkOrphansOf(Check *check, size_t *usedClusters, int bits)
+{
+    Volume *volume = check->volume;
+    size_t end = volume->clusterCount + 2;
+    uint8_t *pointedTo = calloc(end, 1);
+    Problem problem = { PROBLEM_ORPHANS, 0, 0, 0, 0, 0 };
+    size_t used = 0;
+
+    for (size_t cluster = 2; cluster < end; cluster++)
+    {
+        uint32_t value = fatEntryOf(volume, cluster, bits);
+        if (atomic_load_explicit(&check->owner[cluster], memory_order_relaxed) != 0)
+        {
+            used++;
+            continue;
+        }
+        if (value == 0 || value == fatBadClusterOf(bits))
+        {
+            continue;
+        }
+        if (problem.count == 0)
+        {
+            problem.cluster = cluster;
+        }
+        problem.count++;
+        if (pointedTo != NULL && value >= 2 && value < end)
+        {
+            pointedTo[value] = 1;
+        }
+    }
+
+    //a lost chain starts at an orphan no other orphan points to
+    if (problem.count > 0)
+    {
+        for (size_t cluster = 2; cluster < end && pointedTo != NULL; cluster++)
+        {
+            uint32_t value = fatEntryOf(volume, cluster, bits);
+            if (value != 0 && value != fatBadClusterOf(bits) && check->owner[cluster] == 0 && !pointedTo[cluster])
+            {
+                problem.expected++;
+            }
+        }
+        reportProblem(check, &problem);
+    }
+    free(pointedTo);
+    *usedClusters = used;
+}
+
+//allocated clusters nobody owns, and how many chains they form
+static void checkOrphans(Check *check, size_t *usedClusters)
+{
+    FAT_DISPATCH(check->volume, checkOrphansOf, check, usedClusters);
+}
+
+//problems in a stable order: by kind, then cluster
+static int compareProblems(const void *a, const void *b)
+{
+    const Problem *left = a;
+    const Problem *right = b;
+    if (left->kind != right->kind)
+    {
+        return left->kind < right->kind ? -1 : 1;
+    }
+    if (left->cluster != right->cluster)
+    {
+        return left->cluster < right->cluster ? -1 : 1;
+    }
+    return left->file < right->file ? -1 : left->file > right->file;
+}
+
+void freeCheckReport(CheckReport *report)
+{
+    for (size_t f = 0; f < report->fileCount; f++)
+    {
+        free(report->files[f].path);
+    }
+    free(report->files);
+    free(report->problems);
+    memset(report, 0, sizeof(CheckReport));
+}
+
+//check FAT copies, chains and ownership of every cluster
+//returns -1 if the check itself could not run
+int checkVolume(Volume *volume, int workers, CheckReport *report)
+{
+    Check check;
+    memset(&check, 0, sizeof(check));
+    memset(report, 0, sizeof(CheckReport));
+    check.volume = volume;
+    pthread_mutex_init(&check.lock, NULL);
+
+    check.owner = calloc(volume->clusterCount + 2, sizeof(atomic_uint));
+    if (check.owner == NULL)
+    {
+        perror("Error allocating memory");
+        pthread_mutex_destroy(&check.lock);
+        return -1;
+    }
+
+    checkFatCopies(&check);
+    int status = 0;
+    //the FAT32 root has a chain of its own to check
+    if (volume->rootCluster != 0)
+    {
+        DirectoryEntry root;
+        memset(&root, 0, sizeof(root));
+        root.DIR_Attr = 0x10;
+        root.DIR_FstClusLO = volume->rootCluster & 0xFFFF;
+        root.DIR_FstClusHI = volume->rootCluster >> 16;
+        WalkEntry item = { "/", &root, NULL, 0, -1 };
+        status = collectChecked(&check, &item);
+    }
+    if (status == 0)
+    {
+        status = walkVolume(volume, collectChecked, &check);
+    }
+    if (status == 0)
+    {
+        //chains are independent, the ownership map is the only shared state
+        runWorkPool(check.count, workers, checkChain, &check);
+        checkOrphans(&check, &report->usedClusters);
+
+        //which of two cross linked files wins the race is not fixed
+        for (size_t p = 0; p < check.problemCount; p++)
+        {
+            Problem *problem = &check.problems[p];
+            if (problem->kind == PROBLEM_CROSS_LINK && problem->other < problem->file)
+            {
+                size_t swap = problem->file;
+                problem->file = problem->other;
+                problem->other = swap;
+            }
+        }
+        if (check.problemCount > 1)
+        {
+            qsort(check.problems, check.problemCount, sizeof(Problem), compareProblems);
+        }
+    }
+
+    report->files = check.files;
+    report->fileCount = check.count;
+    report->problems = check.problems;
+    report->problemCount = check.problemCount;
+    free(check.owner);
+    pthread_mutex_destroy(&check.lock);
+    if (status != 0)
+    {
+        freeCheckReport(report);
+        return -1;
+    }
+    return 0;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        STATS
+/////////////////////////////////////////////////////////////*/
+
+//free run histogram buckets: 1, 2-3, 4-7, ... 32768+
+#define FREE_RUN_BUCKETS 16
+//most fragmented files reported
+#define STATS_TOP_FILES 10
+
+typedef struct {
+    uint64_t free;  // FAT entry 0
+    uint64_t bad;  // 0xFFF7 (FAT32: 0x0FFFFFF7)
+    uint64_t endOfChain;  // 0xFFF8-0xFFFF (FAT32: 0x0FFFFFF8-0x0FFFFFFF)
+} FatCounts;
+
+typedef struct {
+    const char *path;  // owned copy
+    uint64_t fragments;
+    uint64_t clusters;
+} FragmentedFile;
+
+typedef struct {
+    FatCounts counts;
+    uint64_t freeRuns[FREE_RUN_BUCKETS];  // free runs per length bucket
+    uint64_t largestFreeRun;  // clusters
+    uint64_t files;  // files with at least one cluster
+    uint64_t fragmentedFiles;  // files in more than one run
+    uint64_t fragments;  // runs over all files
+    uint64_t badChains;  // chains that could not be followed
+    FragmentedFile top[STATS_TOP_FILES];  // most fragmented first
+    size_t topCount;
+} VolumeStats;
+
+//scalar kernel: count entries from..end-1, one bit per free entry (bit 0 is entry "base")
+FAT_INLINE void scanFatScalar(const Volume *volume, size_t base, size_t from, size_t end, FatCounts *counts, uint64_t *freeBits, int bits)
+{
+    for (size_t c = from; c < end; c++)
+    {
+        uint32_t value = fatEntryOf(volume, c, bits);
+        if (value == 0)
+        {
+            counts->free++;
+            freeBits[(c - base) / 64] |= (uint64_t)1 << ((c - base) % 64);
+        }
+        counts->bad += value == fatBadClusterOf(bits);
+        counts->endOfChain += value >= fatEndOfChainOf(bits);
+    }
+}
+
+//or a block of free bits into the bitmap, which may straddle two words
+static inline void setFreeBits(uint64_t *freeBits, size_t bit, uint64_t lanes, int width)
+{
+    freeBits[bit / 64] |= lanes << (bit % 64);
+    if (bit % 64 + width > 64)
+    {
+        freeBits[bit / 64 + 1] |= lanes >> (64 - bit % 64);
+    }
+}
+
+#ifdef __SSE2__
+//8 entries per step, returns where it stopped
+//unsigned ">= 0xFFF8" is a signed compare after flipping the top bit
+static size_t scanFatSSE2(const uint16_t *fat, size_t base, size_t from, size_t end, FatCounts *counts, uint64_t *freeBits)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bad = _mm_set1_epi16((short)0xFFF7);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+    const __m128i lastData = _mm_set1_epi16(0x7FF7);
+    size_t c = from;
+
+    for (; c + 8 <= end; c += 8)
+    {
+        __m128i value = _mm_loadu_si128((const __m128i *)(fat + c));
+        //packing the 16 bit masks to bytes gives one movemask bit per entry
+        __m128i isFree = _mm_cmpeq_epi16(value, zero);
+        __m128i isBad = _mm_cmpeq_epi16(value, bad);
+        __m128i isEnd = _mm_cmpgt_epi16(_mm_xor_si128(value, flip), lastData);
+        unsigned freeMask = _mm_movemask_epi8(_mm_packs_epi16(isFree, zero));
+        unsigned otherMask = _mm_movemask_epi8(_mm_packs_epi16(isBad, isEnd));
+        counts->free += __builtin_popcount(freeMask);
+        counts->bad += __builtin_popcount(otherMask & 0xFF);
+        counts->endOfChain += __builtin_popcount(otherMask >> 8);
+        if (freeMask != 0)
+        {
+            setFreeBits(freeBits, c - base, freeMask, 8);
+        }
+    }
+    return c;
+}
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+//16 entries per step, used when the CPU has AVX2
+__attribute__((target("avx2,popcnt")))
+static size_t scanFatAVX2(const uint16_t *fat, size_t base, size_t from, size_t end, FatCounts *counts, uint64_t *freeBits)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i bad = _mm256_set1_epi16((short)0xFFF7);
+    const __m256i flip = _mm256_set1_epi16((short)0x8000);
+    const __m256i lastData = _mm256_set1_epi16(0x7FF7);
+    size_t c = from;
+
+    for (; c + 16 <= end; c += 16)
+    {
+        __m256i value = _mm256_loadu_si256((const __m256i *)(fat + c));
+        __m256i isFree = _mm256_cmpeq_epi16(value, zero);
+        __m256i isBad = _mm256_cmpeq_epi16(value, bad);
+        __m256i isEnd = _mm256_cmpgt_epi16(_mm256_xor_si256(value, flip), lastData);
+        //packs works per 128 bit half, the permute puts the 16 entry bytes in order
+        unsigned freeMask = _mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(isFree, zero), 0xD8)) & 0xFFFF;
+        unsigned otherMask = _mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(isBad, isEnd), 0xD8));
+        counts->free += __builtin_popcount(freeMask);
+        counts->bad += __builtin_popcount(otherMask & 0xFFFF);
+        counts->endOfChain += __builtin_popcount(otherMask >> 16);
+        if (freeMask != 0)
+        {
+            setFreeBits(freeBits, c - base, freeMask, 16);
+        }
+    }
+    return c;
+}
+#endif
+
+//count free, bad and end of chain entries of clusters start..end-1 and mark free ones in freeBits
+//freeBits must hold (end - start + 63) / 64 zeroed words, bit 0 is cluster start
+//the vector kernels cover 16 bit tables (FAT12, FAT16), FAT32 is scanned by the scalar one
+void scanFat(const Volume *volume, size_t start, size_t end, FatCounts *counts, uint64_t *freeBits)
+{
+    memset(counts, 0, sizeof(FatCounts));
+    if (volume->fat32 != NULL)
+    {
+        scanFatScalar(volume, start, start, end, counts, freeBits, 32);
+        return;
+    }
+    const uint16_t *fat = volume->fat;
+    size_t done = start;
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        done = scanFatAVX2(fat, start, done, end, counts, freeBits);
+    }
+#endif
+#ifdef __SSE2__
+    done = scanFatSSE2(fat, start, done, end, counts, freeBits);
+#endif
+    scanFatScalar(volume, start, done, end, counts, freeBits, 16);
+}
+
+//runs of set bits in the free bitmap, bucketed by log2 of their length
+static void countFreeRuns(const uint64_t *freeBits, size_t words, VolumeStats *stats)
+{
+    uint64_t run = 0;
+    for (size_t w = 0; w <= words; w++)
+    {
+        //one extra empty word closes a run that reaches the end
+        uint64_t bits = w < words ? freeBits[w] : 0;
+        if (bits == ~(uint64_t)0)
+        {
+            run += 64;
+            continue;
+        }
+        int position = 0;
+        while (position < 64)
+        {
+            uint64_t rest = bits >> position;
+            if (rest & 1)
+            {
+                //~rest has ones above bit 63 - position, so ctz stops there
+                int ones = __builtin_ctzll(~rest);
+                run += ones;
+                position += ones;
+                continue;
+            }
+            if (run > 0)
+            {
+                int bucket = 63 - __builtin_clzll(run);
+                stats->freeRuns[bucket < FREE_RUN_BUCKETS ? bucket : FREE_RUN_BUCKETS - 1]++;
+                if (run > stats->largestFreeRun)
+                {
+                    stats->largestFreeRun = run;
+                }
+                run = 0;
+            }
+            position += rest == 0 ? 64 - position : __builtin_ctzll(rest);
+        }
+    }
+}
+
+//chainFragments for one entry width
+FAT_INLINE int64_t chainFragmentsOf(const Volume *volume, uint32_t cluster, uint64_t *clusters, int bits)
+{
+    int64_t fragments = 0;
+    uint32_t previous = 0;
+    *clusters = 0;
+    while (cluster >= 2 && cluster < fatEndOfChainOf(bits))
+    {
+        if (cluster >= volume->clusterCount + 2 || *clusters == volume->clusterCount)
+        {
+            return -1;
+        }
+        if (cluster != previous + 1)
+        {
+            fragments++;
+        }
+        (*clusters)++;
+        previous = cluster;
+        cluster = fatEntryOf(volume, cluster, bits);
+    }
+    return fragments;
+}
+
+//runs of contiguous clusters in a chain, -1 if the chain is broken or loops
+static int64_t chainFragments(const Volume *volume, uint32_t cluster, uint64_t *clusters)
+{
+    return FAT_DISPATCH(volume, chainFragmentsOf, volume, cluster, clusters);
+}
+
+typedef struct {
+    const Volume *volume;
+    VolumeStats *stats;
+} StatsWalk;
+
+//walk callback: fragments of every file, keeping the worst few
+static int collectFragments(void *context, const WalkEntry *item)
+{
+    StatsWalk *walk = context;
+    VolumeStats *stats = walk->stats;
+    uint32_t first = entryCluster(walk->volume, item->entry);
+    if ((item->entry->DIR_Attr & 0x10) || first < 2)
+    {
+        return 0;
+    }
+
+    uint64_t clusters;
+    int64_t fragments = chainFragments(walk->volume, first, &clusters);
+    if (fragments == -1)
+    {
+        stats->badChains++;
+        return 0;
+    }
+    stats->files++;
+    stats->fragments += fragments;
+    if (fragments < 2)
+    {
+        return 0;
+    }
+    stats->fragmentedFiles++;
+
+    //insertion into the short sorted list
+    size_t slot = stats->topCount;
+    while (slot > 0 && stats->top[slot - 1].fragments < (uint64_t)fragments)
+    {
+        slot--;
+    }
+    if (slot == STATS_TOP_FILES)
+    {
+        return 0;
+    }
+    char *path = strdup(item->path);
+    if (path == NULL)
+    {
+        return 0;
+    }
+    if (stats->topCount == STATS_TOP_FILES)
+    {
+        free((char *)stats->top[STATS_TOP_FILES - 1].path);
+        stats->topCount--;
+    }
+    memmove(&stats->top[slot + 1], &stats->top[slot], (stats->topCount - slot) * sizeof(FragmentedFile));
+    stats->top[slot].path = path;
+    stats->top[slot].fragments = fragments;
+    stats->top[slot].clusters = clusters;
+    stats->topCount++;
+    return 0;
+}
+
+void freeVolumeStats(VolumeStats *stats)
+{
+    for (size_t i = 0; i < stats->topCount; i++)
+    {
+        free((char *)stats->top[i].path);
+    }
+    stats->topCount = 0;
+}
+
+//FAT usage, free space layout and file fragmentation of a volume
+int volumeStats(Volume *volume, VolumeStats *stats)
+{
+    memset(stats, 0, sizeof(VolumeStats));
+    size_t end = volume->clusterCount + 2;
+    size_t words = (volume->clusterCount + 63) / 64;
+    uint64_t *freeBits = calloc(words + 1, sizeof(uint64_t));
+    if (freeBits == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+
+    scanFat(volume, 2, end, &stats->counts, freeBits);
+    countFreeRuns(freeBits, words, stats);
+    free(freeBits);
+
+    StatsWalk walk = { volume, stats };
+    if (walkVolume(volume, collectFragments, &walk) != 0)
+    {
+        freeVolumeStats(stats);
+        return -1;
+    }
+    return 0;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        UNDELETE
+/////////////////////////////////////////////////////////////*/
+
+//how the clusters of a deleted file are guessed
+typedef enum {
+    RECOVER_EMPTY,  // size 0, nothing to read
+    RECOVER_CONTIGUOUS,  // every cluster the size needs after the start cluster is still free
+    RECOVER_SKIP,  // free clusters from the start cluster on, jumping over live ones
+    RECOVER_OVERWRITTEN,  // the start cluster belongs to a live file again
+} RecoveryMethod;
+
+//one deleted entry of a live directory
+typedef struct {
+    DirectoryEntry entry;  // short entry, first name byte put back when the long name gives it away
+    char *name;  // long name if its entries survived, else the short name with '_' first
+    size_t slot;  // slot of the short entry in its directory
+    RecoveryMethod method;
+    uint32_t clusters;  // clusters the size needs
+    uint32_t conflicts;  // of the clusters right after the start cluster, how many are live
+} DeletedFile;
+
+//a live directory and the deleted entries found in it
+typedef struct {
+    char *path;  // "" for the root
+    uint32_t cluster;  // first cluster, 0 for the root
+    DeletedFile *files;
+    size_t count;
+    int failed;  // directory could not be read
+} ScannedDirectory;
+
+typedef struct {
+    Volume *volume;
+    ScannedDirectory *directories;  // walk order, root first
+    size_t count;
+    size_t capacity;
+} DeletedScan;
+
+//0 to 100: share of the contiguous candidate that no live file claims
+int recoveryScore(const DeletedFile *file)
+{
+    if (file->clusters == 0)
+    {
+        return 100;
+    }
+    return (int)((uint64_t)(file->clusters - file->conflicts) * 100 / file->clusters);
+}
+
+const char *recoveryMethodName(RecoveryMethod method)
+{
+    switch (method)
+    {
+        case RECOVER_EMPTY: return "empty";
+        case RECOVER_CONTIGUOUS: return "contiguous";
+        case RECOVER_SKIP: return "skip-live";
+        case RECOVER_OVERWRITTEN: return "overwritten";
+    }
+    return "?";
+}
+
+//count live clusters in the run a contiguous file would use and pick a method
+static void scoreDeleted(const Volume *volume, DeletedFile *file)
+{
+    size_t lastCluster = volume->clusterCount + 1;
+    uint32_t start = entryCluster(volume, &file->entry);
+
+    file->clusters = (uint32_t)(((uint64_t)file->entry.DIR_FileSize + volume->clusterSize - 1) / volume->clusterSize);
+    file->conflicts = 0;
+    if (file->clusters == 0)
+    {
+        file->method = RECOVER_EMPTY;
+        return;
+    }
+    if (start < 2 || start > lastCluster)
+    {
+        file->conflicts = file->clusters;
+        file->method = RECOVER_OVERWRITTEN;
+        return;
+    }
+
+    for (uint32_t i = 0; i < file->clusters; i++)
+    {
+        //past the end of the volume counts as lost
+        if (start + i > lastCluster || fatEntry(volume, start + i) != 0)
+        {
+            file->conflicts++;
+        }
+    }
+    if (file->conflicts == 0)
+    {
+        file->method = RECOVER_CONTIGUOUS;
+    }
+    else
+    {
+        file->method = fatEntry(volume, start) != 0 ? RECOVER_OVERWRITTEN : RECOVER_SKIP;
+    }
+}
+
+//runs of the candidate picked by scoreDeleted; may be shorter than the size when the volume runs out
+static int candidateExtents(const Volume *volume, const DeletedFile *file, ExtentMap *map)
+{
+    size_t lastCluster = volume->clusterCount + 1;
+    size_t cluster = entryCluster(volume, &file->entry);
+
+    memset(map, 0, sizeof(ExtentMap));
+    if (file->method == RECOVER_EMPTY || cluster < 2 || cluster > lastCluster)
+    {
+        return 0;
+    }
+    for (; cluster <= lastCluster && map->clusterCount < file->clusters; cluster++)
+    {
+        //a deleted file's clusters were free when it was written after the live ones around it
+        if (file->method == RECOVER_SKIP && fatEntry(volume, cluster) != 0)
+        {
+            continue;
+        }
+        if (appendExtent(volume, map, (uint32_t)cluster) == -1)
+        {
+            freeExtentMap(map);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+//name of the deleted short entry at slot, from the deleted long entries stored before it
+//puts the first name byte back into entry when a long name checks out
+static char *deletedName(const DirectoryEntry *entries, size_t slot, DirectoryEntry *entry)
+{
+    uint16_t units[20 * 13];
+    int parts = 0;
+    uint8_t checksum = 0;
+
+    //part 1 is stored right before the short entry, the order byte is gone
+    while (parts < 20 && slot > (size_t)parts)
+    {
+        const DirectoryEntry *previous = &entries[slot - 1 - parts];
+        if (previous->DIR_Name[0] != 0xE5 || (previous->DIR_Attr & 0x3F) != 0x0F)
+        {
+            break;
+        }
+        LongName part;
+        memcpy(&part, previous, sizeof(LongName));
+        if (parts > 0 && part.LDIR_Chksum != checksum)
+        {
+            break;
+        }
+        checksum = part.LDIR_Chksum;
+        longNameUnits(&part, units + parts * 13);
+        parts++;
+
+        //a terminated part is the last one
+        int terminated = 0;
+        for (int u = 0; u < 13; u++)
+        {
+            terminated |= units[(parts - 1) * 13 + u] == 0x0000;
+        }
+        if (terminated)
+        {
+            break;
+        }
+    }
+
+    char name[LONG_NAME_BYTES];
+    size_t length = parts > 0 ? utf16ToUtf8(units, (size_t)parts * 13, name, sizeof(name)) : 0;
+    if (length > 0)
+    {
+        //the short name usually starts with the long name's first letter
+        uint8_t shortName[11];
+        memcpy(shortName, entry->DIR_Name, 11);
+        shortName[0] = (uint8_t)toupper((unsigned char)name[0]);
+        if (shortNameChecksum(shortName) == checksum)
+        {
+            entry->DIR_Name[0] = shortName[0];
+        }
+        else
+        {
+            //the entries belong to some other name
+            length = 0;
+        }
+    }
+    if (length == 0)
+    {
+        uint8_t shortName[11];
+        memcpy(shortName, entry->DIR_Name, 11);
+        shortName[0] = '_';
+        shortNameToString(shortName, name);
+    }
+
+    //a '/' in a corrupt name would read as a directory of its own (hostPath handles "..")
+    for (char *c = name; *c != '\0'; c++)
+    {
+        if (*c == '/')
+        {
+            *c = '_';
+        }
+    }
+    return strdup(name);
+}
+
+//pool task: find the deleted entries of one directory
+static void scanDirectoryTask(void *context, size_t index, int worker)
+{
+    (void)worker;
+    DeletedScan *scan = context;
+    ScannedDirectory *directory = &scan->directories[index];
+    Volume *volume = scan->volume;
+
+    const DirectoryEntry *entries = volume->rootDir;
+    DirectoryEntry *owned = NULL;
+    size_t numOfEntry = volume->bootSector->BPB_RootEntCnt;
+    if (directoryChain(volume, directory->cluster) != 0)
+    {
+        owned = readDirectoryClusters(volume, directoryChain(volume, directory->cluster), &numOfEntry);
+        if (owned == NULL)
+        {
+            directory->failed = 1;
+            return;
+        }
+        entries = owned;
+    }
+
+    size_t capacity = 0;
+    for (size_t slot = 0; slot < numOfEntry && entries[slot].DIR_Name[0] != 0x00; slot++)
+    {
+        const DirectoryEntry *entry = &entries[slot];
+        //long entries, the volume label and deleted directories are not files to recover
+        if (entry->DIR_Name[0] != 0xE5 || (entry->DIR_Attr & 0x18))
+        {
+            continue;
+        }
+
+        if (directory->count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            DeletedFile *grown = realloc(directory->files, capacity * sizeof(DeletedFile));
+            if (grown == NULL)
+            {
+                perror("Error allocating memory");
+                directory->failed = 1;
+                break;
+            }
+            directory->files = grown;
+        }
+        DeletedFile *file = &directory->files[directory->count];
+        file->entry = *entry;
+        file->slot = slot;
+        file->name = deletedName(entries, slot, &file->entry);
+        if (file->name == NULL)
+        {
+            perror("Error allocating memory");
+            directory->failed = 1;
+            break;
+        }
+        scoreDeleted(volume, file);
+        directory->count++;
+    }
+    free(owned);
+}
+
+//walk callback: remember every live directory
+static int collectDirectories(void *context, const WalkEntry *item)
+{
+    DeletedScan *scan = context;
+    if (!(item->entry->DIR_Attr & 0x10) || entryCluster(scan->volume, item->entry) < 2)
+    {
+        return 0;
+    }
+    if (scan->count == scan->capacity)
+    {
+        size_t capacity = scan->capacity * 2;
+        ScannedDirectory *grown = realloc(scan->directories, capacity * sizeof(ScannedDirectory));
+        if (grown == NULL)
+        {
+            perror("Error allocating memory");
+            return -1;
+        }
+        scan->directories = grown;
+        scan->capacity = capacity;
+    }
+    ScannedDirectory *directory = &scan->directories[scan->count];
+    memset(directory, 0, sizeof(ScannedDirectory));
+    directory->path = strdup(item->path);
+    directory->cluster = entryCluster(scan->volume, item->entry);
+    if (directory->path == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    scan->count++;
+    return 0;
+}
+
+void freeDeletedScan(DeletedScan *scan)
+{
+    for (size_t d = 0; d < scan->count; d++)
+    {
+        for (size_t f = 0; f < scan->directories[d].count; f++)
+        {
+            free(scan->directories[d].files[f].name);
+        }
+        free(scan->directories[d].files);
+        free(scan->directories[d].path);
+    }
+    free(scan->directories);
+    memset(scan, 0, sizeof(DeletedScan));
+}
+
+//find and score the deleted files of every live directory, one directory per task
+//the walk keeps only directory paths; each task holds one directory's entries at a time
+int scanDeleted(Volume *volume, int workers, DeletedScan *scan)
+{
+    memset(scan, 0, sizeof(DeletedScan));
+    scan->volume = volume;
+    scan->capacity = 64;
+    scan->directories = malloc(scan->capacity * sizeof(ScannedDirectory));
+    if (scan->directories == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    memset(&scan->directories[0], 0, sizeof(ScannedDirectory));
+    scan->directories[0].path = strdup("");
+    if (scan->directories[0].path == NULL)
+    {
+        perror("Error allocating memory");
+        freeDeletedScan(scan);
+        return -1;
+    }
+    scan->count = 1;
+
+    if (walkVolume(volume, collectDirectories, scan) != 0)
+    {
+        freeDeletedScan(scan);
+        return -1;
+    }
+    runWorkPool(scan->count, workers, scanDirectoryTask, scan);
+    return 0;
+}
+
+//path of a deleted file inside the image (4096 bytes), 1 if it matches one of patterns (any if none) and scores minScore
+int selectDeleted(const ScannedDirectory *directory, const DeletedFile *file, char **patterns, int patternCount, int minScore, char *path)
+{
+    snprintf(path, 4096, "%s%s%s", directory->path, directory->path[0] != '\0' ? "/" : "", file->name);
+
+    int selected = patternCount == 0;
+    for (int p = 0; p < patternCount && !selected; p++)
+    {
+        selected = fnmatch(patterns[p], path, FNM_CASEFOLD) == 0 || fnmatch(patterns[p], file->name, FNM_CASEFOLD) == 0;
+    }
+    return selected && recoveryScore(file) >= minScore;
+}
+
+//one deleted file picked for recovery
+typedef struct {
+    const DeletedFile *file;
+    char *path;  // host path, already created
+} RecoverFile;
+
+typedef struct {
+    Volume *volume;
+    RecoverFile *files;
+    uint8_t **buffers;  // one per worker
+    atomic_int failures;
+} Recovery;
+
+//pool task: copy the candidate clusters of one deleted file to its host file
+static void recoverTask(void *context, size_t index, int worker)
+{
+    Recovery *job = context;
+    RecoverFile *target = &job->files[index];
+    uint8_t *buffer = job->buffers[worker];
+
+    //a file with no chain of its own, then given the guessed runs
+    DirectoryEntry entry = target->file->entry;
+    entry.DIR_FstClusLO = 0;
+    entry.DIR_FstClusHI = 0;
+    File *file = openEntry(job->volume, &entry);
+    int out = open(target->path, O_WRONLY);
+    if (file == NULL || out == -1 || candidateExtents(job->volume, target->file, &file->extents) == -1)
+    {
+        if (out == -1)
+        {
+            perror(target->path);
+        }
+        else
+        {
+            close(out);
+        }
+        if (file != NULL)
+        {
+            closeFile(file);
+        }
+        atomic_fetch_add(&job->failures, 1);
+        return;
+    }
+    file->startCluster = entryCluster(job->volume, &target->file->entry);
+
+    size_t reading;
+    while ((reading = readFile(file, buffer, EXTRACT_BUFFER)) > 0)
+    {
+        if (write(out, buffer, reading) != (ssize_t)reading)
+        {
+            perror(target->path);
+            atomic_fetch_add(&job->failures, 1);
+            break;
+        }
+    }
+    if (file->currentPosition < file->fileLength)
+    {
+        fprintf(stderr, "%s: only %zu of %zu bytes left on the volume\n", target->path, file->currentPosition, file->fileLength);
+    }
+    closeFile(file);
+    close(out);
+}
+
+//create a host file that does not exist yet, adding ~1, ~2... for names deleted more than once
+static char *createRecovered(const char *target)
+{
+    size_t length = strlen(target) + 16;
+    char *created = malloc(length);
+    if (created == NULL)
+    {
+        perror("Error allocating memory");
+        return NULL;
+    }
+
+    for (int copy = 0; copy < 1000; copy++)
+    {
+        if (copy == 0)
+        {
+            snprintf(created, length, "%s", target);
+        }
+        else
+        {
+            snprintf(created, length, "%s~%d", target, copy);
+        }
+        int out = open(created, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (out != -1)
+        {
+            close(out);
+            return created;
+        }
+        if (errno != EEXIST)
+        {
+            break;
+        }
+    }
+    perror(created);
+    free(created);
+    return NULL;
+}
+
+//write every deleted file matching one of patterns (all if none) and scoring at least minScore into outDir
+//returns the number of files that failed
+int recoverFiles(Volume *volume, const DeletedScan *scan, const char *outDir, char **patterns, int patternCount, int minScore, int workers)
+{
+    if (mkdir(outDir, 0777) == -1 && errno != EEXIST)
+    {
+        perror(outDir);
+        return -1;
+    }
+
+    //makeParents only needs its directory memo and the resolved outDir
+    ExtractSelection parents;
+    memset(&parents, 0, sizeof(parents));
+    if (setExtractRoot(&parents, outDir) == -1)
+    {
+        return -1;
+    }
+    RecoverFile *files = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    int failures = 0;
+
+    for (size_t d = 0; d < scan->count; d++)
+    {
+        const ScannedDirectory *directory = &scan->directories[d];
+        for (size_t f = 0; f < directory->count; f++)
+        {
+            const DeletedFile *file = &directory->files[f];
+            char path[4096];
+            if (!selectDeleted(directory, file, patterns, patternCount, minScore, path))
+            {
+                continue;
+            }
+
+            if (count == capacity)
+            {
+                capacity = capacity ? capacity * 2 : 64;
+                RecoverFile *grown = realloc(files, capacity * sizeof(RecoverFile));
+                if (grown == NULL)
+                {
+                    perror("Error allocating memory");
+                    failures++;
+                    break;
+                }
+                files = grown;
+            }
+
+            //directory path and name come from the image, same rules as extract
+            char *target = hostPath(outDir, path);
+            char *created = NULL;
+            if (target != NULL && makeParents(&parents, target) == 0)
+            {
+                created = createRecovered(target);
+            }
+            free(target);
+            if (created == NULL)
+            {
+                failures++;
+                continue;
+            }
+            files[count].file = file;
+            files[count].path = created;
+            count++;
+        }
+    }
+
+    Recovery job;
+    job.volume = volume;
+    job.files = files;
+    atomic_init(&job.failures, 0);
+    int pool = workers < 1 ? 1 : workers;
+    job.buffers = calloc(pool, sizeof(uint8_t *));
+    int ready = job.buffers != NULL;
+    for (int w = 0; ready && w < pool; w++)
+    {
+        job.buffers[w] = malloc(EXTRACT_BUFFER);
+        ready = job.buffers[w] != NULL;
+    }
+    if (ready)
+    {
+        volumePinBuffers(volume, (void *const *)job.buffers, pool, EXTRACT_BUFFER);
+        runWorkPool(count, pool, recoverTask, &job);
+        volumeUnpinBuffers(volume, (void *const *)job.buffers, pool);
+        failures += atomic_load(&job.failures);
+    }
+    else
+    {
+        perror("Error allocating memory");
+        failures = -1;
+    }
+
+    for (int w = 0; job.buffers != NULL && w < pool; w++)
+    {
+        free(job.buffers[w]);
+    }
+    free(job.buffers);
+    for (size_t f = 0; f < count; f++)
+    {
+        free(files[f].path);
+    }
+    free(files);
+    return failures;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        HASH
+/////////////////////////////////////////////////////////////*/
+
+typedef enum {
+    HASH_SHA256,
+    HASH_BLAKE3,
+    HASH_CRC32C,
+} HashKind;
+
+typedef struct {
+    uint32_t state[8];
+    uint8_t block[64];  // bytes not compressed yet
+    size_t used;  // bytes in block
+    uint64_t length;  // bytes hashed so far
+} Sha256;
+
+static const uint32_t sha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+//SHA-256 and BLAKE3 start from the same words
+static const uint32_t hashIV[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static inline uint32_t rotateRight(uint32_t value, int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void sha256BlocksScalar(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    for (; blocks > 0; blocks--, data += 64)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+        {
+            w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 | (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        }
+        for (int i = 16; i < 64; i++)
+        {
+            uint32_t s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t t1 = h + (rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+            uint32_t t2 = (rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+//SHA extensions: two rounds per instruction, the message schedule in four registers
+__attribute__((target("sha,sse4.1")))
+static void sha256BlocksSHA(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    //the instructions keep the state as ABEF and CDGH
+    __m128i cdab = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; blocks > 0; blocks--, data += 64)
+    {
+        __m128i savedAbef = abef;
+        __m128i savedCdgh = cdgh;
+        __m128i message[4];
+
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++)
+        {
+            if (i < 4)
+            {
+                message[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), byteSwap);
+            }
+            __m128i rounds = _mm_add_epi32(message[i & 3], _mm_loadu_si128((const __m128i *)&sha256K[i * 4]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, rounds);
+            if (i >= 3 && i < 15)
+            {
+                //finish the next four schedule words
+                __m128i next = _mm_add_epi32(message[(i + 1) & 3], _mm_alignr_epi8(message[i & 3], message[(i - 1) & 3], 4));
+                message[(i + 1) & 3] = _mm_sha256msg2_epu32(next, message[i & 3]);
+            }
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(rounds, 0x0E));
+            if (i >= 1 && i < 13)
+            {
+                message[(i - 1) & 3] = _mm_sha256msg1_epu32(message[(i - 1) & 3], message[i & 3]);
+            }
+        }
+
+        abef = _mm_add_epi32(abef, savedAbef);
+        cdgh = _mm_add_epi32(cdgh, savedCdgh);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+static void sha256Blocks(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+    {
+        sha256BlocksSHA(state, data, blocks);
+        return;
+    }
+#endif
+    sha256BlocksScalar(state, data, blocks);
+}
+
+void sha256Init(Sha256 *hash)
+{
+    memcpy(hash->state, hashIV, sizeof(hashIV));
+    hash->used = 0;
+    hash->length = 0;
+}
+
+void sha256Update(Sha256 *hash, const uint8_t *data, size_t length)
+{
+    hash->length += length;
+    if (hash->used > 0)
+    {
+        size_t take = 64 - hash->used < length ? 64 - hash->used : length;
+        memcpy(hash->block + hash->used, data, take);
+        hash->used += take;
+        data += take;
+        length -= take;
+        if (hash->used < 64)
+        {
+            return;
+        }
+        sha256Blocks(hash->state, hash->block, 1);
+        hash->used = 0;
+    }
+    //whole blocks straight from the caller's buffer
+    sha256Blocks(hash->state, data, length / 64);
+    memcpy(hash->block, data + length / 64 * 64, length % 64);
+    hash->used = length % 64;
+}
+
+void sha256Final(Sha256 *hash, uint8_t *digest)
+{
+    uint64_t bits = hash->length * 8;
+    uint8_t padding[72] = { 0x80 };
+    size_t padLength = (hash->used < 56 ? 56 : 120) - hash->used;
+    for (int i = 0; i < 8; i++)
+    {
+        padding[padLength + i] = (uint8_t)(bits >> (56 - i * 8));
+    }
+    sha256Update(hash, padding, padLength + 8);
+    for (int i = 0; i < 8; i++)
+    {
+        digest[i * 4] = (uint8_t)(hash->state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(hash->state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(hash->state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)hash->state[i];
+    }
+}
+
+#define BLAKE3_CHUNK 1024
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END 2
+#define BLAKE3_PARENT 4
+#define BLAKE3_ROOT 8
+
+//BLAKE3 without a key: one chunk in progress and a stack of finished subtrees
+typedef struct {
+    uint32_t chunkValue[8];  // chaining value of the chunk in progress
+    uint64_t chunkCounter;  // index of the chunk in progress
+    uint8_t block[64];
+    size_t blockLength;
+    size_t blocksDone;  // blocks of the chunk compressed so far
+    uint32_t stack[54][8];  // chaining values of complete subtrees, one per set bit of the chunk count
+    size_t stackLength;
+} Blake3;
+
+static const uint8_t blake3Permutation[16] = { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+
+static inline void blake3Mix(uint32_t *v, int a, int b, int c, int d, uint32_t x, uint32_t y)
+{
+    v[a] = v[a] + v[b] + x;
+    v[d] = rotateRight(v[d] ^ v[a], 16);
+    v[c] = v[c] + v[d];
+    v[b] = rotateRight(v[b] ^ v[c], 12);
+    v[a] = v[a] + v[b] + y;
+    v[d] = rotateRight(v[d] ^ v[a], 8);
+    v[c] = v[c] + v[d];
+    v[b] = rotateRight(v[b] ^ v[c], 7);
+}
+
+//the compression function, 16 output words
+static void blake3Compress(const uint32_t *value, const uint8_t *block, uint64_t counter, uint32_t blockLength, uint32_t flags, uint32_t *out)
+{
+    uint32_t m[16];
+    uint32_t v[16];
+    for (int i = 0; i < 16; i++)
+    {
+        m[i] = (uint32_t)block[i * 4] | (uint32_t)block[i * 4 + 1] << 8 | (uint32_t)block[i * 4 + 2] << 16 | (uint32_t)block[i * 4 + 3] << 24;
+    }
+    memcpy(v, value, 8 * sizeof(uint32_t));
+    memcpy(v + 8, hashIV, 4 * sizeof(uint32_t));
+    v[12] = (uint32_t)counter;
+    v[13] = (uint32_t)(counter >> 32);
+    v[14] = blockLength;
+    v[15] = flags;
+
+    for (int round = 0; round < 7; round++)
+    {
+        blake3Mix(v, 0, 4, 8, 12, m[0], m[1]);
+        blake3Mix(v, 1, 5, 9, 13, m[2], m[3]);
+        blake3Mix(v, 2, 6, 10, 14, m[4], m[5]);
+        blake3Mix(v, 3, 7, 11, 15, m[6], m[7]);
+        blake3Mix(v, 0, 5, 10, 15, m[8], m[9]);
+        blake3Mix(v, 1, 6, 11, 12, m[10], m[11]);
+        blake3Mix(v, 2, 7, 8, 13, m[12], m[13]);
+        blake3Mix(v, 3, 4, 9, 14, m[14], m[15]);
+
+        uint32_t permuted[16];
+        for (int i = 0; i < 16; i++)
+        {
+            permuted[i] = m[blake3Permutation[i]];
+        }
+        memcpy(m, permuted, sizeof(m));
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        out[i] = v[i] ^ v[i + 8];
+        out[i + 8] = v[i + 8] ^ value[i];
+    }
+}
+
+//chaining value of a parent node over two children
+static void blake3Parent(const uint32_t *left, const uint32_t *right, uint32_t flags, uint32_t *out)
+{
+    uint8_t block[64];
+    for (int i = 0; i < 8; i++)
+    {
+        for (int b = 0; b < 4; b++)
+        {
+            block[i * 4 + b] = (uint8_t)(left[i] >> (b * 8));
+            block[32 + i * 4 + b] = (uint8_t)(right[i] >> (b * 8));
+        }
+    }
+    uint32_t words[16];
+    blake3Compress(hashIV, block, 0, 64, BLAKE3_PARENT | flags, words);
+    memcpy(out, words, 8 * sizeof(uint32_t));
+}
+
+void blake3Init(Blake3 *hash)
+{
+    memcpy(hash->chunkValue, hashIV, sizeof(hashIV));
+    hash->chunkCounter = 0;
+    hash->blockLength = 0;
+    hash->blocksDone = 0;
+    hash->stackLength = 0;
+}
+
+void blake3Update(Blake3 *hash, const uint8_t *data, size_t length)
+{
+    while (length > 0)
+    {
+        //a full block is only compressed once more input shows it is not the last one
+        if (hash->blockLength == 64)
+        {
+            uint32_t words[16];
+            uint32_t flags = hash->blocksDone == 0 ? BLAKE3_CHUNK_START : 0;
+            if (hash->blocksDone == BLAKE3_CHUNK / 64 - 1)
+            {
+                //chunk complete: merge it with the finished subtrees it completes
+                blake3Compress(hash->chunkValue, hash->block, hash->chunkCounter, 64, flags | BLAKE3_CHUNK_END, words);
+                uint64_t chunks = ++hash->chunkCounter;
+                while ((chunks & 1) == 0)
+                {
+                    blake3Parent(hash->stack[--hash->stackLength], words, 0, words);
+                    chunks >>= 1;
+                }
+                memcpy(hash->stack[hash->stackLength++], words, 8 * sizeof(uint32_t));
+                memcpy(hash->chunkValue, hashIV, sizeof(hashIV));
+                hash->blocksDone = 0;
+            }
+            else
+            {
+                blake3Compress(hash->chunkValue, hash->block, hash->chunkCounter, 64, flags, words);
+                memcpy(hash->chunkValue, words, 8 * sizeof(uint32_t));
+                hash->blocksDone++;
+            }
+            hash->blockLength = 0;
+        }
+
+        size_t take = 64 - hash->blockLength < length ? 64 - hash->blockLength : length;
+        memcpy(hash->block + hash->blockLength, data, take);
+        hash->blockLength += take;
+        data += take;
+        length -= take;
+    }
+}
+
+void blake3Final(Blake3 *hash, uint8_t *digest)
+{
+    uint32_t words[16];
+    uint32_t flags = (hash->blocksDone == 0 ? BLAKE3_CHUNK_START : 0) | BLAKE3_CHUNK_END;
+    memset(hash->block + hash->blockLength, 0, 64 - hash->blockLength);
+
+    if (hash->stackLength == 0)
+    {
+        //a single chunk is the root
+        blake3Compress(hash->chunkValue, hash->block, hash->chunkCounter, (uint32_t)hash->blockLength, flags | BLAKE3_ROOT, words);
+    }
+    else
+    {
+        //fold the subtrees from the right, the last parent is the root
+        uint32_t right[8];
+        blake3Compress(hash->chunkValue, hash->block, hash->chunkCounter, (uint32_t)hash->blockLength, flags, words);
+        memcpy(right, words, sizeof(right));
+        for (size_t level = hash->stackLength; level > 1; level--)
+        {
+            blake3Parent(hash->stack[level - 1], right, 0, right);
+        }
+        blake3Parent(hash->stack[0], right, BLAKE3_ROOT, words);
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        for (int b = 0; b < 4; b++)
+        {
+            digest[i * 4 + b] = (uint8_t)(words[i] >> (b * 8));
+        }
+    }
+}
+
+//CRC-32C (Castagnoli), reflected polynomial
+#define CRC32C_POLYNOMIAL 0x82F63B78
+
+static uint32_t crc32cTable[256];
+static pthread_once_t crc32cOnce = PTHREAD_ONCE_INIT;
+
+static void crc32cBuildTable(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+        }
+        crc32cTable[i] = crc;
+    }
+}
+
+static uint32_t crc32cScalar(uint32_t crc, const uint8_t *data, size_t length)
+{
+    pthread_once(&crc32cOnce, crc32cBuildTable);
+    for (size_t i = 0; i < length; i++)
+    {
+        crc = (crc >> 8) ^ crc32cTable[(crc ^ data[i]) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+//SSE4.2 crc32 instruction, 8 bytes per step
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSSE42(uint32_t crc, const uint8_t *data, size_t length)
+{
+    uint64_t value = crc;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        value = _mm_crc32_u64(value, word);
+    }
+    crc = (uint32_t)value;
+    for (; i < length; i++)
+    {
+        crc = _mm_crc32_u8(crc, data[i]);
+    }
+    return crc;
+}
+#endif
+
+//update a CRC-32C kept without the final inversion (start from 0)
+uint32_t crc32cUpdate(uint32_t crc, const uint8_t *data, size_t length)
+{
+    crc = ~crc;
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return ~crc32cSSE42(crc, data, length);
+    }
+#endif
+    return ~crc32cScalar(crc, data, length);
+}
+
+//one of the supported hashes behind one interface
+typedef struct {
+    HashKind kind;
+    union {
+        Sha256 sha256;
+        Blake3 blake3;
+        uint32_t crc32c;
+    } state;
+} Hasher;
+
+//returns -1 for an unknown name
+int parseHashKind(const char *name)
+{
+    if (strcmp(name, "sha256") == 0)
+    {
+        return HASH_SHA256;
+    }
+    if (strcmp(name, "blake3") == 0)
+    {
+        return HASH_BLAKE3;
+    }
+    if (strcmp(name, "crc32c") == 0)
+    {
+        return HASH_CRC32C;
+    }
+    return -1;
+}
+
+size_t hashDigestLength(HashKind kind)
+{
+    return kind == HASH_CRC32C ? 4 : 32;
+}
+
+void hashInit(Hasher *hasher, HashKind kind)
+{
+    hasher->kind = kind;
+    switch (kind)
+    {
+        case HASH_SHA256: sha256Init(&hasher->state.sha256); break;
+        case HASH_BLAKE3: blake3Init(&hasher->state.blake3); break;
+        case HASH_CRC32C: hasher->state.crc32c = 0; break;
+    }
+}
+
+void hashUpdate(Hasher *hasher, const void *data, size_t length)
+{
+    switch (hasher->kind)
+    {
+        case HASH_SHA256: sha256Update(&hasher->state.sha256, data, length); break;
+        case HASH_BLAKE3: blake3Update(&hasher->state.blake3, data, length); break;
+        case HASH_CRC32C: hasher->state.crc32c = crc32cUpdate(hasher->state.crc32c, data, length); break;
+    }
+}
+
+//digest in hashDigestLength bytes; a CRC is written big endian, as it is usually printed
+void hashFinal(Hasher *hasher, uint8_t *digest)
+{
+    switch (hasher->kind)
+    {
+        case HASH_SHA256: sha256Final(&hasher->state.sha256, digest); break;
+        case HASH_BLAKE3: blake3Final(&hasher->state.blake3, digest); break;
+        case HASH_CRC32C:
+            for (int i = 0; i < 4; i++)
+            {
+                digest[i] = (uint8_t)(hasher->state.crc32c >> (24 - i * 8));
+            }
+            break;
+    }
+}
+
+#ifdef HAVE_FUSE
+/*/////////////////////////////////////////////////////////////
+                        FUSE
+/////////////////////////////////////////////////////////////*/
+
+//the image never changes under a read-only mount, the kernel may keep attributes this long
+#define FUSE_METADATA_SECONDS 3600.0
+
+//state shared by every FUSE request thread (read only after mount)
+typedef struct {
+    Volume *volume;
+    uint64_t freeClusters;
+    uid_t owner;
+    gid_t group;
+} Mount;
+
+static Mount *currentMount(void)
+{
+    return fuse_get_context()->private_data;
+}
+
+//FAT date and time (local time, 2 second steps) as a time_t
+static time_t fatTime(uint16_t date, uint16_t time)
+{
+    struct tm parts;
+    memset(&parts, 0, sizeof(parts));
+    parts.tm_year = ((date >> 9) & 0x7F) + 80;
+    parts.tm_mon = ((date >> 5) & 0x0F) - 1;
+    parts.tm_mday = date & 0x1F;
+    parts.tm_hour = (time >> 11) & 0x1F;
+    parts.tm_min = (time >> 5) & 0x3F;
+    parts.tm_sec = (time & 0x1F) * 2;
+    parts.tm_isdst = -1;
+    return date == 0 ? 0 : mktime(&parts);
+}
+
+static void entryStat(const Mount *mount, const DirectoryEntry *entry, struct stat *info)
+{
+    const Volume *volume = mount->volume;
+    memset(info, 0, sizeof(struct stat));
+    if (entry->DIR_Attr & 0x10)
+    {
+        info->st_mode = S_IFDIR | 0555;
+        info->st_nlink = 2;
+    }
+    else
+    {
+        info->st_mode = S_IFREG | 0444;
+        info->st_nlink = 1;
+        info->st_size = entry->DIR_FileSize;
+        info->st_blocks = ((uint64_t)entry->DIR_FileSize + volume->clusterSize - 1) / volume->clusterSize * (volume->clusterSize / 512);
+    }
+    info->st_blksize = volume->clusterSize;
+    info->st_uid = mount->owner;
+    info->st_gid = mount->group;
+    info->st_mtime = fatTime(entry->DIR_WrtDate, entry->DIR_WrtTime);
+    info->st_ctime = info->st_mtime;
+    info->st_atime = fatTime(entry->DIR_LstAccDate, 0);
+}
+
+static int fuseGetattr(const char *path, struct stat *info, struct fuse_file_info *fi)
+{
+    (void)fi;
+    Mount *mount = currentMount();
+    if (strcmp(path, "/") == 0)
+    {
+        DirectoryEntry root;
+        memset(&root, 0, sizeof(root));
+        root.DIR_Attr = 0x10;
+        entryStat(mount, &root, info);
+        return 0;
+    }
+
+    //per directory hash indexes, built once and kept for the whole mount
+    DirectoryEntry entry;
+    if (statPath(mount->volume, path, &entry) == -1)
+    {
+        return -ENOENT;
+    }
+    entryStat(mount, &entry, info);
+    return 0;
+}
+
+static int fuseReaddir(const char *path, void *buffer, fuse_fill_dir_t fill, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+    (void)offset;
+    (void)fi;
+    Mount *mount = currentMount();
+    uint32_t cluster = 0;
+    if (strcmp(path, "/") != 0)
+    {
+        DirectoryEntry entry;
+        if (statPath(mount->volume, path, &entry) == -1)
+        {
+            return -ENOENT;
+        }
+        if (!(entry.DIR_Attr & 0x10))
+        {
+            return -ENOTDIR;
+        }
+        cluster = entryCluster(mount->volume, &entry);
+    }
+    const DirIndex *index = directoryIndex(mount->volume, cluster);
+    if (index == NULL)
+    {
+        return -EIO;
+    }
+
+    //the whole directory in one call, attributes included so ls -l needs no getattr
+    enum fuse_fill_dir_flags fillFlags = (flags & FUSE_READDIR_PLUS) ? FUSE_FILL_DIR_PLUS : 0;
+    fill(buffer, ".", NULL, 0, 0);
+    fill(buffer, "..", NULL, 0, 0);
+    for (size_t e = 0; e < index->count; e++)
+    {
+        const IndexedEntry *indexed = &index->entries[e];
+        //volume label, "." and ".." of the directory itself
+        if ((indexed->entry.DIR_Attr & 0x08) || indexed->entry.DIR_Name[0] == '.')
+        {
+            continue;
+        }
+        const char *name = indexedLongName(index, indexed);
+        char shortName[13];
+        if (name == NULL)
+        {
+            shortNameToString(indexed->entry.DIR_Name, shortName);
+            name = shortName;
+        }
+        struct stat info;
+        entryStat(mount, &indexed->entry, &info);
+        if (fill(buffer, name, &info, 0, fillFlags) != 0)
+        {
+            break;
+        }
+    }
+    return 0;
+}
+
+static int fuseOpen(const char *path, struct fuse_file_info *fi)
+{
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+        return -EROFS;
+    }
+    Mount *mount = currentMount();
+    DirectoryEntry entry;
+    if (statPath(mount->volume, path, &entry) == -1)
+    {
+        return -ENOENT;
+    }
+    if (entry.DIR_Attr & 0x10)
+    {
+        return -EISDIR;
+    }
+
+    //the chain is turned into runs once per open; reads then only search the runs
+    File *file = openEntry(mount->volume, &entry);
+    if (file == NULL)
+    {
+        return -EIO;
+    }
+    fi->fh = (uint64_t)(uintptr_t)file;
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int fuseRead(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    (void)path;
+    //positional and stateless, so request threads can share one open file
+    const File *file = (const File *)(uintptr_t)fi->fh;
+    ssize_t reading = readFileAt(file, buffer, size, offset);
+    return reading < 0 ? -EIO : (int)reading;
+}
+
+static int fuseRelease(const char *path, struct fuse_file_info *fi)
+{
+    (void)path;
+    closeFile((File *)(uintptr_t)fi->fh);
+    return 0;
+}
+
+static int fuseStatfs(const char *path, struct statvfs *info)
+{
+    (void)path;
+    Mount *mount = currentMount();
+    memset(info, 0, sizeof(struct statvfs));
+    info->f_bsize = mount->volume->clusterSize;
+    info->f_frsize = mount->volume->clusterSize;
+    info->f_blocks = mount->volume->clusterCount;
+    info->f_bfree = mount->freeClusters;
+    info->f_bavail = mount->freeClusters;
+    info->f_namemax = 255;
+    info->f_flag = ST_RDONLY;
+    return 0;
+}
+
+static void *fuseInit(struct fuse_conn_info *connection, struct fuse_config *config)
+{
+    (void)connection;
+    config->kernel_cache = 1;
+    config->entry_timeout = FUSE_METADATA_SECONDS;
+    config->attr_timeout = FUSE_METADATA_SECONDS;
+    config->negative_timeout = FUSE_METADATA_SECONDS;
+    return fuse_get_context()->private_data;
+}
+
+static const struct fuse_operations fuseOperations = {
+    .getattr = fuseGetattr,
+    .readdir = fuseReaddir,
+    .open = fuseOpen,
+    .read = fuseRead,
+    .release = fuseRelease,
+    .statfs = fuseStatfs,
+    .init = fuseInit,
+};
+
+//serve the volume read only at mountPoint until it is unmounted
+//fuseArgs are passed on to libfuse (-f, -s, -d, -o ...); returns fuse_main's status
+int mountVolume(Volume *volume, const char *image, const char *mountPoint, int argc, char **argv)
+{
+    Mount mount;
+    mount.volume = volume;
+    mount.freeClusters = 0;
+    mount.owner = getuid();
+    mount.group = getgid();
+    uint64_t *freeBits = calloc((volume->clusterCount + 63) / 64 + 1, sizeof(uint64_t));
+    if (freeBits != NULL)
+    {
+        FatCounts counts;
+        scanFat(volume, 2, volume->clusterCount + 2, &counts, freeBits);
+        mount.freeClusters = counts.free;
+        free(freeBits);
+    }
+
+    //fsname shows the image in mount and df
+    //libfuse splits -o at ',' and takes '\\' as an escape, so both are escaped in the path
+    char fsname[2 * strlen(image) + 1];
+    size_t used = 0;
+    for (const char *c = image; *c != '\0'; c++)
+    {
+        if (*c == ',' || *c == '\\')
+        {
+            fsname[used++] = '\\';
+        }
+        fsname[used++] = *c;
+    }
+    fsname[used] = '\0';
+    char options[used + 64];
+    snprintf(options, sizeof(options), "ro,default_permissions,subtype=fat%d,fsname=%s", (int)volume->fatType, fsname);
+    char *fuseArgv[argc + 5];
+    int fuseArgc = 0;
+    fuseArgv[fuseArgc++] = "fat16-reader";
+    fuseArgv[fuseArgc++] = (char *)mountPoint;
+    fuseArgv[fuseArgc++] = "-o";
+    fuseArgv[fuseArgc++] = options;
+    for (int i = 0; i < argc; i++)
+    {
+        fuseArgv[fuseArgc++] = argv[i];
+    }
+    fuseArgv[fuseArgc] = NULL;
+    return fuse_main(fuseArgc, fuseArgv, &fuseOperations, &mount);
+}
+#endif
+
+/*/////////////////////////////////////////////////////////////
+                        OUTPUT
+/////////////////////////////////////////////////////////////*/
+
+#define OUTPUT_BUFFER (64u << 10)
+
+//buffered writer: all command output goes through one of these
+typedef struct {
+    int fdesc;  // where the output goes
+    size_t used;  // bytes waiting in buffer
+    int failed;  // a write failed (e.g. closed pipe)
+    int headerWritten;  // CSV header already went out
+    int chunked;  // each write goes out as "<length>\n" and the bytes (serve responses)
+    char buffer[OUTPUT_BUFFER];
+} Output;
+
+//write all of data to the file descriptor, unframed
+static void writeRaw(Output *out, const void *data, size_t length)
+{
+    const char *bytes = data;
+    while (length > 0 && !out->failed)
+    {
+        ssize_t writing = write(out->fdesc, bytes, length);
+        profileCount(COUNT_OUTPUT_WRITE, 1);
+        if (writing == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            out->failed = 1;
+            break;
+        }
+        bytes += writing;
+        length -= writing;
+    }
+}
+
+//write everything in buffer to the file descriptor
+static void writeAll(Output *out, const void *data, size_t length)
+{
+    uint64_t start = profileStart();
+    profileCount(COUNT_OUTPUT_BYTES, length);
+    if (out->chunked && length > 0)
+    {
+        char header[24];
+        int size = snprintf(header, sizeof(header), "%zu\n", length);
+        writeRaw(out, header, size);
+    }
+    writeRaw(out, data, length);
+    profileEnd(PROFILE_OUTPUT, start, length);
+}
+
+void outFlush(Output *out)
+{
+    writeAll(out, out->buffer, out->used);
+    out->used = 0;
+}
+
+void outWrite(Output *out, const void *data, size_t length)
+{
+    if (out->used + length > OUTPUT_BUFFER)
+    {
+        outFlush(out);
+        //large blocks (file contents) skip the buffer
+        if (length >= OUTPUT_BUFFER)
+        {
+            writeAll(out, data, length);
+            return;
+        }
+    }
+    memcpy(out->buffer + out->used, data, length);
+    out->used += length;
+}
+
+void outChar(Output *out, char c)
+{
+    if (out->used == OUTPUT_BUFFER)
+    {
+        outFlush(out);
+    }
+    out->buffer[out->used++] = c;
+}
+
+void outString(Output *out, const char *text)
+{
+    outWrite(out, text, strlen(text));
+}
+
+//decimal digits of value, right aligned to width with fill
+void outUnsignedPadded(Output *out, uint64_t value, int width, char fill)
+{
+    char digits[20];
+    int count = 0;
+    do
+    {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+
+    for (int i = count; i < width; i++)
+    {
+        outChar(out, fill);
+    }
+    while (count > 0)
+    {
+        outChar(out, digits[--count]);
+    }
+}
+
+void outUnsigned(Output *out, uint64_t value)
+{
+    outUnsignedPadded(out, value, 0, ' ');
+}
+
+//"2024-01-31 12:00:00" from a FAT date and time
+void outDateTime(Output *out, uint16_t date, uint16_t time)
+{
+    uint16_t hours, minutes, seconds, day, month, year;
+    convertDateTime(time, date, &hours, &minutes, &seconds, &day, &month, &year);
+    outUnsignedPadded(out, year, 4, '0');
+    outChar(out, '-');
+    outUnsignedPadded(out, month, 2, '0');
+    outChar(out, '-');
+    outUnsignedPadded(out, day, 2, '0');
+    outChar(out, ' ');
+    outUnsignedPadded(out, hours, 2, '0');
+    outChar(out, ':');
+    outUnsignedPadded(out, minutes, 2, '0');
+    outChar(out, ':');
+    outUnsignedPadded(out, seconds, 2, '0');
+}
+
+//"RHSVDA" attribute flags, '-' when unset
+void outAttributes(Output *out, uint8_t attributes)
+{
+    const char flags[] = "RHSVDA";
+    for (int bit = 0; bit < 6; bit++)
+    {
+        outChar(out, (attributes & (1 << bit)) ? flags[bit] : '-');
+    }
+}
+
+void outLittle16(Output *out, uint16_t value)
+{
+    outChar(out, (char)(value & 0xFF));
+    outChar(out, (char)(value >> 8));
+}
+
+void outLittle32(Output *out, uint32_t value)
+{
+    outLittle16(out, (uint16_t)(value & 0xFFFF));
+    outLittle16(out, (uint16_t)(value >> 16));
+}
+
+//JSON string with quotes; UTF-8 passes through, control characters are escaped
+void outJsonString(Output *out, const char *text)
+{
+    static const char hex[] = "0123456789abcdef";
+    outChar(out, '"');
+    for (const unsigned char *c = (const unsigned char *)text; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            outChar(out, '\\');
+            outChar(out, (char)*c);
+        }
+        else if (*c < 0x20)
+        {
+            outString(out, "\\u00");
+            outChar(out, hex[*c >> 4]);
+            outChar(out, hex[*c & 0xF]);
+        }
+        else
+        {
+            outChar(out, (char)*c);
+        }
+    }
+    outChar(out, '"');
+}
+
+//CSV field, quoted only when it has to be
+void outCsvField(Output *out, const char *text)
+{
+    if (strpbrk(text, ",\"\r\n") == NULL)
+    {
+        outString(out, text);
+        return;
+    }
+    outChar(out, '"');
+    for (const char *c = text; *c != '\0'; c++)
+    {
+        if (*c == '"')
+        {
+            outChar(out, '"');
+        }
+        outChar(out, *c);
+    }
+    outChar(out, '"');
+}
+
+/*/////////////////////////////////////////////////////////////
+                        HASH PIPELINE
+/////////////////////////////////////////////////////////////*/
+
+//bytes read from a file at a time
+#define HASH_BLOCK (256u << 10)
+//buffers in flight per hash worker; the reader waits when all are queued
+#define HASH_QUEUE_DEPTH 4
+
+//part of one file on its way from the reader to a hash worker
+typedef struct {
+    size_t file;  // index into the results
+    uint8_t *data;
+    size_t length;
+    int last;  // final block of the file
+    int failed;  // the file could not be read in full
+} HashBlock;
+
+//blocks for one worker, all blocks of a file go to the same worker in order
+typedef struct {
+    HashBlock *blocks;  // ring of bufferCount blocks
+    size_t head;
+    size_t count;
+    pthread_cond_t ready;
+} HashQueue;
+
+typedef struct {
+    char *path;
+    uint8_t digest[32];
+    int state;  // 0 pending, 1 done, -1 failed
+} HashResult;
+
+typedef struct {
+    Volume *volume;
+    HashKind kind;
+    int workers;
+    Output *out;
+    pthread_mutex_t lock;  // guards everything below
+    pthread_cond_t bufferFree;  // a spare buffer or a queue slot came free
+    pthread_cond_t resultDone;
+    uint8_t **spare;  // buffers not queued
+    size_t spareCount;
+    size_t bufferCount;
+    HashQueue *queues;  // one per worker
+    HashResult *results;  // walk order
+    size_t resultCount;
+    size_t resultCapacity;
+    int readDone;  // the walk is over, no more blocks or results
+    Hasher volumeHash;  // over every path and digest, in walk order
+    size_t failures;
+    FILE *diagnostics;  // the caller's, for the workers' and printer's messages
+} HashPipeline;
+
+typedef struct {
+    HashPipeline *pipeline;
+    int worker;
+} HashWorkerArgs;
+
+//hash worker: hash the blocks of its queue, one file after another
+static void *hashWorker(void *argument)
+{
+    HashWorkerArgs *args = argument;
+    HashPipeline *pipeline = args->pipeline;
+    HashQueue *queue = &pipeline->queues[args->worker];
+    Hasher hasher;
+    int started = 0;
+    threadDiagnostics = pipeline->diagnostics;
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (;;)
+    {
+        while (queue->count == 0 && !pipeline->readDone)
+        {
+            pthread_cond_wait(&queue->ready, &pipeline->lock);
+        }
+        if (queue->count == 0)
+        {
+            break;
+        }
+        HashBlock block = queue->blocks[queue->head];
+        queue->head = (queue->head + 1) % pipeline->bufferCount;
+        queue->count--;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if (!started)
+        {
+            hashInit(&hasher, pipeline->kind);
+            started = 1;
+        }
+        if (block.length > 0)
+        {
+            hashUpdate(&hasher, block.data, block.length);
+        }
+        uint8_t digest[32];
+        if (block.last)
+        {
+            hashFinal(&hasher, digest);
+            started = 0;
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        if (block.last)
+        {
+            HashResult *result = &pipeline->results[block.file];
+            memcpy(result->digest, digest, sizeof(digest));
+            result->state = block.failed ? -1 : 1;
+            pthread_cond_signal(&pipeline->resultDone);
+        }
+        if (block.data != NULL)
+        {
+            pipeline->spare[pipeline->spareCount++] = block.data;
+        }
+        pthread_cond_signal(&pipeline->bufferFree);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+//write a digest as lowercase hex
+static void outHex(Output *out, const uint8_t *bytes, size_t length)
+{
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < length; i++)
+    {
+        outChar(out, digits[bytes[i] >> 4]);
+        outChar(out, digits[bytes[i] & 15]);
+    }
+}
+
+//output thread: print results in walk order as soon as each is done
+static void *hashPrinter(void *argument)
+{
+    HashPipeline *pipeline = argument;
+    size_t digestLength = hashDigestLength(pipeline->kind);
+    threadDiagnostics = pipeline->diagnostics;
+
+    pthread_mutex_lock(&pipeline->lock);
+    for (size_t next = 0; ; next++)
+    {
+        while ((next < pipeline->resultCount && pipeline->results[next].state == 0) || (next == pipeline->resultCount && !pipeline->readDone))
+        {
+            pthread_cond_wait(&pipeline->resultDone, &pipeline->lock);
+        }
+        if (next == pipeline->resultCount)
+        {
+            break;
+        }
+        //the reader may move the array, not the result
+        HashResult result = pipeline->results[next];
+        pipeline->results[next].path = NULL;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        if (result.state == 1)
+        {
+            outHex(pipeline->out, result.digest, digestLength);
+            outString(pipeline->out, "  ");
+            outString(pipeline->out, result.path);
+            outChar(pipeline->out, '\n');
+            hashUpdate(&pipeline->volumeHash, result.path, strlen(result.path) + 1);
+            hashUpdate(&pipeline->volumeHash, result.digest, digestLength);
+        }
+        else
+        {
+            fprintf(stderr, "%s: cluster chain is shorter than the file size\n", result.path);
+            pipeline->failures++;
+        }
+        free(result.path);
+        pthread_mutex_lock(&pipeline->lock);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return NULL;
+}
+
+//reader side: queue one block for a worker, waiting for a spare buffer first
+static uint8_t *takeSpare(HashPipeline *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->spareCount == 0)
+    {
+        pthread_cond_wait(&pipeline->bufferFree, &pipeline->lock);
+    }
+    uint8_t *buffer = pipeline->spare[--pipeline->spareCount];
+    pthread_mutex_unlock(&pipeline->lock);
+    return buffer;
+}
+
+//blocks of unreadable files hold no buffer, so the ring itself may be full
+static void queueBlock(HashPipeline *pipeline, int worker, const HashBlock *block)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    HashQueue *queue = &pipeline->queues[worker];
+    while (queue->count == pipeline->bufferCount)
+    {
+        pthread_cond_wait(&pipeline->bufferFree, &pipeline->lock);
+    }
+    queue->blocks[(queue->head + queue->count) % pipeline->bufferCount] = *block;
+    queue->count++;
+    pthread_cond_signal(&queue->ready);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+//walk callback, the reader: read each file through readFile and queue its blocks
+static int hashWalked(void *context, const WalkEntry *item)
+{
+    HashPipeline *pipeline = context;
+    if (item->entry->DIR_Attr & 0x10)
+    {
+        return 0;
+    }
+
+    char *path = strdup(item->path);
+    if (path == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+
+    //a new result, and the worker with the shortest queue for the file
+    pthread_mutex_lock(&pipeline->lock);
+    if (pipeline->resultCount == pipeline->resultCapacity)
+    {
+        size_t capacity = pipeline->resultCapacity ? pipeline->resultCapacity * 2 : 256;
+        HashResult *grown = realloc(pipeline->results, capacity * sizeof(HashResult));
+        if (grown == NULL)
+        {
+            pthread_mutex_unlock(&pipeline->lock);
+            perror("Error allocating memory");
+            free(path);
+            return -1;
+        }
+        pipeline->results = grown;
+        pipeline->resultCapacity = capacity;
+    }
+    size_t index = pipeline->resultCount++;
+    pipeline->results[index].path = path;
+    pipeline->results[index].state = 0;
+    int worker = 0;
+    for (int w = 1; w < pipeline->workers; w++)
+    {
+        if (pipeline->queues[w].count < pipeline->queues[worker].count)
+        {
+            worker = w;
+        }
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    HashBlock block = { index, NULL, 0, 1, 1 };
+    File *file = openEntry(pipeline->volume, item->entry);
+    if (file == NULL)
+    {
+        queueBlock(pipeline, worker, &block);
+        return 0;
+    }
+    do
+    {
+        block.data = takeSpare(pipeline);
+        block.length = readFile(file, block.data, HASH_BLOCK);
+        block.failed = block.length == 0 && file->currentPosition < file->fileLength;
+        block.last = block.length == 0 || file->currentPosition >= file->fileLength;
+        queueBlock(pipeline, worker, &block);
+    } while (!block.last);
+    closeFile(file);
+    return 0;
+}
+
+//print the digest of every file (walk order), then the digest of the whole volume as "/"
+//reading, hashing and printing run in parallel with HASH_QUEUE_DEPTH buffers per worker
+//returns the number of files that could not be hashed, -1 on error
+long hashVolume(Volume *volume, HashKind kind, int workers, Output *out)
+{
+    HashPipeline pipeline;
+    memset(&pipeline, 0, sizeof(pipeline));
+    pipeline.volume = volume;
+    pipeline.kind = kind;
+    pipeline.workers = workers < 1 ? 1 : workers;
+    pipeline.out = out;
+    pipeline.diagnostics = threadDiagnostics;
+    pipeline.bufferCount = (size_t)pipeline.workers * HASH_QUEUE_DEPTH;
+    int queueCount = pipeline.workers;
+    hashInit(&pipeline.volumeHash, kind);
+
+    pipeline.spare = calloc(pipeline.bufferCount, sizeof(uint8_t *));
+    pipeline.queues = calloc(pipeline.workers, sizeof(HashQueue));
+    HashWorkerArgs *args = calloc(pipeline.workers, sizeof(HashWorkerArgs));
+    pthread_t *threads = calloc(pipeline.workers, sizeof(pthread_t));
+    int ready = pipeline.spare != NULL && pipeline.queues != NULL && args != NULL && threads != NULL;
+    for (size_t b = 0; ready && b < pipeline.bufferCount; b++)
+    {
+        pipeline.spare[b] = malloc(HASH_BLOCK);
+        ready = pipeline.spare[b] != NULL;
+        pipeline.spareCount += ready;
+    }
+    for (int w = 0; ready && w < pipeline.workers; w++)
+    {
+        pipeline.queues[w].blocks = malloc(pipeline.bufferCount * sizeof(HashBlock));
+        ready = pipeline.queues[w].blocks != NULL;
+    }
+    if (ready)
+    {
+        volumePinBuffers(volume, (void *const *)pipeline.spare, pipeline.bufferCount, HASH_BLOCK);
+    }
+
+    long result = -1;
+    int started = 0;
+    pthread_t printer;
+    int printing = 0;
+    if (ready)
+    {
+        pthread_mutex_init(&pipeline.lock, NULL);
+        pthread_cond_init(&pipeline.bufferFree, NULL);
+        pthread_cond_init(&pipeline.resultDone, NULL);
+        for (int w = 0; w < pipeline.workers; w++)
+        {
+            pthread_cond_init(&pipeline.queues[w].ready, NULL);
+        }
+        for (; started < pipeline.workers; started++)
+        {
+            args[started].pipeline = &pipeline;
+            args[started].worker = started;
+            if (pthread_create(&threads[started], NULL, hashWorker, &args[started]) != 0)
+            {
+                break;
+            }
+        }
+        printing = pthread_create(&printer, NULL, hashPrinter, &pipeline) == 0;
+    }
+    else
+    {
+        perror("Error allocating memory");
+    }
+
+    if (ready)
+    {
+        if (started > 0 && printing)
+        {
+            //blocks only go to workers that are running
+            pipeline.workers = started;
+            result = walkVolume(volume, hashWalked, &pipeline) == 0 ? 0 : -1;
+        }
+        else
+        {
+            fprintf(stderr, "Error starting hash threads\n");
+        }
+
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.readDone = 1;
+        for (int w = 0; w < started; w++)
+        {
+            pthread_cond_signal(&pipeline.queues[w].ready);
+        }
+        pthread_cond_signal(&pipeline.resultDone);
+        pthread_mutex_unlock(&pipeline.lock);
+    }
+
+    for (int w = 0; w < started; w++)
+    {
+        pthread_join(threads[w], NULL);
+    }
+    if (printing)
+    {
+        pthread_join(printer, NULL);
+    }
+
+    if (result == 0)
+    {
+        uint8_t digest[32];
+        hashFinal(&pipeline.volumeHash, digest);
+        outHex(out, digest, hashDigestLength(kind));
+        outString(out, "  /\n");
+        result = (long)pipeline.failures;
+    }
+
+    if (ready)
+    {
+        volumeUnpinBuffers(volume, (void *const *)pipeline.spare, pipeline.bufferCount);
+        for (int w = 0; w < queueCount; w++)
+        {
+            pthread_cond_destroy(&pipeline.queues[w].ready);
+        }
+        pthread_cond_destroy(&pipeline.bufferFree);
+        pthread_cond_destroy(&pipeline.resultDone);
+        pthread_mutex_destroy(&pipeline.lock);
+    }
+    //paths of results never printed (walk stopped early with nothing printed yet)
+    for (size_t r = 0; r < pipeline.resultCount; r++)
+    {
+        free(pipeline.results[r].path);
+    }
+    free(pipeline.results);
+    for (size_t b = 0; pipeline.spare != NULL && b < pipeline.spareCount; b++)
+    {
+        free(pipeline.spare[b]);
+    }
+    free(pipeline.spare);
+    for (int w = 0; pipeline.queues != NULL && w < queueCount; w++)
+    {
+        free(pipeline.queues[w].blocks);
+    }
+    free(pipeline.queues);
+    free(args);
+    free(threads);
+    return result;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        DIFF
+/////////////////////////////////////////////////////////////*/
+
+//bytes of the data area compared per task (whole clusters)
+#define DIFF_BLOCK (1u << 20)
+
+//a file or directory of one image
+typedef struct {
+    char *path;
+    DirectoryEntry entry;
+    size_t chain;  // first slot in DiffSide.chains
+    size_t length;  // clusters in the chain
+    int dirty;  // holds a cluster that changed
+} DiffFile;
+
+//one of the two images, files sorted by path
+typedef struct {
+    Volume *volume;
+    DiffFile *files;
+    size_t count;
+    size_t capacity;
+    uint32_t *chains;
+    size_t chainsUsed;
+    size_t chainsCapacity;
+    size_t *scratch;  // fileClusters output
+    int failed;
+} DiffSide;
+
+//byte range of a file, both ends included
+typedef struct {
+    uint64_t first;
+    uint64_t last;
+} DiffRange;
+
+typedef struct {
+    DiffSide sides[2];  // old, new
+    HashKind kind;
+    size_t blockClusters;
+    uint8_t *changed;  // per cluster: contents differ
+    uint8_t **buffers;  // two blocks per worker
+    atomic_size_t changedBlocks;
+    DiffRange *ranges;
+    size_t rangeCount;
+    size_t rangeCapacity;
+} Diff;
+
+//same layout: every cluster, FAT and directory is at the same offset in both
+static int sameGeometry(const Volume *a, const Volume *b)
+{
+    return a->fatType == b->fatType && a->clusterSize == b->clusterSize && a->clusterCount == b->clusterCount &&
+           a->fatOffset == b->fatOffset && a->fatSize == b->fatSize && a->rootOffset == b->rootOffset &&
+           a->dataOffset == b->dataOffset;
+}
+
+//block of the data area in memory: zero copy when mapped, else read (missing bytes read as zeros)
+static const uint8_t *diffData(const Volume *volume, off_t offset, size_t length, uint8_t *buffer)
+{
+    const uint8_t *data = volumePointer(volume, offset, length);
+    if (data != NULL)
+    {
+        return data;
+    }
+    ssize_t reading = volumeRead(volume, buffer, length, offset);
+    if (reading < 0)
+    {
+        reading = 0;
+    }
+    memset(buffer + reading, 0, length - reading);
+    return buffer;
+}
+
+//task: hash one block of both images, compare clusters only when the digests differ
+static void diffBlock(void *context, size_t block, int worker)
+{
+    Diff *diff = context;
+    const Volume *volume = diff->sides[0].volume;
+    size_t first = 2 + block * diff->blockClusters;
+    size_t count = volume->clusterCount + 2 - first;
+    if (count > diff->blockClusters)
+    {
+        count = diff->blockClusters;
+    }
+    size_t length = count * volume->clusterSize;
+    off_t offset = clusterOffset(volume, (uint32_t)first);
+
+    const uint8_t *data[2];
+    uint8_t digests[2][32];
+    for (int s = 0; s < 2; s++)
+    {
+        data[s] = diffData(diff->sides[s].volume, offset, length, diff->buffers[worker * 2 + s]);
+        Hasher hasher;
+        hashInit(&hasher, diff->kind);
+        hashUpdate(&hasher, data[s], length);
+        hashFinal(&hasher, digests[s]);
+    }
+    if (memcmp(digests[0], digests[1], hashDigestLength(diff->kind)) == 0)
+    {
+        return;
+    }
+    atomic_fetch_add_explicit(&diff->changedBlocks, 1, memory_order_relaxed);
+    for (size_t c = 0; c < count; c++)
+    {
+        size_t at = c * volume->clusterSize;
+        diff->changed[first + c] = memcmp(data[0] + at, data[1] + at, volume->clusterSize) != 0;
+    }
+}
+
+static int collectDiffFile(void *context, const WalkEntry *item)
+{
+    DiffSide *side = context;
+    const Volume *volume = side->volume;
+    if (side->count == side->capacity)
+    {
+        size_t capacity = side->capacity ? side->capacity * 2 : 256;
+        DiffFile *grown = realloc(side->files, capacity * sizeof(DiffFile));
+        if (grown == NULL)
+        {
+            perror("Error allocating memory");
+            return -1;
+        }
+        side->files = grown;
+        side->capacity = capacity;
+    }
+
+    size_t count;
+    fileClusters(volume, entryCluster(volume, item->entry), side->scratch, volume->clusterCount, &count);
+    if (side->chainsUsed + count > side->chainsCapacity)
+    {
+        size_t capacity = (side->chainsUsed + count) * 2;
+        uint32_t *grown = realloc(side->chains, capacity * sizeof(uint32_t));
+        if (grown == NULL)
+        {
+            perror("Error allocating memory");
+            return -1;
+        }
+        side->chains = grown;
+        side->chainsCapacity = capacity;
+    }
+    for (size_t p = 0; p < count; p++)
+    {
+        side->chains[side->chainsUsed + p] = (uint32_t)side->scratch[p];
+    }
+
+    DiffFile *file = &side->files[side->count];
+    file->path = strdup(item->path);
+    if (file->path == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    file->entry = *item->entry;
+    file->chain = side->chainsUsed;
+    file->length = count;
+    file->dirty = 0;
+    side->chainsUsed += count;
+    side->count++;
+    return 0;
+}
+
+static int compareDiffFiles(const void *a, const void *b)
+{
+    return strcmp(((const DiffFile *)a)->path, ((const DiffFile *)b)->path);
+}
+
+//every file and directory of an image, sorted by path
+static int collectDiffSide(DiffSide *side)
+{
+    side->scratch = malloc((side->volume->clusterCount + 1) * sizeof(size_t));
+    if (side->scratch == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    if (walkVolume(side->volume, collectDiffFile, side) != 0)
+    {
+        return -1;
+    }
+    qsort(side->files, side->count, sizeof(DiffFile), compareDiffFiles);
+    return 0;
+}
+
+static void freeDiffSide(DiffSide *side)
+{
+    for (size_t f = 0; f < side->count; f++)
+    {
+        free(side->files[f].path);
+    }
+    free(side->files);
+    free(side->chains);
+    free(side->scratch);
+}
+
+//mark files of a side that hold a changed cluster
+static void markDirtyFiles(Diff *diff, DiffSide *side)
+{
+    for (size_t f = 0; f < side->count; f++)
+    {
+        DiffFile *file = &side->files[f];
+        for (size_t p = 0; p < file->length && !file->dirty; p++)
+        {
+            file->dirty = diff->changed[side->chains[file->chain + p]];
+        }
+    }
+}
+
+//add a range, joined to the previous one when they touch
+static int addDiffRange(Diff *diff, uint64_t first, uint64_t last)
+{
+    if (diff->rangeCount > 0 && diff->ranges[diff->rangeCount - 1].last + 1 >= first)
+    {
+        diff->ranges[diff->rangeCount - 1].last = last;
+        return 0;
+    }
+    if (diff->rangeCount == diff->rangeCapacity)
+    {
+        size_t capacity = diff->rangeCapacity ? diff->rangeCapacity * 2 : 16;
+        DiffRange *grown = realloc(diff->ranges, capacity * sizeof(DiffRange));
+        if (grown == NULL)
+        {
+            perror("Error allocating memory");
+            return -1;
+        }
+        diff->ranges = grown;
+        diff->rangeCapacity = capacity;
+    }
+    diff->ranges[diff->rangeCount++] = (DiffRange){ first, last };
+    return 0;
+}
+
+//byte ranges where two versions of a file differ, into diff->ranges
+//a cluster is compared only when it changed or the chains part there
+static int diffFileRanges(Diff *diff, const DiffFile *a, const DiffFile *b, uint8_t *buffers)
+{
+    const Volume *volume = diff->sides[0].volume;
+    size_t clusterSize = volume->clusterSize;
+    const uint32_t *chainA = diff->sides[0].chains + a->chain;
+    const uint32_t *chainB = diff->sides[1].chains + b->chain;
+    uint64_t common = a->entry.DIR_FileSize < b->entry.DIR_FileSize ? a->entry.DIR_FileSize : b->entry.DIR_FileSize;
+    diff->rangeCount = 0;
+
+    for (size_t p = 0; (uint64_t)p * clusterSize < common; p++)
+    {
+        uint64_t start = (uint64_t)p * clusterSize;
+        size_t bytes = common - start < clusterSize ? (size_t)(common - start) : clusterSize;
+        uint32_t clusterA = p < a->length ? chainA[p] : 0;
+        uint32_t clusterB = p < b->length ? chainB[p] : 0;
+        if (clusterA == clusterB && (clusterA == 0 || !diff->changed[clusterA]))
+        {
+            continue;
+        }
+        //a chain shorter than its size: the rest cannot be compared
+        if (clusterA == 0 || clusterB == 0)
+        {
+            if (addDiffRange(diff, start, start + bytes - 1) == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+        const uint8_t *dataA = diffData(diff->sides[0].volume, clusterOffset(volume, clusterA), bytes, buffers);
+        const uint8_t *dataB = diffData(diff->sides[1].volume, clusterOffset(volume, clusterB), bytes, buffers + clusterSize);
+        if (memcmp(dataA, dataB, bytes) == 0)
+        {
+            continue;
+        }
+        size_t first = 0;
+        size_t last = bytes - 1;
+        while (dataA[first] == dataB[first])
+        {
+            first++;
+        }
+        while (dataA[last] == dataB[last])
+        {
+            last--;
+        }
+        if (addDiffRange(diff, start + first, start + last) == -1)
+        {
+            return -1;
+        }
+    }
+    //grown or cut
+    uint64_t longer = a->entry.DIR_FileSize > b->entry.DIR_FileSize ? a->entry.DIR_FileSize : b->entry.DIR_FileSize;
+    if (longer > common && addDiffRange(diff, common, longer - 1) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static void outDiffFile(Output *out, const char *change, const DiffFile *file)
+{
+    outString(out, change);
+    outString(out, file->path);
+    if (file->entry.DIR_Attr & 0x10)
+    {
+        outChar(out, '/');
+    }
+    else
+    {
+        outString(out, "  ");
+        outUnsigned(out, file->entry.DIR_FileSize);
+        outString(out, " bytes");
+    }
+    outChar(out, '\n');
+}
+
+//compare two images of the same geometry and list added, removed and modified files
+//changed clusters are found block by block (one task per block, digests first), then
+//mapped to files through both FATs; only files holding one are compared byte by byte
+//returns 0 if the files are the same, 1 if they differ, -1 on error
+int diffVolumes(Volume *old, Volume *new, const char *oldName, const char *newName, HashKind kind, int workers, size_t blockBytes, Output *out)
+{
+    if (!sameGeometry(old, new))
+    {
+        fprintf(stderr, "Images have different geometry: %s, %s\n", oldName, newName);
+        return -1;
+    }
+
+    Diff diff = { 0 };
+    diff.sides[0].volume = old;
+    diff.sides[1].volume = new;
+    diff.kind = kind;
+    diff.blockClusters = blockBytes / old->clusterSize > 0 ? blockBytes / old->clusterSize : 1;
+    size_t blocks = (old->clusterCount + diff.blockClusters - 1) / diff.blockClusters;
+    if (workers < 1)
+    {
+        workers = 1;
+    }
+    diff.changed = calloc(old->clusterCount + 2, 1);
+    int status = diff.changed != NULL ? 0 : -1;
+    uint8_t *compare = malloc(2 * old->clusterSize);
+    if (compare == NULL)
+    {
+        status = -1;
+    }
+    //blocks of images that are not mapped (or end early) are read into these
+    diff.buffers = status == 0 ? calloc(2 * workers, sizeof(uint8_t *)) : NULL;
+    status = diff.buffers != NULL ? 0 : -1;
+    for (int b = 0; status == 0 && b < 2 * workers; b++)
+    {
+        diff.buffers[b] = malloc(diff.blockClusters * old->clusterSize);
+        status = diff.buffers[b] != NULL ? 0 : -1;
+    }
+    if (status == -1)
+    {
+        perror("Error allocating memory");
+    }
+
+    if (status == 0)
+    {
+        runWorkPool(blocks, workers, diffBlock, &diff);
+        if (collectDiffSide(&diff.sides[0]) == -1 || collectDiffSide(&diff.sides[1]) == -1)
+        {
+            status = -1;
+        }
+    }
+
+    size_t changedClusters = 0;
+    size_t added = 0;
+    size_t removed = 0;
+    size_t modified = 0;
+    if (status == 0)
+    {
+        for (size_t c = 2; c < old->clusterCount + 2; c++)
+        {
+            changedClusters += diff.changed[c];
+        }
+        markDirtyFiles(&diff, &diff.sides[0]);
+        markDirtyFiles(&diff, &diff.sides[1]);
+
+        DiffSide *before = &diff.sides[0];
+        DiffSide *after = &diff.sides[1];
+        size_t i = 0;
+        size_t j = 0;
+        while ((i < before->count || j < after->count) && status == 0)
+        {
+            int order = i == before->count ? 1 : j == after->count ? -1 : strcmp(before->files[i].path, after->files[j].path);
+            if (order < 0)
+            {
+                outDiffFile(out, "removed   ", &before->files[i++]);
+                removed++;
+                continue;
+            }
+            if (order > 0)
+            {
+                outDiffFile(out, "added     ", &after->files[j++]);
+                added++;
+                continue;
+            }
+
+            const DiffFile *a = &before->files[i++];
+            const DiffFile *b = &after->files[j++];
+            int directoryA = (a->entry.DIR_Attr & 0x10) != 0;
+            int directoryB = (b->entry.DIR_Attr & 0x10) != 0;
+            if (directoryA != directoryB)
+            {
+                outDiffFile(out, "removed   ", a);
+                outDiffFile(out, "added     ", b);
+                removed++;
+                added++;
+                continue;
+            }
+            //a directory's changes show up as changes of its entries
+            if (directoryA)
+            {
+                continue;
+            }
+            int chainsDiffer = a->length != b->length ||
+                               memcmp(before->chains + a->chain, after->chains + b->chain, a->length * sizeof(uint32_t)) != 0;
+            if (!a->dirty && !b->dirty && !chainsDiffer && a->entry.DIR_FileSize == b->entry.DIR_FileSize)
+            {
+                continue;
+            }
+            if (diffFileRanges(&diff, a, b, compare) == -1)
+            {
+                status = -1;
+                break;
+            }
+            if (diff.rangeCount == 0)
+            {
+                continue;
+            }
+            modified++;
+            outString(out, "modified  ");
+            outString(out, b->path);
+            outString(out, "  ");
+            for (size_t r = 0; r < diff.rangeCount; r++)
+            {
+                if (r > 0)
+                {
+                    outChar(out, ',');
+                }
+                outUnsigned(out, diff.ranges[r].first);
+                outChar(out, '-');
+                outUnsigned(out, diff.ranges[r].last);
+            }
+            outChar(out, '\n');
+        }
+    }
+
+    if (status == 0)
+    {
+        outString(out, oldName);
+        outString(out, " -> ");
+        outString(out, newName);
+        outString(out, ": ");
+        outUnsigned(out, added);
+        outString(out, " added, ");
+        outUnsigned(out, removed);
+        outString(out, " removed, ");
+        outUnsigned(out, modified);
+        outString(out, " modified (");
+        outUnsigned(out, changedClusters);
+        outString(out, " changed clusters in ");
+        outUnsigned(out, atomic_load(&diff.changedBlocks));
+        outString(out, " of ");
+        outUnsigned(out, blocks);
+        outString(out, " blocks)\n");
+    }
+
+    if (diff.buffers != NULL)
+    {
+        for (int b = 0; b < 2 * workers; b++)
+        {
+            free(diff.buffers[b]);
+        }
+        free(diff.buffers);
+    }
+    freeDiffSide(&diff.sides[0]);
+    freeDiffSide(&diff.sides[1]);
+    free(diff.ranges);
+    free(diff.changed);
+    free(compare);
+    if (status == -1)
+    {
+        return -1;
+    }
+    return added + removed + modified > 0 ? 1 : 0;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        BENCHMARK
+/////////////////////////////////////////////////////////////*/
+
+//rounds of each stage; the best and the median round are reported
+#define BENCH_ROUNDS 5
+//boot sector parses per round
+#define BENCH_PARSES 100000
+//open and close cycles per round
+#define BENCH_OPENS 50
+//random reads per round and their size
+#define BENCH_RANDOM_READS 4096
+#define BENCH_RANDOM_SIZE 4096
+//buffer of sequential reads
+#define BENCH_READ_BUFFER (1u << 20)
+
+typedef struct {
+    DirectoryEntry entry;
+    char *path;
+} BenchFile;
+
+//the image and everything the stages need, gathered once before timing
+typedef struct {
+    Volume *volume;
+    const char *image;
+    BenchFile *files;
+    size_t fileCount;
+    size_t fileCapacity;
+    uint32_t *directories;  // first cluster of every directory, 0 = root
+    size_t directoryCount;
+    size_t directoryCapacity;
+    size_t longNames;
+    uint64_t bytes;  // bytes in all files
+    uint64_t fragments;  // runs over all files
+    File **opened;  // non empty files, open for the random reads
+    size_t openedCount;
+    size_t *order;  // lookup order, shuffled
+    size_t *clusters;  // fileClusters output, one slot per cluster of the volume
+    uint64_t *freeBits;
+    uint8_t *buffer;
+    uint64_t seed;
+    volatile uint64_t sink;  // results nothing reads, so the work is not optimised away
+} Bench;
+
+//one round of a stage: fills the operations done and bytes moved, -1 on error
+typedef int (*BenchFunction)(Bench *bench, uint64_t *ops, uint64_t *bytes);
+
+typedef struct {
+    const char *name;
+    const char *unit;  // what one operation is
+    BenchFunction run;
+} BenchStage;
+
+//readDisk without the printing: copy the boot sector and work out the regions from it
+static int benchBootSector(Bench *bench, uint64_t *ops, uint64_t *bytes)
+{
+    //read through a volatile pointer so every round really parses
+    const BootSector *volatile source = bench->volume->bootSector;
+    Volume scratch;
+    memset(&scratch, 0, sizeof(scratch));
+    scratch.imageSize = bench->volume->imageSize;
+    BootSector bootSector;
+    uint64_t total = 0;
+    for (size_t i = 0; i < BENCH_PARSES; i++)
+    {
+        memcpy(&bootSector, source, sizeof(BootSector));
+        scratch.bootSector = &bootSector;
+        if (volumeGeometry(&scratch) == -1)
+        {
+            return -1;
+        }
+        total += scratch.clusterCount + (uint64_t)scratch.dataOffset;
+    }
+    bench->sink = total;
+    *ops = BENCH_PARSES;
+    *bytes = 0;
+    return 0;
+}
+
+//whole openVolume: backend, geometry and the metadata copy when not mapped
+static int benchOpen(Bench *bench, uint64_t *ops, uint64_t *bytes)
+{
+    for (size_t i = 0; i < BENCH_OPENS; i++)
+    {
+        Volume *volume = openVolume(bench->image);
+        if (volume == NULL)
+        {
+            return -1;
+        }
+        closeVolume(volume);
+    }
+    *ops = BENCH_OPENS;
+    *bytes = 0;
+    return 0;
+}
+
+//loadFAT and a pass over every entry (the free space scan of stats)
+static int benchFatScan(Bench *bench, uint64_t *ops, uint64_t *bytes)
+{
+    Volume *volume = bench->volume;
+    size_t fatSize;
+    loadFAT(volume, &fatSize);
+    FatCounts counts;
+    memset(bench->freeBits, 0, ((volume->clusterCount + 63) / 64 + 1) * sizeof(uint64_t));
+    scanFat(volume, 2, volume->clusterCount + 2, &counts, bench->freeBits);
+    bench->sink = counts.free;
+    *ops = volume->clusterCount;
+    *bytes = (uint64_t)volume->clusterCount * (volume->fat32 != NULL ? sizeof(uint32_t) : sizeof(uint16_t));
+    return 0;
+}
+
+//every file's chain with the original fileClusters, one FAT lookup per cluster
+static int benchChains(Bench *bench, uint64_t *ops, uint64_t *bytes)
+{
+    Volume *volume = bench->volume;
+    uint64_t total = 0;
+    for (size_t f = 0; f < bench->fileCount; f++)
+    {
+        size_t count;
+        fileClusters(volume, entryCluster(volume, &bench->files[f].entry), bench->clusters, volume->clusterCount, &count);
+        total += count;
+    }
+    *ops = total;
+    *bytes = 0;
+    return 0;
+}
+
+//every file's chain as runs, as openFile builds it
+static int benchExtentMaps(Bench *bench, uint64_t *ops, uint64_t *bytes)
+{
+    uint64_t runs = 0;
+    for (size_t f = 0; f < bench->fileCount; f++)
+    {
+        ExtentMap map;
+        if (buildExtentMap(bench->volume, entryCluster(bench->volume, &bench->files[f].entry), &map) == -1)
+        {
+            return -1;
+        }
+        runs += map.count;
+        freeExtentMap(&map);
+    }
+    bench->sink = runs;
+    *ops = bench->fileCount;
+    *bytes = 0;
+    return 0;
+}
+
+static int countWalked(void *context, const WalkEntry *item)
+{
+    (void)item;
+    (*(uint64_t *)context)++;
+    return 0;
+}
+
+//the whole tree through the walker, as ls -R does
+static int benchList(Bench *bench, uint64_t *ops, uint64_t *bytes)
+{
+    uint64_t entries = 0;
+    if (walkVolume(bench->volume, countWalked, &entries) != 0)
+    {
+        return -1;
+    }
+    *ops = entries;
+    *bytes = 0;
+    return 0;
+}
+
+//drop the directory indexes and build every one again
+static int benchIndex(Bench *bench, uint64_t *ops, uint64_t *bytes)
+{
+    freeDirectoryIndexes(bench->volume);
+    for (size_t d = 0; d < bench->directoryCount; d++)
+    {
+        if (directoryIndex(bench->volume, bench->directories[d]) == NULL)
+        {
+            return -1;
+        }
+    }
+    *ops = bench->directoryCount;
+    *bytes = 0;
+    return 0;
+}
+
+//openFile and closeFile on every path, in random order
+static int benchLookup(Bench *bench, uint64_t *ops, uint64_t *bytes)
+{
+    for (size_t i = 0; i < bench->fileCount; i++)
+    {
+        File *file = openFile(bench->volume, bench->files[bench->order[i]].path);
+        if (file == NULL)
+        {
+            return -1;
+        }
+        closeFile(file);
+    }
+    *ops = bench->fileCount;
+    *bytes = 0;
+    return 0;
+}
+
+//every file from start to end with readFile
+static int benchReadSequential(Bench *bench, uint64_t *ops, uint64_t *bytes)
+{
+    uint64_t total = 0;
+    for (size_t f = 0; f < bench->fileCount; f++)
+    {
+        File *file = openEntry(bench->volume, &bench->files[f].entry);
+        if (file == NULL)
+        {
+            return -1;
+        }
+        size_t reading;
+        while ((reading = readFile(file, bench->buffer, BENCH_READ_BUFFER)) > 0)
+        {
+            total += reading;
+        }
+        closeFile(file);
+    }
+    *ops = bench->fileCount;
+    *bytes = total;
+    return 0;
+}
+
+//small reads at random aligned offsets of random files (same sequence every round)
+static int benchReadRandom(Bench *bench, uint64_t *ops, uint64_t *bytes)
+{
+    uint64_t random = bench->seed;
+    uint64_t total = 0;
+    size_t reads = bench->openedCount > 0 ? BENCH_RANDOM_READS : 0;
+    for (size_t i = 0; i < reads; i++)
+    {
+        File *file = bench->opened[synthRandom(&random) % bench->openedCount];
+        uint64_t offset = synthRandom(&random) % file->fileLength / BENCH_RANDOM_SIZE * BENCH_RANDOM_SIZE;
+        seekFile(file, (off_t)offset, SEEK_SET);
+        total += readFile(file, bench->buffer, BENCH_RANDOM_SIZE);
+    }
+    *ops = reads;
+    *bytes = total;
+    return 0;
+}
+
+static const BenchStage benchStages[] = {
+    { "boot-sector", "parse", benchBootSector },
+    { "open", "open", benchOpen },
+    { "fat-scan", "cluster", benchFatScan },
+    { "chains", "cluster", benchChains },
+    { "extent-maps", "file", benchExtentMaps },
+    { "list", "entry", benchList },
+    { "index", "directory", benchIndex },
+    { "lookup", "file", benchLookup },
+    { "read-seq", "file", benchReadSequential },
+    { "read-random", "read", benchReadRandom },
+};
+
+static int collectBenchEntry(void *context, const WalkEntry *item)
+{
+    Bench *bench = context;
+    const DirectoryEntry *entry = item->entry;
+    //volume label is not a file
+    if (entry->DIR_Attr & 0x08)
+    {
+        return 0;
+    }
+    bench->longNames += item->longName != NULL;
+
+    if (entry->DIR_Attr & 0x10)
+    {
+        if (bench->directoryCount == bench->directoryCapacity)
+        {
+            size_t capacity = bench->directoryCapacity * 2;
+            uint32_t *grown = realloc(bench->directories, capacity * sizeof(uint32_t));
+            if (grown == NULL)
+            {
+                perror("Error allocating memory");
+                return -1;
+            }
+            bench->directories = grown;
+            bench->directoryCapacity = capacity;
+        }
+        bench->directories[bench->directoryCount++] = entryCluster(bench->volume, entry);
+        return 0;
+    }
+
+    if (bench->fileCount == bench->fileCapacity)
+    {
+        size_t capacity = bench->fileCapacity ? bench->fileCapacity * 2 : 256;
+        BenchFile *grown = realloc(bench->files, capacity * sizeof(BenchFile));
+        if (grown == NULL)
+        {
+            perror("Error allocating memory");
+            return -1;
+        }
+        bench->files = grown;
+        bench->fileCapacity = capacity;
+    }
+    BenchFile *file = &bench->files[bench->fileCount];
+    file->entry = *entry;
+    file->path = strdup(item->path);
+    if (file->path == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    bench->fileCount++;
+    bench->bytes += entry->DIR_FileSize;
+    return 0;
+}
+
+static void freeBench(Bench *bench)
+{
+    for (size_t f = 0; f < bench->fileCount; f++)
+    {
+        free(bench->files[f].path);
+    }
+    for (size_t f = 0; f < bench->openedCount; f++)
+    {
+        closeFile(bench->opened[f]);
+    }
+    free(bench->files);
+    free(bench->directories);
+    free(bench->opened);
+    free(bench->order);
+    free(bench->clusters);
+    free(bench->freeBits);
+    free(bench->buffer);
+}
+
+//tree, open files and buffers for the stages
+static int prepareBench(Bench *bench)
+{
+    Volume *volume = bench->volume;
+    bench->directoryCapacity = 64;
+    bench->directories = malloc(bench->directoryCapacity * sizeof(uint32_t));
+    if (bench->directories == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+    bench->directories[bench->directoryCount++] = 0;
+    if (walkVolume(volume, collectBenchEntry, bench) != 0)
+    {
+        return -1;
+    }
+
+    bench->opened = malloc((bench->fileCount + 1) * sizeof(File *));
+    bench->order = malloc((bench->fileCount + 1) * sizeof(size_t));
+    bench->clusters = malloc((volume->clusterCount + 1) * sizeof(size_t));
+    bench->freeBits = malloc(((volume->clusterCount + 63) / 64 + 1) * sizeof(uint64_t));
+    bench->buffer = malloc(BENCH_READ_BUFFER);
+    if (bench->opened == NULL || bench->order == NULL || bench->clusters == NULL || bench->freeBits == NULL || bench->buffer == NULL)
+    {
+        perror("Error allocating memory");
+        return -1;
+    }
+
+    uint64_t random = bench->seed;
+    for (size_t f = 0; f < bench->fileCount; f++)
+    {
+        //Fisher-Yates, inside out
+        size_t swap = synthRandom(&random) % (f + 1);
+        bench->order[f] = bench->order[swap];
+        bench->order[swap] = f;
+
+        if (bench->files[f].entry.DIR_FileSize == 0)
+        {
+            continue;
+        }
+        File *file = openEntry(volume, &bench->files[f].entry);
+        if (file == NULL)
+        {
+            fprintf(stderr, "Skipping %s in the read stages\n", bench->files[f].path);
+            continue;
+        }
+        bench->fragments += file->extents.count;
+        bench->opened[bench->openedCount++] = file;
+    }
+    return 0;
+}
+
+static int compareNanoseconds(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+//number with three decimals
+static void outDecimal(Output *out, double value)
+{
+    char text[64];
+    snprintf(text, sizeof(text), "%.3f", value);
+    outString(out, text);
+}
+
+static void outBenchField(Output *out, const char *name, uint64_t value)
+{
+    outString(out, ",\"");
+    outString(out, name);
+    outString(out, "\":");
+    outUnsigned(out, value);
+}
+
+//time the stages (all, or the ones named) on an image and write one JSON document
+//each stage runs rounds times; ns_per_op and mib_per_s come from the best round
+int runBenchmark(Volume *volume, const char *image, int rounds, char **stages, int stageCount, Output *out)
+{
+    Bench bench;
+    memset(&bench, 0, sizeof(bench));
+    bench.volume = volume;
+    bench.image = image;
+    bench.seed = 0x9E3779B97F4A7C15ULL;
+    uint64_t *times = malloc(rounds * sizeof(uint64_t));
+    if (times == NULL || prepareBench(&bench) == -1)
+    {
+        if (times == NULL)
+        {
+            perror("Error allocating memory");
+        }
+        free(times);
+        freeBench(&bench);
+        return -1;
+    }
+
+    const char *backend = volume->backend->memory != NULL ? "mmap" : volume->backend->readBatch != NULL ? "io_uring" : "pread";
+    outString(out, "{\"image\":");
+    outJsonString(out, image);
+    outString(out, ",\"backend\":\"");
+    outString(out, backend);
+    outChar(out, '"');
+    outBenchField(out, "cluster_size", volume->clusterSize);
+    outBenchField(out, "clusters", volume->clusterCount);
+    outBenchField(out, "files", bench.fileCount);
+    outBenchField(out, "directories", bench.directoryCount);
+    outBenchField(out, "long_names", bench.longNames);
+    outBenchField(out, "bytes", bench.bytes);
+    outBenchField(out, "fragments", bench.fragments);
+    outBenchField(out, "rounds", rounds);
+    outString(out, ",\"stages\":[");
+
+    int status = 0;
+    int written = 0;
+    for (size_t s = 0; s < sizeof(benchStages) / sizeof(benchStages[0]) && status == 0; s++)
+    {
+        const BenchStage *stage = &benchStages[s];
+        int wanted = stageCount == 0;
+        for (int i = 0; i < stageCount && !wanted; i++)
+        {
+            wanted = strcmp(stages[i], stage->name) == 0;
+        }
+        if (!wanted)
+        {
+            continue;
+        }
+
+        uint64_t ops = 0;
+        uint64_t bytes = 0;
+        for (int r = 0; r < rounds && status == 0; r++)
+        {
+            uint64_t start = monotonicNanoseconds();
+            status = stage->run(&bench, &ops, &bytes);
+            times[r] = monotonicNanoseconds() - start;
+        }
+        if (status != 0)
+        {
+            fprintf(stderr, "Stage %s failed\n", stage->name);
+            break;
+        }
+        qsort(times, rounds, sizeof(uint64_t), compareNanoseconds);
+        uint64_t best = times[0] > 0 ? times[0] : 1;
+
+        outString(out, written++ ? ",\n" : "\n");
+        outString(out, "{\"stage\":\"");
+        outString(out, stage->name);
+        outString(out, "\",\"unit\":\"");
+        outString(out, stage->unit);
+        outChar(out, '"');
+        outBenchField(out, "ops", ops);
+        outBenchField(out, "bytes", bytes);
+        outBenchField(out, "best_ns", times[0]);
+        outBenchField(out, "median_ns", times[rounds / 2]);
+        outString(out, ",\"ns_per_op\":");
+        outDecimal(out, ops > 0 ? (double)times[0] / ops : 0.0);
+        outString(out, ",\"mib_per_s\":");
+        outDecimal(out, (double)bytes / (1 << 20) / (best / 1e9));
+        outChar(out, '}');
+    }
+    outString(out, "\n]}\n");
+
+    free(times);
+    freeBench(&bench);
+    return status;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        PROFILE REPORT
+/////////////////////////////////////////////////////////////*/
+
+//what the value of a trace event counts, per operation (NULL: no value)
+static const char *const profileValueNames[PROFILE_OPERATIONS] = {
+    "status", NULL, "bytes", "clusters", "clusters", "entries", "entries", "bytes", "bytes", NULL, "bytes"
+};
+
+//report written to a path, "-" for stderr
+static Output *openReport(const char *path)
+{
+    Output *out = calloc(1, sizeof(Output));
+    if (out == NULL)
+    {
+        perror("Error allocating memory");
+        return NULL;
+    }
+    out->fdesc = strcmp(path, "-") == 0 ? STDERR_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out->fdesc == -1)
+    {
+        perror(path);
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static int closeReport(Output *out, const char *path)
+{
+    outFlush(out);
+    int failed = out->failed;
+    if (out->fdesc != STDERR_FILENO && close(out->fdesc) == -1)
+    {
+        failed = 1;
+    }
+    if (failed)
+    {
+        fprintf(stderr, "Error writing %s\n", path);
+    }
+    free(out);
+    return failed ? -1 : 0;
+}
+
+//counters, then one latency histogram per operation that ran
+static void writeProfile(Output *out, uint64_t elapsed)
+{
+    outString(out, "{\"elapsed_ns\":");
+    outUnsigned(out, elapsed);
+    outString(out, ",\"counters\":{");
+    for (int c = 0; c < COUNT_COUNTERS; c++)
+    {
+        outString(out, c > 0 ? ",\"" : "\"");
+        outString(out, profileCounterNames[c]);
+        outString(out, "\":");
+        outUnsigned(out, atomic_load(&profile.counters[c]));
+    }
+    outString(out, "},\"operations\":[");
+
+    int written = 0;
+    for (int o = 0; o < PROFILE_OPERATIONS; o++)
+    {
+        ProfileHistogram *histogram = &profile.histograms[o];
+        uint64_t count = atomic_load(&histogram->count);
+        if (count == 0)
+        {
+            continue;
+        }
+        uint64_t total = atomic_load(&histogram->totalNs);
+        outString(out, written++ ? ",\n" : "\n");
+        outString(out, "{\"name\":\"");
+        outString(out, profileOperationNames[o]);
+        outString(out, "\",\"count\":");
+        outUnsigned(out, count);
+        outString(out, ",\"total_ns\":");
+        outUnsigned(out, total);
+        outString(out, ",\"mean_ns\":");
+        outDecimal(out, (double)total / count);
+        outString(out, ",\"max_ns\":");
+        outUnsigned(out, atomic_load(&histogram->maxNs));
+        //[lowest ns of the bucket, operations in it], empty buckets left out
+        outString(out, ",\"histogram\":[");
+        int bucketsWritten = 0;
+        for (int b = 0; b < PROFILE_BUCKETS; b++)
+        {
+            uint64_t inBucket = atomic_load(&histogram->buckets[b]);
+            if (inBucket == 0)
+            {
+                continue;
+            }
+            outString(out, bucketsWritten++ ? ",[" : "[");
+            outUnsigned(out, b == 0 ? 0 : (uint64_t)1 << b);
+            outChar(out, ',');
+            outUnsigned(out, inBucket);
+            outChar(out, ']');
+        }
+        outString(out, "]}");
+    }
+    outString(out, "\n]}\n");
+}
+
+//Chrome trace event format (chrome://tracing, Perfetto): one complete event per timed operation
+static void writeTrace(Output *out)
+{
+    size_t count = atomic_load(&profile.eventCount);
+    size_t dropped = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+    count -= dropped;
+    uint64_t process = (uint64_t)getpid();
+
+    outString(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    for (size_t e = 0; e < count; e++)
+    {
+        const TraceEvent *event = &profile.events[e];
+        const char *category = profileOperationNames[event->operation];
+        outString(out, e > 0 ? ",\n{\"name\":\"" : "\n{\"name\":\"");
+        outString(out, event->label != NULL ? event->label : category);
+        outString(out, "\",\"cat\":\"");
+        outString(out, category);
+        outString(out, "\",\"ph\":\"X\",\"pid\":");
+        outUnsigned(out, process);
+        outString(out, ",\"tid\":");
+        outUnsigned(out, event->thread);
+        //microseconds
+        outString(out, ",\"ts\":");
+        outDecimal(out, event->start / 1e3);
+        outString(out, ",\"dur\":");
+        outDecimal(out, event->duration / 1e3);
+        const char *valueName = profileValueNames[event->operation];
+        if (valueName != NULL)
+        {
+            outString(out, ",\"args\":{\"");
+            outString(out, valueName);
+            outString(out, "\":");
+            outUnsigned(out, event->value);
+            outChar(out, '}');
+        }
+        outChar(out, '}');
+    }
+    outString(out, "\n],\"otherData\":{\"dropped_events\":");
+    outUnsigned(out, dropped);
+    outString(out, "}}\n");
+}
+
+//stop profiling and write the reports asked for, -1 if one could not be written
+int profileFinish(void)
+{
+    if (!profile.enabled)
+    {
+        return 0;
+    }
+    uint64_t elapsed = monotonicNanoseconds() - profile.origin;
+    //the reports' own writes are not counted
+    profile.enabled = 0;
+
+    int status = 0;
+    if (profile.profilePath != NULL)
+    {
+        Output *out = openReport(profile.profilePath);
+        if (out == NULL)
+        {
+            status = -1;
+        }
+        else
+        {
+            writeProfile(out, elapsed);
+            status |= closeReport(out, profile.profilePath);
+        }
+    }
+    if (profile.tracePath != NULL)
+    {
+        Output *out = openReport(profile.tracePath);
+        if (out == NULL)
+        {
+            status = -1;
+        }
+        else
+        {
+            writeTrace(out);
+            status |= closeReport(out, profile.tracePath);
+        }
+    }
+    free(profile.events);
+    profile.events = NULL;
+    return status;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        LISTING FORMATS
+/////////////////////////////////////////////////////////////*/
+
+typedef enum {
+    LIST_TEXT,  // aligned columns for people
+    LIST_JSONL,  // one JSON object per line
+    LIST_CSV,  // header line, then one row per entry
+    LIST_BINARY  // ListingRecord, then image and path bytes
+} ListFormat;
+
+//binary listing record, little-endian, followed by imageLength + pathLength bytes
+typedef struct __attribute__((__packed__)) {
+    uint32_t size;  // DIR_FileSize
+    uint32_t cluster;  // first cluster
+    uint8_t attributes;  // DIR_Attr bits
+    uint8_t hasLongName;  // 1 if the last path component is a long name
+    uint16_t writeDate;  // DIR_WrtDate (raw FAT date)
+    uint16_t writeTime;  // DIR_WrtTime (raw FAT time)
+    uint16_t createDate;  // DIR_CrtDate
+    uint16_t createTime;  // DIR_CrtTime
+    uint8_t shortName[11];  // DIR_Name as stored
+    uint8_t reserved;  // 0
+    uint16_t imageLength;  // bytes of image path that follow
+    uint16_t pathLength;  // bytes of entry path that follow the image path
+} ListingRecord;
+
+//where listing records go and how they look
+typedef struct {
+    Output *out;
+    ListFormat format;
+    const char *image;  // image path, part of every machine readable record
+    const Volume *volume;
+} Listing;
+
+//"text", "jsonl", "csv" or "binary", -1 if unknown
+int parseListFormat(const char *name)
+{
+    const char *names[] = { "text", "jsonl", "csv", "binary" };
+    for (int f = 0; f < 4; f++)
+    {
+        if (strcmp(name, names[f]) == 0)
+        {
+            return f;
+        }
+    }
+    return -1;
+}
+
+//one record for one entry; name is what the text format shows, path is the full path
+void emitListing(Listing *listing, const char *path, const char *name, const DirectoryEntry *entry, const char *longName)
+{
+    Output *out = listing->out;
+    char shortName[13];
+    uint32_t cluster = entryCluster(listing->volume, entry);
+
+    switch (listing->format)
+    {
+        case LIST_TEXT:
+            //attributes, size, date, first cluster, name
+            outAttributes(out, entry->DIR_Attr);
+            outChar(out, ' ');
+            outUnsignedPadded(out, entry->DIR_FileSize, 10, ' ');
+            outChar(out, ' ');
+            outDateTime(out, entry->DIR_WrtDate, entry->DIR_WrtTime);
+            outChar(out, ' ');
+            outUnsignedPadded(out, cluster, 5, ' ');
+            outChar(out, ' ');
+            outString(out, name);
+            outChar(out, '\n');
+            break;
+
+        case LIST_JSONL:
+            shortNameToString(entry->DIR_Name, shortName);
+            outString(out, "{\"image\":");
+            outJsonString(out, listing->image);
+            outString(out, ",\"path\":");
+            outJsonString(out, path);
+            outString(out, ",\"short_name\":");
+            outJsonString(out, shortName);
+            outString(out, ",\"long_name\":");
+            if (longName != NULL)
+            {
+                outJsonString(out, longName);
+            }
+            else
+            {
+                outString(out, "null");
+            }
+            outString(out, ",\"size\":");
+            outUnsigned(out, entry->DIR_FileSize);
+            outString(out, ",\"cluster\":");
+            outUnsigned(out, cluster);
+            outString(out, ",\"attributes\":");
+            outUnsigned(out, entry->DIR_Attr);
+            outString(out, ",\"flags\":\"");
+            outAttributes(out, entry->DIR_Attr);
+            outString(out, "\",\"directory\":");
+            outString(out, (entry->DIR_Attr & 0x10) ? "true" : "false");
+            outString(out, ",\"modified\":\"");
+            outDateTime(out, entry->DIR_WrtDate, entry->DIR_WrtTime);
+            outString(out, "\",\"created\":\"");
+            outDateTime(out, entry->DIR_CrtDate, entry->DIR_CrtTime);
+            outString(out, "\"}\n");
+            break;
+
+        case LIST_CSV:
+            if (!out->headerWritten)
+            {
+                outString(out, "image,path,short_name,long_name,size,cluster,attributes,flags,modified,created\n");
+                out->headerWritten = 1;
+            }
+            shortNameToString(entry->DIR_Name, shortName);
+            outCsvField(out, listing->image);
+            outChar(out, ',');
+            outCsvField(out, path);
+            outChar(out, ',');
+            outCsvField(out, shortName);
+            outChar(out, ',');
+            outCsvField(out, longName != NULL ? longName : "");
+            outChar(out, ',');
+            outUnsigned(out, entry->DIR_FileSize);
+            outChar(out, ',');
+            outUnsigned(out, cluster);
+            outChar(out, ',');
+            outUnsigned(out, entry->DIR_Attr);
+            outChar(out, ',');
+            outAttributes(out, entry->DIR_Attr);
+            outChar(out, ',');
+            outDateTime(out, entry->DIR_WrtDate, entry->DIR_WrtTime);
+            outChar(out, ',');
+            outDateTime(out, entry->DIR_CrtDate, entry->DIR_CrtTime);
+            outChar(out, '\n');
+            break;
+
+        case LIST_BINARY:
+        {
+            size_t imageLength = strlen(listing->image);
+            size_t pathLength = strlen(path);
+            imageLength = imageLength > UINT16_MAX ? UINT16_MAX : imageLength;
+            pathLength = pathLength > UINT16_MAX ? UINT16_MAX : pathLength;
+            //field by field so the record is little-endian on any host
+            outLittle32(out, entry->DIR_FileSize);
+            outLittle32(out, cluster);
+            outChar(out, (char)entry->DIR_Attr);
+            outChar(out, longName != NULL);
+            outLittle16(out, entry->DIR_WrtDate);
+            outLittle16(out, entry->DIR_WrtTime);
+            outLittle16(out, entry->DIR_CrtDate);
+            outLittle16(out, entry->DIR_CrtTime);
+            outWrite(out, entry->DIR_Name, 11);
+            outChar(out, 0);
+            outLittle16(out, (uint16_t)imageLength);
+            outLittle16(out, (uint16_t)pathLength);
+            outWrite(out, listing->image, imageLength);
+            outWrite(out, path, pathLength);
+            break;
+        }
+    }
+}
+
+/*/////////////////////////////////////////////////////////////
+                        COMMANDS
+/////////////////////////////////////////////////////////////*/
+
+static int usageError(const char *usage)
+{
+    fprintf(stderr, "usage: fat16-reader %s\n", usage);
+    return 2;
+}
+
+//thread count given to -j, 0 unless it is a whole number from 1 to 1024
+static int parseWorkers(const char *text)
+{
+    char *end;
+    long workers = strtol(text, &end, 10);
+    return end != text && *end == '\0' && workers >= 1 && workers <= 1024 ? (int)workers : 0;
+}
+
+//info <image>...
+int infoCommand(Output *out, int argc, char **argv)
+{
+    if (argc < 1)
+    {
+        return usageError("info <image>...");
+    }
+
+    int failures = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        Volume *volume = openVolume(argv[i]);
+        if (volume == NULL)
+        {
+            failures++;
+            continue;
+        }
+        const BootSector *bs = volume->bootSector;
+        const BootSector32 *bs32 = (const BootSector32 *)((const uint8_t *)bs + BOOT_SECTOR32_OFFSET);
+        outString(out, argv[i]);
+        outString(out, ":\nBytes per Sector: ");
+        outUnsigned(out, bs->BPB_BytsPerSec);
+        outString(out, "\nSectors per Cluster: ");
+        outUnsigned(out, bs->BPB_SecPerClus);
+        outString(out, "\nReserved Sector Count: ");
+        outUnsigned(out, bs->BPB_RsvdSecCnt);
+        outString(out, "\nNumber of copies of FAT: ");
+        outUnsigned(out, bs->BPB_NumFATs);
+        outString(out, "\nRoot directory entries: ");
+        outUnsigned(out, bs->BPB_RootEntCnt);
+        outString(out, "\nTotal sectors: ");
+        outUnsigned(out, bs->BPB_TotSec16 != 0 ? bs->BPB_TotSec16 : bs->BPB_TotSec32);
+        outString(out, "\nSectors in FAT: ");
+        outUnsigned(out, volume->fatSize / bs->BPB_BytsPerSec);
+        outString(out, "\nData clusters: ");
+        outUnsigned(out, volume->clusterCount);
+        outString(out, "\nFAT type: FAT");
+        outUnsigned(out, volume->fatType);
+        if (volume->fatType == FAT32)
+        {
+            outString(out, "\nRoot directory cluster: ");
+            outUnsigned(out, volume->rootCluster);
+        }
+        outString(out, "\nVolume label: ");
+        outWrite(out, volume->fatType == FAT32 ? bs32->BS_VolLab : bs->BS_VolLab, 11);
+        outString(out, "\n");
+        closeVolume(volume);
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+static int listWalked(void *context, const WalkEntry *item)
+{
+    emitListing(context, item->path, item->path, item->entry, item->longName);
+    return 0;
+}
+
+//list one directory from its index (long names where present); prefix is its path
+static void listDirectory(Listing *listing, const DirIndex *index, const char *prefix)
+{
+    for (size_t e = 0; e < index->count; e++)
+    {
+        const IndexedEntry *indexed = &index->entries[e];
+        //volume label is not a file
+        if (indexed->entry.DIR_Attr & 0x08)
+        {
+            continue;
+        }
+        const char *longName = indexedLongName(index, indexed);
+        const char *name = longName;
+        char shortName[13];
+        if (name == NULL)
+        {
+            shortNameToString(indexed->entry.DIR_Name, shortName);
+            name = shortName;
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s%s%s", prefix, *prefix != '\0' ? "/" : "", name);
+        emitListing(listing, path, name, &indexed->entry, longName);
+    }
+}
+
+//ls <image> [-R] [--format text|jsonl|csv|binary] [path...]
+int lsCommand(Output *out, int argc, char **argv)
+{
+    int recursive = 0;
+    int format = LIST_TEXT;
+    char *positional[argc + 1];
+    int count = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-R") == 0)
+        {
+            recursive = 1;
+        }
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc)
+        {
+            format = parseListFormat(argv[++i]);
+        }
+        else
+        {
+            positional[count++] = argv[i];
+        }
+    }
+    if (count < 1 || format == -1)
+    {
+        return usageError("ls <image> [-R] [--format text|jsonl|csv|binary] [path...]");
+    }
+
+    Volume *volume = openVolume(positional[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+
+    Listing listing = { out, (ListFormat)format, positional[0], volume };
+    int failures = 0;
+    if (recursive)
+    {
+        failures += walkVolume(volume, listWalked, &listing) != 0;
+    }
+    else if (count == 1)
+    {
+        const DirIndex *index = directoryIndex(volume, 0);
+        if (index != NULL)
+        {
+            listDirectory(&listing, index, "");
+        }
+    }
+    for (int i = 1; i < count && !recursive; i++)
+    {
+        DirectoryEntry entry;
+        int root = isRootPath(positional[i]);
+        if (root)
+        {
+            rootEntry(volume, &entry);
+        }
+        else if (statPath(volume, positional[i], &entry) == -1)
+        {
+            fprintf(stderr, "File cant be found: %s\n", positional[i]);
+            failures++;
+            continue;
+        }
+        if (!(entry.DIR_Attr & 0x10))
+        {
+            emitListing(&listing, positional[i], positional[i], &entry, NULL);
+            continue;
+        }
+        const DirIndex *index = directoryIndex(volume, root ? 0 : entryCluster(volume, &entry));
+        if (index == NULL)
+        {
+            failures++;
+            continue;
+        }
+        if (count > 2 && listing.format == LIST_TEXT)
+        {
+            outString(out, positional[i]);
+            outString(out, ":\n");
+        }
+        listDirectory(&listing, index, root ? "" : positional[i]);
+    }
+
+    closeVolume(volume);
+    return failures == 0 ? 0 : 1;
+}
+
+//cat <image> <file>...
+int catCommand(Output *out, int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        return usageError("cat <image> <file>...");
+    }
+
+    Volume *volume = openVolume(argv[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+
+    uint8_t *buffer = malloc(EXTRACT_BUFFER);
+    if (buffer == NULL)
+    {
+        perror("Error allocating memory");
+        closeVolume(volume);
+        return 1;
+    }
+
+    int failures = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        File *file = openFile(volume, argv[i]);
+        if (file == NULL)
+        {
+            failures++;
+            continue;
+        }
+        size_t reading;
+        while ((reading = readFile(file, buffer, EXTRACT_BUFFER)) > 0)
+        {
+            outWrite(out, buffer, reading);
+        }
+        closeFile(file);
+    }
+
+    free(buffer);
+    closeVolume(volume);
+    return failures == 0 ? 0 : 1;
+}
+
+//"first-last" runs of a chain, then the totals
+static void outChain(Output *out, const Volume *volume, const char *name, uint32_t startCluster)
+{
+    ExtentMap chain;
+    outString(out, name);
+    outString(out, ":");
+    if (buildExtentMap(volume, startCluster, &chain) == -1)
+    {
+        outString(out, " corrupt chain\n");
+        return;
+    }
+    for (size_t e = 0; e < chain.count; e++)
+    {
+        outChar(out, ' ');
+        outUnsigned(out, chain.extents[e].firstCluster);
+        if (chain.extents[e].length > 1)
+        {
+            outChar(out, '-');
+            outUnsigned(out, chain.extents[e].firstCluster + chain.extents[e].length - 1);
+        }
+    }
+    outString(out, " (");
+    outUnsigned(out, chain.clusterCount);
+    outString(out, " clusters, ");
+    outUnsigned(out, chain.count);
+    outString(out, " extents)\n");
+    freeExtentMap(&chain);
+}
+
+//chain <image> <cluster|path>...
+int chainCommand(Output *out, int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        return usageError("chain <image> <cluster|path>...");
+    }
+
+    Volume *volume = openVolume(argv[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+
+    int failures = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        char *end;
+        unsigned long cluster = strtoul(argv[i], &end, 0);
+        if (*end != '\0' || end == argv[i])
+        {
+            DirectoryEntry entry;
+            if (statPath(volume, argv[i], &entry) == -1)
+            {
+                fprintf(stderr, "File cant be found: %s\n", argv[i]);
+                failures++;
+                continue;
+            }
+            cluster = entryCluster(volume, &entry);
+        }
+        outChain(out, volume, argv[i], (uint32_t)cluster);
+    }
+
+    closeVolume(volume);
+    return failures == 0 ? 0 : 1;
+}
+
+//stat <image> <path>...
+int statCommand(Output *out, int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        return usageError("stat <image> <path>...");
+    }
+
+    Volume *volume = openVolume(argv[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+
+    int failures = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        DirectoryEntry entry;
+        int root = isRootPath(argv[i]);
+        if (root)
+        {
+            rootEntry(volume, &entry);
+        }
+        else if (statPath(volume, argv[i], &entry) == -1)
+        {
+            fprintf(stderr, "File cant be found: %s\n", argv[i]);
+            failures++;
+            continue;
+        }
+        char shortName[13];
+        shortNameToString(entry.DIR_Name, shortName);
+
+        //the root has no entry, so no name or dates of its own
+        outString(out, "Path: ");
+        outString(out, argv[i]);
+        if (!root)
+        {
+            outString(out, "\nShort name: ");
+            outString(out, shortName);
+        }
+        outString(out, "\nSize: ");
+        outUnsigned(out, entry.DIR_FileSize);
+        outString(out, "\nAttributes: ");
+        outAttributes(out, entry.DIR_Attr);
+        outString(out, "\nFirst cluster: ");
+        outUnsigned(out, entryCluster(volume, &entry));
+        if (!root)
+        {
+            outString(out, "\nCreated: ");
+            outDateTime(out, entry.DIR_CrtDate, entry.DIR_CrtTime);
+            outString(out, "\nModified: ");
+            outDateTime(out, entry.DIR_WrtDate, entry.DIR_WrtTime);
+        }
+        outString(out, "\n");
+        outChain(out, volume, "Clusters", entryCluster(volume, &entry));
+    }
+
+    closeVolume(volume);
+    return failures == 0 ? 0 : 1;
+}
+
+//extract <image> <directory> [-j threads] [pattern...]
+int extractCommand(Output *out, int argc, char **argv)
+{
+    (void)out;
+    int workers = defaultWorkers();
+    char *positional[argc + 1];
+    int count = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            workers = parseWorkers(argv[++i]);
+            if (workers == 0)
+            {
+                return usageError("extract <image> <directory> [-j threads] [pattern...]");
+            }
+        }
+        else
+        {
+            positional[count++] = argv[i];
+        }
+    }
+    if (count < 2)
+    {
+        return usageError("extract <image> <directory> [-j threads] [pattern...]");
+    }
+
+    Volume *volume = openVolume(positional[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+    int failures = extractFiles(volume, positional[1], positional + 2, count - 2, workers);
+    closeVolume(volume);
+    return failures == 0 ? 0 : 1;
+}
+
+//print one problem as "image: description"
+static void outProblem(Output *out, const char *image, const CheckReport *report, const Problem *problem)
+{
+    outString(out, image);
+    outString(out, ": ");
+    switch (problem->kind)
+    {
+    case PROBLEM_FAT_COPY:
+        outString(out, "FAT copy ");
+        outUnsigned(out, problem->file + 1);
+        outString(out, " differs from copy 1 in ");
+        outUnsigned(out, problem->count);
+        outString(out, " entries (first at cluster ");
+        outUnsigned(out, problem->cluster);
+        outString(out, ")");
+        break;
+    case PROBLEM_CROSS_LINK:
+        outString(out, "cluster ");
+        outUnsigned(out, problem->cluster);
+        outString(out, " is cross-linked: ");
+        outString(out, report->files[problem->file].path);
+        outString(out, " and ");
+        outString(out, report->files[problem->other].path);
+        break;
+    case PROBLEM_CYCLE:
+        outString(out, "chain of ");
+        outString(out, report->files[problem->file].path);
+        outString(out, " loops back to cluster ");
+        outUnsigned(out, problem->cluster);
+        outString(out, " after ");
+        outUnsigned(out, problem->count);
+        outString(out, " clusters");
+        break;
+    case PROBLEM_BROKEN:
+        outString(out, "chain of ");
+        outString(out, report->files[problem->file].path);
+        outString(out, " is broken at cluster ");
+        outUnsigned(out, problem->cluster);
+        outString(out, " (FAT entry ");
+        outUnsigned(out, problem->count);
+        outString(out, ")");
+        break;
+    case PROBLEM_SIZE:
+        outString(out, report->files[problem->file].path);
+        outString(out, " has ");
+        outUnsigned(out, problem->count);
+        outString(out, " clusters, its size needs ");
+        outUnsigned(out, problem->expected);
+        break;
+    case PROBLEM_ORPHANS:
+        outUnsigned(out, problem->count);
+        outString(out, " allocated clusters belong to no file, ");
+        outUnsigned(out, problem->expected);
+        outString(out, " lost chains (first at cluster ");
+        outUnsigned(out, problem->cluster);
+        outString(out, ")");
+        break;
+    }
+    outChar(out, '\n');
+}
+
+//check <image>... [-j threads] [-q]: verify FAT copies and cluster ownership
+int checkCommand(Output *out, int argc, char **argv)
+{
+    int workers = defaultWorkers();
+    int quiet = 0;
+    char *images[argc + 1];
+    int count = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            workers = parseWorkers(argv[++i]);
+            if (workers == 0)
+            {
+                return usageError("check <image>... [-j threads] [-q]");
+            }
+        }
+        else if (strcmp(argv[i], "-q") == 0)
+        {
+            quiet = 1;
+        }
+        else
+        {
+            images[count++] = argv[i];
+        }
+    }
+    if (count < 1)
+    {
+        return usageError("check <image>... [-j threads] [-q]");
+    }
+
+    int failures = 0;
+    for (int i = 0; i < count; i++)
+    {
+        Volume *volume = openVolume(images[i]);
+        CheckReport report;
+        if (volume == NULL || checkVolume(volume, workers, &report) == -1)
+        {
+            outString(out, images[i]);
+            outString(out, ": cannot be checked\n");
+            if (volume != NULL)
+            {
+                closeVolume(volume);
+            }
+            failures++;
+            continue;
+        }
+
+        if (!quiet)
+        {
+            for (size_t p = 0; p < report.problemCount; p++)
+            {
+                outProblem(out, images[i], &report, &report.problems[p]);
+            }
+        }
+        outString(out, images[i]);
+        outString(out, report.problemCount == 0 ? ": clean, " : ": damaged, ");
+        if (report.problemCount > 0)
+        {
+            outUnsigned(out, report.problemCount);
+            outString(out, " problems, ");
+        }
+        outUnsigned(out, report.fileCount);
+        outString(out, " entries, ");
+        outUnsigned(out, report.usedClusters);
+        outString(out, "/");
+        outUnsigned(out, volume->clusterCount);
+        outString(out, " clusters in use\n");
+
+        if (report.problemCount > 0)
+        {
+            failures++;
+        }
+        freeCheckReport(&report);
+        closeVolume(volume);
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+//a ratio with two decimals
+static void outRatio(Output *out, uint64_t numerator, uint64_t denominator)
+{
+    uint64_t hundredths = denominator ? (numerator * 100 + denominator / 2) / denominator : 0;
+    outUnsigned(out, hundredths / 100);
+    outChar(out, '.');
+    outUnsignedPadded(out, hundredths % 100, 2, '0');
+}
+
+//stats <image>...: cluster usage, free space runs and fragmentation
+int statsCommand(Output *out, int argc, char **argv)
+{
+    if (argc < 1)
+    {
+        return usageError("stats <image>...");
+    }
+
+    int failures = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        Volume *volume = openVolume(argv[i]);
+        VolumeStats stats;
+        if (volume == NULL || volumeStats(volume, &stats) == -1)
+        {
+            if (volume != NULL)
+            {
+                closeVolume(volume);
+            }
+            failures++;
+            continue;
+        }
+
+        const FatCounts *counts = &stats.counts;
+        outString(out, argv[i]);
+        outString(out, ":\nClusters: ");
+        outUnsigned(out, volume->clusterCount);
+        outString(out, " (");
+        outUnsigned(out, volume->clusterCount - counts->free - counts->bad);
+        outString(out, " used, ");
+        outUnsigned(out, counts->free);
+        outString(out, " free, ");
+        outUnsigned(out, counts->bad);
+        outString(out, " bad)\nEnd of chain entries: ");
+        outUnsigned(out, counts->endOfChain);
+        outString(out, "\nLargest free run: ");
+        outUnsigned(out, stats.largestFreeRun);
+        outString(out, " clusters\nFree runs by length:\n");
+        for (int bucket = 0; bucket < FREE_RUN_BUCKETS; bucket++)
+        {
+            if (stats.freeRuns[bucket] == 0)
+            {
+                continue;
+            }
+            outString(out, "  ");
+            outUnsigned(out, (uint64_t)1 << bucket);
+            if (bucket == FREE_RUN_BUCKETS - 1)
+            {
+                outString(out, "+");
+            }
+            else if (bucket > 0)
+            {
+                outChar(out, '-');
+                outUnsigned(out, ((uint64_t)2 << bucket) - 1);
+            }
+            outString(out, ": ");
+            outUnsigned(out, stats.freeRuns[bucket]);
+            outChar(out, '\n');
+        }
+        outString(out, "Files: ");
+        outUnsigned(out, stats.files);
+        outString(out, " (");
+        outUnsigned(out, stats.fragmentedFiles);
+        outString(out, " fragmented, ");
+        outRatio(out, stats.fragments, stats.files);
+        outString(out, " fragments per file)\n");
+        if (stats.badChains > 0)
+        {
+            outString(out, "Unreadable chains: ");
+            outUnsigned(out, stats.badChains);
+            outChar(out, '\n');
+        }
+        if (stats.topCount > 0)
+        {
+            outString(out, "Most fragmented:\n");
+        }
+        for (size_t f = 0; f < stats.topCount; f++)
+        {
+            outString(out, "  ");
+            outUnsigned(out, stats.top[f].fragments);
+            outString(out, " fragments, ");
+            outUnsigned(out, stats.top[f].clusters);
+            outString(out, " clusters: ");
+            outString(out, stats.top[f].path);
+            outChar(out, '\n');
+        }
+
+        freeVolumeStats(&stats);
+        closeVolume(volume);
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+//copy a host file (or stdin for NULL or "-") to the end of a file open for writing
+static int copyIn(File *file, const char *source)
+{
+    int in = STDIN_FILENO;
+    if (source != NULL && strcmp(source, "-") != 0)
+    {
+        in = open(source, O_RDONLY);
+        if (in == -1)
+        {
+            perror(source);
+            return -1;
+        }
+    }
+
+    uint8_t *buffer = malloc(EXTRACT_BUFFER);
+    int status = buffer != NULL ? 0 : -1;
+    while (status == 0)
+    {
+        ssize_t reading = read(in, buffer, EXTRACT_BUFFER);
+        if (reading == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (reading == -1)
+        {
+            perror(source != NULL ? source : "stdin");
+            status = -1;
+        }
+        if (reading <= 0)
+        {
+            break;
+        }
+        if (writeFile(file, buffer, reading) != (size_t)reading)
+        {
+            status = -1;
+        }
+    }
+
+    free(buffer);
+    if (in != STDIN_FILENO)
+    {
+        close(in);
+    }
+    return status;
+}
+
+//put <image> <path> [host file] and append <image> <path> [host file]
+static int storeCommand(int argc, char **argv, int append)
+{
+    if (argc < 2)
+    {
+        return usageError(append ? "append <image> <path> [host file]" : "put <image> <path> [host file]");
+    }
+
+    Volume *volume = openVolumeForWriting(argv[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+    DirectoryEntry entry;
+    int exists = statPath(volume, argv[1], &entry) == 0;
+    File *file = append && exists ? openFileForWriting(volume, argv[1]) : createFile(volume, argv[1]);
+    int status = file != NULL ? 0 : -1;
+    if (file != NULL)
+    {
+        seekFile(file, 0, SEEK_END);
+        status = copyIn(file, argc > 2 ? argv[2] : NULL);
+        //a new file that could not be written (volume full) leaves the directory as it was
+        if (status == -1 && !exists)
+        {
+            freeChain(volume, (uint16_t)file->startCluster);
+            deleteEntry(volume, (uint16_t)file->entryDirectory, file->entrySlot);
+        }
+        closeFile(file);
+    }
+
+    if (flushVolume(volume) == -1)
+    {
+        status = -1;
+    }
+    closeVolume(volume);
+    return status == 0 ? 0 : 1;
+}
+
+int putCommand(Output *out, int argc, char **argv)
+{
+    (void)out;
+    return storeCommand(argc, argv, 0);
+}
+
+int appendCommand(Output *out, int argc, char **argv)
+{
+    (void)out;
+    return storeCommand(argc, argv, 1);
+}
+
+int truncateCommand(Output *out, int argc, char **argv)
+{
+    (void)out;
+    char *end = NULL;
+    unsigned long long length = argc == 3 ? strtoull(argv[2], &end, 10) : 0;
+    if (argc != 3 || *end != '\0')
+    {
+        return usageError("truncate <image> <path> <size>");
+    }
+
+    Volume *volume = openVolumeForWriting(argv[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+    File *file = openFileForWriting(volume, argv[1]);
+    int status = file != NULL ? truncateFile(file, length) : -1;
+    if (file != NULL)
+    {
+        closeFile(file);
+    }
+    if (flushVolume(volume) == -1)
+    {
+        status = -1;
+    }
+    closeVolume(volume);
+    return status == 0 ? 0 : 1;
+}
+
+//rm and mkdir: one change per path, all flushed together
+static int changeCommand(int argc, char **argv, const char *usage, int (*change)(Volume *, const char *))
+{
+    if (argc < 2)
+    {
+        return usageError(usage);
+    }
+
+    Volume *volume = openVolumeForWriting(argv[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+    int failures = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (change(volume, argv[i]) == -1)
+        {
+            failures++;
+        }
+    }
+    if (flushVolume(volume) == -1)
+    {
+        failures++;
+    }
+    closeVolume(volume);
+    return failures == 0 ? 0 : 1;
+}
+
+int rmCommand(Output *out, int argc, char **argv)
+{
+    (void)out;
+    return changeCommand(argc, argv, "rm <image> <path>...", unlinkFile);
+}
+
+int mkdirCommand(Output *out, int argc, char **argv)
+{
+    (void)out;
+    return changeCommand(argc, argv, "mkdir <image> <path>...", makeDirectory);
+}
+
+//mkimage <host directory> <image> [-s MiB] [-c cluster bytes] [-l label]
+int mkimageCommand(Output *out, int argc, char **argv)
+{
+    (void)out;
+    uint64_t imageBytes = 0;
+    size_t clusterBytes = 0;
+    const char *label = NULL;
+    char *positional[argc + 1];
+    int count = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            imageBytes = strtoull(argv[++i], NULL, 10) << 20;
+        }
+        else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+        {
+            //a power of two number of sectors, at most 64
+            char *end;
+            clusterBytes = strtoul(argv[++i], &end, 10);
+            if (end == argv[i] || *end != '\0' || clusterBytes < IMAGE_SECTOR || clusterBytes > 64 * IMAGE_SECTOR ||
+                (clusterBytes & (clusterBytes - 1)) != 0)
+            {
+                fprintf(stderr, "Invalid cluster size: %s (512 to 32768 bytes, a power of two)\n", argv[i]);
+                return 2;
+            }
+        }
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+        {
+            label = argv[++i];
+        }
+        else
+        {
+            positional[count++] = argv[i];
+        }
+    }
+    if (count != 2)
+    {
+        return usageError("mkimage <host directory> <image> [-s MiB] [-c cluster bytes] [-l label]");
+    }
+
+    //labels are stored in upper case
+    char upper[12];
+    if (label != NULL)
+    {
+        size_t length = strnlen(label, 11);
+        for (size_t i = 0; i < length; i++)
+        {
+            upper[i] = toupper((unsigned char)label[i]);
+        }
+        upper[length] = '\0';
+        label = upper;
+    }
+    return buildImage(positional[0], positional[1], imageBytes, clusterBytes, label) == 0 ? 0 : 1;
+}
+
+//mksynth <image> [-n files] [-s mean KiB] [-d files per directory] [-f fragmented %] [-l long name %] [-S seed]
+//generated image for benchmarks
+int mksynthCommand(Output *out, int argc, char **argv)
+{
+    (void)out;
+    SynthOptions options = { 2000, 64u << 10, 50, 20, 50, 1 };
+    char *positional[argc + 1];
+    int count = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+        {
+            options.files = strtoul(argv[++i], NULL, 10);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-s") == 0)
+        {
+            options.meanSize = strtoull(argv[++i], NULL, 10) << 10;
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-d") == 0)
+        {
+            options.filesPerDirectory = strtoul(argv[++i], NULL, 10);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-f") == 0)
+        {
+            options.fragmentPercent = atoi(argv[++i]);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-l") == 0)
+        {
+            options.longNamePercent = atoi(argv[++i]);
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-S") == 0)
+        {
+            options.seed = strtoull(argv[++i], NULL, 10);
+        }
+        else
+        {
+            positional[count++] = argv[i];
+        }
+    }
+    if (count != 1)
+    {
+        return usageError("mksynth <image> [-n files] [-s mean KiB] [-d files per directory] [-f fragmented %] [-l long name %] [-S seed]");
+    }
+    return buildSyntheticImage(positional[0], &options) == 0 ? 0 : 1;
+}
+
+//pack <image> <container> [-c chunk KiB] [-z level] [-k]
+//chunked, random access copy of an image that every command can read
+int packCommand(Output *out, int argc, char **argv)
+{
+    size_t chunkSize = PACK_CHUNK;
+    int level = 6;
+    int keepFree = 0;
+    char *positional[argc + 1];
+    int count = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-c") == 0)
+        {
+            chunkSize = strtoull(argv[++i], NULL, 10) << 10;
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-z") == 0)
+        {
+            level = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-k") == 0)
+        {
+            keepFree = 1;
+        }
+        else
+        {
+            positional[count++] = argv[i];
+        }
+    }
+    if (count != 2 || level < 0 || level > 9)
+    {
+        return usageError("pack <image> <container> [-c chunk KiB] [-z level] [-k]");
+    }
+
+    Volume *volume = openVolume(positional[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+    PackReport report;
+    int status = packImage(volume, positional[1], chunkSize, level, keepFree, &report);
+    closeVolume(volume);
+    if (status == -1)
+    {
+        return 1;
+    }
+    outString(out, positional[1]);
+    outString(out, ": ");
+    outUnsigned(out, report.imageBytes);
+    outString(out, " image bytes in ");
+    outUnsigned(out, report.chunks);
+    outString(out, " chunks (");
+    outUnsigned(out, report.zero);
+    outString(out, " empty, ");
+    outUnsigned(out, report.raw);
+    outString(out, " raw, ");
+    outUnsigned(out, report.deflated);
+    outString(out, " deflated), ");
+    outUnsigned(out, report.storedBytes);
+    outString(out, " bytes stored\n");
+    return 0;
+}
+
+//defrag <image> [-b staging MiB] [-n]
+//rewrites every chain as one run, -n only reports what would move
+int defragCommand(Output *out, int argc, char **argv)
+{
+    size_t stagingBytes = DEFRAG_STAGING;
+    int planOnly = 0;
+    char *positional[argc + 1];
+    int count = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-b") == 0)
+        {
+            stagingBytes = strtoull(argv[++i], NULL, 10) << 20;
+        }
+        else if (strcmp(argv[i], "-n") == 0)
+        {
+            planOnly = 1;
+        }
+        else
+        {
+            positional[count++] = argv[i];
+        }
+    }
+    if (count != 1)
+    {
+        return usageError("defrag <image> [-b staging MiB] [-n]");
+    }
+
+    Volume *volume = openVolumeForWriting(positional[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+    DefragReport report;
+    int status = defragVolume(volume, stagingBytes, planOnly, &report);
+    closeVolume(volume);
+
+    outString(out, positional[0]);
+    outString(out, ": ");
+    outUnsigned(out, report.objects);
+    outString(out, " files and directories, ");
+    outUnsigned(out, report.fragmented);
+    outString(out, " fragmented");
+    if (report.fragmented > 0)
+    {
+        outString(out, ", ");
+        outUnsigned(out, report.objects - report.placed);
+        outString(out, " to move (");
+        outUnsigned(out, report.outOfPlace);
+        outString(out, " clusters)");
+    }
+    outChar(out, '\n');
+    if (!planOnly && report.batches > 0)
+    {
+        outString(out, positional[0]);
+        outString(out, ": ");
+        outUnsigned(out, report.moves);
+        outString(out, " moves in ");
+        outUnsigned(out, report.batches);
+        outString(out, " batches, ");
+        outUnsigned(out, report.clustersCopied);
+        outString(out, " clusters copied\n");
+    }
+    return status == 0 ? 0 : 1;
+}
+
+//undelete <image> [-j threads] [-m min-score] [-x directory] [pattern...]
+//lists deleted files with a recovery score, -x writes them out
+int undeleteCommand(Output *out, int argc, char **argv)
+{
+    int workers = defaultWorkers();
+    int minScore = 0;
+    const char *outDir = NULL;
+    char *positional[argc + 1];
+    int count = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            workers = parseWorkers(argv[++i]);
+            if (workers == 0)
+            {
+                return usageError("undelete <image> [-j threads] [-m min-score] [-x directory] [pattern...]");
+            }
+        }
+        else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+        {
+            minScore = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-x") == 0 && i + 1 < argc)
+        {
+            outDir = argv[++i];
+        }
+        else
+        {
+            positional[count++] = argv[i];
+        }
+    }
+    if (count < 1)
+    {
+        return usageError("undelete <image> [-j threads] [-m min-score] [-x directory] [pattern...]");
+    }
+
+    Volume *volume = openVolume(positional[0]);
+    DeletedScan scan;
+    if (volume == NULL || scanDeleted(volume, workers, &scan) == -1)
+    {
+        if (volume != NULL)
+        {
+            closeVolume(volume);
+        }
+        return 1;
+    }
+
+    //score, method, size, date, first cluster, path
+    char **patterns = positional + 1;
+    int patternCount = count - 1;
+    int failures = 0;
+    for (size_t d = 0; d < scan.count; d++)
+    {
+        const ScannedDirectory *directory = &scan.directories[d];
+        if (directory->failed)
+        {
+            fprintf(stderr, "Directory /%s could not be scanned\n", directory->path);
+            failures++;
+        }
+        for (size_t f = 0; f < directory->count; f++)
+        {
+            const DeletedFile *file = &directory->files[f];
+            char path[4096];
+            if (!selectDeleted(directory, file, patterns, patternCount, minScore, path))
+            {
+                continue;
+            }
+
+            outUnsignedPadded(out, recoveryScore(file), 3, ' ');
+            outString(out, "% ");
+            const char *method = recoveryMethodName(file->method);
+            outString(out, method);
+            for (size_t pad = strlen(method); pad < 11; pad++)
+            {
+                outChar(out, ' ');
+            }
+            outChar(out, ' ');
+            outUnsignedPadded(out, file->entry.DIR_FileSize, 10, ' ');
+            outChar(out, ' ');
+            outDateTime(out, file->entry.DIR_WrtDate, file->entry.DIR_WrtTime);
+            outChar(out, ' ');
+            outUnsignedPadded(out, entryCluster(volume, &file->entry), 5, ' ');
+            outChar(out, ' ');
+            outString(out, path);
+            outChar(out, '\n');
+        }
+    }
+
+    if (outDir != NULL)
+    {
+        //files go out after the listing so it is complete even if some fail
+        outFlush(out);
+        int failed = recoverFiles(volume, &scan, outDir, patterns, patternCount, minScore, workers);
+        failures += failed != 0;
+    }
+
+    freeDeletedScan(&scan);
+    closeVolume(volume);
+    return failures == 0 ? 0 : 1;
+}
+
+//hash <image>... [-a sha256|blake3|crc32c] [-j threads]: digest of every file and of the volume
+int hashCommand(Output *out, int argc, char **argv)
+{
+    int workers = defaultWorkers();
+    int kind = HASH_SHA256;
+    char *images[argc + 1];
+    int count = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            workers = parseWorkers(argv[++i]);
+            if (workers == 0)
+            {
+                return usageError("hash <image>... [-a sha256|blake3|crc32c] [-j threads]");
+            }
+        }
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+        {
+            kind = parseHashKind(argv[++i]);
+            if (kind == -1)
+            {
+                fprintf(stderr, "Unknown hash: %s\n", argv[i]);
+                return 2;
+            }
+        }
+        else
+        {
+            images[count++] = argv[i];
+        }
+    }
+    if (count < 1)
+    {
+        return usageError("hash <image>... [-a sha256|blake3|crc32c] [-j threads]");
+    }
+
+    int failures = 0;
+    for (int i = 0; i < count; i++)
+    {
+        Volume *volume = openVolume(images[i]);
+        if (volume == NULL)
+        {
+            failures++;
+            continue;
+        }
+        //several images: a header line before each listing
+        if (count > 1)
+        {
+            outString(out, images[i]);
+            outString(out, ":\n");
+        }
+        if (hashVolume(volume, (HashKind)kind, workers, out) != 0)
+        {
+            failures++;
+        }
+        closeVolume(volume);
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+//diff <old image> <new image> [-a sha256|blake3|crc32c] [-j threads] [-b block KiB]
+//exits like diff(1): 0 same files, 1 differences, 2 trouble
+int diffCommand(Output *out, int argc, char **argv)
+{
+    int workers = defaultWorkers();
+    int kind = HASH_SHA256;
+    size_t blockBytes = DIFF_BLOCK;
+    char *images[argc + 1];
+    int count = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+        {
+            workers = parseWorkers(argv[++i]);
+            if (workers == 0)
+            {
+                return usageError("diff <old image> <new image> [-a sha256|blake3|crc32c] [-j threads] [-b block KiB]");
+            }
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+        {
+            blockBytes = strtoull(argv[++i], NULL, 10) << 10;
+        }
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+        {
+            kind = parseHashKind(argv[++i]);
+            if (kind == -1)
+            {
+                fprintf(stderr, "Unknown hash: %s\n", argv[i]);
+                return 2;
+            }
+        }
+        else
+        {
+            images[count++] = argv[i];
+        }
+    }
+    if (count != 2)
+    {
+        return usageError("diff <old image> <new image> [-a sha256|blake3|crc32c] [-j threads] [-b block KiB]");
+    }
+
+    Volume *old = openVolume(images[0]);
+    Volume *new = old != NULL ? openVolume(images[1]) : NULL;
+    int status = -1;
+    if (new != NULL)
+    {
+        status = diffVolumes(old, new, images[0], images[1], (HashKind)kind, workers, blockBytes, out);
+        closeVolume(new);
+    }
+    if (old != NULL)
+    {
+        closeVolume(old);
+    }
+    return status == -1 ? 2 : status;
+}
+
+//mount <image> <mountpoint> [libfuse options...]: read-only FUSE mount, until unmounted
+int mountCommand(Output *out, int argc, char **argv)
+{
+    (void)out;
+    if (argc < 2)
+    {
+        return usageError("mount <image> <mountpoint> [-f] [-s] [-o option,...]");
+    }
+#ifdef HAVE_FUSE
+    Volume *volume = openVolume(argv[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+    int status = mountVolume(volume, argv[0], argv[1], argc - 2, argv + 2);
+    closeVolume(volume);
+    return status == 0 ? 0 : 1;
+#else
+    (void)argv;
+    fprintf(stderr, "Built without FUSE; rebuild with -DHAVE_FUSE and libfuse 3 to mount images\n");
+    return 1;
+#endif
+}
+
+//bench <image> [-r rounds] [stage...]: time each stage of reading the image, JSON on stdout
+int benchCommand(Output *out, int argc, char **argv)
+{
+    int rounds = BENCH_ROUNDS;
+    char *positional[argc + 1];
+    int count = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-r") == 0)
+        {
+            rounds = atoi(argv[++i]);
+        }
+        else
+        {
+            positional[count++] = argv[i];
+        }
+    }
+    if (count < 1 || rounds < 1)
+    {
+        return usageError("bench <image> [-r rounds] [stage...]");
+    }
+    for (int i = 1; i < count; i++)
+    {
+        size_t s = 0;
+        while (s < sizeof(benchStages) / sizeof(benchStages[0]) && strcmp(positional[i], benchStages[s].name) != 0)
+        {
+            s++;
+        }
+        if (s == sizeof(benchStages) / sizeof(benchStages[0]))
+        {
+            fprintf(stderr, "Unknown stage: %s\n", positional[i]);
+            return 2;
+        }
+    }
+
+    Volume *volume = openVolume(positional[0]);
+    if (volume == NULL)
+    {
+        return 1;
+    }
+    int status = runBenchmark(volume, positional[0], rounds, positional + 1, count - 1, out);
+    closeVolume(volume);
+    return status == 0 ? 0 : 1;
+}
+
+//tasks [image]: the original interactive walkthrough (prompts on stdin)
+int tasksCommand(Output *out, int argc, char **argv)
+{
+    //everything below prints straight to stdout
+    outFlush(out);
+
+    //      TASK2       //
+    
+    //the image is opened (and mapped) once for every task
+    Volume *volume = openVolume(argc > 0 ? argv[0] : "fat16.img");
+    if (volume == NULL) 
+    {
+        return 1;
+    }
+
+    BootSector bootSector;
+    readDisk(volume, &bootSector);
+
+    //      TASK3       //
+
+    //FAT is read straight from the volume when walking the chain
+
+    //read starting cluster from user
+    int startingCluster;
+    printf("What is the starting cluster?\n");
+    scanf("%u",&startingCluster);
+    uint32_t startCluster = startingCluster;
+    
+    //ordered list of clusters as contiguous runs (no fixed size limit)
+    ExtentMap chain;
+    if (buildExtentMap(volume, startCluster, &chain) == 0) {
+        // Print the ordered list of clusters
+        for (size_t e = 0; e < chain.count; e++) {
+            for (size_t i = 0; i < chain.extents[e].length; i++) {
+                printf("starting cluster: %u\n", (unsigned int)(chain.extents[e].firstCluster + i));
+                //dont print next cluster after the last cluster of the chain
+                if (i + 1 < chain.extents[e].length) {
+                    printf("next cluster: %u\n", (unsigned int)(chain.extents[e].firstCluster + i + 1));
+                } else if (e + 1 < chain.count) {
+                    printf("next cluster: %u\n", (unsigned int)chain.extents[e + 1].firstCluster);
+                }
+            }
+        }
+        freeExtentMap(&chain);
+    }
+
+    //      TASK4       //
+
+    // Read and decode entries in the root directory
+    printRootDirectory(volume);
+
+    //      TASK5       //
+
+    char Filename[256];  //8.3 name ("name.ext") or a long name, 1 for null terminator
+    printf("Enter the filename: ");
+    scanf("%255s", Filename);
+
+    //Calls openFile function to open the specified file
+    File* file = openFile(volume, Filename);
+
+    if (file != NULL) {
+        //store the data read from the file (declares an array)
+        //large buffer so contiguous clusters come back in one read
+        static char buffer[1 << 16];
+        size_t reading;
+        //until end of file (readFile stops at DIR_FileSize)
+        while ((reading = readFile(file, buffer, sizeof(buffer))) > 0) {
+            fwrite(buffer, 1, reading, stdout);
+        }
+        // Close the file
+        closeFile(file);
+    }
+
+    //      TASK6       //
+
+    
+    printRootDirectoryLN(volume);
+
+    //unmap and close the image
+    closeVolume(volume);
+
+    fflush(stdout);
+    return 0;
+}
+
+typedef struct {
+    const char *name;
+    int (*run)(Output *out, int argc, char **argv);
+} Command;
+
+int serveCommand(Output *out, int argc, char **argv);
+int queryCommand(Output *out, int argc, char **argv);
+
+static const Command commands[] = {
+    { "info", infoCommand },
+    { "ls", lsCommand },
+    { "cat", catCommand },
+    { "chain", chainCommand },
+    { "stat", statCommand },
+    { "extract", extractCommand },
+    { "check", checkCommand },
+    { "stats", statsCommand },
+    { "put", putCommand },
+    { "append", appendCommand },
+    { "truncate", truncateCommand },
+    { "rm", rmCommand },
+    { "mkdir", mkdirCommand },
+    { "mkimage", mkimageCommand },
+    { "defrag", defragCommand },
+    { "pack", packCommand },
+    { "mksynth", mksynthCommand },
+    { "undelete", undeleteCommand },
+    { "hash", hashCommand },
+    { "diff", diffCommand },
+    { "mount", mountCommand },
+    { "bench", benchCommand },
+    { "serve", serveCommand },
+    { "query", queryCommand },
+    { "tasks", tasksCommand },
+};
+
+//run one command line (argv[0] is the command name)
+int runCommand(Output *out, int argc, char **argv)
+{
+    for (size_t c = 0; c < sizeof(commands) / sizeof(commands[0]); c++)
+    {
+        if (strcmp(argv[0], commands[c].name) == 0)
+        {
+            uint64_t start = profileStart();
+            int status = commands[c].run(out, argc - 1, argv + 1);
+            if (start != 0)
+            {
+                profileRecord(PROFILE_COMMAND, start, (uint64_t)status, commands[c].name);
+            }
+            return status;
+        }
+    }
+    fprintf(stderr, "Unknown command: %s\n", argv[0]);
+    return 2;
+}
+
+//split a batch line into words; double quotes keep spaces
+static int splitLine(char *line, char **words, int maxWords)
+{
+    int count = 0;
+    char *read = line;
+    while (count < maxWords)
+    {
+        while (*read == ' ' || *read == '\t' || *read == '\n' || *read == '\r')
+        {
+            read++;
+        }
+        if (*read == '\0' || *read == '#')
+        {
+            break;
+        }
+        char *write = read;
+        words[count++] = write;
+        int quoted = 0;
+        while (*read != '\0' && (quoted || (*read != ' ' && *read != '\t' && *read != '\n' && *read != '\r')))
+        {
+            if (*read == '"')
+            {
+                quoted = !quoted;
+                read++;
+                continue;
+            }
+            *write++ = *read++;
+        }
+        if (*read != '\0')
+        {
+            read++;
+        }
+        *write = '\0';
+    }
+    return count;
+}
+
+//batch [file]: one command line per line ("ls a.img", "cat b.img README.TXT"), '-' or nothing for stdin
+int batchCommand(Output *out, int argc, char **argv)
+{
+    FILE *list = stdin;
+    if (argc > 0 && strcmp(argv[0], "-") != 0)
+    {
+        list = fopen(argv[0], "r");
+        if (list == NULL)
+        {
+            perror(argv[0]);
+            return 1;
+        }
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    int failures = 0;
+    while (getline(&line, &capacity, list) != -1)
+    {
+        char *words[256];
+        int count = splitLine(line, words, 256);
+        //tasks prompts on stdin, which is the list itself
+        if (count == 0 || strcmp(words[0], "tasks") == 0 || strcmp(words[0], "batch") == 0)
+        {
+            continue;
+        }
+        if (runCommand(out, count, words) != 0)
+        {
+            failures++;
+        }
+    }
+
+    free(line);
+    if (list != stdin)
+    {
+        fclose(list);
+    }
+    return failures == 0 ? 0 : 1;
+}
+
+/*/////////////////////////////////////////////////////////////
+                        SERVE
+/////////////////////////////////////////////////////////////*/
+
+//connections waiting in the accept queue at most
+#define SERVE_BACKLOG 1024
+
+//commands a server runs for clients; all of them only read images
+static const char *const servedCommands[] = { "info", "ls", "cat", "chain", "stat", "check", "stats", "hash" };
+
+//accepted connections waiting for a worker, and the one each worker is serving
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    int clients[SERVE_BACKLOG];  // ring of descriptors
+    size_t head;
+    size_t count;
+    int *active;  // per worker, -1 when idle
+    int closing;
+} ClientQueue;
+
+typedef struct {
+    ClientQueue *queue;
+    int worker;
+} ServeWorker;
+
+static volatile sig_atomic_t stopServing;
+
+static void stopServer(int signal)
+{
+    (void)signal;
+    stopServing = 1;
+}
+
+//answer each request line of a connection until the client closes it
+//a response is the command output in chunks ("<length>\n" then the bytes), its error
+//messages in one chunk marked "<length> e\n", and "0 <status>\n"
+static void serveClient(Output *out, int client)
+{
+    FILE *in = fdopen(client, "r");
+    if (in == NULL)
+    {
+        perror("Error reading from client");
+        close(client);
+        return;
+    }
+    out->fdesc = client;
+    out->used = 0;
+    out->failed = 0;
+    out->chunked = 1;
+
+    char *line = NULL;
+    size_t capacity = 0;
+    while (!out->failed && getline(&line, &capacity, in) != -1)
+    {
+        char *words[256];
+        int count = splitLine(line, words, 256);
+        if (count == 0)
+        {
+            continue;
+        }
+        int served = 0;
+        for (size_t c = 0; c < sizeof(servedCommands) / sizeof(servedCommands[0]) && !served; c++)
+        {
+            served = strcmp(words[0], servedCommands[c]) == 0;
+        }
+        //messages are collected for the client, the server's own stderr if that fails
+        char *messages = NULL;
+        size_t messagesLength = 0;
+        threadDiagnostics = open_memstream(&messages, &messagesLength);
+        int status = 2;
+        if (served)
+        {
+            out->headerWritten = 0;
+            status = runCommand(out, count, words);
+        }
+        else
+        {
+            fprintf(stderr, "Command not served: %s\n", words[0]);
+        }
+        if (threadDiagnostics != NULL)
+        {
+            fclose(threadDiagnostics);
+            threadDiagnostics = NULL;
+        }
+        outFlush(out);
+        char header[32];
+        if (messagesLength > 0)
+        {
+            int size = snprintf(header, sizeof(header), "%zu e\n", messagesLength);
+            writeRaw(out, header, size);
+            writeRaw(out, messages, messagesLength);
+        }
+        free(messages);
+        int size = snprintf(header, sizeof(header), "0 %d\n", status);
+        writeRaw(out, header, size);
+    }
+    free(line);
+    fclose(in);
+}
+
+static void *serveWorker(void *argument)
+{
+    ServeWorker *self = argument;
+    ClientQueue *queue = self->queue;
+    Output *out = malloc(sizeof(Output));
+    for (;;)
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == 0 && !queue->closing)
+        {
+            pthread_cond_wait(&queue->ready, &queue->lock);
+        }
+        if (queue->count == 0)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        int client = queue->clients[queue->head];
+        queue->head = (queue->head + 1) % SERVE_BACKLOG;
+        queue->count--;
+        queue->active[self->worker] = client;
+        pthread_mutex_unlock(&queue->lock);
+
+        if (out != NULL)
+        {
+            serveClient(out, client);
+        }
+        else
+        {
+            close(client);
+        }
+
+        pthread_mutex_lock(&queue->lock);
+        queue->active[self->worker] = -1;
+        pthread_mutex_unlock(&queue->lock);
+    }
+    free(out);
+    return NULL;
+}
+
+//listen on a Unix socket and run read-only commands for clients until SIGINT or SIGTERM
+//opened images stay in a shared cache of at most maxImages volumes and about budget bytes
+int serveImages(const char *path, int workers, size_t budget, size_t maxImages)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener == -1)
+    {
+        perror("Error creating socket");
+        return -1;
+    }
+    //a socket left behind by a server that was killed is replaced
+    struct stat info;
+    if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+    {
+        unlink(path);
+    }
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listener, 128) == -1)
+    {
+        perror(path);
+        close(listener);
+        return -1;
+    }
+
+    sharedVolumes = createVolumeCache(budget, maxImages);
+    ClientQueue *queue = calloc(1, sizeof(ClientQueue));
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    ServeWorker *selves = malloc(workers * sizeof(ServeWorker));
+    if (sharedVolumes == NULL || queue == NULL || threads == NULL || selves == NULL || (queue->active = malloc(workers * sizeof(int))) == NULL)
+    {
+        perror("Error allocating memory");
+        if (sharedVolumes != NULL)
+        {
+            freeVolumeCache(sharedVolumes);
+            sharedVolumes = NULL;
+        }
+        free(queue);
+        free(threads);
+        free(selves);
+        close(listener);
+        unlink(path);
+        return -1;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->ready, NULL);
+
+    //a client going away must not kill the server; SIGINT and SIGTERM interrupt accept
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopServer;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+
+    //workers start with the signals blocked so only this thread sees them
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+    int started = 0;
+    for (int w = 0; w < workers; w++)
+    {
+        queue->active[w] = -1;
+        selves[w].queue = queue;
+        selves[w].worker = w;
+        if (pthread_create(&threads[started], NULL, serveWorker, &selves[w]) == 0)
+        {
+            started++;
+        }
+    }
+    pthread_sigmask(SIG_UNBLOCK, &stopSignals, NULL);
+    if (started == 0)
+    {
+        fprintf(stderr, "Unable to start worker threads\n");
+        stopServing = 1;
+    }
+
+    while (!stopServing)
+    {
+        int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (client == -1)
+        {
+            if (errno != EINTR)
+            {
+                perror("Error accepting connection");
+                //out of descriptors: give the workers a moment to close some
+                if (errno == EMFILE || errno == ENFILE)
+                {
+                    usleep(10000);
+                }
+            }
+            continue;
+        }
+        pthread_mutex_lock(&queue->lock);
+        if (queue->count == SERVE_BACKLOG)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            close(client);
+            continue;
+        }
+        queue->clients[(queue->head + queue->count) % SERVE_BACKLOG] = client;
+        queue->count++;
+        pthread_cond_signal(&queue->ready);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    //drop waiting connections and wake workers blocked on idle ones
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count > 0)
+    {
+        close(queue->clients[queue->head]);
+        queue->head = (queue->head + 1) % SERVE_BACKLOG;
+        queue->count--;
+    }
+    queue->closing = 1;
+    for (int w = 0; w < workers; w++)
+    {
+        if (queue->active[w] != -1)
+        {
+            shutdown(queue->active[w], SHUT_RDWR);
+        }
+    }
+    pthread_cond_broadcast(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+    for (int w = 0; w < started; w++)
+    {
+        pthread_join(threads[w], NULL);
+    }
+
+    if (volumeOptions.cacheStats)
+    {
+        fprintf(stderr, "volumes: %zu open, %zu bytes, %llu hits, %llu misses, %llu evicted\n",
+                sharedVolumes->count, sharedVolumes->bytes, (unsigned long long)sharedVolumes->hits,
+                (unsigned long long)sharedVolumes->misses, (unsigned long long)sharedVolumes->evictions);
+    }
+    freeVolumeCache(sharedVolumes);
+    sharedVolumes = NULL;
+    pthread_cond_destroy(&queue->ready);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->active);
+    free(queue);
+    free(threads);
+    free(selves);
+    close(listener);
+    unlink(path);
+    return 0;
+}
+
+//serve <socket> [-j threads] [-m MiB] [-n images]
+int serveCommand(Output *out, int argc, char **argv)
+{
+    (void)out;
+    int workers = defaultWorkers();
+    size_t budget = (size_t)256 << 20;
+    size_t maxImages = 256;
+    char *positional[argc + 1];
+    int count = 0;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (i + 1 < argc && strcmp(argv[i], "-j") == 0)
+        {
+            workers = parseWorkers(argv[++i]);
+            if (workers == 0)
+            {
+                return usageError("serve <socket> [-j threads] [-m MiB] [-n images]");
+            }
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-m") == 0)
+        {
+            budget = (size_t)strtoull(argv[++i], NULL, 10) << 20;
+        }
+        else if (i + 1 < argc && strcmp(argv[i], "-n") == 0)
+        {
+            maxImages = strtoul(argv[++i], NULL, 10);
+        }
+        else
+        {
+            positional[count++] = argv[i];
+        }
+    }
+    if (count != 1 || workers < 1)
+    {
+        return usageError("serve <socket> [-j threads] [-m MiB] [-n images]");
+    }
+    return serveImages(positional[0], workers, budget, maxImages) == 0 ? 0 : 1;
+}
+
+//query <socket> <command> [arguments...]: run a command on a server, output as if run here
+int queryCommand(Output *out, int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        return usageError("query <socket> <command> [arguments...]");
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(argv[0]) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "Socket path is too long: %s\n", argv[0]);
+        return 1;
+    }
+    strcpy(address.sun_path, argv[0]);
+
+    Output *request = calloc(1, sizeof(Output));
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (request == NULL || server == -1 || connect(server, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        perror(argv[0]);
+        free(request);
+        if (server != -1)
+        {
+            close(server);
+        }
+        return 1;
+    }
+
+    //one line, arguments with blanks in quotes
+    request->fdesc = server;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strpbrk(argv[i], "\"\n") != NULL)
+        {
+            fprintf(stderr, "Argument cannot be sent: %s\n", argv[i]);
+            free(request);
+            close(server);
+            return 2;
+        }
+        int quote = *argv[i] == '\0' || strpbrk(argv[i], " \t#") != NULL;
+        if (i > 1)
+        {
+            outChar(request, ' ');
+        }
+        if (quote)
+        {
+            outChar(request, '"');
+        }
+        outString(request, argv[i]);
+        if (quote)
+        {
+            outChar(request, '"');
+        }
+    }
+    outChar(request, '\n');
+    outFlush(request);
+    int failed = request->failed;
+    free(request);
+
+    FILE *in = fdopen(server, "r");
+    if (failed || in == NULL)
+    {
+        perror(argv[0]);
+        if (in != NULL)
+        {
+            fclose(in);
+        }
+        else
+        {
+            close(server);
+        }
+        return 1;
+    }
+    int status = -1;
+    char header[32];
+    uint8_t buffer[1 << 16];
+    while (status == -1 && fgets(header, sizeof(header), in) != NULL)
+    {
+        unsigned long long length;
+        int code;
+        char kind;
+        if (sscanf(header, "%llu %d", &length, &code) == 2 && length == 0)
+        {
+            status = code;
+            break;
+        }
+        if (sscanf(header, "%llu", &length) != 1)
+        {
+            break;
+        }
+        //the command's error messages go to our stderr, after the output so far
+        int messages = sscanf(header, "%*u %c", &kind) == 1 && kind == 'e';
+        if (messages)
+        {
+            outFlush(out);
+        }
+        while (length > 0)
+        {
+            size_t want = length < sizeof(buffer) ? length : sizeof(buffer);
+            size_t got = fread(buffer, 1, want, in);
+            if (got == 0)
+            {
+                break;
+            }
+            if (messages)
+            {
+                fwrite(buffer, 1, got, stderr);
+            }
+            else
+            {
+                outWrite(out, buffer, got);
+            }
+            length -= got;
+        }
+        if (length > 0)
+        {
+            break;
+        }
+    }
+    fclose(in);
+    if (status == -1)
+    {
+        fprintf(stderr, "Connection to %s ended early\n", argv[0]);
+        return 1;
+    }
+    return status;
+}
+
+static void printUsage(void)
+{
+    fprintf(stderr,
+            "usage: fat16-reader [options] <command> [arguments]\n"
+            "options:\n"
+            "  --no-mmap                            read the image with pread (network mounts)\n"
+            "  --cache MiB                          cluster cache size when not mapped (default 32, 0 = off)\n"
+            "  --cache-stats                        print cache hits and misses to stderr\n"
+            "  --io-uring                           many reads in flight for images not mapped (NVMe, network block devices)\n"
+            "  --profile FILE                       counters and latency histograms as JSON on exit (\"-\" = stderr)\n"
+            "  --trace FILE                         every timed operation in Chrome trace event format\n"
+            "commands:\n"
+            "  info <image>...                      boot sector summary\n"
+            "  ls <image> [-R] [--format F] [path...]  list directories (-R: whole tree)\n"
+            "                                       F = text, jsonl, csv or binary\n"
+            "  cat <image> <file>...                write file contents to stdout\n"
+            "  chain <image> <cluster|path>...      cluster chain as runs\n"
+            "  stat <image> <path>...               directory entry details\n"
+            "  extract <image> <dir> [-j N] [glob...]  copy files to a host directory\n"
+            "  check <image>... [-j N] [-q]         verify FAT copies and cluster chains\n"
+            "  stats <image>...                     free space and fragmentation\n"
+            "  put <image> <path> [host file]       create or replace a file (stdin by default)\n"
+            "  append <image> <path> [host file]    append to a file, creating it if needed\n"
+            "  truncate <image> <path> <size>       cut or zero extend a file\n"
+            "  rm <image> <path>...                 delete files\n"
+            "  mkdir <image> <path>...              create directories\n"
+            "  mkimage <dir> <image> [-s MiB] [-c bytes] [-l label]  pack a host directory into a new image\n"
+            "  defrag <image> [-b MiB] [-n]         rewrite every file and directory as one run\n"
+            "  pack <image> <container> [-c KiB] [-z level] [-k]  chunked container every command can read\n"
+            "  undelete <image> [-j N] [-m score] [-x dir] [glob...]  list deleted files, -x recovers them\n"
+            "  hash <image>... [-a sha256|blake3|crc32c] [-j N]  digest of every file, then of the volume (\"/\")\n"
+            "  diff <old> <new> [-a hash] [-j N] [-b KiB]  added, removed and modified files with byte ranges\n"
+            "  mount <image> <dir> [-f] [-o opt]    read-only FUSE mount (needs a build with -DHAVE_FUSE)\n"
+            "  mksynth <image> [-n N] [-s KiB] [-d N] [-f pct] [-l pct] [-S seed]  generated image for benchmarks\n"
+            "  bench <image> [-r rounds] [stage...]  time each stage of reading, JSON results\n"
+            "  serve <socket> [-j N] [-m MiB] [-n images]  answer read-only commands, images kept open\n"
+            "  query <socket> <command> [args...]   run a command on a server\n"
+            "  batch [list]                         run one command per line of list (stdin by default)\n"
+            "  tasks [image]                        interactive walkthrough (default image fat16.img)\n");
+}
+
+//global options before the command, returns the arguments consumed or -1
+static int parseOptions(int argc, char **argv, const char **profilePath, const char **tracePath)
+{
+    int used = 0;
+    while (used < argc && strncmp(argv[used], "--", 2) == 0 && strcmp(argv[used], "--help") != 0)
+    {
+        if (strcmp(argv[used], "--no-mmap") == 0)
+        {
+            volumeOptions.noMmap = 1;
+        }
+        else if (strcmp(argv[used], "--cache-stats") == 0)
+        {
+            volumeOptions.cacheStats = 1;
+        }
+        else if (strcmp(argv[used], "--io-uring") == 0)
+        {
+            volumeOptions.ioUring = 1;
+        }
+        else if (strcmp(argv[used], "--profile") == 0 && used + 1 < argc)
+        {
+            *profilePath = argv[++used];
+        }
+        else if (strcmp(argv[used], "--trace") == 0 && used + 1 < argc)
+        {
+            *tracePath = argv[++used];
+        }
+        else if (strcmp(argv[used], "--cache") == 0 && used + 1 < argc)
+        {
+            char *end;
+            unsigned long megabytes = strtoul(argv[++used], &end, 10);
+            if (*end != '\0')
+            {
+                fprintf(stderr, "Invalid cache size: %s\n", argv[used]);
+                return -1;
+            }
+            volumeOptions.cacheBytes = (size_t)megabytes << 20;
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option: %s\n", argv[used]);
+            return -1;
+        }
+        used++;
+    }
+    return used;
+}
+
+int main(int argc, char **argv) 
+{
+    const char *profilePath = NULL;
+    const char *tracePath = NULL;
+    int used = parseOptions(argc - 1, argv + 1, &profilePath, &tracePath);
+    if (used == -1)
+    {
+        printUsage();
+        return 2;
+    }
+    argc -= used;
+    argv += used;
+
+    if (argc < 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) 
+    {
+        printUsage();
+        return argc < 2 ? 2 : 0;
+    }
+
+    if ((profilePath != NULL || tracePath != NULL) && profileBegin(profilePath, tracePath) == -1)
+    {
+        return 1;
+    }
+
+    static Output out;
+    out.fdesc = STDOUT_FILENO;
+
+    int status;
+    if (strcmp(argv[1], "batch") == 0) 
+    {
+        status = batchCommand(&out, argc - 2, argv + 2);
+    }
+    else 
+    {
+        status = runCommand(&out, argc - 1, argv + 1);
+    }
+
+    outFlush(&out);
+    if (out.failed && status == 0) 
+    {
+        status = 1;
+    }
+    if (profileFinish() == -1 && status == 0)
+    {
+        status = 1;
+    }
+    return status;
 }